@@ -0,0 +1,105 @@
+//
+//  GTMAsyncLogWriter.h
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMLogger.h"
+#import "GTMDefines.h"
+
+typedef struct GTMAsyncLogQueue GTMAsyncLogQueue;
+
+// What to do with a message when the queue is full.
+typedef enum {
+  // The logging thread waits until the drain thread has made room.
+  kGTMAsyncLogWriterBlock,
+  // The new message is discarded and counted as dropped.
+  kGTMAsyncLogWriterDrop,
+  // The oldest queued message is discarded (and counted as dropped) to make
+  // room for the new one.
+  kGTMAsyncLogWriterOverwrite,
+} GTMAsyncLogWriterOverflowPolicy;
+
+// GTMAsyncLogWriter is a GTMLogWriter that hands messages off to a dedicated
+// drain thread, which then passes them on to another writer.  The calling
+// thread only pushes the message onto a bounded, lock-free queue, so slow
+// writers (files, pipes, the network) no longer stall the code doing the
+// logging.  The work done by the wrapped writer (newline framing, UTF-8
+// encoding, the write(2) itself) all happens on the drain thread.
+//
+// Messages are delivered to the wrapped writer in the order they were
+// queued, and the wrapped writer is only ever called from the drain thread,
+// so it doesn't need to be thread-safe itself.
+//
+// How to use:
+//
+//   id<GTMLogWriter> fileWriter =
+//       [NSFileHandle fileHandleForLoggingAtPath:@"/tmp/f.log" mode:0644];
+//   GTMAsyncLogWriter *async =
+//       [GTMAsyncLogWriter asyncLogWriterWithWriter:fileWriter
+//                                          capacity:1024
+//                                    overflowPolicy:kGTMAsyncLogWriterBlock];
+//   [[GTMLogger sharedLogger] setWriter:async];
+//
+// Messages still in the queue are written out when the writer is deallocated.
+// Call -flush when you need everything logged so far to have reached the
+// wrapped writer (before calling abort(), for example).
+//
+@interface GTMAsyncLogWriter : NSObject <GTMLogWriter> {
+ @private
+  id<GTMLogWriter> writer_;
+  GTMAsyncLogWriterOverflowPolicy policy_;
+  GTMAsyncLogQueue *queue_;
+}
+
+// Returns an autoreleased async writer.  If |writer| is nil or |capacity| is
+// zero, then nil is returned.
++ (id)asyncLogWriterWithWriter:(id<GTMLogWriter>)writer
+                      capacity:(NSUInteger)capacity
+                overflowPolicy:(GTMAsyncLogWriterOverflowPolicy)policy;
+
+// Designated initializer.  |capacity| is rounded up to the next power of two.
+// If |writer| is nil or |capacity| is zero, then nil is returned.
+// If you just use -init, nil will be returned.
+- (id)initWithWriter:(id<GTMLogWriter>)writer
+            capacity:(NSUInteger)capacity
+      overflowPolicy:(GTMAsyncLogWriterOverflowPolicy)policy;
+
+// The log writer that the drain thread forwards messages to.
+- (id<GTMLogWriter>)writer;
+
+// How many messages can be queued before the overflow policy kicks in.
+- (NSUInteger)capacity;
+
+- (GTMAsyncLogWriterOverflowPolicy)overflowPolicy;
+
+// Blocks until every message queued before this call has been handed to the
+// wrapped writer (or dropped by the overwrite policy).  Calling this from
+// the drain thread (i.e. from within the wrapped writer) returns immediately.
+- (void)flush;
+
+// The number of messages currently waiting in the queue.
+- (NSUInteger)queueDepth;
+
+// The number of messages successfully queued since creation.
+- (uint64_t)enqueuedCount;
+
+// The number of messages discarded by the drop or overwrite policies.
+- (uint64_t)droppedCount;
+
+// The largest number of messages that were ever waiting in the queue.
+- (NSUInteger)maxQueueDepth;
+
+@end  // GTMAsyncLogWriter
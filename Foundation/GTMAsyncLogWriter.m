@@ -0,0 +1,381 @@
+//
+//  GTMAsyncLogWriter.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMAsyncLogWriter.h"
+#import <libkern/OSAtomic.h>
+#import <pthread.h>
+
+// One queue entry.  |sequence_| is what makes the queue lock-free: a slot at
+// index i may be filled by the producer holding ticket |pos| when
+// |sequence_| == pos, and may be emptied by the consumer holding ticket |pos|
+// when |sequence_| == pos + 1 (see Dmitry Vyukov's bounded MPMC queue).
+typedef struct GTMAsyncLogSlot {
+  volatile int64_t sequence_;
+  CFStringRef message_;
+  GTMLoggerLevel level_;
+} GTMAsyncLogSlot;
+
+struct GTMAsyncLogQueue {
+  GTMAsyncLogSlot *slots_;
+  int64_t mask_;
+
+  // Tickets.  Both only ever grow.
+  volatile int64_t enqueuePos_;
+  volatile int64_t dequeuePos_;
+
+  // The ticket the drain thread is working on, or INT64_MAX when it is idle.
+  // Everything before it has been written or dropped.
+  volatile int64_t drainPos_;
+
+  // Statistics.
+  volatile int64_t enqueued_;
+  volatile int64_t dropped_;
+  volatile int64_t maxDepth_;
+
+  // Only used to park threads; the fast paths never take |lock_|.
+  pthread_mutex_t lock_;
+  pthread_cond_t workCondition_;   // Drain thread waits for messages.
+  pthread_cond_t stateCondition_;  // Blocked producers and -flush wait here.
+  volatile int32_t drainSleeping_;
+  volatile int32_t waiters_;
+  volatile int32_t shutdown_;
+
+  id<GTMLogWriter> writer_;  // Weak, GTMAsyncLogWriter owns it.
+  pthread_t drainThread_;
+};
+
+
+// Claims a slot and stores |message| into it.  Returns NO if the queue is full.
+static BOOL QueuePush(GTMAsyncLogQueue *queue,
+                      CFStringRef message,
+                      GTMLoggerLevel level) {
+  GTMAsyncLogSlot *slot = NULL;
+  int64_t pos = queue->enqueuePos_;
+  for (;;) {
+    slot = &queue->slots_[pos & queue->mask_];
+    int64_t diff = slot->sequence_ - pos;
+    if (diff == 0) {
+      if (OSAtomicCompareAndSwap64Barrier(pos, pos + 1, &queue->enqueuePos_)) {
+        break;
+      }
+      pos = queue->enqueuePos_;
+    } else if (diff < 0) {
+      return NO;
+    } else {
+      pos = queue->enqueuePos_;
+    }
+  }
+  slot->message_ = message;
+  slot->level_ = level;
+  OSMemoryBarrier();
+  slot->sequence_ = pos + 1;
+  return YES;
+}
+
+// Takes the oldest message off of the queue.  Returns NO if it is empty.
+static BOOL QueuePop(GTMAsyncLogQueue *queue,
+                     CFStringRef *message,
+                     GTMLoggerLevel *level,
+                     int64_t *ticket) {
+  GTMAsyncLogSlot *slot = NULL;
+  int64_t pos = queue->dequeuePos_;
+  for (;;) {
+    slot = &queue->slots_[pos & queue->mask_];
+    int64_t diff = slot->sequence_ - (pos + 1);
+    if (diff == 0) {
+      if (OSAtomicCompareAndSwap64Barrier(pos, pos + 1, &queue->dequeuePos_)) {
+        break;
+      }
+      pos = queue->dequeuePos_;
+    } else if (diff < 0) {
+      return NO;
+    } else {
+      pos = queue->dequeuePos_;
+    }
+  }
+  *message = slot->message_;
+  *level = slot->level_;
+  *ticket = pos;
+  slot->message_ = NULL;
+  OSMemoryBarrier();
+  slot->sequence_ = pos + queue->mask_ + 1;
+  return YES;
+}
+
+static BOOL QueueIsEmpty(GTMAsyncLogQueue *queue) {
+  OSMemoryBarrier();
+  return queue->enqueuePos_ == queue->dequeuePos_;
+}
+
+// Wakes anyone in -flush or blocked on a full queue.  The barrier pairs with
+// the one in WaitForState() so that a waiter either sees our progress or we
+// see it waiting.
+static void SignalStateChange(GTMAsyncLogQueue *queue) {
+  OSMemoryBarrier();
+  if (queue->waiters_ > 0) {
+    pthread_mutex_lock(&queue->lock_);
+    pthread_cond_broadcast(&queue->stateCondition_);
+    pthread_mutex_unlock(&queue->lock_);
+  }
+}
+
+static void WakeDrainThread(GTMAsyncLogQueue *queue) {
+  OSMemoryBarrier();
+  if (queue->drainSleeping_) {
+    pthread_mutex_lock(&queue->lock_);
+    pthread_cond_signal(&queue->workCondition_);
+    pthread_mutex_unlock(&queue->lock_);
+  }
+}
+
+static void NoteQueueDepth(GTMAsyncLogQueue *queue) {
+  int64_t depth = queue->enqueuePos_ - queue->dequeuePos_;
+  int64_t max = queue->maxDepth_;
+  while (depth > max) {
+    if (OSAtomicCompareAndSwap64Barrier(max, depth, &queue->maxDepth_)) break;
+    max = queue->maxDepth_;
+  }
+}
+
+static void *DrainThreadMain(void *arg) {
+  GTMAsyncLogQueue *queue = (GTMAsyncLogQueue *)arg;
+  for (;;) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    CFStringRef message = NULL;
+    GTMLoggerLevel level = kGTMLoggerLevelUnknown;
+    int64_t ticket = 0;
+    for (;;) {
+      // Publish a lower bound for the ticket we're about to take before taking
+      // it, so -flush never sees a popped-but-unwritten message as done.
+      queue->drainPos_ = queue->dequeuePos_;
+      SignalStateChange(queue);
+      if (!QueuePop(queue, &message, &level, &ticket)) break;
+      queue->drainPos_ = ticket;
+      // Blocked producers can go as soon as the slot is free.
+      SignalStateChange(queue);
+      // Never let a writer exception kill the drain thread.
+      @try {
+        [queue->writer_ logMessage:(NSString *)message level:level];
+      }
+      @catch (id e) {
+        // Ignored
+      }
+      CFRelease(message);
+    }
+    queue->drainPos_ = INT64_MAX;
+    SignalStateChange(queue);
+    [pool drain];
+
+    pthread_mutex_lock(&queue->lock_);
+    queue->drainSleeping_ = 1;
+    if (QueueIsEmpty(queue)) {
+      if (queue->shutdown_) {
+        queue->drainSleeping_ = 0;
+        pthread_mutex_unlock(&queue->lock_);
+        break;
+      }
+      pthread_cond_wait(&queue->workCondition_, &queue->lock_);
+    }
+    queue->drainSleeping_ = 0;
+    pthread_mutex_unlock(&queue->lock_);
+  }
+  return NULL;
+}
+
+// Parks the caller until |done| returns YES.  Used for both -flush and
+// blocking on a full queue.
+static void WaitForState(GTMAsyncLogQueue *queue,
+                         BOOL (*done)(GTMAsyncLogQueue *, int64_t),
+                         int64_t arg) {
+  pthread_mutex_lock(&queue->lock_);
+  OSAtomicIncrement32Barrier(&queue->waiters_);
+  while (!done(queue, arg)) {
+    pthread_cond_wait(&queue->stateCondition_, &queue->lock_);
+  }
+  OSAtomicDecrement32Barrier(&queue->waiters_);
+  pthread_mutex_unlock(&queue->lock_);
+}
+
+static BOOL HasDrained(GTMAsyncLogQueue *queue, int64_t target) {
+  OSMemoryBarrier();
+  return queue->dequeuePos_ >= target && queue->drainPos_ >= target;
+}
+
+static BOOL HasRoom(GTMAsyncLogQueue *queue, int64_t unused) {
+  OSMemoryBarrier();
+  return (queue->enqueuePos_ - queue->dequeuePos_) <= queue->mask_;
+}
+
+@implementation GTMAsyncLogWriter
+
++ (id)asyncLogWriterWithWriter:(id<GTMLogWriter>)writer
+                      capacity:(NSUInteger)capacity
+                overflowPolicy:(GTMAsyncLogWriterOverflowPolicy)policy {
+  return [[[self alloc] initWithWriter:writer
+                              capacity:capacity
+                        overflowPolicy:policy] autorelease];
+}
+
+- (id)initWithWriter:(id<GTMLogWriter>)writer
+            capacity:(NSUInteger)capacity
+      overflowPolicy:(GTMAsyncLogWriterOverflowPolicy)policy {
+  if ((self = [super init])) {
+    if (!writer || capacity == 0 || capacity > (NSUIntegerMax >> 2)) {
+      [self release];
+      return nil;
+    }
+    NSUInteger slotCount = 1;
+    while (slotCount < capacity) slotCount <<= 1;
+
+    writer_ = [writer retain];
+    policy_ = policy;
+    queue_ = (GTMAsyncLogQueue *)calloc(1, sizeof(GTMAsyncLogQueue));
+    if (queue_) {
+      queue_->slots_ =
+          (GTMAsyncLogSlot *)calloc(slotCount, sizeof(GTMAsyncLogSlot));
+    }
+    if (!queue_ || !queue_->slots_) {
+      [self release];
+      return nil;
+    }
+    for (NSUInteger i = 0; i < slotCount; ++i) {
+      queue_->slots_[i].sequence_ = (int64_t)i;
+    }
+    queue_->mask_ = (int64_t)slotCount - 1;
+    queue_->drainPos_ = INT64_MAX;
+    queue_->writer_ = writer_;
+    pthread_mutex_init(&queue_->lock_, NULL);
+    pthread_cond_init(&queue_->workCondition_, NULL);
+    pthread_cond_init(&queue_->stateCondition_, NULL);
+    if (pthread_create(&queue_->drainThread_, NULL,
+                       DrainThreadMain, queue_) != 0) {
+      // COV_NF_START
+      queue_->drainThread_ = NULL;
+      [self release];
+      return nil;
+      // COV_NF_END
+    }
+  }
+  return self;
+}
+
+- (id)init {
+  return [self initWithWriter:nil
+                     capacity:0
+               overflowPolicy:kGTMAsyncLogWriterBlock];
+}
+
+- (void)dealloc {
+  if (queue_) {
+    if (queue_->drainThread_) {
+      // The drain thread empties the queue before it exits.
+      pthread_mutex_lock(&queue_->lock_);
+      queue_->shutdown_ = 1;
+      pthread_cond_signal(&queue_->workCondition_);
+      pthread_mutex_unlock(&queue_->lock_);
+      pthread_join(queue_->drainThread_, NULL);
+      pthread_mutex_destroy(&queue_->lock_);
+      pthread_cond_destroy(&queue_->workCondition_);
+      pthread_cond_destroy(&queue_->stateCondition_);
+    }
+    free(queue_->slots_);
+    free(queue_);
+  }
+  [writer_ release];
+  [super dealloc];
+}
+
+- (id<GTMLogWriter>)writer {
+  return writer_;
+}
+
+- (NSUInteger)capacity {
+  return (NSUInteger)(queue_->mask_ + 1);
+}
+
+- (GTMAsyncLogWriterOverflowPolicy)overflowPolicy {
+  return policy_;
+}
+
+- (void)flush {
+  if (pthread_equal(pthread_self(), queue_->drainThread_)) return;
+  OSMemoryBarrier();
+  WaitForState(queue_, HasDrained, queue_->enqueuePos_);
+}
+
+- (NSUInteger)queueDepth {
+  OSMemoryBarrier();
+  int64_t depth = queue_->enqueuePos_ - queue_->dequeuePos_;
+  return depth > 0 ? (NSUInteger)depth : 0;
+}
+
+- (uint64_t)enqueuedCount {
+  OSMemoryBarrier();
+  return (uint64_t)queue_->enqueued_;
+}
+
+- (uint64_t)droppedCount {
+  OSMemoryBarrier();
+  return (uint64_t)queue_->dropped_;
+}
+
+- (NSUInteger)maxQueueDepth {
+  OSMemoryBarrier();
+  return (NSUInteger)queue_->maxDepth_;
+}
+
+// From the GTMLogWriter protocol.
+- (void)logMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+  if (!msg) return;
+  // -copy rather than CFStringCreateCopy() so NSString subclasses that build
+  // their contents lazily (GTMLogBinaryRecord) can skip doing so here.
+  CFStringRef message = (CFStringRef)[msg copy];
+  if (!message) return;
+
+  // The drain thread can't wait on itself, so a wrapped writer that logs back
+  // into us gets the drop policy when the queue is full.
+  GTMAsyncLogWriterOverflowPolicy policy = policy_;
+  if (policy == kGTMAsyncLogWriterBlock &&
+      pthread_equal(pthread_self(), queue_->drainThread_)) {
+    policy = kGTMAsyncLogWriterDrop;
+  }
+
+  while (!QueuePush(queue_, message, level)) {
+    if (policy == kGTMAsyncLogWriterDrop) {
+      OSAtomicIncrement64Barrier(&queue_->dropped_);
+      CFRelease(message);
+      return;
+    } else if (policy == kGTMAsyncLogWriterOverwrite) {
+      CFStringRef oldest = NULL;
+      GTMLoggerLevel oldestLevel;
+      int64_t ticket;
+      if (QueuePop(queue_, &oldest, &oldestLevel, &ticket)) {
+        CFRelease(oldest);
+        OSAtomicIncrement64Barrier(&queue_->dropped_);
+        SignalStateChange(queue_);
+      }
+    } else {
+      WaitForState(queue_, HasRoom, 0);
+    }
+  }
+  OSAtomicIncrement64Barrier(&queue_->enqueued_);
+  NoteQueueDepth(queue_);
+  WakeDrainThread(queue_);
+}
+
+@end  // GTMAsyncLogWriter
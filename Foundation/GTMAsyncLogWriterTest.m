@@ -0,0 +1,324 @@
+//
+//  GTMAsyncLogWriterTest.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMSenTestCase.h"
+#import "GTMAsyncLogWriter.h"
+#import "GTMTestTimer.h"
+
+// A writer that records what it is asked to log.  It can be "closed", which
+// makes -logMessage:level: wait until it is reopened, so the tests can back up
+// the async writer's queue.
+@interface GatedWriter : NSObject <GTMLogWriter> {
+ @private
+  NSMutableArray *messages_;
+  NSCondition *condition_;
+  BOOL closed_;
+  NSUInteger waiting_;
+}
+- (NSArray *)messages;
+- (void)close;
+- (void)open;
+// Waits until the drain thread is stuck in -logMessage:level:.
+- (void)waitForBlockedWriter;
+@end
+
+@implementation GatedWriter
+
+- (id)init {
+  if ((self = [super init])) {
+    messages_ = [[NSMutableArray alloc] init];
+    condition_ = [[NSCondition alloc] init];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [messages_ release];
+  [condition_ release];
+  [super dealloc];
+}
+
+- (void)logMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+  [condition_ lock];
+  ++waiting_;
+  [condition_ broadcast];
+  while (closed_) {
+    [condition_ wait];
+  }
+  --waiting_;
+  [messages_ addObject:msg];
+  [condition_ unlock];
+}
+
+- (NSArray *)messages {
+  [condition_ lock];
+  NSArray *result = [[messages_ copy] autorelease];
+  [condition_ unlock];
+  return result;
+}
+
+- (void)close {
+  [condition_ lock];
+  closed_ = YES;
+  [condition_ unlock];
+}
+
+- (void)open {
+  [condition_ lock];
+  closed_ = NO;
+  [condition_ broadcast];
+  [condition_ unlock];
+}
+
+- (void)waitForBlockedWriter {
+  [condition_ lock];
+  while (waiting_ == 0) {
+    [condition_ wait];
+  }
+  [condition_ unlock];
+}
+
+@end  // GatedWriter
+
+// A writer that does nothing, for timing the queue itself.
+@interface NullWriter : NSObject <GTMLogWriter>
+@end
+
+@implementation NullWriter
+- (void)logMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+}
+@end  // NullWriter
+
+@interface GTMAsyncLogWriterTest : GTMTestCase
+@end
+
+@implementation GTMAsyncLogWriterTest
+
+- (void)testCreation {
+  GatedWriter *gated = [[[GatedWriter alloc] init] autorelease];
+  GTMAsyncLogWriter *writer =
+      [GTMAsyncLogWriter asyncLogWriterWithWriter:gated
+                                         capacity:5
+                                   overflowPolicy:kGTMAsyncLogWriterDrop];
+  STAssertNotNil(writer, nil);
+  STAssertTrue([writer writer] == gated, nil);
+  // Rounded up to a power of two.
+  STAssertEquals([writer capacity], (NSUInteger)8, nil);
+  STAssertEquals([writer overflowPolicy], kGTMAsyncLogWriterDrop, nil);
+  STAssertEquals([writer queueDepth], (NSUInteger)0, nil);
+  STAssertEquals([writer enqueuedCount], (uint64_t)0, nil);
+  STAssertEquals([writer droppedCount], (uint64_t)0, nil);
+  STAssertEquals([writer maxQueueDepth], (NSUInteger)0, nil);
+
+  // Bad args
+  writer =
+      [GTMAsyncLogWriter asyncLogWriterWithWriter:nil
+                                         capacity:5
+                                   overflowPolicy:kGTMAsyncLogWriterDrop];
+  STAssertNil(writer, nil);
+  writer =
+      [GTMAsyncLogWriter asyncLogWriterWithWriter:gated
+                                         capacity:0
+                                   overflowPolicy:kGTMAsyncLogWriterDrop];
+  STAssertNil(writer, nil);
+  writer = [[GTMAsyncLogWriter alloc] init];
+  STAssertNil(writer, nil);
+}
+
+- (void)testLoggingAndFlush {
+  GatedWriter *gated = [[[GatedWriter alloc] init] autorelease];
+  GTMAsyncLogWriter *writer =
+      [GTMAsyncLogWriter asyncLogWriterWithWriter:gated
+                                         capacity:64
+                                   overflowPolicy:kGTMAsyncLogWriterBlock];
+  GTMLogger *logger = [GTMLogger loggerWithWriter:writer
+                                        formatter:nil
+                                           filter:nil];
+  NSMutableArray *expected = [NSMutableArray array];
+  for (int i = 0; i < 200; ++i) {
+    [logger logInfo:@"msg %d", i];
+    [expected addObject:[NSString stringWithFormat:@"msg %d", i]];
+  }
+  [writer flush];
+  STAssertEqualObjects([gated messages], expected, nil);
+  STAssertEquals([writer enqueuedCount], (uint64_t)200, nil);
+  STAssertEquals([writer droppedCount], (uint64_t)0, nil);
+  STAssertEquals([writer queueDepth], (NSUInteger)0, nil);
+  STAssertTrue([writer maxQueueDepth] <= [writer capacity], nil);
+
+  // Flushing an idle writer returns right away.
+  [writer flush];
+  STAssertEquals([[gated messages] count], (NSUInteger)200, nil);
+
+  // nil messages are ignored.
+  [writer logMessage:nil level:kGTMLoggerLevelInfo];
+  [writer flush];
+  STAssertEquals([writer enqueuedCount], (uint64_t)200, nil);
+}
+
+- (void)testDropPolicy {
+  GatedWriter *gated = [[[GatedWriter alloc] init] autorelease];
+  GTMAsyncLogWriter *writer =
+      [GTMAsyncLogWriter asyncLogWriterWithWriter:gated
+                                         capacity:4
+                                   overflowPolicy:kGTMAsyncLogWriterDrop];
+  [gated close];
+  // The first message gets pulled off the queue and the drain thread blocks
+  // writing it, leaving room for exactly four more.
+  [writer logMessage:@"0" level:kGTMLoggerLevelInfo];
+  [gated waitForBlockedWriter];
+  for (int i = 1; i <= 6; ++i) {
+    [writer logMessage:[NSString stringWithFormat:@"%d", i]
+                 level:kGTMLoggerLevelInfo];
+  }
+  STAssertEquals([writer queueDepth], (NSUInteger)4, nil);
+  STAssertEquals([writer maxQueueDepth], (NSUInteger)4, nil);
+  STAssertEquals([writer droppedCount], (uint64_t)2, nil);
+  STAssertEquals([writer enqueuedCount], (uint64_t)5, nil);
+  [gated open];
+  [writer flush];
+  NSArray *expected = [NSArray arrayWithObjects:@"0", @"1", @"2", @"3", @"4",
+                       nil];
+  STAssertEqualObjects([gated messages], expected, nil);
+}
+
+- (void)testOverwritePolicy {
+  GatedWriter *gated = [[[GatedWriter alloc] init] autorelease];
+  GTMAsyncLogWriter *writer =
+      [GTMAsyncLogWriter asyncLogWriterWithWriter:gated
+                                         capacity:4
+                                   overflowPolicy:kGTMAsyncLogWriterOverwrite];
+  [gated close];
+  [writer logMessage:@"0" level:kGTMLoggerLevelInfo];
+  [gated waitForBlockedWriter];
+  for (int i = 1; i <= 6; ++i) {
+    [writer logMessage:[NSString stringWithFormat:@"%d", i]
+                 level:kGTMLoggerLevelInfo];
+  }
+  STAssertEquals([writer queueDepth], (NSUInteger)4, nil);
+  STAssertEquals([writer droppedCount], (uint64_t)2, nil);
+  STAssertEquals([writer enqueuedCount], (uint64_t)7, nil);
+  [gated open];
+  [writer flush];
+  NSArray *expected = [NSArray arrayWithObjects:@"0", @"3", @"4", @"5", @"6",
+                       nil];
+  STAssertEqualObjects([gated messages], expected, nil);
+}
+
+- (void)logFromThread:(GTMAsyncLogWriter *)writer {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  for (int i = 0; i < 1000; ++i) {
+    [writer logMessage:@"threaded" level:kGTMLoggerLevelInfo];
+  }
+  [pool drain];
+}
+
+- (void)testBlockPolicyWithManyThreads {
+  GatedWriter *gated = [[[GatedWriter alloc] init] autorelease];
+  GTMAsyncLogWriter *writer =
+      [GTMAsyncLogWriter asyncLogWriterWithWriter:gated
+                                         capacity:16
+                                   overflowPolicy:kGTMAsyncLogWriterBlock];
+  NSMutableArray *threads = [NSMutableArray array];
+  for (int i = 0; i < 8; ++i) {
+    NSThread *thread =
+        [[[NSThread alloc] initWithTarget:self
+                                 selector:@selector(logFromThread:)
+                                   object:writer] autorelease];
+    [threads addObject:thread];
+    [thread start];
+  }
+  NSThread *thread = nil;
+  GTM_FOREACH_OBJECT(thread, threads) {
+    while (![thread isFinished]) {
+      usleep(1000);
+    }
+  }
+  [writer flush];
+  // Nothing may be lost when blocking.
+  STAssertEquals([[gated messages] count], (NSUInteger)8000, nil);
+  STAssertEquals([writer enqueuedCount], (uint64_t)8000, nil);
+  STAssertEquals([writer droppedCount], (uint64_t)0, nil);
+  STAssertTrue([writer maxQueueDepth] <= (NSUInteger)16, nil);
+}
+
+- (void)testDeallocDrainsQueue {
+  GatedWriter *gated = [[[GatedWriter alloc] init] autorelease];
+  GTMAsyncLogWriter *writer =
+      [[GTMAsyncLogWriter alloc] initWithWriter:gated
+                                       capacity:128
+                                 overflowPolicy:kGTMAsyncLogWriterBlock];
+  for (int i = 0; i < 100; ++i) {
+    [writer logMessage:@"bye" level:kGTMLoggerLevelInfo];
+  }
+  [writer release];
+  STAssertEquals([[gated messages] count], (NSUInteger)100, nil);
+}
+
+// Compares the time spent on the logging thread with a file handle writer
+// against the same writer wrapped in an async writer.
+- (void)testCallerLatency {
+  const int kMessages = 20000;
+  NSFileHandle *devNull = [NSFileHandle fileHandleForWritingAtPath:@"/dev/null"];
+  STAssertNotNil(devNull, nil);
+  GTMAsyncLogWriter *async =
+      [GTMAsyncLogWriter asyncLogWriterWithWriter:devNull
+                                         capacity:kMessages
+                                   overflowPolicy:kGTMAsyncLogWriterBlock];
+  GTMAsyncLogWriter *asyncNull =
+      [GTMAsyncLogWriter asyncLogWriterWithWriter:[[[NullWriter alloc] init]
+                                                      autorelease]
+                                         capacity:kMessages
+                                   overflowPolicy:kGTMAsyncLogWriterBlock];
+  NSString *msg = @"2014-01-01 00:00:00.000 GTMAsyncLogWriterTest a message";
+
+  GTMTestTimer *syncTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(syncTimer);
+  for (int i = 0; i < kMessages; ++i) {
+    [devNull logMessage:msg level:kGTMLoggerLevelInfo];
+  }
+  GTMTestTimerStop(syncTimer);
+
+  GTMTestTimer *asyncTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(asyncTimer);
+  for (int i = 0; i < kMessages; ++i) {
+    [async logMessage:msg level:kGTMLoggerLevelInfo];
+  }
+  GTMTestTimerStop(asyncTimer);
+  [async flush];
+
+  GTMTestTimer *queueTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(queueTimer);
+  for (int i = 0; i < kMessages; ++i) {
+    [asyncNull logMessage:msg level:kGTMLoggerLevelInfo];
+  }
+  GTMTestTimerStop(queueTimer);
+  [asyncNull flush];
+
+  NSLog(@"GTMAsyncLogWriter caller cost per message: sync %.0fns, "
+        @"async %.0fns, async (null writer) %.0fns",
+        GTMTestTimerGetNanoseconds(syncTimer) / kMessages,
+        GTMTestTimerGetNanoseconds(asyncTimer) / kMessages,
+        GTMTestTimerGetNanoseconds(queueTimer) / kMessages);
+  STAssertEquals([async enqueuedCount], (uint64_t)kMessages, nil);
+  GTMTestTimerRelease(syncTimer);
+  GTMTestTimerRelease(asyncTimer);
+  GTMTestTimerRelease(queueTimer);
+}
+
+@end
@@ -0,0 +1,145 @@
+//
+//  GTMLogBinaryWriter.h
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMLogger.h"
+#import "GTMDefines.h"
+
+// Binary logging
+// --------------
+//
+// Most of the cost of a log message is turning the format and its arguments
+// into text, and most of the bytes on disk are that text. The classes here
+// defer that work: GTMLogBinaryFormatter records the format string (as an
+// interned ID), the raw arguments, the level, the thread and a monotonic
+// timestamp in a compact binary record, GTMLogBinaryWriter appends those
+// records to a file, and GTMLogBinaryReader turns the file back into text
+// lines (in the same layout as GTMLogStandardFormatter) whenever somebody
+// actually wants to read it.
+//
+//   GTMLogger *logger =
+//       [GTMLogger loggerWithWriter:[GTMLogBinaryWriter
+//                                       binaryWriterWithPath:@"/tmp/app.glog"]
+//                         formatter:[[[GTMLogBinaryFormatter alloc] init]
+//                                       autorelease]
+//                            filter:nil];
+//   [logger logInfo:@"served %d bytes to %@", count, host];
+//
+// A command line decoder is just a loop over a reader:
+//
+//   int main(int argc, const char *argv[]) {
+//     NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+//     NSData *data = [NSData dataWithContentsOfMappedFile:
+//                        [NSString stringWithUTF8String:argv[1]]];
+//     GTMLogBinaryReader *reader =
+//         [[[GTMLogBinaryReader alloc] initWithData:data] autorelease];
+//     NSString *line;
+//     while ((line = [reader nextLine])) printf("%s\n", [line UTF8String]);
+//     [pool drain];
+//     return [reader isCorrupt] ? 1 : 0;
+//   }
+//
+// Arguments for %@ are still converted with -description when the message is
+// logged (objects can't be recorded any other way), and C strings are copied
+// (only as far as the precision for "%.*s").  Formats the binary encoding
+// can't represent (positional arguments, %n, wide character strings, C strings
+// with a literal precision) are formatted as text on the spot instead, and
+// are written out as text records that still carry the function, thread and
+// time of the call.
+//
+// The GTMLogBinaryFormatter returns NSStrings, so it can be combined with
+// any filter or writer; the text is only produced if something other than a
+// GTMLogBinaryWriter (a message filter, or a plain text writer) asks for the
+// string's contents.
+
+// A GTMLogFormatter that returns GTMLogBinaryRecords.
+@interface GTMLogBinaryFormatter : GTMLogBasicFormatter
+@end  // GTMLogBinaryFormatter
+
+
+// The string returned by GTMLogBinaryFormatter. It behaves as the formatted
+// message (as GTMLogBasicFormatter would have produced it) but only builds
+// that text on demand.
+@interface GTMLogBinaryRecord : NSString {
+ @private
+  NSString *format_;
+  NSString *func_;
+  uint32_t formatID_;
+  uint32_t funcID_;
+  uint8_t *bytes_;
+  NSUInteger length_;
+  NSUInteger argsOffset_;
+  NSUInteger argsLength_;
+  NSString *text_;
+}
+
+// The encoded record, as GTMLogBinaryWriter writes it.
+- (const uint8_t *)recordBytes;
+- (NSUInteger)recordLength;
+
+@end  // GTMLogBinaryRecord
+
+
+// A GTMLogWriter that appends binary records to a file. Messages that did not
+// come from a GTMLogBinaryFormatter are written as text records, so the file
+// stays readable whatever is logged to it. Each message is a single write(2).
+@interface GTMLogBinaryWriter : NSObject <GTMLogWriter> {
+ @private
+  int fd_;
+  BOOL closeOnDealloc_;
+  NSMutableData *buffer_;
+  uint8_t *definedIDs_;  // Bit set of the IDs already written to this file.
+  NSUInteger definedIDsSize_;
+}
+
+// Opens the file at |path| for appending, creating it (mode 0644) if needed.
+// Returns nil if the file can't be opened.
++ (id)binaryWriterWithPath:(NSString *)path;
+
+// Designated initializer. Writes a stream header to |fd| straight away.
+- (id)initWithFileDescriptor:(int)fd closeOnDealloc:(BOOL)closeOnDealloc;
+
+@end  // GTMLogBinaryWriter
+
+
+// Decodes the output of a GTMLogBinaryWriter back into text. A file may hold
+// the output of several processes appended one after the other.
+@interface GTMLogBinaryReader : NSObject {
+ @private
+  NSData *data_;
+  NSUInteger offset_;
+  BOOL corrupt_;
+  NSMutableDictionary *strings_;
+  NSString *processName_;
+  uint64_t version_;
+  uint64_t pid_;
+  uint64_t wallMicroseconds_;
+  uint64_t monotonicNanoseconds_;
+  GTMLogBasicFormatter *funcFormatter_;
+}
+
+- (id)initWithData:(NSData *)data;
+
+// Returns the next message formatted like GTMLogStandardFormatter would:
+//   2014-01-01 10:29:24.177 myapp[4588/0xa07d0f60] [lvl=1] -[Foo bar] message
+// Returns nil once all of the data has been read, or if the data is corrupt.
+- (NSString *)nextLine;
+
+// YES if decoding stopped because of bad or truncated data.
+- (BOOL)isCorrupt;
+
+@end  // GTMLogBinaryReader
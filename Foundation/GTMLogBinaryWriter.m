@@ -0,0 +1,1234 @@
+//
+//  GTMLogBinaryWriter.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMLogBinaryWriter.h"
+#import <errno.h>
+#import <fcntl.h>
+#import <libkern/OSByteOrder.h>
+#import <mach/mach_time.h>
+#import <pthread.h>
+#import <sys/time.h>
+#import <time.h>
+#import <unistd.h>
+
+#if !defined(__clang__) && (__GNUC__*10+__GNUC_MINOR__ >= 42)
+// See the comment at the top of GTMLogger.m.
+#pragma GCC diagnostic ignored "-Wmissing-format-attribute"
+#endif  // !__clang__
+
+// Stream layout
+// -------------
+// Values are unsigned LEB128 varints unless noted otherwise. Signed integers
+// are zigzag encoded first, doubles are 8 little-endian bytes, and strings are
+// a varint count followed by that many UTF-8 bytes less one (a count of 0 is
+// a nil string).
+//
+//   'H' version wall-clock-usec monotonic-nsec pid process-name
+//   'S' id string                    (interned format or function name)
+//   'M' level thread monotonic-nsec format-id func-id args-length args...
+//   'T' level thread monotonic-nsec func-id message
+//
+// Each 'H' starts a new section (a new process appending to the file); the
+// reader forgets the strings it knew about when it sees one. Version 1 'T'
+// records have no func-id.
+enum {
+  kGTMLogBinaryVersion = 2,
+  kGTMLogBinaryHeaderTag = 'H',
+  kGTMLogBinaryStringTag = 'S',
+  kGTMLogBinaryMessageTag = 'M',
+  kGTMLogBinaryTextTag = 'T',
+};
+
+// How many distinct format strings and function names get IDs. Formats seen
+// after that are logged as text.
+static const NSUInteger kGTMLogBinaryMaxInterned = 8192;
+
+#pragma mark Encoding
+
+// A growable byte buffer that starts out in caller supplied (stack) storage.
+typedef struct GTMLogBinaryBuffer {
+  uint8_t *bytes_;
+  size_t length_;
+  size_t capacity_;
+  BOOL onHeap_;
+  BOOL failed_;
+} GTMLogBinaryBuffer;
+
+static void BufferInit(GTMLogBinaryBuffer *buffer,
+                       uint8_t *storage, size_t size) {
+  buffer->bytes_ = storage;
+  buffer->length_ = 0;
+  buffer->capacity_ = size;
+  buffer->onHeap_ = NO;
+  buffer->failed_ = NO;
+}
+
+static void BufferFree(GTMLogBinaryBuffer *buffer) {
+  if (buffer->onHeap_) free(buffer->bytes_);
+}
+
+static BOOL BufferReserve(GTMLogBinaryBuffer *buffer, size_t extra) {
+  if (buffer->failed_) return NO;
+  if (buffer->length_ + extra <= buffer->capacity_) return YES;
+  size_t capacity = buffer->capacity_ * 2;
+  if (capacity < buffer->length_ + extra) capacity = buffer->length_ + extra;
+  uint8_t *bytes = NULL;
+  if (buffer->onHeap_) {
+    bytes = realloc(buffer->bytes_, capacity);
+  } else {
+    bytes = malloc(capacity);
+    if (bytes) memcpy(bytes, buffer->bytes_, buffer->length_);
+  }
+  if (!bytes) {
+    // COV_NF_START
+    buffer->failed_ = YES;
+    return NO;
+    // COV_NF_END
+  }
+  buffer->bytes_ = bytes;
+  buffer->capacity_ = capacity;
+  buffer->onHeap_ = YES;
+  return YES;
+}
+
+static void AppendByte(GTMLogBinaryBuffer *buffer, uint8_t byte) {
+  if (!BufferReserve(buffer, 1)) return;
+  buffer->bytes_[buffer->length_++] = byte;
+}
+
+static void AppendBytes(GTMLogBinaryBuffer *buffer,
+                        const void *bytes, size_t length) {
+  if (!BufferReserve(buffer, length)) return;
+  memcpy(buffer->bytes_ + buffer->length_, bytes, length);
+  buffer->length_ += length;
+}
+
+static void AppendVarint(GTMLogBinaryBuffer *buffer, uint64_t value) {
+  if (!BufferReserve(buffer, 10)) return;
+  uint8_t *out = buffer->bytes_ + buffer->length_;
+  while (value >= 0x80) {
+    *out++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t)value;
+  buffer->length_ = (size_t)(out - buffer->bytes_);
+}
+
+static void AppendSigned(GTMLogBinaryBuffer *buffer, int64_t value) {
+  AppendVarint(buffer, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static void AppendDouble(GTMLogBinaryBuffer *buffer, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  bits = OSSwapHostToLittleInt64(bits);
+  AppendBytes(buffer, &bits, sizeof(bits));
+}
+
+static void AppendUTF8(GTMLogBinaryBuffer *buffer,
+                       const char *utf8, size_t length) {
+  if (!utf8) {
+    AppendVarint(buffer, 0);
+    return;
+  }
+  AppendVarint(buffer, (uint64_t)length + 1);
+  AppendBytes(buffer, utf8, length);
+}
+
+static void AppendString(GTMLogBinaryBuffer *buffer, NSString *string) {
+  if (!string) {
+    AppendVarint(buffer, 0);
+    return;
+  }
+  const char *utf8 = CFStringGetCStringPtr((CFStringRef)string,
+                                           kCFStringEncodingUTF8);
+  if (!utf8) utf8 = [string UTF8String];
+  AppendUTF8(buffer, utf8, utf8 ? strlen(utf8) : 0);
+}
+
+static uint64_t MonotonicNanoseconds(void) {
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0) {
+    mach_timebase_info(&timebase);
+  }
+  uint64_t now = mach_absolute_time();
+  return now * timebase.numer / timebase.denom;
+}
+
+static uint64_t CurrentThreadID(void) {
+  pthread_t thread = pthread_self();
+  return (uint64_t)(uintptr_t)thread;
+}
+
+// Appends a 'T' record for |message|.
+static void AppendTextRecord(GTMLogBinaryBuffer *buffer,
+                             GTMLoggerLevel level, uint32_t funcID,
+                             NSString *message) {
+  AppendByte(buffer, kGTMLogBinaryTextTag);
+  AppendVarint(buffer, (uint64_t)level);
+  AppendVarint(buffer, CurrentThreadID());
+  AppendVarint(buffer, MonotonicNanoseconds());
+  AppendVarint(buffer, funcID);
+  AppendString(buffer, message);
+}
+
+#pragma mark Format Strings
+
+// One conversion in a format string.
+typedef struct GTMLogFormatSpec {
+  size_t start_;      // Offset of the '%'.
+  size_t end_;        // Offset just past the conversion character.
+  char types_[3];     // Arguments consumed, '*' width/precision ones first.
+  size_t typeCount_;  // 0 for "%%".
+} GTMLogFormatSpec;
+
+// Argument types. Each one is a single va_arg().
+enum {
+  kGTMLogArgInt = 'i',
+  kGTMLogArgLong = 'l',
+  kGTMLogArgLongLong = 'q',
+  kGTMLogArgDouble = 'd',
+  kGTMLogArgLongDouble = 'L',
+  kGTMLogArgPointer = 'p',
+  kGTMLogArgCString = 's',
+  kGTMLogArgBoundedCString = 'b',  // "%.*s", after its precision.
+  kGTMLogArgUnichars = 'S',
+  kGTMLogArgObject = '@',
+};
+
+// Finds the next conversion in |fmt| at or after |*pos|. Returns 1 and fills in
+// |spec| if there is one, 0 at the end of the string, and -1 for conversions
+// that can't be recorded (positional arguments, %n, wide strings, junk).
+static int NextFormatSpec(const char *fmt, size_t *pos,
+                          GTMLogFormatSpec *spec) {
+  const char *p = strchr(fmt + *pos, '%');
+  if (!p) {
+    *pos += strlen(fmt + *pos);
+    return 0;
+  }
+  spec->start_ = (size_t)(p - fmt);
+  spec->typeCount_ = 0;
+  ++p;
+  if (*p == '%') {
+    spec->end_ = (size_t)(p + 1 - fmt);
+    *pos = spec->end_;
+    return 1;
+  }
+
+  // Flags, width, precision.
+  while (*p && strchr("-+ #0'", *p)) ++p;
+  if (*p == '*') {
+    spec->types_[spec->typeCount_++] = kGTMLogArgInt;
+    ++p;
+  } else {
+    while (*p >= '0' && *p <= '9') ++p;
+    if (*p == '$') return -1;
+  }
+  char precision = 0;
+  if (*p == '.') {
+    ++p;
+    if (*p == '*') {
+      spec->types_[spec->typeCount_++] = kGTMLogArgInt;
+      precision = '*';
+      ++p;
+    } else {
+      precision = '.';
+      while (*p >= '0' && *p <= '9') ++p;
+    }
+  }
+
+  // Length modifiers.
+  char size = 0;
+  if (*p == 'h') {
+    ++p;
+    if (*p == 'h') ++p;
+  } else if (*p == 'l') {
+    ++p;
+    size = kGTMLogArgLong;
+    if (*p == 'l') {
+      ++p;
+      size = kGTMLogArgLongLong;
+    }
+  } else if (*p == 'q' || *p == 'j') {
+    ++p;
+    size = kGTMLogArgLongLong;
+  } else if (*p == 'z' || *p == 't') {
+    ++p;
+    size = kGTMLogArgLong;
+  } else if (*p == 'L') {
+    ++p;
+    size = kGTMLogArgLongDouble;
+  }
+
+  char type = 0;
+  switch (*p) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+      if (size == kGTMLogArgLongDouble) return -1;
+      if (*p == 'c' && size) return -1;  // wint_t
+      type = size ? size : kGTMLogArgInt;
+      break;
+    case 'C':
+      type = kGTMLogArgInt;  // unichar, promoted to int
+      break;
+    case 'D': case 'O': case 'U':
+      type = kGTMLogArgLong;
+      break;
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+      type = (size == kGTMLogArgLongDouble) ? kGTMLogArgLongDouble
+                                            : kGTMLogArgDouble;
+      break;
+    case 's':
+      if (size) return -1;  // wchar_t *
+      // The string needn't be terminated within a precision, so only what
+      // it covers can be copied. That comes along as an argument for "*";
+      // a literal one is left to the text formatter.
+      if (precision == '.') return -1;
+      type = (precision == '*') ? kGTMLogArgBoundedCString : kGTMLogArgCString;
+      break;
+    case 'S':
+      type = kGTMLogArgUnichars;
+      break;
+    case 'p':
+      type = kGTMLogArgPointer;
+      break;
+    case '@':
+      type = kGTMLogArgObject;
+      break;
+    default:
+      return -1;
+  }
+  spec->types_[spec->typeCount_++] = type;
+  spec->end_ = (size_t)(p + 1 - fmt);
+  *pos = spec->end_;
+  return 1;
+}
+
+// What we know about an interned string.
+typedef struct GTMLogInternedString {
+  uint32_t id_;
+  BOOL parsed_;    // YES once |binary_| and |argTypes_| are valid.
+  BOOL binary_;    // NO if the format can't be recorded.
+  char *argTypes_;
+} GTMLogInternedString;
+
+static pthread_mutex_t gInternLock = PTHREAD_MUTEX_INITIALIZER;
+static CFMutableDictionaryRef gInterned = NULL;
+static uint32_t gNextInternID = 1;
+
+// Returns the entry for |string|, adding it if needed. If |isFormat| the
+// argument types are worked out as well. Returns NULL once the table is full.
+static GTMLogInternedString *InternString(NSString *string, BOOL isFormat) {
+  GTMLogInternedString *entry = NULL;
+  pthread_mutex_lock(&gInternLock);
+  if (!gInterned) {
+    gInterned = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                          &kCFTypeDictionaryKeyCallBacks,
+                                          NULL);
+  }
+  if (gInterned) {
+    entry = (GTMLogInternedString *)CFDictionaryGetValue(gInterned, string);
+    if (!entry &&
+        (NSUInteger)CFDictionaryGetCount(gInterned) < kGTMLogBinaryMaxInterned) {
+      CFStringRef key = CFStringCreateCopy(kCFAllocatorDefault,
+                                           (CFStringRef)string);
+      entry = calloc(1, sizeof(GTMLogInternedString));
+      if (key && entry) {
+        entry->id_ = gNextInternID++;
+        CFDictionarySetValue(gInterned, key, entry);
+      } else {
+        // COV_NF_START
+        free(entry);
+        entry = NULL;
+        // COV_NF_END
+      }
+      if (key) CFRelease(key);
+    }
+    if (entry && isFormat && !entry->parsed_) {
+      const char *fmt = [string UTF8String];
+      size_t length = fmt ? strlen(fmt) : 0;
+      // Each conversion is at least 2 characters and uses at most 3 args.
+      char *types = malloc(length * 3 / 2 + 1);
+      size_t count = 0;
+      BOOL binary = (fmt && types);
+      if (binary) {
+        size_t pos = 0;
+        GTMLogFormatSpec spec;
+        int found;
+        while ((found = NextFormatSpec(fmt, &pos, &spec)) == 1) {
+          memcpy(types + count, spec.types_, spec.typeCount_);
+          count += spec.typeCount_;
+        }
+        if (found < 0) binary = NO;
+      }
+      if (types) types[count] = '\0';
+      entry->argTypes_ = types;
+      entry->binary_ = binary;
+      entry->parsed_ = YES;
+    }
+  }
+  pthread_mutex_unlock(&gInternLock);
+  return entry;
+}
+
+// Each thread remembers what it has interned, so the lock (and the hashing of
+// the whole string) is only paid the first time a thread logs a given format
+// or function. Formats are nearly always literals, so they are looked up by
+// pointer; the cache holds a reference so the address can't be reused by a
+// different string. Function names are new strings on every call, so those
+// are looked up by their contents.
+#define kGTMLogInternCacheSlots 64
+
+typedef struct GTMLogInternCache {
+  NSString *formatKeys_[kGTMLogInternCacheSlots];
+  GTMLogInternedString *formats_[kGTMLogInternCacheSlots];
+  CFMutableDictionaryRef names_;
+} GTMLogInternCache;
+
+static pthread_key_t gInternCacheKey;
+static pthread_once_t gInternCacheKeyOnce = PTHREAD_ONCE_INIT;
+
+static void FreeInternCache(void *value) {
+  GTMLogInternCache *cache = value;
+  for (int i = 0; i < kGTMLogInternCacheSlots; ++i) {
+    [cache->formatKeys_[i] release];
+  }
+  if (cache->names_) CFRelease(cache->names_);
+  free(cache);
+}
+
+static void CreateInternCacheKey(void) {
+  pthread_key_create(&gInternCacheKey, FreeInternCache);
+}
+
+static GTMLogInternCache *CurrentInternCache(void) {
+  pthread_once(&gInternCacheKeyOnce, CreateInternCacheKey);
+  GTMLogInternCache *cache = pthread_getspecific(gInternCacheKey);
+  if (!cache) {
+    cache = calloc(1, sizeof(GTMLogInternCache));
+    if (cache && pthread_setspecific(gInternCacheKey, cache) != 0) {
+      // COV_NF_START
+      free(cache);
+      cache = NULL;
+      // COV_NF_END
+    }
+  }
+  return cache;
+}
+
+// InternString(format, YES), remembered by this thread.
+static GTMLogInternedString *InternFormat(NSString *format) {
+  GTMLogInternCache *cache = CurrentInternCache();
+  if (!cache) return InternString(format, YES);  // COV_NF_LINE
+  NSUInteger slot =
+      ((uintptr_t)format >> 4) & (kGTMLogInternCacheSlots - 1);
+  if (cache->formatKeys_[slot] == format) return cache->formats_[slot];
+
+  GTMLogInternedString *entry = InternString(format, YES);
+  if (entry) {
+    // Only immutable strings copy to themselves; a mutable one could change
+    // under the cache, so it isn't remembered.
+    NSString *key = [format copy];
+    if (key == format) {
+      [cache->formatKeys_[slot] release];
+      cache->formatKeys_[slot] = key;
+      cache->formats_[slot] = entry;
+    } else {
+      [key release];
+    }
+  }
+  return entry;
+}
+
+// InternString(name, NO), remembered by this thread.
+static GTMLogInternedString *InternName(NSString *name) {
+  GTMLogInternCache *cache = CurrentInternCache();
+  if (!cache) return InternString(name, NO);  // COV_NF_LINE
+  if (!cache->names_) {
+    cache->names_ = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                              &kCFTypeDictionaryKeyCallBacks,
+                                              NULL);
+    if (!cache->names_) return InternString(name, NO);  // COV_NF_LINE
+  }
+  GTMLogInternedString *entry =
+      (GTMLogInternedString *)CFDictionaryGetValue(cache->names_, name);
+  if (entry) return entry;
+
+  entry = InternString(name, NO);
+  if (entry) {
+    CFStringRef key = CFStringCreateCopy(kCFAllocatorDefault,
+                                         (CFStringRef)name);
+    if (key) {
+      CFDictionarySetValue(cache->names_, key, entry);
+      CFRelease(key);
+    }
+  }
+  return entry;
+}
+
+#pragma mark Decoding
+
+typedef struct GTMLogCursor {
+  const uint8_t *bytes_;
+  size_t length_;
+  size_t offset_;
+  BOOL failed_;
+} GTMLogCursor;
+
+static uint64_t ReadVarint(GTMLogCursor *cursor) {
+  uint64_t value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    if (cursor->offset_ >= cursor->length_) break;
+    uint8_t byte = cursor->bytes_[cursor->offset_++];
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return value;
+  }
+  cursor->failed_ = YES;
+  return 0;
+}
+
+static int64_t ReadSigned(GTMLogCursor *cursor) {
+  uint64_t value = ReadVarint(cursor);
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static double ReadDouble(GTMLogCursor *cursor) {
+  uint64_t bits;
+  if (cursor->length_ - cursor->offset_ < sizeof(bits)) {
+    cursor->failed_ = YES;
+    return 0;
+  }
+  memcpy(&bits, cursor->bytes_ + cursor->offset_, sizeof(bits));
+  cursor->offset_ += sizeof(bits);
+  bits = OSSwapLittleToHostInt64(bits);
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Returns the bytes of a string without decoding them. Returns NULL for nil
+// strings as well as errors, check |failed_|.
+static const uint8_t *ReadStringBytes(GTMLogCursor *cursor, size_t *length) {
+  *length = 0;
+  uint64_t count = ReadVarint(cursor);
+  if (cursor->failed_ || count == 0) return NULL;
+  if (count - 1 > cursor->length_ - cursor->offset_) {
+    cursor->failed_ = YES;
+    return NULL;
+  }
+  const uint8_t *bytes = cursor->bytes_ + cursor->offset_;
+  *length = (size_t)(count - 1);
+  cursor->offset_ += *length;
+  return bytes;
+}
+
+// Returns nil for nil strings as well as errors, check |failed_|.
+static NSString *ReadString(GTMLogCursor *cursor) {
+  size_t length;
+  const uint8_t *bytes = ReadStringBytes(cursor, &length);
+  if (!bytes) return nil;
+  NSString *string =
+      [[[NSString alloc] initWithBytes:bytes
+                                length:length
+                              encoding:NSUTF8StringEncoding] autorelease];
+  if (!string) cursor->failed_ = YES;
+  return string;
+}
+
+// Formats a single argument. Not marked as a format function since |spec| is
+// never a literal; it was checked by NextFormatSpec().
+static NSString *FormatArgument(NSString *spec, ...) {
+  va_list args;
+  va_start(args, spec);
+  NSString *result =
+      [[[NSString alloc] initWithFormat:spec arguments:args] autorelease];
+  va_end(args);
+  return result;
+}
+
+// Formats one conversion of |fmt| with arguments read from |cursor|.
+static NSString *ExpandSpec(const char *fmt,
+                            const GTMLogFormatSpec *spec,
+                            GTMLogCursor *cursor) {
+  // Rewrite the conversion so it takes just one argument: '*'s get replaced
+  // by the recorded numbers and long doubles become plain doubles.
+  char rewritten[128];
+  size_t out = 0;
+  size_t nextType = 0;
+  char type = spec->types_[spec->typeCount_ - 1];
+  for (size_t i = spec->start_; i < spec->end_; ++i) {
+    char c = fmt[i];
+    if (out + 24 >= sizeof(rewritten)) return nil;
+    if (c == '*') {
+      int64_t value = ReadSigned(cursor);
+      ++nextType;
+      out += (size_t)snprintf(rewritten + out, sizeof(rewritten) - out,
+                              "%d", (int)value);
+    } else if (c == 'L' && type == kGTMLogArgLongDouble) {
+      // Dropped; recorded as a double.
+    } else {
+      rewritten[out++] = c;
+    }
+  }
+  rewritten[out] = '\0';
+  if (cursor->failed_) return nil;
+
+  NSString *conversion = [NSString stringWithUTF8String:rewritten];
+  NSString *result = nil;
+  switch (type) {
+    case kGTMLogArgInt:
+      result = FormatArgument(conversion, (int)ReadSigned(cursor));
+      break;
+    case kGTMLogArgLong:
+      result = FormatArgument(conversion, (long)ReadSigned(cursor));
+      break;
+    case kGTMLogArgLongLong:
+      result = FormatArgument(conversion, (long long)ReadSigned(cursor));
+      break;
+    case kGTMLogArgDouble:
+    case kGTMLogArgLongDouble:
+      result = FormatArgument(conversion, ReadDouble(cursor));
+      break;
+    case kGTMLogArgPointer:
+      result = FormatArgument(conversion, (void *)(uintptr_t)ReadVarint(cursor));
+      break;
+    case kGTMLogArgCString:
+    case kGTMLogArgBoundedCString: {
+      // Handed back to %s as the original bytes, so the text comes out exactly
+      // as NSString would have interpreted them.
+      size_t length;
+      const uint8_t *bytes = ReadStringBytes(cursor, &length);
+      NSMutableData *string = nil;
+      if (bytes) {
+        string = [NSMutableData dataWithBytes:bytes length:length + 1];
+        ((char *)[string mutableBytes])[length] = '\0';
+      }
+      result = FormatArgument(conversion, [string bytes]);
+      break;
+    }
+    case kGTMLogArgUnichars: {
+      NSString *string = ReadString(cursor);
+      NSMutableData *characters = nil;
+      if (string) {
+        NSUInteger length = [string length];
+        characters =
+            [NSMutableData dataWithLength:(length + 1) * sizeof(unichar)];
+        [string getCharacters:[characters mutableBytes]
+                        range:NSMakeRange(0, length)];
+      }
+      result = FormatArgument(conversion, [characters bytes]);
+      break;
+    }
+    case kGTMLogArgObject:
+      result = FormatArgument(conversion, ReadString(cursor));
+      break;
+    default:
+      return nil;  // COV_NF_LINE
+  }
+  return cursor->failed_ ? nil : result;
+}
+
+// Rebuilds the message from |format| and its recorded arguments. Returns nil if
+// the arguments don't match the format.
+static NSString *ExpandMessage(NSString *format,
+                               const uint8_t *args, size_t length) {
+  const char *fmt = [format UTF8String];
+  if (!fmt) return nil;
+  NSMutableString *result = [NSMutableString string];
+  GTMLogCursor cursor = { args, length, 0, NO };
+  size_t pos = 0;
+  size_t literalStart = 0;
+  GTMLogFormatSpec spec;
+  int found;
+  while ((found = NextFormatSpec(fmt, &pos, &spec)) == 1) {
+    if (spec.start_ > literalStart) {
+      NSString *literal =
+          [[[NSString alloc] initWithBytes:fmt + literalStart
+                                    length:spec.start_ - literalStart
+                                  encoding:NSUTF8StringEncoding] autorelease];
+      if (!literal) return nil;
+      [result appendString:literal];
+    }
+    literalStart = spec.end_;
+    if (spec.typeCount_ == 0) {
+      [result appendString:@"%"];
+      continue;
+    }
+    NSString *piece = ExpandSpec(fmt, &spec, &cursor);
+    if (!piece) return nil;
+    [result appendString:piece];
+  }
+  if (found < 0 || cursor.offset_ != cursor.length_) return nil;
+  [result appendString:[NSString stringWithUTF8String:fmt + literalStart]];
+  return result;
+}
+
+#pragma mark -
+
+@interface GTMLogBinaryRecord (PrivateMethods)
+- (id)initWithBytesNoCopy:(uint8_t *)bytes
+                   length:(NSUInteger)length
+               argsOffset:(NSUInteger)argsOffset
+                   format:(NSString *)format
+                 formatID:(uint32_t)formatID
+                     func:(NSString *)func
+                   funcID:(uint32_t)funcID;
+- (id)initWithBytesNoCopy:(uint8_t *)bytes
+                   length:(NSUInteger)length
+                     text:(NSString *)text
+                     func:(NSString *)func
+                   funcID:(uint32_t)funcID;
+- (NSString *)format;
+- (uint32_t)formatID;
+- (NSString *)func;
+- (uint32_t)funcID;
+@end
+
+@implementation GTMLogBinaryFormatter
+
+- (NSString *)stringForFunc:(NSString *)func
+                 withFormat:(NSString *)fmt
+                     valist:(va_list)args
+                      level:(GTMLoggerLevel)level {
+  if (!(fmt && args)) return nil;
+  GTMLogInternedString *name = func ? InternName(func) : NULL;
+  if (func && !name) {
+    // The table is full; the writer will have to make a text record of it.
+    return [super stringForFunc:func withFormat:fmt valist:args level:level];
+  }
+  GTMLogInternedString *format = InternFormat(fmt);
+  if (!format || !format->binary_) {
+    // Formatted now, but still recorded along with the function, thread and
+    // time of the call (not of whenever it gets written).
+    NSString *text =
+        [super stringForFunc:func withFormat:fmt valist:args level:level];
+    if (!text) return nil;  // COV_NF_LINE
+    uint8_t storage[256];
+    GTMLogBinaryBuffer buffer;
+    BufferInit(&buffer, storage, sizeof(storage));
+    AppendTextRecord(&buffer, level, name ? name->id_ : 0, text);
+    GTMLogBinaryRecord *record = nil;
+    uint8_t *bytes = buffer.failed_ ? NULL : malloc(buffer.length_);
+    if (bytes) {
+      memcpy(bytes, buffer.bytes_, buffer.length_);
+      record = [[[GTMLogBinaryRecord alloc]
+                  initWithBytesNoCopy:bytes
+                               length:buffer.length_
+                                 text:text
+                                 func:func
+                               funcID:name ? name->id_ : 0] autorelease];
+    }
+    BufferFree(&buffer);
+    return record ? record : text;
+  }
+
+  uint8_t argStorage[256];
+  GTMLogBinaryBuffer argBuffer;
+  BufferInit(&argBuffer, argStorage, sizeof(argStorage));
+  int lastInt = -1;  // The precision for a kGTMLogArgBoundedCString.
+  for (const char *type = format->argTypes_; *type; ++type) {
+    switch (*type) {
+      case kGTMLogArgInt:
+        lastInt = va_arg(args, int);
+        AppendSigned(&argBuffer, lastInt);
+        break;
+      case kGTMLogArgLong:
+        AppendSigned(&argBuffer, va_arg(args, long));
+        break;
+      case kGTMLogArgLongLong:
+        AppendSigned(&argBuffer, va_arg(args, long long));
+        break;
+      case kGTMLogArgDouble:
+        AppendDouble(&argBuffer, va_arg(args, double));
+        break;
+      case kGTMLogArgLongDouble: {
+        long double value = va_arg(args, long double);
+        AppendDouble(&argBuffer, (double)value);
+        break;
+      }
+      case kGTMLogArgPointer: {
+        void *value = va_arg(args, void *);
+        AppendVarint(&argBuffer, (uint64_t)(uintptr_t)value);
+        break;
+      }
+      case kGTMLogArgCString: {
+        const char *value = va_arg(args, const char *);
+        AppendUTF8(&argBuffer, value, value ? strlen(value) : 0);
+        break;
+      }
+      case kGTMLogArgBoundedCString: {
+        // A negative precision is taken as no precision.
+        const char *value = va_arg(args, const char *);
+        size_t length = 0;
+        if (value) {
+          while ((lastInt < 0 || length < (size_t)lastInt) && value[length]) {
+            ++length;
+          }
+        }
+        AppendUTF8(&argBuffer, value, length);
+        break;
+      }
+      case kGTMLogArgUnichars: {
+        const unichar *value = va_arg(args, const unichar *);
+        NSString *string = nil;
+        if (value) {
+          NSUInteger length = 0;
+          while (value[length]) ++length;
+          string = [[[NSString alloc] initWithCharacters:value
+                                                  length:length] autorelease];
+        }
+        AppendString(&argBuffer, string);
+        break;
+      }
+      case kGTMLogArgObject: {
+        id value = va_arg(args, id);
+        AppendString(&argBuffer, value ? [value description] : nil);
+        break;
+      }
+    }
+  }
+
+  uint8_t headerStorage[64];
+  GTMLogBinaryBuffer header;
+  BufferInit(&header, headerStorage, sizeof(headerStorage));
+  AppendByte(&header, kGTMLogBinaryMessageTag);
+  AppendVarint(&header, (uint64_t)level);
+  AppendVarint(&header, CurrentThreadID());
+  AppendVarint(&header, MonotonicNanoseconds());
+  AppendVarint(&header, format->id_);
+  AppendVarint(&header, name ? name->id_ : 0);
+  AppendVarint(&header, argBuffer.length_);
+
+  GTMLogBinaryRecord *record = nil;
+  if (!header.failed_ && !argBuffer.failed_) {
+    size_t length = header.length_ + argBuffer.length_;
+    uint8_t *bytes = malloc(length ? length : 1);
+    if (bytes) {
+      memcpy(bytes, header.bytes_, header.length_);
+      memcpy(bytes + header.length_, argBuffer.bytes_, argBuffer.length_);
+      record = [[[GTMLogBinaryRecord alloc]
+                  initWithBytesNoCopy:bytes
+                               length:length
+                           argsOffset:header.length_
+                               format:fmt
+                             formatID:format->id_
+                                 func:func
+                               funcID:name ? name->id_ : 0] autorelease];
+    }
+  }
+  BufferFree(&header);
+  BufferFree(&argBuffer);
+  return record;
+}
+
+@end  // GTMLogBinaryFormatter
+
+
+@implementation GTMLogBinaryRecord
+
+- (id)initWithBytesNoCopy:(uint8_t *)bytes
+                   length:(NSUInteger)length
+               argsOffset:(NSUInteger)argsOffset
+                   format:(NSString *)format
+                 formatID:(uint32_t)formatID
+                     func:(NSString *)func
+                   funcID:(uint32_t)funcID {
+  if ((self = [super init])) {
+    bytes_ = bytes;
+    length_ = length;
+    argsOffset_ = argsOffset;
+    argsLength_ = length - argsOffset;
+    format_ = [format copy];
+    formatID_ = formatID;
+    func_ = [func copy];
+    funcID_ = funcID;
+  } else {
+    free(bytes);  // COV_NF_LINE
+  }
+  return self;
+}
+
+// A text record; |text| is already formatted.
+- (id)initWithBytesNoCopy:(uint8_t *)bytes
+                   length:(NSUInteger)length
+                     text:(NSString *)text
+                     func:(NSString *)func
+                   funcID:(uint32_t)funcID {
+  if ((self = [super init])) {
+    bytes_ = bytes;
+    length_ = length;
+    text_ = [text copy];
+    func_ = [func copy];
+    funcID_ = funcID;
+  } else {
+    free(bytes);  // COV_NF_LINE
+  }
+  return self;
+}
+
+- (void)dealloc {
+  free(bytes_);
+  [format_ release];
+  [func_ release];
+  [text_ release];
+  [super dealloc];
+}
+
+- (const uint8_t *)recordBytes {
+  return bytes_;
+}
+
+- (NSUInteger)recordLength {
+  return length_;
+}
+
+- (NSString *)format {
+  return format_;
+}
+
+- (uint32_t)formatID {
+  return formatID_;
+}
+
+- (NSString *)func {
+  return func_;
+}
+
+- (uint32_t)funcID {
+  return funcID_;
+}
+
+// The formatted message, built the first time anybody looks at the string.
+- (NSString *)text {
+  @synchronized(self) {
+    if (!text_) {
+      text_ = [ExpandMessage(format_, bytes_ + argsOffset_, argsLength_) retain];
+      if (!text_) text_ = @"";  // COV_NF_LINE
+    }
+  }
+  return text_;
+}
+
+// NSString primitives.
+- (NSUInteger)length {
+  return [[self text] length];
+}
+
+- (unichar)characterAtIndex:(NSUInteger)index {
+  return [[self text] characterAtIndex:index];
+}
+
+- (void)getCharacters:(unichar *)buffer range:(NSRange)range {
+  [[self text] getCharacters:buffer range:range];
+}
+
+// Records are immutable, and copying must not force the text to be built
+// (writers like GTMAsyncLogWriter copy what they are given).
+- (id)copyWithZone:(NSZone *)zone {
+  return [self retain];
+}
+
+@end  // GTMLogBinaryRecord
+
+
+// Writes all of |length| bytes, retrying on EINTR and short writes.
+static void WriteFully(int fd, const uint8_t *bytes, size_t length) {
+  while (length) {
+    ssize_t written = write(fd, bytes, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    bytes += written;
+    length -= (size_t)written;
+  }
+}
+
+@implementation GTMLogBinaryWriter
+
++ (id)binaryWriterWithPath:(NSString *)path {
+  if (!path) return nil;
+  int fd = open([path fileSystemRepresentation],
+                O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd == -1) return nil;
+  return [[[self alloc] initWithFileDescriptor:fd
+                                closeOnDealloc:YES] autorelease];
+}
+
+- (id)initWithFileDescriptor:(int)fd closeOnDealloc:(BOOL)closeOnDealloc {
+  if ((self = [super init])) {
+    fd_ = fd;
+    closeOnDealloc_ = closeOnDealloc;
+    buffer_ = [[NSMutableData alloc] initWithCapacity:256];
+    if (fd_ < 0 || !buffer_) {
+      [self release];
+      return nil;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t wallMicroseconds =
+        (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_usec;
+    NSProcessInfo *processInfo = [NSProcessInfo processInfo];
+    uint8_t storage[128];
+    GTMLogBinaryBuffer header;
+    BufferInit(&header, storage, sizeof(storage));
+    AppendByte(&header, kGTMLogBinaryHeaderTag);
+    AppendVarint(&header, kGTMLogBinaryVersion);
+    AppendVarint(&header, wallMicroseconds);
+    AppendVarint(&header, MonotonicNanoseconds());
+    AppendVarint(&header, (uint64_t)[processInfo processIdentifier]);
+    AppendString(&header, [processInfo processName]);
+    if (!header.failed_) {
+      WriteFully(fd_, header.bytes_, header.length_);
+    }
+    BufferFree(&header);
+  }
+  return self;
+}
+
+- (id)init {
+  return [self initWithFileDescriptor:-1 closeOnDealloc:NO];
+}
+
+- (void)dealloc {
+  if (closeOnDealloc_ && fd_ >= 0) close(fd_);
+  free(definedIDs_);
+  [buffer_ release];
+  [super dealloc];
+}
+
+// Appends an 'S' record for |string| to |buffer_| unless this file already has
+// one for |stringID|. Assumes the caller is synchronized.
+- (void)defineString:(NSString *)string withID:(uint32_t)stringID {
+  NSUInteger byte = stringID / 8;
+  uint8_t bit = (uint8_t)(1 << (stringID % 8));
+  if (byte >= definedIDsSize_) {
+    NSUInteger size = (byte + 1) * 2;
+    uint8_t *defined = realloc(definedIDs_, size);
+    if (!defined) return;  // COV_NF_LINE
+    memset(defined + definedIDsSize_, 0, size - definedIDsSize_);
+    definedIDs_ = defined;
+    definedIDsSize_ = size;
+  }
+  if (definedIDs_[byte] & bit) return;
+
+  uint8_t storage[256];
+  GTMLogBinaryBuffer record;
+  BufferInit(&record, storage, sizeof(storage));
+  AppendByte(&record, kGTMLogBinaryStringTag);
+  AppendVarint(&record, stringID);
+  AppendString(&record, string);
+  if (!record.failed_) {
+    [buffer_ appendBytes:record.bytes_ length:record.length_];
+    definedIDs_[byte] |= bit;
+  }
+  BufferFree(&record);
+}
+
+- (void)logMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+  if (!msg) return;
+  @synchronized(self) {
+    [buffer_ setLength:0];
+    if ([msg isKindOfClass:[GTMLogBinaryRecord class]]) {
+      GTMLogBinaryRecord *record = (GTMLogBinaryRecord *)msg;
+      if ([record formatID]) {
+        [self defineString:[record format] withID:[record formatID]];
+      }
+      if ([record funcID]) {
+        [self defineString:[record func] withID:[record funcID]];
+      }
+      [buffer_ appendBytes:[record recordBytes] length:[record recordLength]];
+    } else {
+      uint8_t storage[256];
+      GTMLogBinaryBuffer text;
+      BufferInit(&text, storage, sizeof(storage));
+      AppendTextRecord(&text, level, 0, msg);
+      if (!text.failed_) {
+        [buffer_ appendBytes:text.bytes_ length:text.length_];
+      }
+      BufferFree(&text);
+    }
+    WriteFully(fd_, [buffer_ bytes], [buffer_ length]);
+  }
+}
+
+@end  // GTMLogBinaryWriter
+
+
+@implementation GTMLogBinaryReader
+
+- (id)initWithData:(NSData *)data {
+  if ((self = [super init])) {
+    data_ = [data retain];
+    strings_ = [[NSMutableDictionary alloc] init];
+    funcFormatter_ = [[GTMLogBasicFormatter alloc] init];
+    if (!data_ || !strings_ || !funcFormatter_) {
+      [self release];
+      return nil;
+    }
+  }
+  return self;
+}
+
+- (id)init {
+  return [self initWithData:nil];
+}
+
+- (void)dealloc {
+  [data_ release];
+  [strings_ release];
+  [processName_ release];
+  [funcFormatter_ release];
+  [super dealloc];
+}
+
+- (BOOL)isCorrupt {
+  return corrupt_;
+}
+
+- (NSString *)lineWithLevel:(uint64_t)level
+                     thread:(uint64_t)thread
+                  monotonic:(uint64_t)monotonic
+                       func:(NSString *)func
+                    message:(NSString *)message {
+  int64_t elapsed = (int64_t)(monotonic - monotonicNanoseconds_) / 1000;
+  uint64_t microseconds = wallMicroseconds_ + (uint64_t)elapsed;
+  time_t seconds = (time_t)(microseconds / 1000000);
+  struct tm local;
+  localtime_r(&seconds, &local);
+  char stamp[32];
+  if (strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local) == 0) {
+    stamp[0] = '\0';  // COV_NF_LINE
+  }
+  return [NSString stringWithFormat:@"%s.%03d %@[%llu/0x%llx] [lvl=%d] %@ %@",
+          stamp, (int)((microseconds / 1000) % 1000),
+          processName_ ? processName_ : @"(unknown)",
+          (unsigned long long)pid_, (unsigned long long)thread, (int)level,
+          [funcFormatter_ prettyNameForFunc:func], message];
+}
+
+- (NSString *)nextLine {
+  const uint8_t *bytes = [data_ bytes];
+  GTMLogCursor cursor = { bytes, [data_ length], offset_, NO };
+  NSString *line = nil;
+  while (!line && !corrupt_ && cursor.offset_ < cursor.length_) {
+    uint8_t tag = bytes[cursor.offset_++];
+    switch (tag) {
+      case kGTMLogBinaryHeaderTag: {
+        uint64_t version = ReadVarint(&cursor);
+        uint64_t wall = ReadVarint(&cursor);
+        uint64_t monotonic = ReadVarint(&cursor);
+        uint64_t pid = ReadVarint(&cursor);
+        NSString *name = ReadString(&cursor);
+        if (cursor.failed_ || version < 1 || version > kGTMLogBinaryVersion) {
+          corrupt_ = YES;
+          break;
+        }
+        version_ = version;
+        wallMicroseconds_ = wall;
+        monotonicNanoseconds_ = monotonic;
+        pid_ = pid;
+        [processName_ autorelease];
+        processName_ = [name copy];
+        [strings_ removeAllObjects];
+        break;
+      }
+      case kGTMLogBinaryStringTag: {
+        uint64_t stringID = ReadVarint(&cursor);
+        NSString *string = ReadString(&cursor);
+        if (cursor.failed_ || !string) {
+          corrupt_ = YES;
+          break;
+        }
+        [strings_ setObject:string
+                     forKey:[NSNumber numberWithUnsignedLongLong:stringID]];
+        break;
+      }
+      case kGTMLogBinaryMessageTag: {
+        uint64_t level = ReadVarint(&cursor);
+        uint64_t thread = ReadVarint(&cursor);
+        uint64_t monotonic = ReadVarint(&cursor);
+        uint64_t formatID = ReadVarint(&cursor);
+        uint64_t funcID = ReadVarint(&cursor);
+        uint64_t argsLength = ReadVarint(&cursor);
+        if (cursor.failed_ ||
+            argsLength > cursor.length_ - cursor.offset_) {
+          corrupt_ = YES;
+          break;
+        }
+        const uint8_t *args = bytes + cursor.offset_;
+        cursor.offset_ += (size_t)argsLength;
+        NSString *format =
+            [strings_ objectForKey:
+                [NSNumber numberWithUnsignedLongLong:formatID]];
+        NSString *func = nil;
+        if (funcID) {
+          func = [strings_ objectForKey:
+                     [NSNumber numberWithUnsignedLongLong:funcID]];
+        }
+        NSString *message =
+            format ? ExpandMessage(format, args, (size_t)argsLength) : nil;
+        if (!message || (funcID && !func)) {
+          corrupt_ = YES;
+          break;
+        }
+        line = [self lineWithLevel:level
+                            thread:thread
+                         monotonic:monotonic
+                              func:func
+                           message:message];
+        break;
+      }
+      case kGTMLogBinaryTextTag: {
+        uint64_t level = ReadVarint(&cursor);
+        uint64_t thread = ReadVarint(&cursor);
+        uint64_t monotonic = ReadVarint(&cursor);
+        uint64_t funcID = (version_ >= 2) ? ReadVarint(&cursor) : 0;
+        NSString *message = ReadString(&cursor);
+        NSString *func = nil;
+        if (funcID) {
+          func = [strings_ objectForKey:
+                     [NSNumber numberWithUnsignedLongLong:funcID]];
+        }
+        if (cursor.failed_ || (funcID && !func)) {
+          corrupt_ = YES;
+          break;
+        }
+        line = [self lineWithLevel:level
+                            thread:thread
+                         monotonic:monotonic
+                              func:func
+                           message:message ? message : @""];
+        break;
+      }
+      default:
+        corrupt_ = YES;
+        break;
+    }
+  }
+  offset_ = cursor.offset_;
+  return corrupt_ ? nil : line;
+}
+
+@end  // GTMLogBinaryReader
+
+#if !defined(__clang__) && (__GNUC__*10+__GNUC_MINOR__ >= 42)
+// See comment at top of file.
+#pragma GCC diagnostic error "-Wmissing-format-attribute"
+#endif  // !__clang__
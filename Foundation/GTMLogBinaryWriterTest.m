@@ -0,0 +1,392 @@
+//
+//  GTMLogBinaryWriterTest.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import <pthread.h>
+#import <sys/mman.h>
+#import "GTMSenTestCase.h"
+#import "GTMLogBinaryWriter.h"
+#import "GTMTestTimer.h"
+
+@interface GTMLogBinaryWriterTest : GTMTestCase {
+ @private
+  NSString *path_;
+}
+- (NSString *)stringFromFormatter:(id<GTMLogFormatter>)formatter
+                           format:(NSString *)fmt, ... NS_FORMAT_FUNCTION(2,3);
+// For formats that aren't literals.
+- (NSString *)stringFromFormatter:(id<GTMLogFormatter>)formatter
+                   variableFormat:(NSString *)fmt, ...;
+- (NSArray *)linesAtPath:(NSString *)path corrupt:(BOOL *)corrupt;
+@end
+
+@implementation GTMLogBinaryWriterTest
+
+- (void)setUp {
+  path_ = [[NSTemporaryDirectory() stringByAppendingPathComponent:
+            @"GTMLogBinaryWriterTest.glog"] retain];
+  [[NSFileManager defaultManager] removeItemAtPath:path_ error:NULL];
+}
+
+- (void)tearDown {
+  [[NSFileManager defaultManager] removeItemAtPath:path_ error:NULL];
+  [path_ release];
+  path_ = nil;
+}
+
+- (NSString *)stringFromFormatter:(id<GTMLogFormatter>)formatter
+                           format:(NSString *)fmt, ... {
+  va_list args;
+  va_start(args, fmt);
+  NSString *msg = [formatter stringForFunc:nil
+                                withFormat:fmt
+                                    valist:args
+                                     level:kGTMLoggerLevelInfo];
+  va_end(args);
+  return msg;
+}
+
+- (NSString *)stringFromFormatter:(id<GTMLogFormatter>)formatter
+                   variableFormat:(NSString *)fmt, ... {
+  va_list args;
+  va_start(args, fmt);
+  NSString *msg = [formatter stringForFunc:nil
+                                withFormat:fmt
+                                    valist:args
+                                     level:kGTMLoggerLevelInfo];
+  va_end(args);
+  return msg;
+}
+
+- (NSArray *)linesAtPath:(NSString *)path corrupt:(BOOL *)corrupt {
+  NSData *data = [NSData dataWithContentsOfFile:path];
+  GTMLogBinaryReader *reader =
+      [[[GTMLogBinaryReader alloc] initWithData:data] autorelease];
+  NSMutableArray *lines = [NSMutableArray array];
+  NSString *line;
+  while ((line = [reader nextLine])) {
+    [lines addObject:line];
+  }
+  *corrupt = [reader isCorrupt];
+  return lines;
+}
+
+- (void)testCreation {
+  STAssertNil([[[GTMLogBinaryWriter alloc] init] autorelease], nil);
+  STAssertNil([GTMLogBinaryWriter binaryWriterWithPath:nil], nil);
+  STAssertNil([GTMLogBinaryWriter binaryWriterWithPath:@"/no/such/dir/x"], nil);
+  STAssertNotNil([GTMLogBinaryWriter binaryWriterWithPath:path_], nil);
+  STAssertNil([[[GTMLogBinaryReader alloc] init] autorelease], nil);
+}
+
+- (void)testRecordText {
+  GTMLogBinaryFormatter *binary =
+      [[[GTMLogBinaryFormatter alloc] init] autorelease];
+  STAssertNotNil(binary, nil);
+  GTMLogBasicFormatter *basic =
+      [[[GTMLogBasicFormatter alloc] init] autorelease];
+
+  // Each record has to read back exactly as the basic formatter's string.
+#define CHECK_FORMAT(...) \
+  do { \
+    NSString *record = [self stringFromFormatter:binary format:__VA_ARGS__]; \
+    STAssertTrue([record isKindOfClass:[GTMLogBinaryRecord class]], \
+                 @"%@", record); \
+    STAssertEqualObjects(record, \
+                         [self stringFromFormatter:basic format:__VA_ARGS__], \
+                         nil); \
+  } while (0)
+
+  CHECK_FORMAT(@"plain text");
+  CHECK_FORMAT(@"");
+  CHECK_FORMAT(@"%d %i %u %x %X %o", -1, 42, 7U, 255U, 255U, 8U);
+  CHECK_FORMAT(@"%ld %lu %lld %llu", LONG_MIN, ULONG_MAX, LLONG_MIN, ULLONG_MAX);
+  CHECK_FORMAT(@"%zu %qd %jd", (size_t)3, (long long)-4, (intmax_t)5);
+  CHECK_FORMAT(@"%hd %hhu", (short)-2, (unsigned char)200);
+  CHECK_FORMAT(@"%5.2f|%e|%g|%a", 3.14159, 1e-20, 0.5, 2.0);
+  CHECK_FORMAT(@"%Lf", (long double)1.5);
+  CHECK_FORMAT(@"%s|%s|%10s", "c string", "\xC3\xA9t\xC3\xA9", "pad");
+  CHECK_FORMAT(@"%@ and %@ and %@", @"obj", [NSNumber numberWithInt:3], nil);
+  CHECK_FORMAT(@"%p %p", (void *)0, (void *)self);
+  CHECK_FORMAT(@"%*d|%-*.*f|", 6, 12, 9, 2, 1.25);
+  CHECK_FORMAT(@"100%% done, %c%C", 'x', (unichar)0x263A);
+  CHECK_FORMAT(@"unicode é %@ ☃", @"ü");
+#undef CHECK_FORMAT
+
+  // Formats that can't be recorded are formatted straight away (but still
+  // come back as records).
+  NSString *positional =
+      [self stringFromFormatter:binary format:@"%1$@ %1$@", @"x"];
+  STAssertTrue([positional isKindOfClass:[GTMLogBinaryRecord class]], nil);
+  STAssertEqualObjects(positional, @"x x", nil);
+
+  // Copies don't expand the record.
+  NSString *record = [self stringFromFormatter:binary format:@"%d", 1];
+  NSString *copy = [[record copy] autorelease];
+  STAssertEquals(copy, record, nil);
+}
+
+- (void)testStringPrecision {
+  // A string with a precision doesn't have to be terminated, so end one right
+  // before a page that can't be read.
+  size_t pageSize = (size_t)getpagesize();
+  char *pages = mmap(NULL, pageSize * 2, PROT_READ | PROT_WRITE,
+                     MAP_ANON | MAP_PRIVATE, -1, 0);
+  STAssertTrue(pages != MAP_FAILED, nil);
+  STAssertEquals(mprotect(pages + pageSize, pageSize, PROT_NONE), 0, nil);
+  char *unterminated = pages + pageSize - 5;
+  memcpy(unterminated, "hello", 5);
+
+  GTMLogBinaryFormatter *binary =
+      [[[GTMLogBinaryFormatter alloc] init] autorelease];
+  NSString *record =
+      [self stringFromFormatter:binary format:@"[%.*s]", 5, unterminated];
+  STAssertTrue([record isKindOfClass:[GTMLogBinaryRecord class]], nil);
+  STAssertEqualObjects(record, @"[hello]", nil);
+  record = [self stringFromFormatter:binary
+                              format:@"[%*.*s]", 6, 3, unterminated];
+  STAssertTrue([record isKindOfClass:[GTMLogBinaryRecord class]], nil);
+  STAssertEqualObjects(record, @"[   hel]", nil);
+  // Negative means there's no precision.
+  record = [self stringFromFormatter:binary format:@"[%.*s]", -1, "whole"];
+  STAssertEqualObjects(record, @"[whole]", nil);
+
+  // A literal precision is formatted as text.
+  record = [self stringFromFormatter:binary format:@"[%.4s]", unterminated];
+  STAssertEqualObjects(record, @"[hell]", nil);
+
+  // And they read back from a file the same way.
+  GTMLogger *logger =
+      [GTMLogger loggerWithWriter:[GTMLogBinaryWriter binaryWriterWithPath:path_]
+                        formatter:binary
+                           filter:[[[GTMLogNoFilter alloc] init] autorelease]];
+  [logger logInfo:@"%.*s", 5, unterminated];
+  [logger logInfo:@"%.3s", unterminated];
+  BOOL corrupt = YES;
+  NSArray *lines = [self linesAtPath:path_ corrupt:&corrupt];
+  STAssertFalse(corrupt, nil);
+  STAssertEquals([lines count], (NSUInteger)2, nil);
+  if ([lines count] == 2) {
+    STAssertTrue([[lines objectAtIndex:0] hasSuffix:@"hello"], nil);
+    STAssertTrue([[lines objectAtIndex:1] hasSuffix:@"hel"], nil);
+  }
+
+  munmap(pages, pageSize * 2);
+}
+
+- (void)testInternedFormats {
+  GTMLogBinaryFormatter *binary =
+      [[[GTMLogBinaryFormatter alloc] init] autorelease];
+
+  // Formats are remembered by address, so one that changes, or goes away
+  // and has its address reused, mustn't get the old one's argument types.
+  NSMutableString *mutableFormat = [NSMutableString stringWithString:@"<%d>"];
+  STAssertEqualObjects([self stringFromFormatter:binary
+                                  variableFormat:mutableFormat, 7],
+                       @"<7>", nil);
+  [mutableFormat setString:@"<%@>"];
+  STAssertEqualObjects([self stringFromFormatter:binary
+                                  variableFormat:mutableFormat, @"seven"],
+                       @"<seven>", nil);
+  for (int i = 0; i < 200; ++i) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSString *format = [NSString stringWithFormat:@"%d:%@", i,
+                        (i % 2) ? @"%s" : @"%g"];
+    NSString *expected = [NSString stringWithFormat:@"%d:%@", i,
+                          (i % 2) ? @"odd" : @"0.5"];
+    NSString *record = (i % 2)
+        ? [self stringFromFormatter:binary variableFormat:format, "odd"]
+        : [self stringFromFormatter:binary variableFormat:format, 0.5];
+    STAssertEqualObjects(record, expected, nil);
+    [pool drain];
+  }
+}
+
+- (void)testRoundTrip {
+  GTMLogger *logger =
+      [GTMLogger loggerWithWriter:[GTMLogBinaryWriter binaryWriterWithPath:path_]
+                        formatter:[[[GTMLogBinaryFormatter alloc] init]
+                                    autorelease]
+                           filter:[[[GTMLogNoFilter alloc] init] autorelease]];
+  STAssertNotNil(logger, nil);
+  [logger logFuncInfo:"-[Foo bar]" msg:@"hello %@ %d", @"world", 1];
+  [logger logFuncError:"-[Foo bar]" msg:@"%.1f%%", 99.5];
+  [logger logFuncDebug:"BazFunction" msg:@"%s", "c"];
+  [logger logInfo:@"no function"];
+  [logger logInfo:@"%1$d", 4];  // Text record.
+  [logger logFuncInfo:"TextFunction" msg:@"%1$d", 5];
+  [[logger writer] logMessage:@"raw text" level:kGTMLoggerLevelError];
+
+  // A second process appending to the same file.
+  logger = [GTMLogger loggerWithWriter:
+               [GTMLogBinaryWriter binaryWriterWithPath:path_]
+                             formatter:[[[GTMLogBinaryFormatter alloc] init]
+                                         autorelease]
+                                filter:nil];
+  [logger logFuncInfo:"-[Foo bar]" msg:@"hello %@ %d", @"again", 2];
+
+  BOOL corrupt = YES;
+  NSArray *lines = [self linesAtPath:path_ corrupt:&corrupt];
+  STAssertFalse(corrupt, nil);
+  NSArray *expected = [NSArray arrayWithObjects:
+      @"[lvl=2] -[Foo bar] hello world 1",
+      @"[lvl=4] -[Foo bar] 99.5%",
+      @"[lvl=1] BazFunction() c",
+      @"[lvl=2] (unknown) no function",
+      @"[lvl=2] (unknown) 4",
+      @"[lvl=2] TextFunction() 5",
+      @"[lvl=4] (unknown) raw text",
+      @"[lvl=2] -[Foo bar] hello again 2",
+      nil];
+  STAssertEquals([lines count], [expected count], @"%@", lines);
+  NSString *prefix =
+      [NSString stringWithFormat:@" %@[%d/0x",
+       [[NSProcessInfo processInfo] processName],
+       [[NSProcessInfo processInfo] processIdentifier]];
+  NSUInteger count = MIN([lines count], [expected count]);
+  for (NSUInteger i = 0; i < count; ++i) {
+    NSString *line = [lines objectAtIndex:i];
+    STAssertTrue([line hasSuffix:[expected objectAtIndex:i]], @"%@", line);
+    STAssertTrue([line rangeOfString:prefix].location == 23, @"%@", line);
+  }
+}
+
+- (void)formatOnThread:(NSMutableDictionary *)job {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  GTMLogBinaryFormatter *binary =
+      [[[GTMLogBinaryFormatter alloc] init] autorelease];
+  [job setObject:[self stringFromFormatter:binary format:@"%1$d", 6]
+          forKey:@"record"];
+  [job setObject:[NSString stringWithFormat:@"/0x%llx]",
+                  (unsigned long long)(uintptr_t)pthread_self()]
+          forKey:@"thread"];
+  NSConditionLock *done = [job objectForKey:@"done"];
+  [done lock];
+  [done unlockWithCondition:1];
+  [pool drain];
+}
+
+- (void)testTextRecordsKeepTheirThread {
+  // Text records are stamped when they're formatted, not when they're
+  // written (which could be on another thread, like GTMAsyncLogWriter's).
+  NSConditionLock *done =
+      [[[NSConditionLock alloc] initWithCondition:0] autorelease];
+  NSMutableDictionary *job =
+      [NSMutableDictionary dictionaryWithObject:done forKey:@"done"];
+  [NSThread detachNewThreadSelector:@selector(formatOnThread:)
+                           toTarget:self
+                         withObject:job];
+  [done lockWhenCondition:1];
+  [done unlock];
+
+  GTMLogBinaryWriter *writer = [GTMLogBinaryWriter binaryWriterWithPath:path_];
+  [writer logMessage:[job objectForKey:@"record"] level:kGTMLoggerLevelInfo];
+  BOOL corrupt = YES;
+  NSArray *lines = [self linesAtPath:path_ corrupt:&corrupt];
+  STAssertFalse(corrupt, nil);
+  STAssertEquals([lines count], (NSUInteger)1, nil);
+  NSString *line = [lines lastObject];
+  STAssertTrue([line hasSuffix:@"(unknown) 6"], @"%@", line);
+  STAssertTrue([line rangeOfString:[job objectForKey:@"thread"]].location
+                   != NSNotFound, @"%@", line);
+}
+
+- (void)testCorruptData {
+  GTMLogBinaryWriter *writer = [GTMLogBinaryWriter binaryWriterWithPath:path_];
+  GTMLogger *logger =
+      [GTMLogger loggerWithWriter:writer
+                        formatter:[[[GTMLogBinaryFormatter alloc] init]
+                                    autorelease]
+                           filter:nil];
+  [logger logInfo:@"one %d", 1];
+  [logger logInfo:@"two %d", 2];
+
+  NSData *data = [NSData dataWithContentsOfFile:path_];
+  NSData *truncated = [data subdataWithRange:NSMakeRange(0, [data length] - 1)];
+  GTMLogBinaryReader *reader =
+      [[[GTMLogBinaryReader alloc] initWithData:truncated] autorelease];
+  STAssertTrue([[reader nextLine] hasSuffix:@"one 1"], nil);
+  STAssertNil([reader nextLine], nil);
+  STAssertTrue([reader isCorrupt], nil);
+
+  NSMutableData *garbage = [NSMutableData dataWithData:data];
+  [garbage appendBytes:"?" length:1];
+  reader = [[[GTMLogBinaryReader alloc] initWithData:garbage] autorelease];
+  STAssertNotNil([reader nextLine], nil);
+  STAssertNotNil([reader nextLine], nil);
+  STAssertNil([reader nextLine], nil);
+  STAssertTrue([reader isCorrupt], nil);
+
+  reader = [[[GTMLogBinaryReader alloc] initWithData:[NSData data]] autorelease];
+  STAssertNil([reader nextLine], nil);
+  STAssertFalse([reader isCorrupt], nil);
+}
+
+// Compares the cost of logging a typical message as text through
+// GTMLogStandardFormatter and a file handle with the binary path.
+- (void)testBinaryLoggingCost {
+  const NSUInteger kMessages = 20000;
+  NSString *textPath = [path_ stringByAppendingPathExtension:@"txt"];
+  [[NSFileManager defaultManager] removeItemAtPath:textPath error:NULL];
+
+  GTMLogger *textLogger =
+      [GTMLogger loggerWithWriter:
+          [NSFileHandle fileHandleForLoggingAtPath:textPath mode:0644]
+                        formatter:[[[GTMLogStandardFormatter alloc] init]
+                                    autorelease]
+                           filter:nil];
+  GTMTestTimer *textTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(textTimer);
+  for (NSUInteger i = 0; i < kMessages; ++i) {
+    [textLogger logFuncInfo:"-[Server handleRequest:]"
+                        msg:@"served %lu bytes to %@ in %.3fms",
+                            (unsigned long)i * 17, @"client.example.com", 1.5];
+  }
+  GTMTestTimerStop(textTimer);
+
+  GTMLogger *binaryLogger =
+      [GTMLogger loggerWithWriter:[GTMLogBinaryWriter binaryWriterWithPath:path_]
+                        formatter:[[[GTMLogBinaryFormatter alloc] init]
+                                    autorelease]
+                           filter:nil];
+  GTMTestTimer *binaryTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(binaryTimer);
+  for (NSUInteger i = 0; i < kMessages; ++i) {
+    [binaryLogger logFuncInfo:"-[Server handleRequest:]"
+                          msg:@"served %lu bytes to %@ in %.3fms",
+                              (unsigned long)i * 17, @"client.example.com",
+                              1.5];
+  }
+  GTMTestTimerStop(binaryTimer);
+
+  NSFileManager *fm = [NSFileManager defaultManager];
+  unsigned long long textBytes =
+      [[fm attributesOfItemAtPath:textPath error:NULL] fileSize];
+  unsigned long long binaryBytes =
+      [[fm attributesOfItemAtPath:path_ error:NULL] fileSize];
+  NSLog(@"Per message: text %.0fns %.1f bytes, binary %.0fns %.1f bytes",
+        GTMTestTimerGetNanoseconds(textTimer) / kMessages,
+        (double)textBytes / kMessages,
+        GTMTestTimerGetNanoseconds(binaryTimer) / kMessages,
+        (double)binaryBytes / kMessages);
+  STAssertLessThan(binaryBytes, textBytes, nil);
+  GTMTestTimerRelease(textTimer);
+  GTMTestTimerRelease(binaryTimer);
+  [fm removeItemAtPath:textPath error:NULL];
+}
+
+@end
@@ -211,6 +211,7 @@
   id<GTMLogWriter> writer_;
   id<GTMLogFormatter> formatter_;
   id<GTMLogFilter> filter_;
+  id<GTMLogFilter> levelFilter_;  // |filter_| if its level check counts, weak
 }
 
 //
@@ -297,7 +298,10 @@
 - (void)setFormatter:(id<GTMLogFormatter>)formatter;
 
 // Accessor methods for the log filter. If the log filter is set to nil,
-// GTMLogNoFilter is used, which allows all log messages through.
+// GTMLogNoFilter is used, which allows all log messages through. If the filter
+// implements -filterAllowsMessageAtLevel:, messages it rejects are dropped
+// before they are formatted (unless it comes from a superclass of the one that
+// implements -filterAllowsMessage:level:, which it then can't speak for).
 - (id<GTMLogFilter>)filter;
 - (void)setFilter:(id<GTMLogFilter>)filter;
 
@@ -429,9 +433,11 @@ typedef enum {
 // also prepends a timestamp and some basic process info to the message, as
 // shown in the following sample output.
 //   2007-12-30 10:29:24.177 myapp[4588/0xa07d0f60] [lvl=1] log mesage here
+// The timestamp is in local time. Each thread caches the formatted date and
+// time for the current second, so formatting takes no locks and only the
+// milliseconds are formatted for most messages.
 @interface GTMLogStandardFormatter : GTMLogBasicFormatter {
  @private
-  NSDateFormatter *dateFormatter_;  // yyyy-MM-dd HH:mm:ss.SSS
   NSString *pname_;
   pid_t pid_;
 }
@@ -446,6 +452,13 @@ typedef enum {
 @protocol GTMLogFilter <NSObject>
 // Returns YES if |msg| at |level| should be logged; NO otherwise.
 - (BOOL)filterAllowsMessage:(NSString *)msg level:(GTMLoggerLevel)level;
+@optional
+// Returns NO if nothing at |level| will ever be logged, regardless of the
+// message. GTMLogger asks this before formatting anything, so a filter that
+// implements it lets rejected messages skip formatting (and all of the
+// allocations that go with it) entirely. Messages that pass this check are
+// still handed to -filterAllowsMessage:level: once they have been formatted.
+- (BOOL)filterAllowsMessageAtLevel:(GTMLoggerLevel)level;
 @end  // GTMLogFilter
 
 
@@ -21,6 +21,8 @@
 #import <unistd.h>
 #import <stdlib.h>
 #import <pthread.h>
+#import <sys/time.h>
+#import <time.h>
 
 
 #if !defined(__clang__) && (__GNUC__*10+__GNUC_MINOR__ >= 42)
@@ -37,6 +39,34 @@
 // just an easy reference to one shared instance.
 static GTMLogger *gSharedLogger = nil;
 
+// Returns the class in |cls|'s hierarchy that |sel| is implemented in.
+static Class ImplementingClass(Class cls, SEL sel) {
+  IMP imp = [cls instanceMethodForSelector:sel];
+  Class superclass;
+  while ((superclass = [cls superclass]) &&
+         [superclass instancesRespondToSelector:sel] &&
+         [superclass instanceMethodForSelector:sel] == imp) {
+    cls = superclass;
+  }
+  return cls;
+}
+
+// Returns YES if |filter|'s -filterAllowsMessageAtLevel: can be trusted to
+// speak for its -filterAllowsMessage:level:. That's not so for a subclass that
+// only overrides -filterAllowsMessage:level:, since its superclass's level
+// check knows nothing about it.
+static BOOL FilterChecksLevel(id<GTMLogFilter> filter) {
+  if (![filter respondsToSelector:@selector(filterAllowsMessageAtLevel:)]) {
+    return NO;
+  }
+  Class cls = [filter class];
+  Class levelClass =
+      ImplementingClass(cls, @selector(filterAllowsMessageAtLevel:));
+  Class messageClass =
+      ImplementingClass(cls, @selector(filterAllowsMessage:level:));
+  return [levelClass isSubclassOfClass:messageClass];
+}
+
 
 @implementation GTMLogger
 
@@ -229,18 +259,22 @@ static GTMLogger *gSharedLogger = nil;
 
 - (void)setFilter:(id<GTMLogFilter>)filter {
   @synchronized(self) {
-    [filter_ autorelease];
-    filter_ = nil;
+    id<GTMLogFilter> newFilter = nil;
     if (filter == nil) {
       @try {
-        filter_ = [[GTMLogNoFilter alloc] init];
+        newFilter = [[GTMLogNoFilter alloc] init];
       }
       @catch (id e) {
         // Leave |filter_| nil
       }
     } else {
-      filter_ = [filter retain];
+      newFilter = [filter retain];
     }
+    // Logging reads these without the lock. |levelFilter_| is a single
+    // pointer so a reader never pairs a filter with a stale answer about it.
+    [filter_ autorelease];
+    levelFilter_ = FilterChecksLevel(newFilter) ? newFilter : nil;
+    filter_ = newFilter;
   }
 }
 
@@ -315,6 +349,11 @@ static GTMLogger *gSharedLogger = nil;
   // Primary point where logging happens, logging should never throw, catch
   // everything.
   @try {
+    // Let the filter reject the level before we pay for any formatting.
+    id<GTMLogFilter> levelFilter = levelFilter_;
+    if (levelFilter && ![levelFilter filterAllowsMessageAtLevel:level]) {
+      return;
+    }
     NSString *fname = func ? [NSString stringWithUTF8String:func] : nil;
     NSString *msg = [formatter_ stringForFunc:fname
                                    withFormat:fmt
@@ -435,16 +474,67 @@ static GTMLogger *gSharedLogger = nil;
 @end  // GTMLogBasicFormatter
 
 
+// Per-thread cache of the "yyyy-MM-dd HH:mm:ss" part of the timestamp. The
+// date and time only change once a second, so almost every message just has
+// to append the milliseconds.
+typedef struct GTMLogTimestampCache {
+  time_t second_;
+  BOOL valid_;
+  char prefix_[32];
+} GTMLogTimestampCache;
+
+static pthread_key_t gTimestampCacheKey;
+static pthread_once_t gTimestampCacheKeyOnce = PTHREAD_ONCE_INIT;
+
+static void CreateTimestampCacheKey(void) {
+  pthread_key_create(&gTimestampCacheKey, free);
+}
+
+// Fills |buffer| with the current local time as "yyyy-MM-dd HH:mm:ss.SSS".
+static void CopyTimestamp(char *buffer, size_t size) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  pthread_once(&gTimestampCacheKeyOnce, CreateTimestampCacheKey);
+  GTMLogTimestampCache *cache = pthread_getspecific(gTimestampCacheKey);
+  if (!cache) {
+    cache = calloc(1, sizeof(GTMLogTimestampCache));
+    if (!cache || pthread_setspecific(gTimestampCacheKey, cache) != 0) {
+      // COV_NF_START
+      free(cache);
+      cache = NULL;
+      // COV_NF_END
+    }
+  }
+
+  GTMLogTimestampCache uncached;
+  if (!cache) {
+    // COV_NF_START
+    uncached.valid_ = NO;
+    cache = &uncached;
+    // COV_NF_END
+  }
+  if (!cache->valid_ || cache->second_ != now.tv_sec) {
+    struct tm local;
+    localtime_r(&now.tv_sec, &local);
+    if (strftime(cache->prefix_, sizeof(cache->prefix_),
+                 "%Y-%m-%d %H:%M:%S", &local) == 0) {
+      cache->prefix_[0] = '\0';  // COV_NF_LINE
+    }
+    cache->second_ = now.tv_sec;
+    cache->valid_ = YES;
+  }
+  snprintf(buffer, size, "%s.%03d",
+           cache->prefix_, (int)(now.tv_usec / 1000));
+}
+
 @implementation GTMLogStandardFormatter
 
 - (id)init {
   if ((self = [super init])) {
-    dateFormatter_ = [[NSDateFormatter alloc] init];
-    [dateFormatter_ setFormatterBehavior:NSDateFormatterBehavior10_4];
-    [dateFormatter_ setDateFormat:@"yyyy-MM-dd HH:mm:ss.SSS"];
     pname_ = [[[NSProcessInfo processInfo] processName] copy];
     pid_ = [[NSProcessInfo processInfo] processIdentifier];
-    if (!(dateFormatter_ && pname_)) {
+    if (!pname_) {
       [self release];
       return nil;
     }
@@ -453,7 +543,6 @@ static GTMLogger *gSharedLogger = nil;
 }
 
 - (void)dealloc {
-  [dateFormatter_ release];
   [pname_ release];
   [super dealloc];
 }
@@ -462,11 +551,9 @@ static GTMLogger *gSharedLogger = nil;
                  withFormat:(NSString *)fmt
                      valist:(va_list)args
                       level:(GTMLoggerLevel)level {
-  NSString *tstamp = nil;
-  @synchronized (dateFormatter_) {
-    tstamp = [dateFormatter_ stringFromDate:[NSDate date]];
-  }
-  return [NSString stringWithFormat:@"%@ %@[%d/%p] [lvl=%d] %@ %@",
+  char tstamp[40];
+  CopyTimestamp(tstamp, sizeof(tstamp));
+  return [NSString stringWithFormat:@"%s %@[%d/%p] [lvl=%d] %@ %@",
            tstamp, pname_, pid_, pthread_self(),
            level, [self prettyNameForFunc:func],
            // |super| has guard for nil |fmt| and |args|
@@ -522,9 +609,13 @@ static BOOL IsVerboseLoggingEnabled(void) {
   [super dealloc];
 }
 
+- (BOOL)filterAllowsMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+  return [self filterAllowsMessageAtLevel:level];
+}
+
 // In DEBUG builds, log everything. If we're not in a debug build we'll assume
 // that we're in a Release build.
-- (BOOL)filterAllowsMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+- (BOOL)filterAllowsMessageAtLevel:(GTMLoggerLevel)level {
 #if defined(DEBUG) && DEBUG
   return YES;
 #endif
@@ -565,6 +656,10 @@ static BOOL IsVerboseLoggingEnabled(void) {
   return YES;  // Allow everything through
 }
 
+- (BOOL)filterAllowsMessageAtLevel:(GTMLoggerLevel)level {
+  return YES;
+}
+
 @end  // GTMLogNoFilter
 
 
@@ -602,6 +697,10 @@ static BOOL IsVerboseLoggingEnabled(void) {
 }
 
 - (BOOL)filterAllowsMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+  return [self filterAllowsMessageAtLevel:level];
+}
+
+- (BOOL)filterAllowsMessageAtLevel:(GTMLoggerLevel)level {
   return [allowedLevels_ containsIndex:level];
 }
 
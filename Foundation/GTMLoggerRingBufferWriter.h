@@ -20,6 +20,7 @@
 #import "GTMDefines.h"
 
 typedef struct GTMRingBufferPair GTMRingBufferPair;
+typedef struct GTMRingBufferArena GTMRingBufferArena;
 
 // GTMLoggerRingBufferWriter is a GTMLogWriter that accumulates logged Info
 // and Debug messages (when they're not compiled out in a release build)
@@ -48,6 +49,23 @@ typedef struct GTMRingBufferPair GTMRingBufferPair;
 // compiled out).  You can pass nil to GTMLogger's -setFilter to have it pass
 // along all the messages.
 //
+// Flight recorder mode:
+//
+// By default every message takes a lock and a copy of the NSString.  If you
+// give a |messageSize| when creating the writer, it instead preallocates
+// |capacity| slots of |messageSize| bytes each and copies the UTF-8 bytes of
+// each message (truncated to fit) into the next slot, claimed with an atomic
+// counter.  Logging never locks or allocates, so it is cheap enough to leave
+// debug logging running into the buffer all the time.  Should two threads
+// end up writing to the same slot at once (only possible when the buffer
+// wraps while a message is still being copied), the newer message is dropped
+// and counted in -droppedLogCount.
+//
+// Dumping doesn't allocate either: each message is handed to |writer| in the
+// same reused string, which is only valid for the duration of the
+// -logMessage:level: call.  Writers that hold on to messages must -copy them
+// (GTMAsyncLogWriter does).
+//
 @interface GTMLoggerRingBufferWriter : NSObject <GTMLogWriter> {
  @private  
   id<GTMLogWriter> writer_;
@@ -55,6 +73,7 @@ typedef struct GTMRingBufferPair GTMRingBufferPair;
   NSUInteger capacity_;
   NSUInteger nextIndex_;    // Index of the next element of |buffer_| to fill.
   NSUInteger totalLogged_;  // This > 0 and |nextIndex_| == 0 means we've wrapped.
+  GTMRingBufferArena *arena_;  // Only used in flight recorder mode.
 }
 
 // Returns an autoreleased ring buffer writer.  If |writer| is nil, 
@@ -62,11 +81,26 @@ typedef struct GTMRingBufferPair GTMRingBufferPair;
 + (id)ringBufferWriterWithCapacity:(NSUInteger)capacity
                             writer:(id<GTMLogWriter>)loggerWriter;
 
-// Designated initializer.  If |writer| is nil, then nil is returned.  
+// Returns an autoreleased ring buffer writer in flight recorder mode (see
+// above).  Messages longer than |messageSize| UTF-8 bytes are truncated.
++ (id)ringBufferWriterWithCapacity:(NSUInteger)capacity
+                       messageSize:(NSUInteger)messageSize
+                            writer:(id<GTMLogWriter>)loggerWriter;
+
+// Calls -initWithCapacity:messageSize:writer: with a |messageSize| of 0.
+- (id)initWithCapacity:(NSUInteger)capacity
+                writer:(id<GTMLogWriter>)loggerWriter;
+
+// Designated initializer.  If |messageSize| is non-zero the writer runs in
+// flight recorder mode.  If |writer| is nil, then nil is returned.
 // If you just use -init, nil will be returned.
 - (id)initWithCapacity:(NSUInteger)capacity
+           messageSize:(NSUInteger)messageSize
                 writer:(id<GTMLogWriter>)loggerWriter;
 
+// The most UTF-8 bytes kept per message, or 0 if messages are kept whole.
+- (NSUInteger)messageSize;
+
 // How many messages will be logged before older messages get dropped
 // on the floor.
 - (NSUInteger)capacity;
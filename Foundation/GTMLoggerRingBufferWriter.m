@@ -17,6 +17,7 @@
 //
 
 #import "GTMLoggerRingBufferWriter.h"
+#import <libkern/OSAtomic.h>
 
 // Holds a message and a level.
 struct GTMRingBufferPair {
@@ -28,6 +29,192 @@ struct GTMRingBufferPair {
   GTMLoggerLevel level_;
 };
 
+// Flight recorder mode keeps messages as UTF-8 in a preallocated arena of
+// fixed size slots.  Each slot starts with this header, followed by
+// |messageSize_| bytes of message.
+typedef struct GTMRingBufferSlot {
+  // 0 if empty, -1 while being written, otherwise the ticket of the message it
+  // holds plus 1.
+  volatile int64_t sequence_;
+  GTMLoggerLevel level_;
+  uint32_t length_;
+} GTMRingBufferSlot;
+
+enum {
+  kGTMRingBufferSlotEmpty = 0,
+  kGTMRingBufferSlotBusy = -1,
+};
+
+struct GTMRingBufferArena {
+  uint8_t *slots_;
+  size_t slotStride_;
+  NSUInteger messageSize_;
+  // Every message gets the next ticket; ticket % capacity is its slot.
+  volatile int64_t nextTicket_;
+  // Messages with tickets before this were thrown away by -reset.
+  volatile int64_t firstTicket_;
+  // Messages dropped because their slot was being written by another thread.
+  volatile int64_t collisions_;
+  // The string (and its backing store) handed to the writer when dumping.
+  unichar *characters_;
+  CFMutableStringRef message_;
+};
+
+GTM_INLINE int64_t AtomicLoad64(volatile int64_t *value) {
+  return OSAtomicAdd64Barrier(0, value);
+}
+
+GTM_INLINE GTMRingBufferSlot *ArenaSlot(GTMRingBufferArena *arena,
+                                        int64_t ticket, NSUInteger capacity) {
+  size_t index = (size_t)((uint64_t)ticket % capacity);
+  return (GTMRingBufferSlot *)(arena->slots_ + index * arena->slotStride_);
+}
+
+static GTMRingBufferArena *ArenaCreate(NSUInteger capacity,
+                                       NSUInteger messageSize) {
+  if (messageSize > UINT32_MAX) return NULL;
+  // Keep the slots 8 byte aligned for the atomic sequence numbers.
+  size_t stride = (sizeof(GTMRingBufferSlot) + messageSize + 7) & ~(size_t)7;
+  if (capacity > SIZE_MAX / stride) return NULL;
+  GTMRingBufferArena *arena = calloc(1, sizeof(GTMRingBufferArena));
+  if (!arena) return NULL;
+  arena->slots_ = calloc(capacity, stride);
+  arena->slotStride_ = stride;
+  arena->messageSize_ = messageSize;
+  // UTF-8 never takes fewer bytes than UTF-16 takes unichars.
+  arena->characters_ = calloc(messageSize, sizeof(unichar));
+  if (arena->characters_) {
+    arena->message_ =
+        CFStringCreateMutableWithExternalCharactersNoCopy(kCFAllocatorDefault,
+                                                          arena->characters_,
+                                                          0,
+                                                          (CFIndex)messageSize,
+                                                          kCFAllocatorNull);
+  }
+  if (!arena->slots_ || !arena->message_) {
+    // COV_NF_START
+    if (arena->message_) CFRelease(arena->message_);
+    free(arena->characters_);
+    free(arena->slots_);
+    free(arena);
+    return NULL;
+    // COV_NF_END
+  }
+  return arena;
+}
+
+static void ArenaFree(GTMRingBufferArena *arena) {
+  if (!arena) return;
+  CFRelease(arena->message_);
+  free(arena->characters_);
+  free(arena->slots_);
+  free(arena);
+}
+
+// Lock-free: claims a ticket, then the slot for that ticket, and copies the
+// message bytes into it.
+static void ArenaAdd(GTMRingBufferArena *arena, NSUInteger capacity,
+                     NSString *message, GTMLoggerLevel level) {
+  int64_t ticket = OSAtomicIncrement64Barrier(&arena->nextTicket_) - 1;
+  GTMRingBufferSlot *slot = ArenaSlot(arena, ticket, capacity);
+  int64_t old;
+  do {
+    old = AtomicLoad64(&slot->sequence_);
+    if (old == kGTMRingBufferSlotBusy || old > ticket) {
+      // Another thread is still writing the message from a lap ago (or one
+      // from a later lap got in first).
+      OSAtomicIncrement64Barrier(&arena->collisions_);
+      return;
+    }
+  } while (!OSAtomicCompareAndSwap64Barrier(old, kGTMRingBufferSlotBusy,
+                                            &slot->sequence_));
+
+  CFIndex used = 0;
+  if (message) {
+    CFStringRef string = (CFStringRef)message;
+    CFStringGetBytes(string, CFRangeMake(0, CFStringGetLength(string)),
+                     kCFStringEncodingUTF8, '?', false,
+                     (UInt8 *)(slot + 1), (CFIndex)arena->messageSize_, &used);
+  }
+  slot->level_ = level;
+  slot->length_ = (uint32_t)used;
+  OSAtomicCompareAndSwap64Barrier(kGTMRingBufferSlotBusy, ticket + 1,
+                                  &slot->sequence_);
+}
+
+// Converts UTF-8 to UTF-16.  |bytes| may have been torn by a concurrent
+// writer (the result is thrown away then), so bad input is tolerated.
+static CFIndex DecodeUTF8(const uint8_t *bytes, size_t length,
+                          unichar *characters) {
+  CFIndex count = 0;
+  size_t i = 0;
+  while (i < length) {
+    uint32_t c = bytes[i];
+    size_t extra = 0;
+    if (c >= 0xF0) {
+      c &= 0x07;
+      extra = 3;
+    } else if (c >= 0xE0) {
+      c &= 0x0F;
+      extra = 2;
+    } else if (c >= 0xC0) {
+      c &= 0x1F;
+      extra = 1;
+    } else if (c >= 0x80) {
+      c = 0xFFFD;
+    }
+    if (i + extra >= length) break;  // Cut off mid character.
+    for (size_t j = 1; j <= extra; ++j) {
+      c = (c << 6) | (bytes[i + j] & 0x3F);
+    }
+    i += extra + 1;
+    if (c >= 0x10000) {
+      // Two UTF-16 units from at least four bytes of UTF-8.
+      c -= 0x10000;
+      characters[count++] = (unichar)(0xD800 + ((c >> 10) & 0x3FF));
+      characters[count++] = (unichar)(0xDC00 + (c & 0x3FF));
+    } else {
+      characters[count++] = (unichar)c;
+    }
+  }
+  return count;
+}
+
+// Hands every intact message to |writer| without allocating.  Returns the
+// ticket after the last message looked at.  Assumes the caller is
+// synchronized with other dumpers.
+static int64_t ArenaDump(GTMRingBufferArena *arena, NSUInteger capacity,
+                         id<GTMLogWriter> writer) {
+  int64_t end = AtomicLoad64(&arena->nextTicket_);
+  int64_t start = AtomicLoad64(&arena->firstTicket_);
+  if (end - start > (int64_t)capacity) start = end - (int64_t)capacity;
+  for (int64_t ticket = start; ticket < end; ++ticket) {
+    GTMRingBufferSlot *slot = ArenaSlot(arena, ticket, capacity);
+    int64_t sequence = AtomicLoad64(&slot->sequence_);
+    if (sequence != ticket + 1) continue;
+    GTMLoggerLevel level = slot->level_;
+    size_t length = MIN(slot->length_, arena->messageSize_);
+    CFIndex count = DecodeUTF8((const uint8_t *)(slot + 1), length,
+                               arena->characters_);
+    // If the slot was reused while we were reading it, skip it.
+    if (AtomicLoad64(&slot->sequence_) != sequence) continue;
+    CFStringSetExternalCharactersNoCopy(arena->message_, arena->characters_,
+                                        count, (CFIndex)arena->messageSize_);
+    [writer logMessage:(NSString *)arena->message_ level:level];
+  }
+  return end;
+}
+
+// Forgets the messages before |ticket|.
+static void ArenaReset(GTMRingBufferArena *arena, int64_t ticket) {
+  int64_t first = AtomicLoad64(&arena->firstTicket_);
+  if (ticket > first) {
+    OSAtomicAdd64Barrier(ticket - first, &arena->firstTicket_);
+  }
+  int64_t collisions = AtomicLoad64(&arena->collisions_);
+  OSAtomicAdd64Barrier(-collisions, &arena->collisions_);
+}
+
 
 // There are two operations that involve iterating over the buffer
 // contents and doing Something to them.  This is a callback function
@@ -59,7 +246,26 @@ typedef void (GTMRingBufferPairCallback)(GTMLoggerRingBufferWriter *rbw,
 }  // ringBufferWriterWithCapacity
 
 
++ (id)ringBufferWriterWithCapacity:(NSUInteger)capacity
+                       messageSize:(NSUInteger)messageSize
+                            writer:(id<GTMLogWriter>)writer {
+  GTMLoggerRingBufferWriter *rbw =
+    [[[self alloc] initWithCapacity:capacity
+                        messageSize:messageSize
+                             writer:writer] autorelease];
+  return rbw;
+
+}  // ringBufferWriterWithCapacity:messageSize:
+
+
+- (id)initWithCapacity:(NSUInteger)capacity
+                writer:(id<GTMLogWriter>)writer {
+  return [self initWithCapacity:capacity messageSize:0 writer:writer];
+}  // initWithCapacity
+
+
 - (id)initWithCapacity:(NSUInteger)capacity
+           messageSize:(NSUInteger)messageSize
                 writer:(id<GTMLogWriter>)writer {
   if ((self = [super init])) {
     writer_ = [writer retain];
@@ -67,25 +273,32 @@ typedef void (GTMRingBufferPairCallback)(GTMLoggerRingBufferWriter *rbw,
 
     // iVars are initialized to NULL.
     // Calling calloc with 0 is outside the standard.
+    BOOL allocated = NO;
     if (capacity_) {
-      buffer_ = (GTMRingBufferPair *)calloc(capacity_,
-                                            sizeof(GTMRingBufferPair));
+      if (messageSize) {
+        arena_ = ArenaCreate(capacity_, messageSize);
+        allocated = (arena_ != NULL);
+      } else {
+        buffer_ = (GTMRingBufferPair *)calloc(capacity_,
+                                              sizeof(GTMRingBufferPair));
+        allocated = (buffer_ != NULL);
+      }
     }
 
     nextIndex_ = 0;
 
-    if (capacity_ == 0 || !buffer_ || !writer_) {
+    if (capacity_ == 0 || !allocated || !writer_) {
       [self release];
       self = nil;
     }
   }
   return self;
 
-}  // initWithCapacity
+}  // initWithCapacity:messageSize:
 
 
 - (id)init {
-  return [self initWithCapacity:0 writer:nil];
+  return [self initWithCapacity:0 messageSize:0 writer:nil];
 }  // init
 
 
@@ -94,6 +307,7 @@ typedef void (GTMRingBufferPairCallback)(GTMLoggerRingBufferWriter *rbw,
 
   [writer_ release];
   if (buffer_) free(buffer_);
+  ArenaFree(arena_);
 
   [super dealloc];
   
@@ -110,8 +324,17 @@ typedef void (GTMRingBufferPairCallback)(GTMLoggerRingBufferWriter *rbw,
 }  // writer
 
 
+- (NSUInteger)messageSize {
+  return arena_ ? arena_->messageSize_ : 0;
+}  // messageSize
+
+
 - (NSUInteger)count {
   NSUInteger count = 0;
+  if (arena_) {
+    NSUInteger total = [self totalLogged];
+    return total < capacity_ ? total : capacity_;
+  }
   @synchronized(self) {
     if ((nextIndex_ == 0 && totalLogged_ > 0)
         || totalLogged_ >= capacity_) {
@@ -130,6 +353,12 @@ typedef void (GTMRingBufferPairCallback)(GTMLoggerRingBufferWriter *rbw,
 - (NSUInteger)droppedLogCount {
   NSUInteger droppedCount = 0;
   
+  if (arena_) {
+    NSUInteger total = [self totalLogged];
+    droppedCount = total > capacity_ ? total - capacity_ : 0;
+    return droppedCount + (NSUInteger)AtomicLoad64(&arena_->collisions_);
+  }
+
   @synchronized(self) {
     if (capacity_ > totalLogged_) {
       droppedCount = 0;
@@ -144,6 +373,10 @@ typedef void (GTMRingBufferPairCallback)(GTMLoggerRingBufferWriter *rbw,
 
 
 - (NSUInteger)totalLogged {
+  if (arena_) {
+    return (NSUInteger)(AtomicLoad64(&arena_->nextTicket_) -
+                        AtomicLoad64(&arena_->firstTicket_));
+  }
   return totalLogged_;
 }  // totalLogged
 
@@ -191,6 +424,10 @@ static void ResetCallback(GTMLoggerRingBufferWriter *rbw,
 // Reset the contents.
 - (void)reset {
   @synchronized(self) {
+    if (arena_) {
+      ArenaReset(arena_, AtomicLoad64(&arena_->nextTicket_));
+      return;
+    }
     [self iterateBufferWithCallback:ResetCallback];
     nextIndex_ = 0;
     totalLogged_ = 0;
@@ -209,6 +446,10 @@ static void PrintContentsCallback(GTMLoggerRingBufferWriter *rbw,
 
 - (void)dumpContents {
   @synchronized(self) {
+    if (arena_) {
+      ArenaDump(arena_, capacity_, writer_);
+      return;
+    }
     [self iterateBufferWithCallback:PrintContentsCallback];
   }
 }  // printContents
@@ -237,6 +478,18 @@ static void PrintContentsCallback(GTMLoggerRingBufferWriter *rbw,
 
 // From the GTMLogWriter protocol.
 - (void)logMessage:(NSString *)message level:(GTMLoggerLevel)level {
+  if (arena_) {
+    ArenaAdd(arena_, capacity_, message, level);
+    if (level >= kGTMLoggerLevelError) {
+      // Only what was dumped is reset; messages logged meanwhile by other
+      // threads stay for next time.
+      @synchronized(self) {
+        ArenaReset(arena_, ArenaDump(arena_, capacity_, writer_));
+      }
+    }
+    return;
+  }
+
   @synchronized(self) {
     [self addMessage:(NSString*)message level:level];
     
@@ -20,6 +20,7 @@
 #import "GTMLoggerRingBufferWriter.h"
 #import "GTMLogger.h"
 #import "GTMUnitTestDevLog.h"
+#import "GTMTestTimer.h"
 
 // --------------------------------------------------
 // CountingWriter keeps a count of the number of times it has been
@@ -42,7 +43,8 @@
   if (!loggedContents_) {
     loggedContents_ = [[NSMutableArray alloc] init];
   }
-  [loggedContents_ addObject:msg];
+  // Copied, since in flight recorder mode the string is reused.
+  [loggedContents_ addObject:[[msg copy] autorelease]];
 }  // logMessage
 
 - (void)dealloc {
@@ -327,6 +329,7 @@ static volatile NSUInteger gStoppedThreads = 0; // Total number that have stoppe
                                                      writer:countingWriter_];
   [logger_ setWriter:writer];
 
+  gStoppedThreads = 0;
   for (NSUInteger i = 0; i < kThreadCount; i++) {
     [NSThread detachNewThreadSelector:@selector(bangMe:)
                              toTarget:self
@@ -360,4 +363,160 @@ static volatile NSUInteger gStoppedThreads = 0; // Total number that have stoppe
 
 }  // testThreading
 
+
+- (void)testFlightRecorderCreation {
+  GTMLoggerRingBufferWriter *writer =
+    [GTMLoggerRingBufferWriter ringBufferWriterWithCapacity:32
+                                                messageSize:128
+                                                     writer:countingWriter_];
+  STAssertNotNil(writer, nil);
+  STAssertEquals([writer capacity], (NSUInteger)32, nil);
+  STAssertEquals([writer messageSize], (NSUInteger)128, nil);
+  STAssertEquals([writer count], (NSUInteger)0, nil);
+  STAssertEquals([writer droppedLogCount], (NSUInteger)0, nil);
+  STAssertEquals([writer totalLogged], (NSUInteger)0, nil);
+
+  writer =
+    [GTMLoggerRingBufferWriter ringBufferWriterWithCapacity:32
+                                                     writer:countingWriter_];
+  STAssertEquals([writer messageSize], (NSUInteger)0, nil);
+
+  writer =
+    [GTMLoggerRingBufferWriter ringBufferWriterWithCapacity:0
+                                                messageSize:128
+                                                     writer:countingWriter_];
+  STAssertNil(writer, nil);
+  writer =
+    [GTMLoggerRingBufferWriter ringBufferWriterWithCapacity:32
+                                                messageSize:128
+                                                     writer:nil];
+  STAssertNil(writer, nil);
+}  // testFlightRecorderCreation
+
+
+- (void)testFlightRecorderLogging {
+  GTMLoggerRingBufferWriter *writer =
+    [GTMLoggerRingBufferWriter ringBufferWriterWithCapacity:4
+                                                messageSize:8
+                                                     writer:countingWriter_];
+  [logger_ setWriter:writer];
+
+  [writer dumpContents];
+  STAssertEquals([countingWriter_ count], (NSUInteger)0, nil);
+
+  [logger_ logDebug:@"oop"];
+  [logger_ logDebug:@"ack"];
+  STAssertEquals([writer count], (NSUInteger)2, nil);
+  STAssertEquals([writer totalLogged], (NSUInteger)2, nil);
+  [writer dumpContents];
+  STAssertEquals([writer count], (NSUInteger)2, nil);  // Should not be zeroed.
+  [self compareWriter:countingWriter_
+  withExpectedLogging:[NSArray arrayWithObjects:@"oop", @"ack", nil]
+                 line:__LINE__];
+
+  [writer reset];
+  [countingWriter_ reset];
+  STAssertEquals([writer count], (NSUInteger)0, nil);
+  STAssertEquals([writer totalLogged], (NSUInteger)0, nil);
+  [writer dumpContents];
+  STAssertEquals([countingWriter_ count], (NSUInteger)0, nil);
+
+  // Long messages are cut down to |messageSize| bytes, on a character
+  // boundary.
+  [logger_ logInfo:@"0123456789"];
+  [logger_ logInfo:@"caf\u00e9\u00e9\u00e9"];  // 3 + 2 * 3 bytes.
+  [logger_ logInfo:@"\U0001F600\U0001F600\U0001F600"];  // 4 bytes each.
+  [logger_ logInfo:@"%@", @""];
+  [logger_ logInfo:@"wraps"];
+  STAssertEquals([writer count], (NSUInteger)4, nil);
+  STAssertEquals([writer droppedLogCount], (NSUInteger)1, nil);
+
+  [logger_ logError:@"blargh"];
+  [self compareWriter:countingWriter_
+  withExpectedLogging:[NSArray arrayWithObjects:@"\U0001F600\U0001F600",
+                       @"", @"wraps", @"blargh", nil]
+                 line:__LINE__];
+  STAssertEquals([writer count], (NSUInteger)0, nil);
+  STAssertEquals([writer totalLogged], (NSUInteger)0, nil);
+  STAssertEquals([writer droppedLogCount], (NSUInteger)0, nil);
+}  // testFlightRecorderLogging
+
+
+- (void)testFlightRecorderThreading {
+  const NSUInteger kThreadCount = 10;
+  const NSUInteger kCapacity = 10;
+
+  GTMLoggerRingBufferWriter *writer =
+    [GTMLoggerRingBufferWriter ringBufferWriterWithCapacity:kCapacity
+                                                messageSize:16
+                                                     writer:countingWriter_];
+  [logger_ setWriter:writer];
+
+  gStoppedThreads = 0;
+  for (NSUInteger i = 0; i < kThreadCount; i++) {
+    [NSThread detachNewThreadSelector:@selector(bangMe:)
+                             toTarget:self
+                           withObject:logger_];
+  }
+  while (1) {
+    NSDate *quick = [NSDate dateWithTimeIntervalSinceNow:0.2];
+    [[NSRunLoop currentRunLoop] runUntilDate:quick];
+    @synchronized ([self class]) {
+      if (gStoppedThreads == kThreadCount) break;
+    }
+  }
+
+  STAssertEquals([writer count], kCapacity, nil);
+  STAssertEquals([countingWriter_ count], (NSUInteger)0, nil);
+  STAssertEquals([writer totalLogged], (NSUInteger)420, nil);
+
+  // Messages lost to two threads sharing a slot just don't show up, but
+  // everything that does must be intact.
+  [logger_ logError:@"bork"];
+  NSArray *logged = [countingWriter_ loggedContents];
+  STAssertTrue([logged count] <= kCapacity, nil);
+  STAssertEqualObjects([logged lastObject], @"bork", nil);
+  for (NSUInteger i = 0; i + 1 < [logged count]; ++i) {
+    NSString *msg = [logged objectAtIndex:i];
+    STAssertTrue([msg isEqualToString:@"ack"] || [msg isEqualToString:@"oop"],
+                 @"%@", msg);
+  }
+}  // testFlightRecorderThreading
+
+
+// Compares the per message cost of the two modes.
+- (void)testFlightRecorderCost {
+  const NSUInteger kMessages = 200000;
+  NSString *message = @"a typical debug message, id 1234567";
+
+  GTMLoggerRingBufferWriter *classic =
+    [GTMLoggerRingBufferWriter ringBufferWriterWithCapacity:1024
+                                                     writer:countingWriter_];
+  GTMTestTimer *classicTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(classicTimer);
+  for (NSUInteger i = 0; i < kMessages; ++i) {
+    [classic logMessage:message level:kGTMLoggerLevelDebug];
+  }
+  GTMTestTimerStop(classicTimer);
+
+  GTMLoggerRingBufferWriter *recorder =
+    [GTMLoggerRingBufferWriter ringBufferWriterWithCapacity:1024
+                                                messageSize:128
+                                                     writer:countingWriter_];
+  GTMTestTimer *recorderTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(recorderTimer);
+  for (NSUInteger i = 0; i < kMessages; ++i) {
+    [recorder logMessage:message level:kGTMLoggerLevelDebug];
+  }
+  GTMTestTimerStop(recorderTimer);
+
+  NSLog(@"GTMLoggerRingBufferWriter cost per message: classic %.0fns, "
+        @"flight recorder %.0fns",
+        GTMTestTimerGetNanoseconds(classicTimer) / kMessages,
+        GTMTestTimerGetNanoseconds(recorderTimer) / kMessages);
+  STAssertEquals([recorder totalLogged], kMessages, nil);
+  GTMTestTimerRelease(classicTimer);
+  GTMTestTimerRelease(recorderTimer);
+}  // testFlightRecorderCost
+
 @end  // GTMLoggerRingBufferWriterTest
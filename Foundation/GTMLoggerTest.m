@@ -19,6 +19,7 @@
 #import "GTMLogger.h"
 #import "GTMRegex.h"
 #import "GTMSenTestCase.h"
+#import "GTMTestTimer.h"
 
 
 // A test writer that stores log messages in an array for easy retrieval.
@@ -83,6 +84,117 @@
 @end  // DumbFormatter
 
 
+// A formatter for testing that counts how many messages it has formatted.
+@interface CountingFormatter : GTMLogBasicFormatter {
+ @private
+  NSUInteger count_;
+}
+- (NSUInteger)count;
+@end
+@implementation CountingFormatter
+
+#if !defined(__clang__) && (__GNUC__*10+__GNUC_MINOR__ >= 42)
+// See comment in DumbFormatter.
+#pragma GCC diagnostic ignored "-Wmissing-format-attribute"
+#endif  // !__clang__
+
+- (NSString *)stringForFunc:(NSString *)func
+                 withFormat:(NSString *)fmt
+                     valist:(va_list)args
+                      level:(GTMLoggerLevel)level {
+  ++count_;
+  return [super stringForFunc:func withFormat:fmt valist:args level:level];
+}
+
+#if !defined(__clang__) && (__GNUC__*10+__GNUC_MINOR__ >= 42)
+#pragma GCC diagnostic error "-Wmissing-format-attribute"
+#endif  // !__clang__
+
+- (NSUInteger)count {
+  return count_;
+}
+@end  // CountingFormatter
+
+
+// A formatter that builds its timestamp the way GTMLogStandardFormatter used
+// to, through a shared NSDateFormatter behind a lock. Used as a baseline when
+// timing GTMLogStandardFormatter.
+@interface LockedDateFormatter : GTMLogBasicFormatter {
+ @private
+  NSDateFormatter *dateFormatter_;
+}
+@end
+@implementation LockedDateFormatter
+
+- (id)init {
+  if ((self = [super init])) {
+    dateFormatter_ = [[NSDateFormatter alloc] init];
+    [dateFormatter_ setFormatterBehavior:NSDateFormatterBehavior10_4];
+    [dateFormatter_ setDateFormat:@"yyyy-MM-dd HH:mm:ss.SSS"];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [dateFormatter_ release];
+  [super dealloc];
+}
+
+#if !defined(__clang__) && (__GNUC__*10+__GNUC_MINOR__ >= 42)
+// See comment in DumbFormatter.
+#pragma GCC diagnostic ignored "-Wmissing-format-attribute"
+#endif  // !__clang__
+
+- (NSString *)stringForFunc:(NSString *)func
+                 withFormat:(NSString *)fmt
+                     valist:(va_list)args
+                      level:(GTMLoggerLevel)level {
+  NSString *tstamp = nil;
+  @synchronized (dateFormatter_) {
+    tstamp = [dateFormatter_ stringFromDate:[NSDate date]];
+  }
+  return [NSString stringWithFormat:@"%@ [lvl=%d] %@", tstamp, level,
+          [super stringForFunc:func withFormat:fmt valist:args level:level]];
+}
+
+#if !defined(__clang__) && (__GNUC__*10+__GNUC_MINOR__ >= 42)
+#pragma GCC diagnostic error "-Wmissing-format-attribute"
+#endif  // !__clang__
+
+@end  // LockedDateFormatter
+
+
+// A level filter that only implements the message based check, the way
+// filters written before -filterAllowsMessageAtLevel: existed do.
+@interface MessageOnlyLevelFilter : NSObject <GTMLogFilter>
+@end
+@implementation MessageOnlyLevelFilter
+- (BOOL)filterAllowsMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+  return level >= kGTMLoggerLevelError;
+}
+@end  // MessageOnlyLevelFilter
+
+
+// Subclasses of level filters that only override the message based check,
+// which the level check they inherit knows nothing about.
+@interface LevelFilterAllowingAll : GTMLogLevelFilter
+@end
+@implementation LevelFilterAllowingAll
+- (BOOL)filterAllowsMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+  return YES;
+}
+@end  // LevelFilterAllowingAll
+
+@interface MinimumFilterAllowingDebug : GTMLogMininumLevelFilter
+@end
+@implementation MinimumFilterAllowingDebug
+- (BOOL)filterAllowsMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+  return (level == kGTMLoggerLevelDebug ||
+          [super filterAllowsMessage:msg level:level]);
+}
+@end  // MinimumFilterAllowingDebug
+
+
 // A test filter that ignores messages with the string "ignore".
 @interface IgnoreFilter : NSObject <GTMLogFilter>
 @end
@@ -474,6 +586,86 @@
                            format:@"test"];
   STAssertTrue([msg gtm_matchesPattern:[kFormatBasePattern stringByAppendingString:@"test"]],
                @"msg: %@", msg);
+
+  // The cached timestamp should agree with NSDateFormatter in local time.
+  NSDateFormatter *dateFormatter = [[[NSDateFormatter alloc] init] autorelease];
+  [dateFormatter setFormatterBehavior:NSDateFormatterBehavior10_4];
+  [dateFormatter setDateFormat:@"yyyy-MM-dd HH:mm:ss"];
+  NSString *before = [dateFormatter stringFromDate:[NSDate date]];
+  msg = [self stringFromFormatter:fmtr
+                            level:kGTMLoggerLevelInfo
+                           format:@"test"];
+  NSString *after = [dateFormatter stringFromDate:[NSDate date]];
+  STAssertTrue([msg hasPrefix:before] || [msg hasPrefix:after],
+               @"msg: %@ before: %@ after: %@", msg, before, after);
+}
+
+// Thread body for -secondsToFormat:messages:threads:.
+- (void)formatMessages:(NSDictionary *)job {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  id<GTMLogFormatter> formatter = [job objectForKey:@"formatter"];
+  NSConditionLock *done = [job objectForKey:@"done"];
+  NSUInteger count = [[job objectForKey:@"count"] unsignedIntegerValue];
+  for (NSUInteger i = 0; i < count; ++i) {
+    NSAutoreleasePool *inner = [[NSAutoreleasePool alloc] init];
+    [self stringFromFormatter:formatter
+                        level:kGTMLoggerLevelInfo
+                       format:@"message %lu", (unsigned long)i];
+    [inner drain];
+  }
+  [done lock];
+  [done unlockWithCondition:[done condition] + 1];
+  [pool drain];
+}
+
+// Returns the wall clock time it takes |threads| threads to format |messages|
+// messages between them with |formatter|.
+- (double)secondsToFormat:(id<GTMLogFormatter>)formatter
+                 messages:(NSUInteger)messages
+                  threads:(NSUInteger)threads {
+  NSConditionLock *done =
+      [[[NSConditionLock alloc] initWithCondition:0] autorelease];
+  NSDictionary *job =
+      [NSDictionary dictionaryWithObjectsAndKeys:
+       formatter, @"formatter",
+       done, @"done",
+       [NSNumber numberWithUnsignedInteger:messages / threads], @"count",
+       nil];
+  GTMTestTimer *timer = GTMTestTimerCreate();
+  GTMTestTimerStart(timer);
+  for (NSUInteger i = 0; i < threads; ++i) {
+    [NSThread detachNewThreadSelector:@selector(formatMessages:)
+                             toTarget:self
+                           withObject:job];
+  }
+  [done lockWhenCondition:(NSInteger)threads];
+  [done unlock];
+  GTMTestTimerStop(timer);
+  double seconds = GTMTestTimerGetSeconds(timer);
+  GTMTestTimerRelease(timer);
+  return seconds;
+}
+
+- (void)testStandardFormatterThroughput {
+  const NSUInteger kMessages = 64000;
+  GTMLogStandardFormatter *standard =
+      [[[GTMLogStandardFormatter alloc] init] autorelease];
+  LockedDateFormatter *locked =
+      [[[LockedDateFormatter alloc] init] autorelease];
+  const NSUInteger threadCounts[] = { 1, 4, 16 };
+  for (size_t i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); ++i) {
+    NSUInteger threads = threadCounts[i];
+    double standardSeconds = [self secondsToFormat:standard
+                                          messages:kMessages
+                                           threads:threads];
+    double lockedSeconds = [self secondsToFormat:locked
+                                        messages:kMessages
+                                         threads:threads];
+    NSLog(@"Standard formatter, %lu threads: %.0f msgs/s "
+          @"(locked NSDateFormatter: %.0f msgs/s)",
+          (unsigned long)threads, kMessages / standardSeconds,
+          kMessages / lockedSeconds);
+  }
 }
 
 - (void)testNoFilter {
@@ -567,6 +759,108 @@
   STAssertNil(filter, nil);
 }
 
+- (void)testLevelPrefilter {
+  ArrayWriter *writer = [[[ArrayWriter alloc] init] autorelease];
+  CountingFormatter *formatter = [[[CountingFormatter alloc] init] autorelease];
+  id<GTMLogFilter> filter = [[[GTMLogMininumLevelFilter alloc]
+                                initWithMinimumLevel:kGTMLoggerLevelError]
+                                    autorelease];
+  STAssertTrue([filter respondsToSelector:@selector(filterAllowsMessageAtLevel:)],
+               nil);
+  GTMLogger *logger = [GTMLogger loggerWithWriter:writer
+                                        formatter:formatter
+                                           filter:filter];
+
+  // Rejected levels never reach the formatter.
+  [logger logDebug:@"debug %@", self];
+  [logger logInfo:@"info %@", self];
+  STAssertEquals([formatter count], (NSUInteger)0, nil);
+  STAssertEquals([[writer messages] count], (NSUInteger)0, nil);
+
+  [logger logError:@"error %d", 1];
+  STAssertEquals([formatter count], (NSUInteger)1, nil);
+  STAssertEqualObjects([writer messages],
+                       [NSArray arrayWithObject:@"error 1"], nil);
+  [writer clear];
+
+  // Filters without the level check still see every formatted message.
+  [logger setFilter:[[[MessageOnlyLevelFilter alloc] init] autorelease]];
+  [logger logDebug:@"debug"];
+  STAssertEquals([formatter count], (NSUInteger)2, nil);
+  STAssertEquals([[writer messages] count], (NSUInteger)0, nil);
+
+  // Filters that check both get asked both questions.
+  [logger setFilter:[[[IgnoreFilter alloc] init] autorelease]];
+  [logger logError:@"ignore me"];
+  STAssertEquals([formatter count], (NSUInteger)3, nil);
+  STAssertEquals([[writer messages] count], (NSUInteger)0, nil);
+
+  // Back to the defaults.
+  [logger setFilter:nil];
+  [logger logDebug:@"debug"];
+  STAssertEquals([formatter count], (NSUInteger)4, nil);
+  STAssertEquals([[writer messages] count], (NSUInteger)1, nil);
+  [writer clear];
+
+  // Subclasses that only override the message check aren't second guessed
+  // by the level check they inherit.
+  [logger setFilter:[[[LevelFilterAllowingAll alloc] init] autorelease]];
+  [logger logDebug:@"debug"];
+  STAssertEquals([formatter count], (NSUInteger)5, nil);
+  STAssertEqualObjects([writer messages],
+                       [NSArray arrayWithObject:@"debug"], nil);
+  [writer clear];
+
+  [logger setFilter:[[[MinimumFilterAllowingDebug alloc]
+                        initWithMinimumLevel:kGTMLoggerLevelError]
+                           autorelease]];
+  [logger logDebug:@"debug"];
+  [logger logInfo:@"info"];
+  STAssertEquals([formatter count], (NSUInteger)7, nil);
+  STAssertEqualObjects([writer messages],
+                       [NSArray arrayWithObject:@"debug"], nil);
+}
+
+- (void)testFilteredDebugCost {
+  const int kIterations = 100000;
+  ArrayWriter *writer = [[[ArrayWriter alloc] init] autorelease];
+  GTMLogger *logger =
+      [GTMLogger loggerWithWriter:writer
+                        formatter:[[[GTMLogStandardFormatter alloc] init]
+                                      autorelease]
+                           filter:[[[GTMLogMininumLevelFilter alloc]
+                                      initWithMinimumLevel:kGTMLoggerLevelError]
+                                         autorelease]];
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  GTMTestTimer *prefiltered = GTMTestTimerCreate();
+  GTMTestTimerStart(prefiltered);
+  for (int i = 0; i < kIterations; ++i) {
+    [logger logFuncDebug:__func__ msg:@"value %d of %@", i, self];
+  }
+  GTMTestTimerStop(prefiltered);
+  [pool drain];
+
+  [logger setFilter:[[[MessageOnlyLevelFilter alloc] init] autorelease]];
+  pool = [[NSAutoreleasePool alloc] init];
+  GTMTestTimer *postfiltered = GTMTestTimerCreate();
+  GTMTestTimerStart(postfiltered);
+  for (int i = 0; i < kIterations; ++i) {
+    [logger logFuncDebug:__func__ msg:@"value %d of %@", i, self];
+  }
+  GTMTestTimerStop(postfiltered);
+  [pool drain];
+
+  STAssertEquals([[writer messages] count], (NSUInteger)0, nil);
+  double prefilteredNS = GTMTestTimerGetNanoseconds(prefiltered) / kIterations;
+  double postfilteredNS =
+      GTMTestTimerGetNanoseconds(postfiltered) / kIterations;
+  NSLog(@"Filtered debug message cost: %.0fns with level prefilter, "
+        @"%.0fns formatting first", prefilteredNS, postfilteredNS);
+  STAssertLessThan(prefilteredNS, postfilteredNS, nil);
+  GTMTestTimerRelease(prefiltered);
+  GTMTestTimerRelease(postfiltered);
+}
+
 - (void)testFileHandleCreation {
   NSFileHandle *fh = nil;
 
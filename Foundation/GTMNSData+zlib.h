@@ -25,6 +25,10 @@
 // NOTE: For 64bit, none of these apis handle input sizes >32bits, they will
 // return nil when given such data.  To handle data of that size you really
 // should be streaming it rather then doing it all in memory.
+//
+// Each thread that uses these keeps its zlib state around for the next call
+// (up to a few hundred KB per mode used), and the results are built in a
+// single allocation sized up front, so lots of small payloads are cheap.
 
 #pragma mark Gzip Compression
 
@@ -50,6 +54,24 @@
 + (NSData *)gtm_dataByGzippingData:(NSData *)data
                   compressionLevel:(int)level;
 
+/// Return an autoreleased NSData w/ the result of gzipping the bytes using up to |threadCount| threads.
+//
+// The input is split into 128KB blocks that are compressed concurrently (each
+// primed with the 32KB before it, so the ratio is close to single threaded)
+// and joined into one ordinary gzip stream.  A |threadCount| of 0 uses one
+// thread per active processor.  Since the blocks are compressed separately
+// this has no 32bit limit on |length|.  The output differs from (and is
+// slightly larger than) that of the single threaded apis.
++ (NSData *)gtm_dataByGzippingBytes:(const void *)bytes
+                             length:(NSUInteger)length
+                   compressionLevel:(int)level
+                        threadCount:(NSUInteger)threadCount;
+
+/// Return an autoreleased NSData w/ the result of gzipping the payload of |data| using up to |threadCount| threads.
++ (NSData *)gtm_dataByGzippingData:(NSData *)data
+                  compressionLevel:(int)level
+                       threadCount:(NSUInteger)threadCount;
+
 #pragma mark Zlib "Stream" Compression
 
 // NOTE: deflate is *NOT* gzip.  deflate is a "zlib" stream.  pick which one
@@ -90,6 +112,53 @@
 // The data to decompress can be zlib or gzip payloads.
 + (NSData *)gtm_dataByInflatingData:(NSData *)data;
 
+#pragma mark Preset Dictionaries
+
+// Small payloads compress poorly because deflate has nothing earlier in the
+// stream to refer back to.  A preset dictionary of the sort of content the
+// payloads have in common fixes that, the receiver just has to use the same
+// dictionary to inflate.  The output is a zlib stream naming the dictionary
+// (by its adler32), so inflating it with the wrong (or no) dictionary fails.
+// Only the last 32KB of a dictionary can be used.
+
+/// Return an autoreleased NSData w/ the result of deflating the bytes using |level| compression level and a preset |dictionary|.
+//
+// |level| can be 1-9, any other values will be clipped to that range.
++ (NSData *)gtm_dataByDeflatingBytes:(const void *)bytes
+                              length:(NSUInteger)length
+                    compressionLevel:(int)level
+                          dictionary:(NSData *)dictionary;
+
+/// Return an autoreleased NSData w/ the result of deflating the payload of |data| using a preset |dictionary|.
+//
+//  Uses the default compression level.
++ (NSData *)gtm_dataByDeflatingData:(NSData *)data
+                         dictionary:(NSData *)dictionary;
+
+/// Return an autoreleased NSData w/ the result of deflating the payload of |data| using |level| compression level and a preset |dictionary|.
++ (NSData *)gtm_dataByDeflatingData:(NSData *)data
+                   compressionLevel:(int)level
+                         dictionary:(NSData *)dictionary;
+
+/// Return an autoreleased NSData w/ the result of decompressing the bytes using the preset |dictionary| they were deflated with.
++ (NSData *)gtm_dataByInflatingBytes:(const void *)bytes
+                              length:(NSUInteger)length
+                          dictionary:(NSData *)dictionary;
+
+/// Return an autoreleased NSData w/ the result of decompressing the payload of |data| using the preset |dictionary| it was deflated with.
++ (NSData *)gtm_dataByInflatingData:(NSData *)data
+                         dictionary:(NSData *)dictionary;
+
+/// Return an autoreleased dictionary of up to |maxLength| bytes built from the NSDatas in |samples|.
+//
+// Picks the stretches of the samples made of runs that turn up in the most
+// samples, with the most useful at the end (where zlib finds it cheapest to
+// refer to).  Train on a few hundred (or more) payloads like the ones that
+// will be compressed.  |maxLength| is capped at 32KB.  Returns nil if the
+// samples have nothing in common.
++ (NSData *)gtm_dictionaryFromSamples:(NSArray *)samples
+                            maxLength:(NSUInteger)maxLength;
+
 
 #pragma mark "Raw" Compression Support
 
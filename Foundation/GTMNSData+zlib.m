@@ -18,9 +18,23 @@
 
 #import "GTMNSData+zlib.h"
 #import <zlib.h>
+#import <libkern/OSAtomic.h>
+#import <pthread.h>
 #import "GTMDefines.h"
 
-#define kChunkSize 1024
+// The gzip header and trailer, which older zlibs leave out of deflateBound().
+#define kGzipOverhead 18
+
+// Deflate can't do better than about 1032:1.
+#define kMaxDeflateRatio 1032
+
+// Only the last 32KB (the window) of a preset dictionary can be used.
+#define kMaxDictionaryLength (32 * 1024)
+
+// Parallel gzip splits the input into blocks of this size, each primed with
+// up to a full window of the data before it.
+#define kParallelBlockSize (128 * 1024)
+#define kParallelWindowSize (32 * 1024)
 
 typedef enum {
   CompressionModeZlib,
@@ -28,14 +42,306 @@ typedef enum {
   CompressionModeRaw,
 } CompressionMode;
 
+// The shared state for a parallel gzip.  Threads take blocks in turn until
+// there are none left.
+typedef struct {
+  const unsigned char *input;
+  NSUInteger length;
+  int level;
+  int64_t blockCount;
+  volatile int64_t nextBlock;
+  volatile int32_t failed;
+  unsigned char **outputs;  // Raw deflate of each block.
+  size_t *outputLengths;
+  uLong *crcs;              // crc32 of each block of input.
+} GTMParallelGzipJob;
+
+// Raw deflates one block, ending it with a sync flush (or the end of stream
+// for the last one) so the pieces can simply be joined.
+static BOOL DeflateParallelBlock(GTMParallelGzipJob *job, int64_t index) {
+  NSUInteger start = (NSUInteger)index * kParallelBlockSize;
+  NSUInteger length = MIN((NSUInteger)kParallelBlockSize, job->length - start);
+  BOOL last = (index == job->blockCount - 1);
+  const unsigned char *input = job->input + start;
+
+  z_stream strm;
+  bzero(&strm, sizeof(z_stream));
+  if (deflateInit2(&strm, job->level, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NO;  // COV_NF_LINE
+  }
+  if (start) {
+    NSUInteger dictionaryLength = MIN((NSUInteger)kParallelWindowSize, start);
+    deflateSetDictionary(&strm, input - dictionaryLength,
+                         (uInt)dictionaryLength);
+  }
+
+  // Room for the worst case plus the sync flush marker, so one call does it.
+  size_t capacity = deflateBound(&strm, length) + 16;
+  unsigned char *output = malloc(capacity);
+  if (!output) {
+    // COV_NF_START
+    deflateEnd(&strm);
+    return NO;
+    // COV_NF_END
+  }
+  strm.next_in = (unsigned char *)input;
+  strm.avail_in = (uInt)length;
+  strm.next_out = output;
+  strm.avail_out = (uInt)capacity;
+  int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+  int retCode = deflate(&strm, flush);
+  // Should the bound ever be short, keep going in a bigger buffer.
+  while ((retCode == Z_OK || retCode == Z_BUF_ERROR) &&
+         (last || strm.avail_out == 0)) {
+    size_t used = capacity - strm.avail_out;
+    unsigned char *bigger = realloc(output, capacity * 2);
+    if (!bigger) break;  // COV_NF_LINE
+    output = bigger;
+    strm.next_out = output + used;
+    strm.avail_out = (uInt)capacity;
+    capacity *= 2;
+    retCode = deflate(&strm, flush);
+  }
+  deflateEnd(&strm);
+  // A repeated sync flush with nothing left to do reports Z_BUF_ERROR.
+  BOOL done = last ? (retCode == Z_STREAM_END)
+                   : (retCode == Z_OK || retCode == Z_BUF_ERROR);
+  if (!done) {
+    // COV_NF_START
+    free(output);
+    return NO;
+    // COV_NF_END
+  }
+  job->outputs[index] = output;
+  job->outputLengths[index] = capacity - strm.avail_out;
+  job->crcs[index] = crc32(0, input, (uInt)length);
+  return YES;
+}
+
+static void *ParallelGzipWorker(void *arg) {
+  GTMParallelGzipJob *job = arg;
+  int64_t index;
+  while ((index = OSAtomicIncrement64Barrier(&job->nextBlock) - 1) <
+         job->blockCount) {
+    if (!DeflateParallelBlock(job, index)) {
+      OSAtomicCompareAndSwap32Barrier(0, 1, &job->failed);  // COV_NF_LINE
+    }
+  }
+  return NULL;
+}
+
+// The deflaters (one per CompressionMode) and inflaters (zlib/gzip and raw)
+// kept for each thread, so the one shot apis only pay for setting up zlib's
+// state the first time a thread uses them, after that it is just a reset.
+typedef struct {
+  z_stream deflaters[3];
+  int deflaterLevels[3];
+  BOOL deflaterReady[3];
+  z_stream inflaters[2];
+  BOOL inflaterReady[2];
+} GTMZlibThreadContexts;
+
+static pthread_key_t gContextsKey;
+static pthread_once_t gContextsOnce = PTHREAD_ONCE_INIT;
+
+static void FreeThreadContexts(void *arg) {
+  GTMZlibThreadContexts *contexts = arg;
+  for (int i = 0; i < 3; ++i) {
+    if (contexts->deflaterReady[i]) deflateEnd(&contexts->deflaters[i]);
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (contexts->inflaterReady[i]) inflateEnd(&contexts->inflaters[i]);
+  }
+  free(contexts);
+}
+
+static void CreateContextsKey(void) {
+  pthread_key_create(&gContextsKey, FreeThreadContexts);
+}
+
+static GTMZlibThreadContexts *ThreadContexts(void) {
+  pthread_once(&gContextsOnce, CreateContextsKey);
+  GTMZlibThreadContexts *contexts = pthread_getspecific(gContextsKey);
+  if (!contexts) {
+    contexts = calloc(1, sizeof(GTMZlibThreadContexts));
+    if (contexts && pthread_setspecific(gContextsKey, contexts) != 0) {
+      // COV_NF_START
+      free(contexts);
+      contexts = NULL;
+      // COV_NF_END
+    }
+  }
+  return contexts;
+}
+
+// Drops a cached stream's pointers into the caller's buffers, which are gone
+// by the time the stream is used again.
+static void ClearStreamBuffers(z_stream *strm) {
+  strm->next_in = Z_NULL;
+  strm->avail_in = 0;
+  strm->next_out = Z_NULL;
+  strm->avail_out = 0;
+}
+
+// Returns this thread's deflater for |mode|, reset and set to |level|, or
+// NULL with the zlib error in |retCode|.
+static z_stream *CachedDeflater(CompressionMode mode, int level, int *retCode) {
+  *retCode = Z_MEM_ERROR;
+  GTMZlibThreadContexts *contexts = ThreadContexts();
+  if (!contexts) return NULL;  // COV_NF_LINE
+  z_stream *strm = &contexts->deflaters[mode];
+  if (contexts->deflaterReady[mode]) {
+    // deflateParams() isn't used for a new level: deflateReset() doesn't
+    // clear the stream's history of having seen input, so some zlibs flush
+    // a block on the level change, and others refuse to change it without
+    // somewhere to write one.  Starting over is the same work as a reset.
+    if (contexts->deflaterLevels[mode] == level) {
+      *retCode = deflateReset(strm);
+      if (*retCode == Z_OK) return strm;
+    }
+    deflateEnd(strm);
+    contexts->deflaterReady[mode] = NO;
+  }
+
+  bzero(strm, sizeof(z_stream));
+  int memLevel = 8; // the default
+  int windowBits = 15; // the default
+  switch (mode) {
+    case CompressionModeZlib:
+      // nothing to do
+      break;
+
+    case CompressionModeGzip:
+      windowBits += 16; // enable gzip header instead of zlib header
+      break;
+
+    case CompressionModeRaw:
+      windowBits *= -1; // Negative to mean no header.
+      break;
+  }
+  *retCode = deflateInit2(strm, level, Z_DEFLATED, windowBits,
+                          memLevel, Z_DEFAULT_STRATEGY);
+  if (*retCode != Z_OK) return NULL;  // COV_NF_LINE
+  contexts->deflaterReady[mode] = YES;
+  contexts->deflaterLevels[mode] = level;
+  return strm;
+}
+
+// Returns this thread's inflater, reset, or NULL with the zlib error in
+// |retCode|.
+static z_stream *CachedInflater(BOOL isRawData, int *retCode) {
+  *retCode = Z_MEM_ERROR;
+  GTMZlibThreadContexts *contexts = ThreadContexts();
+  if (!contexts) return NULL;  // COV_NF_LINE
+  int index = isRawData ? 1 : 0;
+  z_stream *strm = &contexts->inflaters[index];
+  if (contexts->inflaterReady[index]) {
+    *retCode = inflateReset(strm);
+    if (*retCode == Z_OK) return strm;
+    // COV_NF_START - start over with a fresh one.
+    inflateEnd(strm);
+    contexts->inflaterReady[index] = NO;
+    // COV_NF_END
+  }
+
+  bzero(strm, sizeof(z_stream));
+  int windowBits = 15; // 15 to enable any window size
+  if (isRawData) {
+    windowBits *= -1; // make it negative to signal no header.
+  } else {
+    windowBits += 32; // and +32 to enable zlib or gzip header detection.
+  }
+  *retCode = inflateInit2(strm, windowBits);
+  if (*retCode != Z_OK) return NULL;  // COV_NF_LINE
+  contexts->inflaterReady[index] = YES;
+  return strm;
+}
+
+// A guess at how big |bytes| will inflate to.  A gzip stream ends with its
+// length (mod 2^32), which is exact unless the data is bad, so it is trusted
+// up to what deflate could possibly have produced from this much input.
+static size_t InflatedSizeHint(const unsigned char *bytes, NSUInteger length,
+                               BOOL isRawData) {
+  // hint the size at 4x the input size
+  unsigned long long hint = (unsigned long long)length * 4;
+  if (!isRawData && length >= kGzipOverhead &&
+      bytes[0] == 0x1f && bytes[1] == 0x8b) {
+    const unsigned char *isize = bytes + length - 4;
+    unsigned long long trailer =
+        (uint32_t)(isize[0] | (isize[1] << 8) | (isize[2] << 16) |
+                   ((uint32_t)isize[3] << 24));
+    if (trailer <= (unsigned long long)length * kMaxDeflateRatio) {
+      hint = trailer;
+    }
+  }
+  // avail_out is only an unsigned int.
+  return (size_t)MIN(hint, (unsigned long long)UINT_MAX - 1);
+}
+
+// Wraps up |output| (from malloc) as the result, trimming it if a lot of
+// |capacity| went unused.  Shrinking with realloc is normally done in place.
+static NSData *DataWithOutput(unsigned char *output, size_t length,
+                              size_t capacity) {
+  if (capacity - length > capacity / 4) {
+    unsigned char *smaller = realloc(output, length ? length : 1);
+    if (smaller) output = smaller;
+  }
+  return [NSData dataWithBytesNoCopy:output
+                              length:length
+                        freeWhenDone:YES];
+}
+
+// Dictionary training looks for the runs of this many bytes that turn up in
+// the most samples, and builds the dictionary out of the segments of this
+// length that have the most of them.
+#define kDictionaryGramLength 6
+#define kDictionarySegmentLength 48
+#define kDictionaryHashBits 18
+
+static uint32_t DictionaryGramHash(const unsigned char *bytes) {
+  uint64_t gram = 0;
+  memcpy(&gram, bytes, kDictionaryGramLength);
+  return (uint32_t)((gram * 0x9E3779B97F4A7C15ULL) >> (64 - kDictionaryHashBits));
+}
+
+typedef struct {
+  const unsigned char *bytes;
+  NSUInteger length;
+  uint64_t score;
+} GTMDictionarySegment;
+
+static int CompareSegmentScores(const void *a, const void *b) {
+  uint64_t scoreA = ((const GTMDictionarySegment *)a)->score;
+  uint64_t scoreB = ((const GTMDictionarySegment *)b)->score;
+  return (scoreA > scoreB) - (scoreA < scoreB);
+}
+
+// The sum of the counts of the grams in |segment|.
+static uint64_t DictionarySegmentScore(const unsigned char *segment,
+                                       NSUInteger length,
+                                       const uint32_t *counts) {
+  uint64_t score = 0;
+  for (NSUInteger i = 0; i + kDictionaryGramLength <= length; ++i) {
+    score += counts[DictionaryGramHash(segment + i)];
+  }
+  return score;
+}
+
 @interface NSData (GTMZlibAdditionsPrivate)
 + (NSData *)gtm_dataByCompressingBytes:(const void *)bytes
                                 length:(NSUInteger)length
                       compressionLevel:(int)level
-                                  mode:(CompressionMode)mode;
+                                  mode:(CompressionMode)mode
+                            dictionary:(NSData *)dictionary;
 + (NSData *)gtm_dataByInflatingBytes:(const void *)bytes
                               length:(NSUInteger)length
-                           isRawData:(BOOL)isRawData;
+                           isRawData:(BOOL)isRawData
+                          dictionary:(NSData *)dictionary;
++ (NSData *)gtm_dataByParallelGzippingBytes:(const void *)bytes
+                                     length:(NSUInteger)length
+                           compressionLevel:(int)level
+                                threadCount:(NSUInteger)threadCount;
 @end
 
 @implementation NSData (GTMZlibAdditionsPrivate)
@@ -43,14 +349,15 @@ typedef enum {
 + (NSData *)gtm_dataByCompressingBytes:(const void *)bytes
                                 length:(NSUInteger)length
                       compressionLevel:(int)level
-                                  mode:(CompressionMode)mode {
+                                  mode:(CompressionMode)mode
+                            dictionary:(NSData *)dictionary {
   if (!bytes || !length) {
     return nil;
   }
 
 #if defined(__LP64__) && __LP64__
   // Don't support > 32bit length for 64 bit, see note in header.
-  if (length > UINT_MAX) {
+  if (length > UINT_MAX || [dictionary length] > UINT_MAX) {
     return nil;
   }
 #endif
@@ -64,27 +371,9 @@ typedef enum {
     level = Z_BEST_COMPRESSION;
   }
 
-  z_stream strm;
-  bzero(&strm, sizeof(z_stream));
-
-  int memLevel = 8; // the default
-  int windowBits = 15; // the default
-  switch (mode) {
-    case CompressionModeZlib:
-      // nothing to do
-      break;
-
-    case CompressionModeGzip:
-      windowBits += 16; // enable gzip header instead of zlib header
-      break;
-
-    case CompressionModeRaw:
-      windowBits *= -1; // Negative to mean no header.
-      break;
-  }
   int retCode;
-  if ((retCode = deflateInit2(&strm, level, Z_DEFLATED, windowBits,
-                              memLevel, Z_DEFAULT_STRATEGY)) != Z_OK) {
+  z_stream *strm = CachedDeflater(mode, level, &retCode);
+  if (!strm) {
     // COV_NF_START - no real way to force this in a unittest (we guard all args)
     _GTMDevLog(@"Failed to init for deflate w/ level %d, error %d",
                level, retCode);
@@ -92,130 +381,260 @@ typedef enum {
     // COV_NF_END
   }
 
-  // hint the size at 1/4 the input size
-  NSMutableData *result = [NSMutableData dataWithCapacity:(length/4)];
-  unsigned char output[kChunkSize];
-
-  // setup the input
-  strm.avail_in = (unsigned int)length;
-  strm.next_in = (unsigned char*)bytes;
-
-  // loop to collect the data
-  do {
-    // update what we're passing in
-    strm.avail_out = kChunkSize;
-    strm.next_out = output;
-    retCode = deflate(&strm, Z_FINISH);
-    if ((retCode != Z_OK) && (retCode != Z_STREAM_END)) {
-      // COV_NF_START - no real way to force this in a unittest
-      // (in inflate, we can feed bogus/truncated data to test, but an error
-      // here would be some internal issue w/in zlib, and there isn't any real
-      // way to test it)
-      _GTMDevLog(@"Error trying to deflate some of the payload, error %d",
-                 retCode);
-      deflateEnd(&strm);
+  if (dictionary) {
+    // zlib only uses the end of a long dictionary, but the header's id is
+    // for the whole thing.
+    retCode = deflateSetDictionary(strm, [dictionary bytes],
+                                   (uInt)[dictionary length]);
+    if (retCode != Z_OK) {
+      // COV_NF_START - we only ever pass a fresh stream and good arguments.
+      _GTMDevLog(@"Failed to set the deflate dictionary, error %d", retCode);
       return nil;
       // COV_NF_END
     }
-    // collect what we got
-    unsigned gotBack = kChunkSize - strm.avail_out;
-    if (gotBack > 0) {
-      [result appendBytes:output length:gotBack];
-    }
+  }
 
-  } while (retCode == Z_OK);
+  // Size the output for the worst case so it is written in place with a
+  // single call.  Older zlibs leave the gzip header out of the bound.
+  size_t capacity = deflateBound(strm, (uLong)length) + kGzipOverhead;
+  unsigned char *output = malloc(capacity);
+  if (!output) {
+    return nil;  // COV_NF_LINE
+  }
+
+  // setup the input
+  strm->avail_in = (unsigned int)length;
+  strm->next_in = (unsigned char*)bytes;
+  strm->avail_out = (unsigned int)capacity;
+  strm->next_out = output;
+
+  retCode = deflate(strm, Z_FINISH);
+  // Should the bound ever come up short, grow and keep going.
+  while (retCode == Z_OK || retCode == Z_BUF_ERROR) {
+    size_t used = capacity - strm->avail_out;
+    unsigned char *bigger = realloc(output, capacity * 2);
+    if (!bigger) break;  // COV_NF_LINE
+    output = bigger;
+    strm->next_out = output + used;
+    strm->avail_out = (unsigned int)capacity;
+    capacity *= 2;
+    retCode = deflate(strm, Z_FINISH);
+  }
+  if (retCode != Z_STREAM_END) {
+    // COV_NF_START - no real way to force this in a unittest
+    // (in inflate, we can feed bogus/truncated data to test, but an error
+    // here would be some internal issue w/in zlib, and there isn't any real
+    // way to test it)
+    _GTMDevLog(@"Error trying to deflate some of the payload, error %d",
+               retCode);
+    ClearStreamBuffers(strm);
+    free(output);
+    return nil;
+    // COV_NF_END
+  }
 
   // if the loop exits, we used all input and the stream ended
-  _GTMDevAssert(strm.avail_in == 0,
+  _GTMDevAssert(strm->avail_in == 0,
                 @"thought we finished deflate w/o using all input, %u bytes left",
-                strm.avail_in);
-  _GTMDevAssert(retCode == Z_STREAM_END,
-                @"thought we finished deflate w/o getting a result of stream end, code %d",
-                retCode);
-
-  // clean up
-  deflateEnd(&strm);
+                strm->avail_in);
+  ClearStreamBuffers(strm);
 
-  return result;
+  return DataWithOutput(output, capacity - strm->avail_out, capacity);
 } // gtm_dataByCompressingBytes:length:compressionLevel:useGzip:
 
 + (NSData *)gtm_dataByInflatingBytes:(const void *)bytes
                               length:(NSUInteger)length
-                           isRawData:(BOOL)isRawData {
+                           isRawData:(BOOL)isRawData
+                          dictionary:(NSData *)dictionary {
   if (!bytes || !length) {
     return nil;
   }
 
 #if defined(__LP64__) && __LP64__
   // Don't support > 32bit length for 64 bit, see note in header.
-  if (length > UINT_MAX) {
+  if (length > UINT_MAX || [dictionary length] > UINT_MAX) {
     return nil;
   }
 #endif
 
-  z_stream strm;
-  bzero(&strm, sizeof(z_stream));
-
-  // setup the input
-  strm.avail_in = (unsigned int)length;
-  strm.next_in = (unsigned char*)bytes;
-
-  int windowBits = 15; // 15 to enable any window size
-  if (isRawData) {
-    windowBits *= -1; // make it negative to signal no header.
-  } else {
-    windowBits += 32; // and +32 to enable zlib or gzip header detection.
-  }
-
   int retCode;
-  if ((retCode = inflateInit2(&strm, windowBits)) != Z_OK) {
+  z_stream *strm = CachedInflater(isRawData, &retCode);
+  if (!strm) {
     // COV_NF_START - no real way to force this in a unittest (we guard all args)
     _GTMDevLog(@"Failed to init for inflate, error %d", retCode);
     return nil;
     // COV_NF_END
   }
 
-  // hint the size at 4x the input size
-  NSMutableData *result = [NSMutableData dataWithCapacity:(length*4)];
-  unsigned char output[kChunkSize];
+  // setup the input
+  strm->avail_in = (unsigned int)length;
+  strm->next_in = (unsigned char*)bytes;
+
+  // One spare byte lets zlib get through the trailer when the guess is exact.
+  size_t capacity = InflatedSizeHint(bytes, length, isRawData) + 1;
+  unsigned char *output = malloc(capacity);
+  if (!output) {
+    return nil;  // COV_NF_LINE
+  }
+  strm->avail_out = (unsigned int)capacity;
+  strm->next_out = output;
+
+  // Raw data has no header to ask for the dictionary, so it goes in first.
+  BOOL needsDictionary = (dictionary && isRawData);
 
   // loop to collect the data
   do {
-    // update what we're passing in
-    strm.avail_out = kChunkSize;
-    strm.next_out = output;
-    retCode = inflate(&strm, Z_NO_FLUSH);
+    if (needsDictionary) {
+      needsDictionary = NO;
+      retCode = inflateSetDictionary(strm, [dictionary bytes],
+                                     (uInt)[dictionary length]);
+      if (retCode != Z_OK) {
+        _GTMDevLog(@"Failed to set the inflate dictionary, error %d", retCode);
+        free(output);
+        return nil;
+      }
+    }
+    if (strm->avail_out == 0) {
+      size_t used = capacity;
+      // avail_out is only an unsigned int.
+      size_t grow = MIN(capacity, (size_t)UINT_MAX);
+      unsigned char *bigger = realloc(output, capacity + grow);
+      if (!bigger) {
+        // COV_NF_START
+        free(output);
+        return nil;
+        // COV_NF_END
+      }
+      output = bigger;
+      strm->next_out = output + used;
+      strm->avail_out = (unsigned int)grow;
+      capacity += grow;
+    }
+    retCode = inflate(strm, Z_NO_FLUSH);
+    if (retCode == Z_NEED_DICT && dictionary) {
+      // The header names the dictionary by its adler32, setting it checks it.
+      needsDictionary = YES;
+      retCode = Z_OK;
+      continue;
+    }
     if ((retCode != Z_OK) && (retCode != Z_STREAM_END)) {
       _GTMDevLog(@"Error trying to inflate some of the payload, error %d: %s",
-                 retCode, strm.msg);
-      inflateEnd(&strm);
+                 retCode, strm->msg);
+      free(output);
       return nil;
     }
-    // collect what we got
-    unsigned gotBack = kChunkSize - strm.avail_out;
-    if (gotBack > 0) {
-      [result appendBytes:output length:gotBack];
-    }
-
   } while (retCode == Z_OK);
 
   // make sure there wasn't more data tacked onto the end of a valid compressed
   // stream.
-  if (strm.avail_in != 0) {
+  if (strm->avail_in != 0) {
     _GTMDevLog(@"thought we finished inflate w/o using all input, %u bytes left",
-               strm.avail_in);
-    result = nil;
+               strm->avail_in);
+    free(output);
+    return nil;
+  }
+
+  return DataWithOutput(output, capacity - strm->avail_out, capacity);
+} // gtm_dataByInflatingBytes:length:windowBits:
+
++ (NSData *)gtm_dataByParallelGzippingBytes:(const void *)bytes
+                                     length:(NSUInteger)length
+                           compressionLevel:(int)level
+                                threadCount:(NSUInteger)threadCount {
+  if (!bytes || !length) {
+    return nil;
   }
-  // the only way out of the loop was by hitting the end of the stream
-  _GTMDevAssert(retCode == Z_STREAM_END,
-                @"thought we finished inflate w/o getting a result of stream end, code %d",
-                retCode);
 
-  // clean up
-  inflateEnd(&strm);
+  if (level == Z_DEFAULT_COMPRESSION) {
+    // the default value is actually outside the range, so we have to let it
+    // through specifically.
+  } else if (level < Z_BEST_SPEED) {
+    level = Z_BEST_SPEED;
+  } else if (level > Z_BEST_COMPRESSION) {
+    level = Z_BEST_COMPRESSION;
+  }
 
+  GTMParallelGzipJob job;
+  bzero(&job, sizeof(job));
+  job.input = bytes;
+  job.length = length;
+  job.level = level;
+  job.blockCount =
+      (int64_t)((length + kParallelBlockSize - 1) / kParallelBlockSize);
+  size_t blockCount = (size_t)job.blockCount;
+  job.outputs = calloc(blockCount, sizeof(unsigned char *));
+  job.outputLengths = calloc(blockCount, sizeof(size_t));
+  job.crcs = calloc(blockCount, sizeof(uLong));
+  NSData *result = nil;
+  if (job.outputs && job.outputLengths && job.crcs) {
+    if (threadCount == 0) {
+      threadCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    }
+    if (threadCount > blockCount) threadCount = blockCount;
+
+    // This thread is one of the workers.
+    NSUInteger helperCount = threadCount ? threadCount - 1 : 0;
+    pthread_t *helpers = calloc(helperCount ? helperCount : 1,
+                                sizeof(pthread_t));
+    NSUInteger started = 0;
+    if (helpers) {
+      for (; started < helperCount; ++started) {
+        if (pthread_create(&helpers[started], NULL, ParallelGzipWorker,
+                           &job) != 0) {
+          break;  // COV_NF_LINE - the others pick up the slack.
+        }
+      }
+    }
+    ParallelGzipWorker(&job);
+    for (NSUInteger i = 0; i < started; ++i) {
+      pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+
+    if (!job.failed) {
+      size_t total = 10 + 8;  // gzip header and trailer
+      uLong crc = job.crcs[0];
+      for (size_t i = 0; i < blockCount; ++i) {
+        total += job.outputLengths[i];
+        if (i) {
+          NSUInteger blockLength =
+              MIN((NSUInteger)kParallelBlockSize, length - i * kParallelBlockSize);
+          crc = crc32_combine(crc, job.crcs[i], (z_off_t)blockLength);
+        }
+      }
+      NSMutableData *gzipped = [NSMutableData dataWithLength:total];
+      unsigned char *out = [gzipped mutableBytes];
+      // Magic, deflate, no flags, no mtime, no extra flags, unix.
+      static const unsigned char kHeader[10] = {
+        0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+      };
+      memcpy(out, kHeader, sizeof(kHeader));
+      out += sizeof(kHeader);
+      for (size_t i = 0; i < blockCount; ++i) {
+        memcpy(out, job.outputs[i], job.outputLengths[i]);
+        out += job.outputLengths[i];
+      }
+      // CRC-32 and ISIZE (the length mod 2^32), both little endian.
+      uint32_t trailer[2] = { (uint32_t)crc, (uint32_t)length };
+      for (int i = 0; i < 2; ++i) {
+        for (int b = 0; b < 4; ++b) {
+          *out++ = (unsigned char)(trailer[i] >> (8 * b));
+        }
+      }
+      result = gzipped;
+    }
+  }
+
+  if (job.outputs) {
+    for (size_t i = 0; i < blockCount; ++i) {
+      free(job.outputs[i]);
+    }
+  }
+  free(job.outputs);
+  free(job.outputLengths);
+  free(job.crcs);
   return result;
-} // gtm_dataByInflatingBytes:length:windowBits:
+} // gtm_dataByParallelGzippingBytes:length:compressionLevel:threadCount:
 
 @end
 
@@ -227,14 +646,16 @@ typedef enum {
   return [self gtm_dataByCompressingBytes:bytes
                                    length:length
                          compressionLevel:Z_DEFAULT_COMPRESSION
-                                     mode:CompressionModeGzip];
+                                     mode:CompressionModeGzip
+                               dictionary:nil];
 } // gtm_dataByGzippingBytes:length:
 
 + (NSData *)gtm_dataByGzippingData:(NSData *)data {
   return [self gtm_dataByCompressingBytes:[data bytes]
                                    length:[data length]
                          compressionLevel:Z_DEFAULT_COMPRESSION
-                                     mode:CompressionModeGzip];
+                                     mode:CompressionModeGzip
+                               dictionary:nil];
 } // gtm_dataByGzippingData:
 
 + (NSData *)gtm_dataByGzippingBytes:(const void *)bytes
@@ -243,7 +664,8 @@ typedef enum {
   return [self gtm_dataByCompressingBytes:bytes
                                    length:length
                          compressionLevel:level
-                                     mode:CompressionModeGzip];
+                                     mode:CompressionModeGzip
+                               dictionary:nil];
 } // gtm_dataByGzippingBytes:length:level:
 
 + (NSData *)gtm_dataByGzippingData:(NSData *)data
@@ -251,9 +673,29 @@ typedef enum {
   return [self gtm_dataByCompressingBytes:[data bytes]
                                    length:[data length]
                          compressionLevel:level
-                                     mode:CompressionModeGzip];
+                                     mode:CompressionModeGzip
+                               dictionary:nil];
 } // gtm_dataByGzippingData:level:
 
++ (NSData *)gtm_dataByGzippingBytes:(const void *)bytes
+                             length:(NSUInteger)length
+                   compressionLevel:(int)level
+                        threadCount:(NSUInteger)threadCount {
+  return [self gtm_dataByParallelGzippingBytes:bytes
+                                        length:length
+                              compressionLevel:level
+                                   threadCount:threadCount];
+} // gtm_dataByGzippingBytes:length:level:threadCount:
+
++ (NSData *)gtm_dataByGzippingData:(NSData *)data
+                  compressionLevel:(int)level
+                       threadCount:(NSUInteger)threadCount {
+  return [self gtm_dataByParallelGzippingBytes:[data bytes]
+                                        length:[data length]
+                              compressionLevel:level
+                                   threadCount:threadCount];
+} // gtm_dataByGzippingData:level:threadCount:
+
 #pragma mark -
 
 + (NSData *)gtm_dataByDeflatingBytes:(const void *)bytes
@@ -261,14 +703,16 @@ typedef enum {
   return [self gtm_dataByCompressingBytes:bytes
                                    length:length
                          compressionLevel:Z_DEFAULT_COMPRESSION
-                                     mode:CompressionModeZlib];
+                                     mode:CompressionModeZlib
+                               dictionary:nil];
 } // gtm_dataByDeflatingBytes:length:
 
 + (NSData *)gtm_dataByDeflatingData:(NSData *)data {
   return [self gtm_dataByCompressingBytes:[data bytes]
                                    length:[data length]
                          compressionLevel:Z_DEFAULT_COMPRESSION
-                                     mode:CompressionModeZlib];
+                                     mode:CompressionModeZlib
+                               dictionary:nil];
 } // gtm_dataByDeflatingData:
 
 + (NSData *)gtm_dataByDeflatingBytes:(const void *)bytes
@@ -277,7 +721,8 @@ typedef enum {
   return [self gtm_dataByCompressingBytes:bytes
                                    length:length
                          compressionLevel:level
-                                     mode:CompressionModeZlib];
+                                     mode:CompressionModeZlib
+                               dictionary:nil];
 } // gtm_dataByDeflatingBytes:length:level:
 
 + (NSData *)gtm_dataByDeflatingData:(NSData *)data
@@ -285,7 +730,8 @@ typedef enum {
   return [self gtm_dataByCompressingBytes:[data bytes]
                                    length:[data length]
                          compressionLevel:level
-                                     mode:CompressionModeZlib];
+                                     mode:CompressionModeZlib
+                               dictionary:nil];
 } // gtm_dataByDeflatingData:level:
 
 #pragma mark -
@@ -294,30 +740,189 @@ typedef enum {
                               length:(NSUInteger)length {
   return [self gtm_dataByInflatingBytes:bytes
                                  length:length
-                              isRawData:NO];
+                              isRawData:NO
+                             dictionary:nil];
 } // gtm_dataByInflatingBytes:length:
 
 + (NSData *)gtm_dataByInflatingData:(NSData *)data {
   return [self gtm_dataByInflatingBytes:[data bytes]
                                  length:[data length]
-                              isRawData:NO];
+                              isRawData:NO
+                             dictionary:nil];
 } // gtm_dataByInflatingData:
 
 #pragma mark -
 
++ (NSData *)gtm_dataByDeflatingBytes:(const void *)bytes
+                              length:(NSUInteger)length
+                    compressionLevel:(int)level
+                          dictionary:(NSData *)dictionary {
+  return [self gtm_dataByCompressingBytes:bytes
+                                   length:length
+                         compressionLevel:level
+                                     mode:CompressionModeZlib
+                               dictionary:dictionary];
+} // gtm_dataByDeflatingBytes:length:compressionLevel:dictionary:
+
++ (NSData *)gtm_dataByDeflatingData:(NSData *)data
+                         dictionary:(NSData *)dictionary {
+  return [self gtm_dataByCompressingBytes:[data bytes]
+                                   length:[data length]
+                         compressionLevel:Z_DEFAULT_COMPRESSION
+                                     mode:CompressionModeZlib
+                               dictionary:dictionary];
+} // gtm_dataByDeflatingData:dictionary:
+
++ (NSData *)gtm_dataByDeflatingData:(NSData *)data
+                   compressionLevel:(int)level
+                         dictionary:(NSData *)dictionary {
+  return [self gtm_dataByCompressingBytes:[data bytes]
+                                   length:[data length]
+                         compressionLevel:level
+                                     mode:CompressionModeZlib
+                               dictionary:dictionary];
+} // gtm_dataByDeflatingData:compressionLevel:dictionary:
+
++ (NSData *)gtm_dataByInflatingBytes:(const void *)bytes
+                              length:(NSUInteger)length
+                          dictionary:(NSData *)dictionary {
+  return [self gtm_dataByInflatingBytes:bytes
+                                 length:length
+                              isRawData:NO
+                             dictionary:dictionary];
+} // gtm_dataByInflatingBytes:length:dictionary:
+
++ (NSData *)gtm_dataByInflatingData:(NSData *)data
+                         dictionary:(NSData *)dictionary {
+  return [self gtm_dataByInflatingBytes:[data bytes]
+                                 length:[data length]
+                              isRawData:NO
+                             dictionary:dictionary];
+} // gtm_dataByInflatingData:dictionary:
+
++ (NSData *)gtm_dictionaryFromSamples:(NSArray *)samples
+                            maxLength:(NSUInteger)maxLength {
+  maxLength = MIN(maxLength, (NSUInteger)kMaxDictionaryLength);
+  if (!maxLength || ![samples count]) {
+    return nil;
+  }
+
+  // Count how many samples each gram shows up in.  Hash collisions just make
+  // the counts a bit rough.
+  size_t tableSize = (size_t)1 << kDictionaryHashBits;
+  uint32_t *counts = calloc(tableSize, sizeof(uint32_t));
+  uint32_t *lastSample = calloc(tableSize, sizeof(uint32_t));
+  NSUInteger segmentCapacity =
+      (maxLength + kDictionarySegmentLength - 1) / kDictionarySegmentLength;
+  GTMDictionarySegment *segments =
+      calloc(segmentCapacity + 1, sizeof(GTMDictionarySegment));
+  if (!counts || !lastSample || !segments) {
+    // COV_NF_START
+    free(counts);
+    free(lastSample);
+    free(segments);
+    return nil;
+    // COV_NF_END
+  }
+  uint32_t sampleNumber = 0;
+  unsigned long long total = 0;
+  for (NSData *sample in samples) {
+    const unsigned char *bytes = [sample bytes];
+    NSUInteger length = [sample length];
+    ++sampleNumber;
+    for (NSUInteger i = 0; i + kDictionaryGramLength <= length; ++i) {
+      uint32_t hash = DictionaryGramHash(bytes + i);
+      if (lastSample[hash] != sampleNumber) {
+        lastSample[hash] = sampleNumber;
+        ++counts[hash];
+      }
+    }
+    total += length;
+  }
+  free(lastSample);
+  // Something in only one sample won't help with the next message.
+  for (size_t i = 0; i < tableSize; ++i) {
+    if (counts[i] < 2) counts[i] = 0;
+  }
+
+  // Split the corpus into one stretch per segment wanted, and take the best
+  // segment from each.  Once a segment is taken its grams stop counting, so
+  // later ones bring in something new.
+  unsigned long long epochLength =
+      MAX(total / segmentCapacity, (unsigned long long)kDictionarySegmentLength);
+  unsigned long long offset = 0;
+  unsigned long long epoch = 0;
+  NSUInteger segmentCount = 0;
+  GTMDictionarySegment best = { NULL, 0, 0 };
+  for (NSData *sample in samples) {
+    const unsigned char *bytes = [sample bytes];
+    NSUInteger length = [sample length];
+    NSUInteger segmentLength = MIN(length, (NSUInteger)kDictionarySegmentLength);
+    for (NSUInteger i = 0;
+         segmentLength >= kDictionaryGramLength && i + segmentLength <= length;
+         ++i) {
+      unsigned long long thisEpoch = (offset + i) / epochLength;
+      if (thisEpoch != epoch) {
+        epoch = thisEpoch;
+        if (best.score && segmentCount < segmentCapacity) {
+          segments[segmentCount++] = best;
+          for (NSUInteger g = 0; g + kDictionaryGramLength <= best.length; ++g) {
+            counts[DictionaryGramHash(best.bytes + g)] = 0;
+          }
+        }
+        best.score = 0;
+      }
+      uint64_t score = DictionarySegmentScore(bytes + i, segmentLength, counts);
+      if (score > best.score) {
+        best.bytes = bytes + i;
+        best.length = segmentLength;
+        best.score = score;
+      }
+    }
+    offset += length;
+  }
+  if (best.score && segmentCount < segmentCapacity) {
+    segments[segmentCount++] = best;
+  }
+  free(counts);
+
+  // zlib reaches the end of the dictionary most cheaply, so the best goes
+  // last, and if it is too long the weakest come off the front.
+  qsort(segments, segmentCount, sizeof(GTMDictionarySegment),
+        CompareSegmentScores);
+  NSMutableData *dictionary = [NSMutableData dataWithCapacity:maxLength];
+  for (NSUInteger i = 0; i < segmentCount; ++i) {
+    [dictionary appendBytes:segments[i].bytes length:segments[i].length];
+  }
+  free(segments);
+  if (![dictionary length]) {
+    return nil;
+  }
+  if ([dictionary length] > maxLength) {
+    [dictionary replaceBytesInRange:NSMakeRange(0, [dictionary length] - maxLength)
+                          withBytes:NULL
+                             length:0];
+  }
+  return dictionary;
+} // gtm_dictionaryFromSamples:maxLength:
+
+#pragma mark -
+
 + (NSData *)gtm_dataByRawDeflatingBytes:(const void *)bytes
                                  length:(NSUInteger)length {
   return [self gtm_dataByCompressingBytes:bytes
                                    length:length
                          compressionLevel:Z_DEFAULT_COMPRESSION
-                                     mode:CompressionModeRaw];
+                                     mode:CompressionModeRaw
+                               dictionary:nil];
 } // gtm_dataByRawDeflatingBytes:length:
 
 + (NSData *)gtm_dataByRawDeflatingData:(NSData *)data {
   return [self gtm_dataByCompressingBytes:[data bytes]
                                    length:[data length]
                          compressionLevel:Z_DEFAULT_COMPRESSION
-                                     mode:CompressionModeRaw];
+                                     mode:CompressionModeRaw
+                               dictionary:nil];
 } // gtm_dataByRawDeflatingData:
 
 + (NSData *)gtm_dataByRawDeflatingBytes:(const void *)bytes
@@ -326,7 +931,8 @@ typedef enum {
   return [self gtm_dataByCompressingBytes:bytes
                                    length:length
                          compressionLevel:level
-                                     mode:CompressionModeRaw];
+                                     mode:CompressionModeRaw
+                               dictionary:nil];
 } // gtm_dataByRawDeflatingBytes:length:compressionLevel:
 
 + (NSData *)gtm_dataByRawDeflatingData:(NSData *)data
@@ -334,20 +940,23 @@ typedef enum {
   return [self gtm_dataByCompressingBytes:[data bytes]
                                    length:[data length]
                          compressionLevel:level
-                                     mode:CompressionModeRaw];
+                                     mode:CompressionModeRaw
+                               dictionary:nil];
 } // gtm_dataByRawDeflatingData:compressionLevel:
 
 + (NSData *)gtm_dataByRawInflatingBytes:(const void *)bytes
                                  length:(NSUInteger)length {
   return [self gtm_dataByInflatingBytes:bytes
                                  length:length
-                              isRawData:YES];
+                              isRawData:YES
+                             dictionary:nil];
 } // gtm_dataByRawInflatingBytes:length:
 
 + (NSData *)gtm_dataByRawInflatingData:(NSData *)data {
   return [self gtm_dataByInflatingBytes:[data bytes]
                                  length:[data length]
-                              isRawData:YES];
+                              isRawData:YES
+                             dictionary:nil];
 } // gtm_dataByRawInflatingData:
 
 @end
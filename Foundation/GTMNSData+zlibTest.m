@@ -19,6 +19,7 @@
 #import "GTMSenTestCase.h"
 #import "GTMUnitTestDevLog.h"
 #import "GTMNSData+zlib.h"
+#import "GTMTestTimer.h"
 #import <stdlib.h> // for randiom/srandomdev
 #import <zlib.h>
 
@@ -499,11 +500,11 @@ static BOOL HasGzipHeader(NSData *data) {
     [input appendData:scratch];
   }
 
-  // The internal buffer size for GTM's deflate/inflate is 1024.
+  // Well past the size of zlib's own internal buffers.
   NSUInteger internalBufferSize = 1024;
 
-  // Should deflate to more then one buffer size to make sure the internal loop
-  // is working.
+  // Should deflate to more then one buffer size to make sure the output is
+  // sized correctly.
   NSData *compressed = [NSData gtm_dataByDeflatingData:input
                                       compressionLevel:9];
   STAssertNotNil(compressed, @"failed to deflate");
@@ -511,7 +512,7 @@ static BOOL HasGzipHeader(NSData *data) {
                       @"should have been more then %d bytes",
                       (int)internalBufferSize);
 
-  // Should inflate to more then one buffer size to make sure the internal loop
+  // Should inflate to more then 4x the input to make sure growing the output
   // is working.
   NSData *uncompressed = [NSData gtm_dataByInflatingData:compressed];
   STAssertNotNil(uncompressed, @"fail to inflate");
@@ -523,4 +524,321 @@ static BOOL HasGzipHeader(NSData *data) {
                        @"didn't get the same thing back");
 }
 
+- (void)testReusedStreams {
+  // Each thread keeps its zlib streams between calls, so mix up the modes,
+  // levels and sizes, and make sure a failure doesn't leave anything behind.
+  NSData *payload = [NSData dataWithBytes:randomDataLarge
+                                   length:sizeof(randomDataLarge)];
+  int levels[] = { 1, 9, Z_DEFAULT_COMPRESSION, 5 };
+  for (NSUInteger i = 0; i < 40; ++i) {
+    NSData *input = [payload subdataWithRange:NSMakeRange(0, 1 + i * 12)];
+    int level = levels[i % (sizeof(levels) / sizeof(levels[0]))];
+    NSData *gzipped = [NSData gtm_dataByGzippingData:input
+                                    compressionLevel:level];
+    NSData *deflated = [NSData gtm_dataByDeflatingData:input
+                                      compressionLevel:level];
+    NSData *raw = [NSData gtm_dataByRawDeflatingData:input
+                                    compressionLevel:level];
+    STAssertEqualObjects([NSData gtm_dataByInflatingData:gzipped], input, nil);
+    STAssertEqualObjects([NSData gtm_dataByInflatingData:deflated], input, nil);
+    STAssertEqualObjects([NSData gtm_dataByRawInflatingData:raw], input, nil);
+    if (i % 10 == 0) {
+      [GTMUnitTestDevLog expectString:@"Error trying to inflate some of the "
+       @"payload, error -5: (null)"];
+      STAssertNil([NSData gtm_dataByInflatingBytes:[gzipped bytes]
+                                            length:[gzipped length] / 2], nil);
+    }
+  }
+
+  // Same output as a fresh stream would give.
+  NSData *first = [NSData gtm_dataByDeflatingData:payload compressionLevel:9];
+  [NSData gtm_dataByDeflatingData:payload compressionLevel:1];
+  STAssertEqualObjects([NSData gtm_dataByDeflatingData:payload
+                                      compressionLevel:9], first, nil);
+
+  // A gzip trailer that claims more than could be there is just ignored.
+  NSMutableData *gzipped =
+      [NSMutableData dataWithData:[NSData gtm_dataByGzippingData:payload]];
+  unsigned char *isize = (unsigned char *)[gzipped mutableBytes] +
+                         [gzipped length] - 4;
+  isize[3] = 0x7f;
+  [GTMUnitTestDevLog expectString:@"Error trying to inflate some of the "
+   @"payload, error -3: incorrect length check"];
+  STAssertNil([NSData gtm_dataByInflatingData:gzipped], nil);
+}
+
+- (void)testAlternatingLevels {
+  // A level change on a thread's cached stream has to leave nothing from the
+  // last call behind, and the level has to actually take.
+  NSMutableString *text = [NSMutableString string];
+  for (int i = 0; i < 2000; ++i) {
+    [text appendFormat:@"line %d of %d, checksum %x\n", i, i * 7, i * 31];
+  }
+  NSData *payload = [text dataUsingEncoding:NSUTF8StringEncoding];
+  NSData *fast = nil;
+  NSData *best = nil;
+  for (int i = 0; i < 10; ++i) {
+    int level = (i % 2) ? 9 : 1;
+    NSData *deflated = [NSData gtm_dataByDeflatingData:payload
+                                      compressionLevel:level];
+    STAssertNotNil(deflated, @"level %d", level);
+    STAssertEqualObjects([NSData gtm_dataByInflatingData:deflated], payload,
+                         @"level %d", level);
+    // The second byte of the zlib header records the level it was made with.
+    const unsigned char *header = [deflated bytes];
+    STAssertEquals((int)header[1], (level == 9) ? 0xda : 0x01,
+                   @"level %d", level);
+    NSData **expected = (level == 9) ? &best : &fast;
+    if (*expected) {
+      STAssertEqualObjects(deflated, *expected, @"level %d", level);
+    } else {
+      *expected = deflated;
+    }
+  }
+  STAssertLessThan([best length], [fast length], nil);
+}
+
+// Reports the per call cost for the small payloads that logging produces.
+- (void)testSmallPayloadCost {
+  const NSUInteger kCalls = 20000;
+  NSData *message =
+      [@"2014-01-01 10:29:24.177 myapp[4588/0xa07d0f60] [lvl=1] -[Foo bar] "
+       @"a typical log message with a few details: 42, YES, /tmp/foo"
+        dataUsingEncoding:NSUTF8StringEncoding];
+  GTMTestTimer *gzipTimer = GTMTestTimerCreate();
+  GTMTestTimer *inflateTimer = GTMTestTimerCreate();
+  for (NSUInteger i = 0; i < kCalls; ++i) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    GTMTestTimerStart(gzipTimer);
+    NSData *gzipped = [NSData gtm_dataByGzippingData:message];
+    GTMTestTimerStop(gzipTimer);
+    GTMTestTimerStart(inflateTimer);
+    NSData *inflated = [NSData gtm_dataByInflatingData:gzipped];
+    GTMTestTimerStop(inflateTimer);
+    STAssertEquals([inflated length], [message length], nil);
+    [pool release];
+  }
+  NSLog(@"%lu byte payload: gzip %.0fns, inflate %.0fns per call",
+        (unsigned long)[message length],
+        GTMTestTimerGetNanoseconds(gzipTimer) / kCalls,
+        GTMTestTimerGetNanoseconds(inflateTimer) / kCalls);
+  GTMTestTimerRelease(gzipTimer);
+  GTMTestTimerRelease(inflateTimer);
+}
+
+// A few hundred bytes of JSON, like a typical small message.
+static NSData *SmallMessage(NSUInteger i) {
+  NSString *levels[] = { @"info", @"warning", @"error", @"debug" };
+  NSString *services[] = { @"auth", @"billing", @"search", @"profile" };
+  NSString *json =
+      [NSString stringWithFormat:@"{\"timestamp\":\"2014-03-%02luT%02lu:%02lu:"
+       @"%02lu.%03luZ\",\"level\":\"%@\",\"service\":\"%@\",\"request_id\":"
+       @"\"%08lx\",\"user\":{\"id\":%lu,\"country\":\"%@\"},\"latency_ms\":"
+       @"%lu,\"message\":\"request completed\"}",
+       (unsigned long)(i % 28 + 1), (unsigned long)(i % 24),
+       (unsigned long)(i * 7 % 60), (unsigned long)(i * 13 % 60),
+       (unsigned long)(i * 37 % 1000), levels[i % 4], services[i * 3 % 4],
+       (unsigned long)((i * 2654435761U) & 0xffffffff),
+       (unsigned long)(i * 97 % 100000), (i % 3) ? @"US" : @"DE",
+       (unsigned long)(i * 31 % 900)];
+  return [json dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+- (void)testDictionary {
+  NSMutableArray *samples = [NSMutableArray array];
+  for (NSUInteger i = 0; i < 500; ++i) {
+    [samples addObject:SmallMessage(i)];
+  }
+  NSData *dictionary = [NSData gtm_dictionaryFromSamples:samples
+                                               maxLength:2048];
+  STAssertNotNil(dictionary, nil);
+  STAssertLessThanOrEqual([dictionary length], (NSUInteger)2048, nil);
+  STAssertGreaterThan([dictionary length], (NSUInteger)0, nil);
+
+  STAssertNil([NSData gtm_dictionaryFromSamples:samples maxLength:0], nil);
+  STAssertNil([NSData gtm_dictionaryFromSamples:[NSArray array]
+                                      maxLength:2048], nil);
+  // Nothing in common with anything else.
+  NSArray *lonely = [NSArray arrayWithObject:SmallMessage(1)];
+  STAssertNil([NSData gtm_dictionaryFromSamples:lonely maxLength:2048], nil);
+  NSData *capped = [NSData gtm_dictionaryFromSamples:samples
+                                           maxLength:1000000];
+  STAssertLessThanOrEqual([capped length], (NSUInteger)(32 * 1024), nil);
+
+  NSData *message = SmallMessage(12345);
+  NSData *plain = [NSData gtm_dataByDeflatingData:message];
+  NSData *deflated = [NSData gtm_dataByDeflatingData:message
+                                          dictionary:dictionary];
+  STAssertNotNil(deflated, nil);
+  STAssertLessThan([deflated length], [plain length], nil);
+  STAssertEqualObjects([NSData gtm_dataByInflatingData:deflated
+                                            dictionary:dictionary],
+                       message, nil);
+  deflated = [NSData gtm_dataByDeflatingData:message
+                            compressionLevel:9
+                                  dictionary:dictionary];
+  STAssertEqualObjects([NSData gtm_dataByInflatingBytes:[deflated bytes]
+                                                 length:[deflated length]
+                                             dictionary:dictionary],
+                       message, nil);
+
+  // A nil dictionary is the same as the plain apis.
+  STAssertEqualObjects([NSData gtm_dataByDeflatingData:message dictionary:nil],
+                       plain, nil);
+  STAssertEqualObjects([NSData gtm_dataByInflatingData:plain dictionary:nil],
+                       message, nil);
+  // An unneeded dictionary is ignored.
+  STAssertEqualObjects([NSData gtm_dataByInflatingData:plain
+                                            dictionary:dictionary],
+                       message, nil);
+
+  // The wrong dictionary, or none, fails.
+  [GTMUnitTestDevLog expectString:@"Failed to set the inflate dictionary, "
+   @"error -3"];
+  STAssertNil([NSData gtm_dataByInflatingData:deflated dictionary:capped], nil);
+  [GTMUnitTestDevLog expectPattern:@"Error trying to inflate some of the "
+   @"payload, error 2: .*"];
+  STAssertNil([NSData gtm_dataByInflatingData:deflated], nil);
+  // And the per thread inflater is fine afterwards.
+  STAssertEqualObjects([NSData gtm_dataByInflatingData:deflated
+                                            dictionary:dictionary],
+                       message, nil);
+}
+
+// Reports the ratio and speed with and without a trained dictionary on a
+// corpus of small messages.
+- (void)testDictionaryRatio {
+  NSMutableArray *samples = [NSMutableArray array];
+  NSMutableArray *messages = [NSMutableArray array];
+  for (NSUInteger i = 0; i < 1000; ++i) {
+    [samples addObject:SmallMessage(i)];
+    [messages addObject:SmallMessage(100000 + i)];
+  }
+  GTMTestTimer *trainTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(trainTimer);
+  NSData *dictionary = [NSData gtm_dictionaryFromSamples:samples
+                                               maxLength:4096];
+  GTMTestTimerStop(trainTimer);
+
+  NSUInteger inputBytes = 0;
+  NSUInteger plainBytes = 0;
+  NSUInteger dictionaryBytes = 0;
+  GTMTestTimer *plainTimer = GTMTestTimerCreate();
+  GTMTestTimer *dictionaryTimer = GTMTestTimerCreate();
+  for (NSData *message in messages) {
+    inputBytes += [message length];
+    GTMTestTimerStart(plainTimer);
+    NSData *plain = [NSData gtm_dataByDeflatingData:message];
+    GTMTestTimerStop(plainTimer);
+    GTMTestTimerStart(dictionaryTimer);
+    NSData *deflated = [NSData gtm_dataByDeflatingData:message
+                                            dictionary:dictionary];
+    GTMTestTimerStop(dictionaryTimer);
+    plainBytes += [plain length];
+    dictionaryBytes += [deflated length];
+  }
+  double megabytes = inputBytes / (1024.0 * 1024.0);
+  NSLog(@"%lu messages, %lu bytes: trained a %lu byte dictionary in %.1fms; "
+        @"no dictionary %.1f%% at %.1fMB/s, dictionary %.1f%% at %.1fMB/s",
+        (unsigned long)[messages count], (unsigned long)inputBytes,
+        (unsigned long)[dictionary length],
+        GTMTestTimerGetMilliseconds(trainTimer),
+        100.0 * plainBytes / inputBytes,
+        megabytes / GTMTestTimerGetSeconds(plainTimer),
+        100.0 * dictionaryBytes / inputBytes,
+        megabytes / GTMTestTimerGetSeconds(dictionaryTimer));
+  STAssertLessThan(dictionaryBytes, plainBytes / 2, nil);
+  GTMTestTimerRelease(trainTimer);
+  GTMTestTimerRelease(plainTimer);
+  GTMTestTimerRelease(dictionaryTimer);
+}
+
+// Builds |length| bytes of compressible but not trivial data.
+static NSData *CompressibleData(NSUInteger length) {
+  NSMutableData *data = [NSMutableData dataWithLength:length];
+  unsigned char *bytes = [data mutableBytes];
+  uint32_t seed = 12345;
+  for (NSUInteger i = 0; i < length; ++i) {
+    seed = seed * 1103515245 + 12345;
+    bytes[i] = (unsigned char)("abcdefgh \n"[(seed >> 16) % 10]);
+  }
+  return data;
+}
+
+- (void)testParallelGzip {
+  STAssertNil([NSData gtm_dataByGzippingData:nil
+                            compressionLevel:6
+                                 threadCount:4], nil);
+  STAssertNil([NSData gtm_dataByGzippingBytes:randomDataSmall
+                                       length:0
+                             compressionLevel:6
+                                  threadCount:4], nil);
+
+  // Less than a block, exactly some blocks, and a partial last block.
+  const NSUInteger kBlock = 128 * 1024;
+  NSUInteger lengths[] = { 1, 1000, kBlock, 3 * kBlock, 5 * kBlock + 77 };
+  NSUInteger threads[] = { 0, 1, 2, 7 };
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+    NSData *input = CompressibleData(lengths[l]);
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t) {
+      NSData *gzipped = [NSData gtm_dataByGzippingData:input
+                                      compressionLevel:-4
+                                           threadCount:threads[t]];
+      STAssertNotNil(gzipped, nil);
+      STAssertTrue(HasGzipHeader(gzipped), nil);
+      STAssertEqualObjects([NSData gtm_dataByInflatingData:gzipped], input,
+                           @"length %lu threads %lu",
+                           (unsigned long)lengths[l], (unsigned long)threads[t]);
+    }
+  }
+
+  // The ratio stays close to the single threaded one.
+  NSData *input = CompressibleData(20 * kBlock);
+  NSData *serial = [NSData gtm_dataByGzippingData:input compressionLevel:9];
+  NSData *parallel = [NSData gtm_dataByGzippingData:input
+                                   compressionLevel:9
+                                        threadCount:4];
+  STAssertLessThan([parallel length], [serial length] + [serial length] / 50,
+                   nil);
+}
+
+// Reports how parallel gzip scales with threads on a large buffer.
+- (void)testParallelGzipScaling {
+  // 64MB only w/ GTM_ENABLE_BENCHMARKS set, the default keeps the unittests
+  // quick.
+  NSUInteger megabytes = getenv("GTM_ENABLE_BENCHMARKS") ? 64 : 2;
+  NSData *input = CompressibleData(megabytes * 1024 * 1024);
+  GTMTestTimer *timer = GTMTestTimerCreate();
+  GTMTestTimerStart(timer);
+  NSData *serial = [NSData gtm_dataByGzippingData:input];
+  GTMTestTimerStop(timer);
+  double serialSeconds = GTMTestTimerGetSeconds(timer);
+  NSLog(@"gzip %luMB: single threaded api %.3fs (%lu bytes)",
+        (unsigned long)megabytes, serialSeconds,
+        (unsigned long)[serial length]);
+  GTMTestTimerRelease(timer);
+
+  NSUInteger processors = [[NSProcessInfo processInfo] activeProcessorCount];
+  for (NSUInteger threads = 1; ; threads *= 2) {
+    if (threads > processors) threads = processors;
+    timer = GTMTestTimerCreate();
+    GTMTestTimerStart(timer);
+    NSData *gzipped = [NSData gtm_dataByGzippingData:input
+                                    compressionLevel:Z_DEFAULT_COMPRESSION
+                                         threadCount:threads];
+    GTMTestTimerStop(timer);
+    double seconds = GTMTestTimerGetSeconds(timer);
+    NSLog(@"gzip %luMB: %lu threads %.3fs, %.2fx (%lu bytes)",
+          (unsigned long)megabytes, (unsigned long)threads, seconds,
+          serialSeconds / seconds, (unsigned long)[gzipped length]);
+    GTMTestTimerRelease(timer);
+    STAssertNotNil(gzipped, nil);
+    if (threads == processors) {
+      STAssertEqualObjects([NSData gtm_dataByInflatingData:gzipped], input,
+                           nil);
+      break;
+    }
+  }
+}
+
 @end
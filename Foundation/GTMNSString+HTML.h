@@ -56,7 +56,8 @@
 /// Get a string where internal characters that are escaped for HTML are unescaped 
 //
 ///  For example, '&amp;' becomes '&'
-///  Handles &#32; and &#x32; cases as well
+///  Handles &#32; and &#x32; cases as well, including characters beyond the
+///  BMP such as &#x1F600; (which become surrogate pairs)
 ///
 //  Returns:
 //    Autoreleased NSString
@@ -19,6 +19,11 @@
 
 #import "GTMDefines.h"
 #import "GTMNSString+HTML.h"
+#import <pthread.h>
+
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#endif
 
 typedef struct {
   NSString *escapeSequence;
@@ -26,7 +31,7 @@ typedef struct {
 } HTMLEscapeMap;
 
 // Taken from http://www.w3.org/TR/xhtml1/dtds.html#a_dtd_Special_characters
-// Ordered by uchar lowest to highest for bsearching
+// Ordered by uchar lowest to highest
 static HTMLEscapeMap gAsciiHTMLEscapeMap[] = {
   // A.2.2. Special characters
   { @"&quot;", 34 },
@@ -355,33 +360,269 @@ static HTMLEscapeMap gUnicodeHTMLEscapeMap[] = {
 };
 
 
-// Utility function for Bsearching table above
-static int EscapeMapCompare(const void *ucharVoid, const void *mapVoid) {
-  const unichar *uchar = (const unichar*)ucharVoid;
-  const HTMLEscapeMap *map = (const HTMLEscapeMap*)mapVoid;
-  int val;
-  if (*uchar > map->uchar) {
-    val = 1;
-  } else if (*uchar < map->uchar) {
-    val = -1;
-  } else {
-    val = 0;
+// The longest sequence in either table ("&thetasym;").  Numeric escapes are
+// at most "&#65535;".
+#define kMaxEscapeLength 10
+
+// An escape sequence in UTF-16, ready to be copied into the output.
+typedef struct {
+  unichar chars[kMaxEscapeLength];
+  NSUInteger length;
+} EscapeSequence;
+
+// Maps UTF-16 code units to their escape sequences in two steps: the high
+// byte picks one of |pages| and the low byte an entry in it.  Entries are one
+// more than the index into |sequences|, so 0 means no escape.  Page 0 is
+// left empty and shared by every high byte that has nothing to escape.
+#define kMaxEscapePages 16
+typedef struct {
+  uint8_t pageIndex[256];
+  uint16_t pages[kMaxEscapePages][256];
+  EscapeSequence *sequences;
+  BOOL escapeUnicode;
+} EscapeTable;
+
+static EscapeSequence gAsciiEscapeSequences[sizeof(gAsciiHTMLEscapeMap) /
+                                            sizeof(HTMLEscapeMap)];
+static EscapeSequence gUnicodeEscapeSequences[sizeof(gUnicodeHTMLEscapeMap) /
+                                              sizeof(HTMLEscapeMap)];
+static EscapeTable gAsciiEscapeTable;
+static EscapeTable gUnicodeEscapeTable;
+static pthread_once_t gEscapeTablesOnce = PTHREAD_ONCE_INIT;
+
+static void BuildEscapeTable(EscapeTable *table, const HTMLEscapeMap *map,
+                             size_t count, EscapeSequence *sequences,
+                             BOOL escapeUnicode) {
+  table->sequences = sequences;
+  table->escapeUnicode = escapeUnicode;
+  uint8_t pageCount = 1;
+  for (size_t i = 0; i < count; ++i) {
+    NSString *escape = map[i].escapeSequence;
+    NSUInteger length = [escape length];
+    _GTMDevAssert(length <= kMaxEscapeLength, @"%@ is too long", escape);
+    [escape getCharacters:sequences[i].chars];
+    sequences[i].length = length;
+
+    unichar uchar = map[i].uchar;
+    uint8_t high = (uint8_t)(uchar >> 8);
+    if (!table->pageIndex[high]) {
+      _GTMDevAssert(pageCount < kMaxEscapePages, @"Too many escape pages");
+      table->pageIndex[high] = pageCount++;
+    }
+    table->pages[table->pageIndex[high]][uchar & 0xff] = (uint16_t)(i + 1);
+  }
+}
+
+// A perfect hash of the entity names in gAsciiHTMLEscapeMap (without the '&'
+// and ';'), generated offline.  The FNV-1a hash of a name picks one of
+// gEntitySeeds, which scrambles the hash again to pick its slot in
+// gEntitySlots.  Slots hold one more than the index of the entry, so 0 is
+// empty.  Names that aren't entities land either on an empty slot or on one
+// whose name doesn't match.  If gAsciiHTMLEscapeMap changes these have to be
+// regenerated; BuildEscapeTables checks them in debug builds.
+#define kEntitySeedCount 64
+#define kEntitySlotBits 9
+static const uint8_t gEntitySeeds[kEntitySeedCount] = {
+  1, 1, 1, 4, 4, 5, 1, 2, 1, 3, 1, 1, 5, 3, 2, 1,
+  4, 7, 2, 2, 1, 1, 5, 1, 8, 2, 1, 4, 9, 24, 4, 10,
+  3, 4, 5, 2, 12, 11, 2, 1, 12, 4, 1, 6, 4, 20, 2, 2,
+  9, 1, 3, 6, 5, 5, 1, 2, 1, 0, 4, 2, 13, 3, 6, 3
+};
+static const uint8_t gEntitySlots[1 << kEntitySlotBits] = {
+  25, 0, 0, 0, 83, 168, 0, 0, 100, 0, 0, 0, 236, 51, 0, 176,
+  0, 64, 26, 0, 7, 0, 18, 0, 0, 156, 90, 0, 0, 0, 241, 0,
+  212, 0, 0, 148, 207, 0, 120, 232, 79, 238, 107, 0, 0, 99, 150, 17,
+  0, 0, 0, 174, 0, 0, 108, 0, 239, 166, 0, 0, 59, 0, 0, 22,
+  198, 0, 186, 113, 0, 9, 10, 56, 0, 158, 28, 0, 76, 0, 0, 125,
+  146, 0, 181, 0, 0, 0, 0, 0, 50, 124, 145, 0, 98, 117, 0, 234,
+  0, 206, 173, 3, 0, 27, 2, 196, 0, 0, 0, 0, 0, 0, 0, 0,
+  215, 134, 151, 0, 161, 0, 0, 228, 167, 0, 0, 192, 0, 0, 109, 0,
+  66, 0, 0, 0, 0, 0, 0, 8, 0, 0, 14, 0, 0, 127, 131, 119,
+  0, 0, 190, 135, 250, 37, 62, 182, 200, 57, 0, 30, 195, 85, 0, 0,
+  0, 4, 0, 38, 229, 243, 41, 0, 88, 0, 43, 0, 0, 0, 48, 191,
+  252, 0, 153, 184, 0, 0, 147, 136, 180, 84, 0, 144, 194, 214, 0, 0,
+  95, 0, 0, 0, 45, 251, 248, 0, 114, 0, 0, 15, 0, 231, 175, 0,
+  0, 0, 0, 0, 44, 0, 129, 0, 16, 0, 226, 24, 0, 0, 0, 205,
+  249, 0, 0, 0, 0, 71, 89, 81, 209, 164, 0, 82, 104, 0, 0, 247,
+  0, 115, 211, 0, 225, 63, 61, 72, 0, 0, 230, 221, 171, 0, 0, 0,
+  0, 0, 219, 208, 0, 0, 0, 0, 223, 183, 94, 0, 78, 242, 49, 122,
+  0, 130, 204, 0, 240, 0, 121, 0, 0, 245, 0, 0, 0, 0, 197, 0,
+  0, 0, 0, 0, 105, 36, 222, 75, 0, 189, 97, 218, 103, 0, 237, 199,
+  0, 0, 0, 87, 0, 74, 133, 5, 67, 0, 0, 0, 0, 0, 142, 96,
+  224, 0, 0, 235, 0, 0, 0, 202, 0, 0, 11, 0, 116, 128, 34, 68,
+  233, 0, 0, 0, 138, 73, 0, 165, 0, 154, 170, 0, 20, 0, 39, 0,
+  6, 0, 0, 140, 0, 172, 19, 201, 46, 0, 0, 141, 80, 0, 0, 69,
+  0, 106, 0, 102, 162, 0, 0, 0, 91, 246, 0, 101, 58, 0, 0, 217,
+  155, 65, 0, 0, 0, 112, 0, 0, 92, 110, 0, 253, 0, 0, 244, 126,
+  0, 0, 188, 0, 42, 21, 137, 152, 0, 0, 157, 0, 0, 53, 185, 0,
+  12, 0, 227, 0, 0, 0, 0, 13, 0, 0, 143, 220, 0, 0, 0, 32,
+  55, 0, 0, 169, 0, 139, 0, 0, 111, 0, 0, 86, 0, 33, 0, 0,
+  70, 163, 179, 0, 52, 0, 123, 0, 0, 35, 187, 0, 178, 0, 193, 0,
+  54, 160, 0, 0, 203, 0, 0, 31, 0, 0, 0, 0, 77, 93, 1, 0,
+  60, 210, 0, 0, 0, 0, 0, 0, 0, 0, 177, 0, 132, 0, 0, 0,
+  29, 23, 118, 159, 216, 0, 40, 149, 0, 213, 0, 0, 0, 47, 0, 0
+};
+
+GTM_INLINE uint32_t EntityNameHash(const unichar *name, NSUInteger length) {
+  uint32_t hash = 0x811C9DC5;
+  for (NSUInteger i = 0; i < length; ++i) {
+    hash = (hash ^ name[i]) * 0x01000193;
+  }
+  return hash;
+}
+
+// Returns the index in gAsciiHTMLEscapeMap of the entity |name| (|length|
+// characters, without the '&' and ';'), or -1 if there isn't one.
+static int LookUpEntity(const unichar *name, NSUInteger length) {
+  uint32_t hash = EntityNameHash(name, length);
+  uint32_t seed = gEntitySeeds[hash % kEntitySeedCount];
+  uint32_t slot = ((hash ^ (seed * 0x9E3779B9)) * 0x85EBCA6B)
+                  >> (32 - kEntitySlotBits);
+  int entry = gEntitySlots[slot];
+  if (!entry) return -1;
+  const EscapeSequence *sequence = &gAsciiEscapeSequences[entry - 1];
+  if (sequence->length != length + 2 ||
+      memcmp(sequence->chars + 1, name, length * sizeof(unichar))) {
+    return -1;
+  }
+  return entry - 1;
+}
+
+static void BuildEscapeTables(void) {
+  BuildEscapeTable(&gAsciiEscapeTable, gAsciiHTMLEscapeMap,
+                   sizeof(gAsciiHTMLEscapeMap) / sizeof(HTMLEscapeMap),
+                   gAsciiEscapeSequences, YES);
+  BuildEscapeTable(&gUnicodeEscapeTable, gUnicodeHTMLEscapeMap,
+                   sizeof(gUnicodeHTMLEscapeMap) / sizeof(HTMLEscapeMap),
+                   gUnicodeEscapeSequences, NO);
+#ifdef DEBUG
+  for (size_t i = 0;
+       i < sizeof(gAsciiHTMLEscapeMap) / sizeof(HTMLEscapeMap); ++i) {
+    const EscapeSequence *sequence = &gAsciiEscapeSequences[i];
+    _GTMDevAssert(LookUpEntity(sequence->chars + 1,
+                               sequence->length - 2) == (int)i,
+                  @"gEntitySlots needs regenerating for %@",
+                  gAsciiHTMLEscapeMap[i].escapeSequence);
+  }
+#endif  // DEBUG
+}
+
+// Parses the digits of a numeric character reference, returning 0 if they
+// aren't all digits or the value is beyond Unicode.
+static uint32_t CharacterReferenceValue(const unichar *digits,
+                                        NSUInteger length, BOOL hex) {
+  uint32_t value = 0;
+  for (NSUInteger i = 0; i < length; ++i) {
+    unichar uchar = digits[i];
+    unichar lower = uchar | 0x20;
+    uint32_t digit;
+    if (uchar >= '0' && uchar <= '9') {
+      digit = uchar - '0';
+    } else if (hex && lower >= 'a' && lower <= 'f') {
+      digit = lower - 'a' + 10;
+    } else {
+      return 0;
+    }
+    value = value * (hex ? 16 : 10) + digit;
+    if (value > 0x10FFFF) return 0;
+  }
+  return value;
+}
+
+GTM_INLINE BOOL IsPlainAscii(unichar uchar) {
+  return uchar < 128 && uchar != '"' && uchar != '&' && uchar != '\'' &&
+         uchar != '<' && uchar != '>';
+}
+
+// Returns the index of the first character from |i| on that isn't plain
+// ASCII, i.e. that might need escaping (or |length|).
+static NSUInteger SkipPlainAscii(const unichar *buffer, NSUInteger i,
+                                 NSUInteger length) {
+#if defined(__SSE2__)
+  const __m128i quot = _mm_set1_epi16('"');
+  const __m128i amp = _mm_set1_epi16('&');
+  const __m128i apos = _mm_set1_epi16('\'');
+  const __m128i lt = _mm_set1_epi16('<');
+  const __m128i gt = _mm_set1_epi16('>');
+  const __m128i asciiMax = _mm_set1_epi16(127);
+  const __m128i zero = _mm_setzero_si128();
+  for (; length - i >= 8; i += 8) {
+    __m128i chars = _mm_loadu_si128((const __m128i *)(buffer + i));
+    __m128i special =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(chars, quot),
+                                  _mm_cmpeq_epi16(chars, amp)),
+                     _mm_or_si128(_mm_cmpeq_epi16(chars, apos),
+                                  _mm_or_si128(_mm_cmpeq_epi16(chars, lt),
+                                               _mm_cmpeq_epi16(chars, gt))));
+    // Anything over 127 saturates to something other than zero.
+    __m128i ascii = _mm_cmpeq_epi16(_mm_subs_epu16(chars, asciiMax), zero);
+    int mask = _mm_movemask_epi8(special) |
+               (~_mm_movemask_epi8(ascii) & 0xFFFF);
+    if (mask) return i + (NSUInteger)__builtin_ctz((unsigned int)mask) / 2;
+  }
+#endif  // __SSE2__
+  while (i < length && IsPlainAscii(buffer[i])) ++i;
+  return i;
+}
+
+// Escapes |length| characters into |out| according to |table|, returning the
+// number of characters that takes.  With a NULL |out| it just counts them.
+static NSUInteger EscapeCharacters(const EscapeTable *table,
+                                   const unichar *buffer, NSUInteger length,
+                                   unichar *out) {
+  NSUInteger outLength = 0;
+  NSUInteger i = 0;
+  while (i < length) {
+    NSUInteger plainEnd = SkipPlainAscii(buffer, i, length);
+    if (out && plainEnd > i) {
+      memcpy(out + outLength, buffer + i, (plainEnd - i) * sizeof(unichar));
+    }
+    outLength += plainEnd - i;
+    i = plainEnd;
+    if (i == length) break;
+
+    unichar uchar = buffer[i++];
+    uint16_t entry = table->pages[table->pageIndex[uchar >> 8]][uchar & 0xff];
+    if (entry) {
+      const EscapeSequence *sequence = &table->sequences[entry - 1];
+      if (out) {
+        memcpy(out + outLength, sequence->chars,
+               sequence->length * sizeof(unichar));
+      }
+      outLength += sequence->length;
+    } else if (table->escapeUnicode && uchar > 127) {
+      // &#decimal;
+      unichar digits[5];
+      NSUInteger digitCount = 0;
+      do {
+        digits[digitCount++] = (unichar)('0' + uchar % 10);
+        uchar /= 10;
+      } while (uchar);
+      if (out) {
+        unichar *next = out + outLength;
+        *next++ = '&';
+        *next++ = '#';
+        while (digitCount) *next++ = digits[--digitCount];
+        *next = ';';
+        outLength = (NSUInteger)(next + 1 - out);
+      } else {
+        outLength += digitCount + 3;
+      }
+    } else {
+      if (out) out[outLength] = uchar;
+      outLength += 1;
+    }
   }
-  return val;
+  return outLength;
 }
 
 @implementation NSString (GTMNSStringHTMLAdditions)
 
-- (NSString *)gtm_stringByEscapingHTMLUsingTable:(HTMLEscapeMap*)table 
-                                          ofSize:(NSUInteger)size 
-                                 escapingUnicode:(BOOL)escapeUnicode {  
+- (NSString *)gtm_stringByEscapingHTMLUsingTable:(const EscapeTable *)table {
   NSUInteger length = [self length];
   if (!length) {
     return self;
   }
-  
-  NSMutableString *finalString = [NSMutableString string];
-  NSMutableData *data2 = [NSMutableData dataWithCapacity:sizeof(unichar) * length];
 
   // this block is common between GTMNSString+HTML and GTMNSString+XML but
   // it's so short that it isn't really worth trying to share.
@@ -399,122 +640,122 @@ static int EscapeMapCompare(const void *ucharVoid, const void *mapVoid) {
     buffer = [data bytes];
   }
 
-  if (!buffer || !data2) {
+  // Every escape is longer than what it replaces, so if the length doesn't
+  // change there is nothing to escape.
+  NSUInteger outLength = EscapeCharacters(table, buffer, length, NULL);
+  if (outLength == length) {
+    return [[self copy] autorelease];
+  }
+  unichar *out = malloc(outLength * sizeof(unichar));
+  if (!out) {
     // COV_NF_START
-    _GTMDevLog(@"Unable to allocate buffer or data2");
+    _GTMDevLog(@"Unable to allocate buffer");
     return nil;
     // COV_NF_END
   }
-  
-  unichar *buffer2 = (unichar *)[data2 mutableBytes];
-  
-  NSUInteger buffer2Length = 0;
-  
-  for (NSUInteger i = 0; i < length; ++i) {
-    HTMLEscapeMap *val = bsearch(&buffer[i], table, 
-                                 size / sizeof(HTMLEscapeMap), 
-                                 sizeof(HTMLEscapeMap), EscapeMapCompare);
-    if (val || (escapeUnicode && buffer[i] > 127)) {
-      if (buffer2Length) {
-        CFStringAppendCharacters((CFMutableStringRef)finalString, 
-                                 buffer2, 
-                                 buffer2Length);
-        buffer2Length = 0;
-      }
-      if (val) {
-        [finalString appendString:val->escapeSequence];
-      }
-      else {
-        _GTMDevAssert(escapeUnicode && buffer[i] > 127, @"Illegal Character");
-        [finalString appendFormat:@"&#%d;", buffer[i]];
-      }
-    } else {
-      buffer2[buffer2Length] = buffer[i];
-      buffer2Length += 1;
-    }
-  }
-  if (buffer2Length) {
-    CFStringAppendCharacters((CFMutableStringRef)finalString, 
-                             buffer2, 
-                             buffer2Length);
-  }
-  return finalString;
+  EscapeCharacters(table, buffer, length, out);
+  return [[[NSString alloc] initWithCharactersNoCopy:out
+                                              length:outLength
+                                        freeWhenDone:YES] autorelease];
 }
 
 - (NSString *)gtm_stringByEscapingForHTML {
-  return [self gtm_stringByEscapingHTMLUsingTable:gUnicodeHTMLEscapeMap 
-                                           ofSize:sizeof(gUnicodeHTMLEscapeMap) 
-                                  escapingUnicode:NO];
+  pthread_once(&gEscapeTablesOnce, BuildEscapeTables);
+  return [self gtm_stringByEscapingHTMLUsingTable:&gUnicodeEscapeTable];
 } // gtm_stringByEscapingHTML
 
 - (NSString *)gtm_stringByEscapingForAsciiHTML {
-  return [self gtm_stringByEscapingHTMLUsingTable:gAsciiHTMLEscapeMap 
-                                           ofSize:sizeof(gAsciiHTMLEscapeMap) 
-                                  escapingUnicode:YES];
+  pthread_once(&gEscapeTablesOnce, BuildEscapeTables);
+  return [self gtm_stringByEscapingHTMLUsingTable:&gAsciiEscapeTable];
 } // gtm_stringByEscapingAsciiHTML
 
 - (NSString *)gtm_stringByUnescapingFromHTML {
-  NSRange range = NSMakeRange(0, [self length]);
-  NSRange subrange = [self rangeOfString:@"&" options:NSBackwardsSearch range:range];
-  
+  NSUInteger length = [self length];
+  NSRange ampersand = [self rangeOfString:@"&"];
+
   // if no ampersands, we've got a quick way out
-  if (subrange.length == 0) return self;
-  NSMutableString *finalString = [NSMutableString stringWithString:self];
-  do {
-    NSRange semiColonRange = NSMakeRange(subrange.location, NSMaxRange(range) - subrange.location);
-    semiColonRange = [self rangeOfString:@";" options:0 range:semiColonRange];
-    range = NSMakeRange(0, subrange.location);
-    // if we don't find a semicolon in the range, we don't have a sequence
-    if (semiColonRange.location == NSNotFound) {
+  if (ampersand.length == 0) return self;
+
+  const unichar *buffer = CFStringGetCharactersPtr((CFStringRef)self);
+  if (!buffer) {
+    // We want this buffer to be autoreleased.
+    NSMutableData *data = [NSMutableData dataWithLength:length * sizeof(UniChar)];
+    if (!data) {
+      // COV_NF_START  - Memory fail case
+      _GTMDevLog(@"couldn't alloc buffer");
+      return nil;
+      // COV_NF_END
+    }
+    [self getCharacters:[data mutableBytes]];
+    buffer = [data bytes];
+  }
+
+  // Every sequence is longer than what it stands for, so the result is never
+  // longer than the original.
+  unichar *out = malloc(length * sizeof(unichar));
+  if (!out) {
+    // COV_NF_START
+    _GTMDevLog(@"Unable to allocate buffer");
+    return nil;
+    // COV_NF_END
+  }
+  pthread_once(&gEscapeTablesOnce, BuildEscapeTables);
+
+  NSUInteger i = ampersand.location;
+  memcpy(out, buffer, i * sizeof(unichar));
+  NSUInteger outLength = i;
+  while (i < length) {
+    unichar uchar = buffer[i];
+    if (uchar != '&') {
+      out[outLength++] = uchar;
+      ++i;
       continue;
     }
-    NSRange escapeRange = NSMakeRange(subrange.location, semiColonRange.location - subrange.location + 1);
-    NSString *escapeString = [self substringWithRange:escapeRange];
-    NSUInteger length = [escapeString length];
-    // a squence must be longer than 3 (&lt;) and less than 11 (&thetasym;)
-    if (length > 3 && length < 11) {
-      if ([escapeString characterAtIndex:1] == '#') {
-        unichar char2 = [escapeString characterAtIndex:2];
-        if (char2 == 'x' || char2 == 'X') {
-          // Hex escape squences &#xa3;
-          NSString *hexSequence = [escapeString substringWithRange:NSMakeRange(3, length - 4)];
-          NSScanner *scanner = [NSScanner scannerWithString:hexSequence];
-          unsigned value;
-          if ([scanner scanHexInt:&value] && 
-              value < USHRT_MAX &&
-              value > 0 
-              && [scanner scanLocation] == length - 4) {
-            unichar uchar = (unichar)value;
-            NSString *charString = [NSString stringWithCharacters:&uchar length:1];
-            [finalString replaceCharactersInRange:escapeRange withString:charString];
-          }
 
+    // a sequence must be longer than 3 (&lt;) and less than 11 (&thetasym;),
+    // and can't have another '&' in it.
+    NSUInteger end = i + 1;
+    NSUInteger limit = MIN(length, i + 10);
+    while (end < limit && buffer[end] != ';' && buffer[end] != '&') ++end;
+    uint32_t value = 0;
+    if (end < limit && buffer[end] == ';' && end - i > 2) {
+      const unichar *name = buffer + i + 1;
+      NSUInteger nameLength = end - i - 1;
+      if (name[0] == '#') {
+        if (name[1] == 'x' || name[1] == 'X') {
+          // Hex escape squences &#xa3;
+          value = CharacterReferenceValue(name + 2, nameLength - 2, YES);
         } else {
           // Decimal Sequences &#123;
-          NSString *numberSequence = [escapeString substringWithRange:NSMakeRange(2, length - 3)];
-          NSScanner *scanner = [NSScanner scannerWithString:numberSequence];
-          int value;
-          if ([scanner scanInt:&value] && 
-              value < USHRT_MAX &&
-              value > 0 
-              && [scanner scanLocation] == length - 3) {
-            unichar uchar = (unichar)value;
-            NSString *charString = [NSString stringWithCharacters:&uchar length:1];
-            [finalString replaceCharactersInRange:escapeRange withString:charString];
-          }
+          value = CharacterReferenceValue(name + 1, nameLength - 1, NO);
         }
+        // U+FFFF isn't a character.
+        if (value == 0xFFFF) value = 0;
       } else {
         // "standard" sequences
-        for (unsigned i = 0; i < sizeof(gAsciiHTMLEscapeMap) / sizeof(HTMLEscapeMap); ++i) {
-          if ([escapeString isEqualToString:gAsciiHTMLEscapeMap[i].escapeSequence]) {
-            [finalString replaceCharactersInRange:escapeRange withString:[NSString stringWithCharacters:&gAsciiHTMLEscapeMap[i].uchar length:1]];
-            break;
-          }
-        }
+        int entry = LookUpEntity(name, nameLength);
+        if (entry >= 0) value = gAsciiHTMLEscapeMap[entry].uchar;
       }
     }
-  } while ((subrange = [self rangeOfString:@"&" options:NSBackwardsSearch range:range]).length != 0);
-  return finalString;
+
+    if (!value) {
+      out[outLength++] = '&';
+      ++i;
+      continue;
+    }
+    if (value > 0xFFFF) {
+      // Outside the BMP, so a surrogate pair.
+      value -= 0x10000;
+      out[outLength++] = (unichar)(0xD800 + (value >> 10));
+      out[outLength++] = (unichar)(0xDC00 + (value & 0x3FF));
+    } else {
+      out[outLength++] = (unichar)value;
+    }
+    i = end + 1;
+  }
+  return [[[NSString alloc] initWithCharactersNoCopy:out
+                                              length:outLength
+                                        freeWhenDone:YES] autorelease];
 } // gtm_stringByUnescapingHTML
 
 
@@ -18,6 +18,7 @@
 
 #import "GTMSenTestCase.h"
 #import "GTMNSString+HTML.h"
+#import "GTMTestTimer.h"
 
 @interface GTMNSString_HTMLTest : GTMTestCase
 @end
@@ -133,6 +134,95 @@
                        @"HTML escaping failed");
 } // stringByEscapingAsciiHTML
 
+- (void)testEscapingLongStrings {
+  // Characters to escape at every position relative to the chunks that are
+  // checked together.
+  NSString *plain = @"The quick brown fox jumps over the lazy dog again";
+  STAssertEqualObjects([plain gtm_stringByEscapingForHTML], plain, nil);
+  STAssertEqualObjects([plain gtm_stringByEscapingForAsciiHTML], plain, nil);
+  unichar specials[] = { '<', 233, 8364, '&' };
+  NSString *htmlEscapes[] = { @"&lt;", nil, @"&euro;", @"&amp;" };
+  NSString *asciiEscapes[] = { @"&lt;", @"&eacute;", @"&euro;", @"&amp;" };
+  for (size_t s = 0; s < sizeof(specials) / sizeof(specials[0]); ++s) {
+    NSString *special = [NSString stringWithCharacters:&specials[s] length:1];
+    for (NSUInteger i = 0; i < [plain length]; ++i) {
+      NSMutableString *string = [NSMutableString stringWithString:plain];
+      [string replaceCharactersInRange:NSMakeRange(i, 1) withString:special];
+      NSMutableString *expected =
+          [NSMutableString stringWithString:plain];
+      [expected replaceCharactersInRange:NSMakeRange(i, 1)
+                              withString:htmlEscapes[s] ? htmlEscapes[s]
+                                                        : special];
+      STAssertEqualObjects([string gtm_stringByEscapingForHTML], expected,
+                           @"%@ at %lu", special, (unsigned long)i);
+      [expected setString:plain];
+      [expected replaceCharactersInRange:NSMakeRange(i, 1)
+                              withString:asciiEscapes[s]];
+      STAssertEqualObjects([string gtm_stringByEscapingForAsciiHTML], expected,
+                           @"%@ at %lu", special, (unsigned long)i);
+    }
+  }
+
+  // Numeric escapes of every length.
+  unichar numerics[] = { 128, 1000, 12345, 65535 };
+  NSString *string = [NSString stringWithCharacters:numerics length:4];
+  STAssertEqualObjects([string gtm_stringByEscapingForAsciiHTML],
+                       @"&#128;&#1000;&#12345;&#65535;", nil);
+  STAssertEqualObjects([string gtm_stringByEscapingForHTML], string, nil);
+}
+
+// A page that is mostly ASCII markup and text, with the odd entity and
+// accented character, as most real pages are.
+static NSString *SamplePage(NSUInteger paragraphs) {
+  NSMutableString *page = [NSMutableString stringWithString:
+      @"<html><head><title>Sample</title></head><body>\n"];
+  NSString *words[] = {
+    @"the", @"quick", @"brown", @"fox", @"jumps", @"over", @"lazy", @"dog",
+    @"caf\u00e9", @"na\u00efve", @"AT&T", @"\"quoted\"", @"it's", @"x<y",
+    @"\u2014", @"\u20ac10", @"search", @"results", @"for", @"your", @"query"
+  };
+  const NSUInteger wordCount = sizeof(words) / sizeof(words[0]);
+  uint32_t seed = 42;
+  for (NSUInteger p = 0; p < paragraphs; ++p) {
+    [page appendString:@"<p class=\"result\">"];
+    for (NSUInteger w = 0; w < 60; ++w) {
+      seed = seed * 1103515245 + 12345;
+      // Plain words (the first eight) come up most of the time.
+      NSUInteger index = (seed >> 16) % 64;
+      if (index >= wordCount) index %= 8;
+      [page appendString:words[index]];
+      [page appendString:@" "];
+    }
+    [page appendString:@"</p>\n"];
+  }
+  [page appendString:@"</body></html>\n"];
+  return page;
+}
+
+// Reports escaping rates for a typical page.
+- (void)testEscapingThroughput {
+  NSString *page = SamplePage(2000);
+  double megabytes = [page length] * sizeof(unichar) / (1024.0 * 1024.0);
+  for (int ascii = 0; ascii < 2; ++ascii) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    GTMTestTimer *timer = GTMTestTimerCreate();
+    NSString *escaped = nil;
+    for (int i = 0; i < 10; ++i) {
+      GTMTestTimerStart(timer);
+      escaped = ascii ? [page gtm_stringByEscapingForAsciiHTML]
+                      : [page gtm_stringByEscapingForHTML];
+      GTMTestTimerStop(timer);
+    }
+    STAssertGreaterThan([escaped length], [page length], nil);
+    STAssertEquals([escaped rangeOfString:@"<"].location,
+                   (NSUInteger)NSNotFound, nil);
+    NSLog(@"%@: %.1fMB/s", ascii ? @"ascii HTML" : @"HTML",
+          10 * megabytes / GTMTestTimerGetSeconds(timer));
+    GTMTestTimerRelease(timer);
+    [pool release];
+  }
+}
+
 - (void)testStringByUnescapingHTML {
   NSString *string1 = 
   @"&quot;&amp;&apos;&lt;&gt;&nbsp;&iexcl;&cent;&pound;&curren;&yen;"
@@ -229,6 +319,67 @@
   
 } // testStringByUnescapingHTML
 
+- (void)testUnescapingBeyondBMP {
+  unichar grin[] = { 0xD83D, 0xDE00 };
+  NSString *grinString = [NSString stringWithCharacters:grin length:2];
+  STAssertEqualObjects([@"&#x1F600;" gtm_stringByUnescapingFromHTML],
+                       grinString, nil);
+  STAssertEqualObjects([@"&#128512;" gtm_stringByUnescapingFromHTML],
+                       grinString, nil);
+  unichar last[] = { 0xDBFF, 0xDFFF };
+  STAssertEqualObjects([@"a&#x10FFFF;b" gtm_stringByUnescapingFromHTML],
+                       ([NSString stringWithFormat:@"a%@b",
+                         [NSString stringWithCharacters:last length:2]]),
+                       nil);
+  // Past the end of Unicode, and not a character.
+  STAssertEqualObjects([@"&#x110000;" gtm_stringByUnescapingFromHTML],
+                       @"&#x110000;", nil);
+  STAssertEqualObjects([@"&#1114112;" gtm_stringByUnescapingFromHTML],
+                       @"&#1114112;", nil);
+  STAssertEqualObjects([@"&#xFFFF;&#0;&#x;" gtm_stringByUnescapingFromHTML],
+                       @"&#xFFFF;&#0;&#x;", nil);
+  // Sequences aren't unescaped twice.
+  STAssertEqualObjects([@"&amp;lt;&&amp;" gtm_stringByUnescapingFromHTML],
+                       @"&lt;&&", nil);
+}
+
+- (void)testUnescapingEverything {
+  // Every character (bar the surrogates and U+FFFF) survives being escaped
+  // and unescaped, which covers every named entity.
+  NSMutableString *string = [NSMutableString string];
+  for (unichar uchar = 1; uchar < 0xFFFF; ++uchar) {
+    if (uchar >= 0xD800 && uchar <= 0xDFFF) continue;
+    [string appendFormat:@"%C", uchar];
+  }
+  STAssertEqualObjects([[string gtm_stringByEscapingForAsciiHTML]
+                         gtm_stringByUnescapingFromHTML], string, nil);
+  STAssertEqualObjects([[string gtm_stringByEscapingForHTML]
+                         gtm_stringByUnescapingFromHTML], string, nil);
+}
+
+// Reports the unescaping rate for a page full of entities, at two sizes to
+// show the time is linear in the length.
+- (void)testUnescapingThroughput {
+  for (NSUInteger paragraphs = 500; paragraphs <= 2000; paragraphs *= 4) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSString *page = SamplePage(paragraphs);
+    NSString *escaped = [page gtm_stringByEscapingForAsciiHTML];
+    double megabytes = [escaped length] * sizeof(unichar) / (1024.0 * 1024.0);
+    GTMTestTimer *timer = GTMTestTimerCreate();
+    NSString *unescaped = nil;
+    for (int i = 0; i < 10; ++i) {
+      GTMTestTimerStart(timer);
+      unescaped = [escaped gtm_stringByUnescapingFromHTML];
+      GTMTestTimerStop(timer);
+    }
+    STAssertEqualObjects(unescaped, page, nil);
+    NSLog(@"Unescaping %.1fMB: %.1fMB/s", megabytes,
+          10 * megabytes / GTMTestTimerGetSeconds(timer));
+    GTMTestTimerRelease(timer);
+    [pool release];
+  }
+}
+
 - (void)testStringRoundtrippingEscapedHTML {
   NSString *string = [NSString stringWithUTF8String:"This test ©™®๒०᠐٧"];
   STAssertEqualObjects(string,
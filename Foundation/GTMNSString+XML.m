@@ -19,6 +19,10 @@
 #import "GTMDefines.h"
 #import "GTMNSString+XML.h"
 
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#endif
+
 enum {
   kGTMXMLCharModeEncodeQUOT  = 0,
   kGTMXMLCharModeEncodeAMP   = 1,
@@ -30,13 +34,16 @@ enum {
 };
 typedef NSUInteger GTMXMLCharMode;
 
-static NSString *gXMLEntityList[] = {
+static const struct {
+  const char *entity;
+  NSUInteger length;
+} gXMLEntityList[] = {
   // this must match the above order
-  @"&quot;",
-  @"&amp;",
-  @"&apos;",
-  @"&lt;",
-  @"&gt;",
+  { "&quot;", 6 },
+  { "&amp;", 5 },
+  { "&apos;", 6 },
+  { "&lt;", 4 },
+  { "&gt;", 4 },
 };
 
 GTM_INLINE GTMXMLCharMode XMLModeForUnichar(UniChar c) {
@@ -90,6 +97,153 @@ GTM_INLINE GTMXMLCharMode XMLModeForUnichar(UniChar c) {
 } // XMLModeForUnichar
 
 
+// Strings up to this long are checked from the stack rather than a heap copy
+// when they don't hand over their characters.
+#define kStackBufferLength 256
+
+// Returns the index of the first character from |i| on that has to be
+// removed, or escaped if |escaping| (or |length| if there isn't one).
+static NSUInteger SkipCleanXMLCharacters(const UniChar *buffer, NSUInteger i,
+                                         NSUInteger length, BOOL escaping) {
+#if defined(__SSE2__)
+  // There are no unsigned 16 bit compares, so flip the top bit and use the
+  // signed ones.
+  const __m128i flip = _mm_set1_epi16((short)0x8000);
+  const __m128i lowMin = _mm_set1_epi16((short)(0x0020 ^ 0x8000) - 1);
+  const __m128i lowMax = _mm_set1_epi16((short)(0xD7FF ^ 0x8000) + 1);
+  const __m128i highMin = _mm_set1_epi16((short)(0xE000 ^ 0x8000) - 1);
+  const __m128i highMax = _mm_set1_epi16((short)(0xFFFD ^ 0x8000) + 1);
+  const __m128i tab = _mm_set1_epi16('\t');
+  const __m128i newline = _mm_set1_epi16('\n');
+  const __m128i ret = _mm_set1_epi16('\r');
+  const __m128i quot = _mm_set1_epi16('"');
+  const __m128i amp = _mm_set1_epi16('&');
+  const __m128i apos = _mm_set1_epi16('\'');
+  const __m128i lt = _mm_set1_epi16('<');
+  const __m128i gt = _mm_set1_epi16('>');
+  for (; length - i >= 8; i += 8) {
+    __m128i chars = _mm_loadu_si128((const __m128i *)(buffer + i));
+    __m128i flipped = _mm_xor_si128(chars, flip);
+    __m128i valid =
+        _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi16(flipped, lowMin),
+                                       _mm_cmplt_epi16(flipped, lowMax)),
+                         _mm_and_si128(_mm_cmpgt_epi16(flipped, highMin),
+                                       _mm_cmplt_epi16(flipped, highMax))),
+            _mm_or_si128(_mm_cmpeq_epi16(chars, tab),
+                         _mm_or_si128(_mm_cmpeq_epi16(chars, newline),
+                                      _mm_cmpeq_epi16(chars, ret))));
+    if (escaping) {
+      __m128i special =
+          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(chars, quot),
+                                    _mm_cmpeq_epi16(chars, amp)),
+                       _mm_or_si128(_mm_cmpeq_epi16(chars, apos),
+                                    _mm_or_si128(_mm_cmpeq_epi16(chars, lt),
+                                                 _mm_cmpeq_epi16(chars, gt))));
+      valid = _mm_andnot_si128(special, valid);
+    }
+    int mask = ~_mm_movemask_epi8(valid) & 0xFFFF;
+    if (mask) return i + (NSUInteger)__builtin_ctz((unsigned int)mask) / 2;
+  }
+#endif  // __SSE2__
+  for (; i < length; ++i) {
+    GTMXMLCharMode cMode = XMLModeForUnichar(buffer[i]);
+    if (cMode == kGTMXMLCharModeInvalid ||
+        (escaping && cMode != kGTMXMLCharModeValid)) {
+      break;
+    }
+  }
+  return i;
+}
+
+// The same for 8 bit ASCII strings, but only answering whether there is
+// anything to do at all.
+static BOOL IsCleanXMLASCII(const char *buffer, NSUInteger length,
+                            BOOL escaping) {
+  NSUInteger i = 0;
+#if defined(__SSE2__)
+  // Anything with the top bit set compares as negative, so fails too.
+  const __m128i min = _mm_set1_epi8(0x20 - 1);
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i ret = _mm_set1_epi8('\r');
+  const __m128i quot = _mm_set1_epi8('"');
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i apos = _mm_set1_epi8('\'');
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i gt = _mm_set1_epi8('>');
+  for (; length - i >= 16; i += 16) {
+    __m128i chars = _mm_loadu_si128((const __m128i *)(buffer + i));
+    __m128i valid =
+        _mm_or_si128(_mm_cmpgt_epi8(chars, min),
+                     _mm_or_si128(_mm_cmpeq_epi8(chars, tab),
+                                  _mm_or_si128(_mm_cmpeq_epi8(chars, newline),
+                                               _mm_cmpeq_epi8(chars, ret))));
+    if (escaping) {
+      __m128i special =
+          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars, quot),
+                                    _mm_cmpeq_epi8(chars, amp)),
+                       _mm_or_si128(_mm_cmpeq_epi8(chars, apos),
+                                    _mm_or_si128(_mm_cmpeq_epi8(chars, lt),
+                                                 _mm_cmpeq_epi8(chars, gt))));
+      valid = _mm_andnot_si128(special, valid);
+    }
+    if (_mm_movemask_epi8(valid) != 0xFFFF) return NO;
+  }
+#endif  // __SSE2__
+  for (; i < length; ++i) {
+    unsigned char c = (unsigned char)buffer[i];
+    if (c > 127) return NO;
+    GTMXMLCharMode cMode = XMLModeForUnichar(c);
+    if (cMode == kGTMXMLCharModeInvalid ||
+        (escaping && cMode != kGTMXMLCharModeValid)) {
+      return NO;
+    }
+  }
+  return YES;
+}
+
+// Copies |length| characters to |out|, dropping invalid ones and (if
+// |escaping|) escaping entities, and returns how many characters that took.
+// With a NULL |out| it just counts them.
+static NSUInteger CloneCharactersForXML(const UniChar *buffer,
+                                        NSUInteger length, BOOL escaping,
+                                        UniChar *out) {
+  NSUInteger outLength = 0;
+  NSUInteger i = 0;
+  while (i < length) {
+    NSUInteger goodRunEnd = SkipCleanXMLCharacters(buffer, i, length,
+                                                   escaping);
+    if (out && goodRunEnd > i) {
+      memcpy(out + outLength, buffer + i, (goodRunEnd - i) * sizeof(UniChar));
+    }
+    outLength += goodRunEnd - i;
+    i = goodRunEnd;
+    if (i == length) break;
+
+    GTMXMLCharMode cMode = XMLModeForUnichar(buffer[i]);
+    if (cMode == kGTMXMLCharModeInvalid) {
+      // dropped
+    } else if (escaping) {
+      const char *entity = gXMLEntityList[cMode].entity;
+      NSUInteger entityLength = gXMLEntityList[cMode].length;
+      if (out) {
+        for (NSUInteger e = 0; e < entityLength; ++e) {
+          out[outLength + e] = (UniChar)entity[e];
+        }
+      }
+      outLength += entityLength;
+    } else {
+      // COV_NF_START - SkipCleanXMLCharacters keeps these when not escaping.
+      if (out) out[outLength] = buffer[i];
+      outLength += 1;
+      // COV_NF_END
+    }
+    ++i;
+  }
+  return outLength;
+}
+
 static NSString *AutoreleasedCloneForXML(NSString *src, BOOL escaping) {
   //
   // NOTE:
@@ -105,12 +259,24 @@ static NSString *AutoreleasedCloneForXML(NSString *src, BOOL escaping) {
   if (!length) {
     return src;
   }
-  
-  NSMutableString *finalString = [NSMutableString string];
+
+  // Most strings need nothing done, and in that case the copy is just the
+  // receiver unless it's mutable.  8 bit strings can be checked as they are.
+  const char *ascii = CFStringGetCStringPtr((CFStringRef)src,
+                                            kCFStringEncodingASCII);
+  if (ascii && IsCleanXMLASCII(ascii, length, escaping)) {
+    return [[src copy] autorelease];
+  }
 
   // this block is common between GTMNSString+HTML and GTMNSString+XML but
   // it's so short that it isn't really worth trying to share.
+  UniChar stackBuffer[kStackBufferLength];
   const UniChar *buffer = CFStringGetCharactersPtr((CFStringRef)src);
+  if (!buffer && length <= kStackBufferLength) {
+    CFStringGetCharacters((CFStringRef)src, CFRangeMake(0, (CFIndex)length),
+                          stackBuffer);
+    buffer = stackBuffer;
+  }
   if (!buffer) {
     // We want this buffer to be autoreleased.
     NSMutableData *data = [NSMutableData dataWithLength:length * sizeof(UniChar)];
@@ -123,49 +289,32 @@ static NSString *AutoreleasedCloneForXML(NSString *src, BOOL escaping) {
     [src getCharacters:[data mutableBytes]];
     buffer = [data bytes];
   }
-  
-  const UniChar *goodRun = buffer;
-  NSUInteger goodRunLength = 0;
-  
-  for (NSUInteger i = 0; i < length; ++i) {
-    
-    GTMXMLCharMode cMode = XMLModeForUnichar(buffer[i]);
-    
-    // valid chars go as is, and if we aren't doing entities, then
-    // everything goes as is.
-    if ((cMode == kGTMXMLCharModeValid) ||
-        (!escaping && (cMode != kGTMXMLCharModeInvalid))) {
-      // goes as is
-      goodRunLength += 1;
-    } else {
-      // it's something we have to encode or something invalid
-      
-      // start by adding what we already collected (if anything)
-      if (goodRunLength) {
-        CFStringAppendCharacters((CFMutableStringRef)finalString, 
-                                 goodRun, 
-                                 goodRunLength);
-        goodRunLength = 0;
-      }
-      
-      // if it wasn't invalid, add the encoded version
-      if (cMode != kGTMXMLCharModeInvalid) {
-        // add this encoded
-        [finalString appendString:gXMLEntityList[cMode]];
-      }
-      
-      // update goodRun to point to the next UniChar
-      goodRun = buffer + i + 1;
-    }
+
+  NSUInteger goodRunLength = SkipCleanXMLCharacters(buffer, 0, length,
+                                                    escaping);
+  if (goodRunLength == length) {
+    return [[src copy] autorelease];
   }
-  
-  // anything left to add?
-  if (goodRunLength) {
-    CFStringAppendCharacters((CFMutableStringRef)finalString, 
-                             goodRun, 
-                             goodRunLength);
+
+  // Count, then fill a buffer of exactly the right size.
+  NSUInteger outLength =
+      goodRunLength + CloneCharactersForXML(buffer + goodRunLength,
+                                            length - goodRunLength,
+                                            escaping, NULL);
+  // Never zero, so the NoCopy below always has something to own.
+  UniChar *out = malloc((outLength + 1) * sizeof(UniChar));
+  if (!out) {
+    // COV_NF_START
+    _GTMDevLog(@"Unable to allocate buffer");
+    return nil;
+    // COV_NF_END
   }
-  return finalString;
+  memcpy(out, buffer, goodRunLength * sizeof(UniChar));
+  CloneCharactersForXML(buffer + goodRunLength, length - goodRunLength,
+                        escaping, out + goodRunLength);
+  return [[[NSString alloc] initWithCharactersNoCopy:out
+                                              length:outLength
+                                        freeWhenDone:YES] autorelease];
 } // AutoreleasedCloneForXML
 
 @implementation NSString (GTMNSStringXMLAdditions)
@@ -19,6 +19,7 @@
 
 #import "GTMSenTestCase.h"
 #import "GTMNSString+XML.h"
+#import "GTMTestTimer.h"
 
 
 @interface GTMNSString_XMLTest : GTMTestCase
@@ -90,4 +91,88 @@
   STAssertEqualObjects([@"" gtm_stringBySanitizingToXMLSpec], @"", nil);
 }
 
+- (void)testCleanStrings {
+  // Nothing to do means no new string, unless the receiver is mutable.
+  NSString *clean = @"Nothing to see here\n\tat all";
+  STAssertTrue([clean gtm_stringBySanitizingAndEscapingForXML] == clean, nil);
+  STAssertTrue([clean gtm_stringBySanitizingToXMLSpec] == clean, nil);
+  UniChar wide[] = { 'a', 0x00e9, 0x4e2d, 0xd7ff, 0xe000, 0xfffd, '\r' };
+  NSString *wideString =
+      [NSString stringWithCharacters:wide
+                              length:sizeof(wide) / sizeof(UniChar)];
+  STAssertTrue([wideString gtm_stringBySanitizingAndEscapingForXML]
+               == wideString, nil);
+  NSMutableString *mutable = [NSMutableString stringWithString:clean];
+  NSString *result = [mutable gtm_stringBySanitizingAndEscapingForXML];
+  STAssertEqualObjects(result, clean, nil);
+  [mutable appendString:@"<"];
+  STAssertEqualObjects(result, clean, nil);
+}
+
+- (void)testLongStrings {
+  // Something to do at every position relative to the chunks that are checked
+  // together, in both 8 and 16 bit strings.
+  NSString *plain = @"The quick brown fox jumps over the lazy dog again";
+  UniChar specials[] = { '<', 1, 0xfffe, 0xe9 };
+  NSString *escaped[] = { @"&lt;", @"", @"", @"\u00e9" };
+  NSString *sanitized[] = { @"<", @"", @"", @"\u00e9" };
+  for (size_t s = 0; s < sizeof(specials) / sizeof(specials[0]); ++s) {
+    NSString *special = [NSString stringWithCharacters:&specials[s] length:1];
+    for (NSUInteger i = 0; i < [plain length]; ++i) {
+      NSMutableString *string = [NSMutableString stringWithString:plain];
+      [string replaceCharactersInRange:NSMakeRange(i, 1) withString:special];
+      NSMutableString *expected = [NSMutableString stringWithString:plain];
+      [expected replaceCharactersInRange:NSMakeRange(i, 1)
+                              withString:escaped[s]];
+      NSMutableString *expectedSanitized =
+          [NSMutableString stringWithString:plain];
+      [expectedSanitized replaceCharactersInRange:NSMakeRange(i, 1)
+                                       withString:sanitized[s]];
+
+      NSMutableArray *variants = [NSMutableArray arrayWithObject:string];
+      NSData *ascii = [string dataUsingEncoding:NSASCIIStringEncoding];
+      if (ascii) {
+        [variants addObject:
+         [[[NSString alloc] initWithData:ascii
+                                encoding:NSASCIIStringEncoding] autorelease]];
+      }
+      for (NSUInteger v = 0; v < [variants count]; ++v) {
+        NSString *variant = [variants objectAtIndex:v];
+        STAssertEqualObjects([variant gtm_stringBySanitizingAndEscapingForXML],
+                             expected, @"%lu at %lu", (unsigned long)s,
+                             (unsigned long)i);
+        STAssertEqualObjects([variant gtm_stringBySanitizingToXMLSpec],
+                             expectedSanitized, @"%lu at %lu",
+                             (unsigned long)s, (unsigned long)i);
+      }
+    }
+  }
+}
+
+// Reports the rate for lots of short strings, which is the usual case.
+- (void)testThroughput {
+  NSArray *strings =
+      [NSArray arrayWithObjects:
+       @"user@example.com", @"Mountain View", @"A short description",
+       @"1600 Amphitheatre Parkway", @"en-US", @"Tom & Jerry", nil];
+  const int kRepeats = 100000;
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  GTMTestTimer *timer = GTMTestTimerCreate();
+  GTMTestTimerStart(timer);
+  for (int i = 0; i < kRepeats; ++i) {
+    for (NSUInteger j = 0; j < [strings count]; ++j) {
+      [[strings objectAtIndex:j] gtm_stringBySanitizingAndEscapingForXML];
+    }
+    if (i % 1000 == 0) {
+      [pool release];
+      pool = [[NSAutoreleasePool alloc] init];
+    }
+  }
+  GTMTestTimerStop(timer);
+  [pool release];
+  NSLog(@"Escaping short strings for XML: %.0f ns each",
+        GTMTestTimerGetNanoseconds(timer) / (kRepeats * [strings count]));
+  GTMTestTimerRelease(timer);
+}
+
 @end
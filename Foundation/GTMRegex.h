@@ -74,6 +74,17 @@ enum {
 _EXTERN NSString* kGTMRegexPatternErrorPattern _INITIALIZE_AS(@"pattern");
 _EXTERN NSString* kGTMRegexPatternErrorErrorString _INITIALIZE_AS(@"patternError");
 
+@class GTMRegexStringSegment;
+
+#if NS_BLOCKS_AVAILABLE
+/// Block called for each segment by -enumerateSegmentsInString:usingBlock: and -enumerateMatchSegmentsInString:usingBlock:
+//
+// Set |*stop| to YES to end the enumeration early.
+//
+typedef void (^GTMRegexSegmentBlock)(GTMRegexStringSegment *segment,
+                                     BOOL *stop);
+#endif  // NS_BLOCKS_AVAILABLE
+
 /// Class for doing Extended Regex operations w/ libregex (see re_format(7)).
 //
 // NOTE: the docs for recomp/regexec make *no* claims about i18n.  All work
@@ -143,6 +154,12 @@ _EXTERN NSString* kGTMRegexPatternErrorErrorString _INITIALIZE_AS(@"patternError
               options:(GTMRegexOptions)options
             withError:(NSError **)outErrorOrNULL;
 
+/// Returns the pattern the regex was created with
+- (NSString *)pattern;
+
+/// Returns the options the regex was created with
+- (GTMRegexOptions)options;
+
 /// Returns the number of sub patterns in the pattern
 //
 // Sub Patterns are basically the number of parenthesis blocks w/in the pattern.
@@ -178,6 +195,13 @@ _EXTERN NSString* kGTMRegexPatternErrorErrorString _INITIALIZE_AS(@"patternError
 /// Returns YES if this pattern some substring of |str|.
 - (BOOL)matchesSubStringInString:(NSString *)str;
 
+/// Returns the number of matches -matchSegmentEnumeratorForString: would return for |str|.
+//
+// This walks the matches w/o creating any segments or substrings.  An empty
+// match counts, and the search picks up again after the next character.
+//
+- (NSUInteger)numberOfMatchesInString:(NSString *)str;
+
 /// Returns a new, autoreleased enumerator that will walk segments (GTMRegexStringSegment) of |str| based on the pattern.
 //
 // This will split the string into "segments" using the given pattern.  You get
@@ -197,6 +221,30 @@ _EXTERN NSString* kGTMRegexPatternErrorErrorString _INITIALIZE_AS(@"patternError
 //
 - (NSEnumerator *)matchSegmentEnumeratorForString:(NSString *)str;
 
+#if NS_BLOCKS_AVAILABLE
+/// Calls |block| w/ each segment of |str|, the same ones -segmentEnumeratorForString: returns.
+//
+// Unlike the enumerators, this doesn't create an object or allocate memory
+// for each segment.  The same GTMRegexStringSegment is handed to every call,
+// updated for the segment at hand, so it is only good until |block| returns;
+// -range, -utf8Range and their sub pattern versions are the cheap way to
+// find where things are, and strings are only made if you ask for them.
+//
+// If the pattern matches an empty string, that empty match is handed to the
+// block and the search picks up again after the next character (the
+// enumerators don't support patterns like that).
+//
+- (void)enumerateSegmentsInString:(NSString *)str
+                       usingBlock:(GTMRegexSegmentBlock)block;
+
+/// Calls |block| w/ each matching segment of |str|, the same ones -matchSegmentEnumeratorForString: returns.
+//
+// See -enumerateSegmentsInString:usingBlock: for the details.
+//
+- (void)enumerateMatchSegmentsInString:(NSString *)str
+                            usingBlock:(GTMRegexSegmentBlock)block;
+#endif  // NS_BLOCKS_AVAILABLE
+
 /// Returns a new, autoreleased string with all matches of the pattern in |str| replaced with |replacementPattern|.
 //
 // Replacement uses the SED substitution like syntax w/in |replacementPattern|
@@ -213,6 +261,47 @@ _EXTERN NSString* kGTMRegexPatternErrorErrorString _INITIALIZE_AS(@"patternError
 
 @end
 
+/// Process wide cache of compiled patterns
+//
+// The NSString (GTMRegexAdditions) methods take their GTMRegex from here, so
+// calling them over and over w/ the same few patterns only pays for regcomp
+// once per pattern.  The cache holds the most recently used patterns (keyed by
+// pattern and options), dropping the least recently used one when it is full.
+// It is safe to use from any thread; a GTMRegex doesn't change once it is
+// created, so one instance can be used by several threads at the same time.
+//
+@interface GTMRegex (GTMRegexPatternCache)
+
+/// Returns an autoreleased GTMRegex for |pattern| and |options|, from the cache if it is there
+//
+// Returns nil (and logs, as +regexWithPattern: does) if the pattern is bad;
+// bad patterns aren't cached.  When the cache is disabled this is the same as
+// +regexWithPattern:options:.
+//
++ (id)cachedRegexWithPattern:(NSString *)pattern
+                     options:(GTMRegexOptions)options;
+
+/// The most patterns the cache will hold (defaults to 32)
+//
+// Setting it to zero empties and disables the cache.  Lowering it drops the
+// least recently used patterns (and counts them as evictions).
+//
++ (NSUInteger)patternCacheLimit;
++ (void)setPatternCacheLimit:(NSUInteger)limit;
+
+/// Counters for how the cache is doing
+//
+// Hits and misses are only counted while the cache is enabled.
+//
++ (uint64_t)patternCacheHitCount;
++ (uint64_t)patternCacheMissCount;
++ (uint64_t)patternCacheEvictionCount;
+
+/// Empties the cache and zeroes the counters (mainly for tests)
++ (void)resetPatternCache;
+
+@end
+
 /// Class returned by the nextObject for the enumerators from GTMRegex
 //
 // The two enumerators on from GTMRegex return objects of this type.  This object
@@ -262,9 +351,19 @@ _EXTERN NSString* kGTMRegexPatternErrorErrorString _INITIALIZE_AS(@"patternError
 //   // and all the versons of foobaz in italics tags.
 //   //   ie: " fooobar foobaaz " ==> " <b>fooobar</b> <i>foobaaz</i> "
 //
+// If you only need to know where the matches are, use -range (or -utf8Range)
+// instead of -string, they don't create any strings.  The UTF-16 ranges are
+// worked out from the UTF-8 ones the regex library gives back using an index
+// that is shared by all the segments from one enumerator, and is only built as
+// far into the string as the ranges asked for.  Like the enumerator, the
+// segments from one enumerator shouldn't be used from several threads at once.
+//
+@class GTMRegexOffsetIndex;
+
 @interface GTMRegexStringSegment : NSObject {
  @private
   NSData *utf8StrBuf_;
+  GTMRegexOffsetIndex *offsetIndex_;
   regmatch_t *regMatches_;  // STRONG: ie-we call free
   NSUInteger numRegMatches_;
   BOOL isMatch_;
@@ -298,6 +397,23 @@ _EXTERN NSString* kGTMRegexPatternErrorErrorString _INITIALIZE_AS(@"patternError
 //
 - (NSString *)subPatternString:(NSUInteger)index;
 
+/// Returns the range of the full text segment in the original string.
+- (NSRange)range;
+
+/// Returns the range of the |index| sub pattern in the original string.
+//
+// Sub pattern indexes work as they do for -subPatternString:.  If the sub
+// pattern didn't match (or |index| is out of range), the location is
+// NSNotFound.
+//
+- (NSRange)rangeOfSubPattern:(NSUInteger)index;
+
+/// Returns the range of the full text segment in the UTF-8 bytes of the original string.
+- (NSRange)utf8Range;
+
+/// Returns the range of the |index| sub pattern in the UTF-8 bytes of the original string (location NSNotFound if it didn't match).
+- (NSRange)utf8RangeOfSubPattern:(NSUInteger)index;
+
 @end
 
 /// Some helpers to streamline usage of GTMRegex
@@ -331,6 +447,9 @@ _EXTERN NSString* kGTMRegexPatternErrorErrorString _INITIALIZE_AS(@"patternError
 //                                    withReplacement:@"<i>\\1</i><b>\\2</b>"];
 //   ....
 //
+// The patterns come from +[GTMRegex cachedRegexWithPattern:options:], so
+// repeated calls w/ the same pattern don't recompile it.
+//
 @interface NSString (GTMRegexAdditions)
 
 /// Returns YES if the full string matches regex |pattern| using the default match options
@@ -348,6 +467,9 @@ _EXTERN NSString* kGTMRegexPatternErrorErrorString _INITIALIZE_AS(@"patternError
 /// Returns YES if a substring string matches regex |pattern| using the default match options
 - (BOOL)gtm_subStringMatchesPattern:(NSString *)pattern;
 
+/// Returns the number of substrings in the string that match the regex |pattern| using the default match options
+- (NSUInteger)gtm_numberOfMatchesOfPattern:(NSString *)pattern;
+
 /// Returns a new, autoreleased array of substrings in the string that match the regex |pattern| using the default match options
 //
 // Note: if the string has no matches, you get an empty array.
@@ -19,6 +19,7 @@
 #define GTMREGEX_DEFINE_GLOBALS 1
 #import "GTMRegex.h"
 #import "GTMDefines.h"
+#import <pthread.h>
 
 // This is the pattern to use for walking replacement text when doing
 // substitutions.
@@ -31,12 +32,155 @@ static NSString *const kReplacementPattern =
 #define kReplacementPatternLeadingTextIndex       1
 #define kReplacementPatternSubpatternNumberIndex  5
 
+// kReplacementPattern is compiled once, the first time it is needed.
+static GTMRegex *gReplacementRegex = nil;
+static pthread_once_t gReplacementRegexOnce = PTHREAD_ONCE_INIT;
+
+static void CreateReplacementRegex(void) {
+  // don't need newline support, just match the start of the pattern for '^'
+  gReplacementRegex =
+    [[GTMRegex alloc] initWithPattern:kReplacementPattern
+                              options:kGTMRegexOptionSupressNewlineSupport];
+}
+
+// An entry in the pattern cache.  The entries are kept in a set (to look them
+// up by pattern and options) and in a list from most to least recently used.
+// Like GTMLoggerRingBufferWriter, these use CF types so the objects can be
+// CFRetained, otherwise the GC wouldn't know that the entries hold them.
+typedef struct GTMRegexCacheEntry {
+  CFStringRef pattern_;
+  GTMRegexOptions options_;
+  CFTypeRef regex_;
+  struct GTMRegexCacheEntry *newer_;
+  struct GTMRegexCacheEntry *older_;
+} GTMRegexCacheEntry;
+
+// Everything about the cache is guarded by gPatternCacheLock.
+static pthread_mutex_t gPatternCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static CFMutableSetRef gPatternCacheEntries = NULL;
+static GTMRegexCacheEntry *gPatternCacheNewest = NULL;
+static GTMRegexCacheEntry *gPatternCacheOldest = NULL;
+static NSUInteger gPatternCacheLimit = 32;
+static uint64_t gPatternCacheHits = 0;
+static uint64_t gPatternCacheMisses = 0;
+static uint64_t gPatternCacheEvictions = 0;
+
+static CFHashCode PatternCacheEntryHash(const void *value) {
+  const GTMRegexCacheEntry *entry = value;
+  return CFHash(entry->pattern_) ^ (CFHashCode)entry->options_;
+}
+
+static Boolean PatternCacheEntryEqual(const void *value1, const void *value2) {
+  const GTMRegexCacheEntry *entry1 = value1;
+  const GTMRegexCacheEntry *entry2 = value2;
+  return (entry1->options_ == entry2->options_) &&
+    CFEqual(entry1->pattern_, entry2->pattern_);
+}
+
+static void UnlinkPatternCacheEntry(GTMRegexCacheEntry *entry) {
+  if (entry->newer_) {
+    entry->newer_->older_ = entry->older_;
+  } else {
+    gPatternCacheNewest = entry->older_;
+  }
+  if (entry->older_) {
+    entry->older_->newer_ = entry->newer_;
+  } else {
+    gPatternCacheOldest = entry->newer_;
+  }
+  entry->newer_ = entry->older_ = NULL;
+}
+
+static void LinkPatternCacheEntryAsNewest(GTMRegexCacheEntry *entry) {
+  entry->older_ = gPatternCacheNewest;
+  entry->newer_ = NULL;
+  if (gPatternCacheNewest) {
+    gPatternCacheNewest->newer_ = entry;
+  } else {
+    gPatternCacheOldest = entry;
+  }
+  gPatternCacheNewest = entry;
+}
+
+static void RemovePatternCacheEntry(GTMRegexCacheEntry *entry) {
+  CFSetRemoveValue(gPatternCacheEntries, entry);
+  UnlinkPatternCacheEntry(entry);
+  CFRelease(entry->pattern_);
+  CFRelease(entry->regex_);
+  free(entry);
+}
+
+// Drops the least recently used entries until there are at most |limit|.
+static void TrimPatternCache(NSUInteger limit, BOOL countEvictions) {
+  if (!gPatternCacheEntries) return;
+  while ((NSUInteger)CFSetGetCount(gPatternCacheEntries) > limit) {
+    RemovePatternCacheEntry(gPatternCacheOldest);
+    if (countEvictions) ++gPatternCacheEvictions;
+  }
+}
+
 @interface GTMRegex (PrivateMethods)
 - (NSString *)errorMessage:(int)errCode;
 - (BOOL)runRegexOnUTF8:(const char*)utf8Str
                 nmatch:(size_t)nmatch
                 pmatch:(regmatch_t *)pmatch
                  flags:(int)flags;
+#if NS_BLOCKS_AVAILABLE
+- (void)enumerateSegmentsInString:(NSString *)str
+                      allSegments:(BOOL)allSegments
+                       usingBlock:(GTMRegexSegmentBlock)block;
+#endif  // NS_BLOCKS_AVAILABLE
+@end
+
+// Returns where to look for the next match after |match|.  An empty match
+// would just be found again, so that steps over the next character.
+static regoff_t NextParseIndex(const char *utf8Str, regoff_t length,
+                               const regmatch_t *match) {
+  if (match->rm_eo > match->rm_so)
+    return match->rm_eo;
+  regoff_t index = match->rm_eo + 1;
+  while ((index < length) && ((utf8Str[index] & 0xC0) == 0x80)) {
+    ++index;
+  }
+  return index;
+}
+
+// Every kOffsetIndexCheckpointBytes bytes of UTF-8, GTMRegexOffsetIndex
+// remembers how many UTF-16 characters came before that point.
+#define kOffsetIndexCheckpointBytes 256
+
+// Counts the UTF-16 characters |length| bytes of UTF-8 make up.
+static NSUInteger CountUTF16Characters(const unsigned char *bytes,
+                                       NSUInteger length) {
+  NSUInteger count = 0;
+  for (NSUInteger x = 0; x < length; ++x) {
+    unsigned char ch = bytes[x];
+    // continuation bytes don't start a character, and the four byte sequences
+    // are outside the BMP so they take a surrogate pair.
+    if ((ch & 0xC0) != 0x80) {
+      count += (ch >= 0xF0) ? 2 : 1;
+    }
+  }
+  return count;
+}
+
+// private class to map offsets in the UTF-8 form of a string (what regexec
+// works in) to UTF-16 offsets (what NSString ranges use).  The UTF-16 offset
+// of every kOffsetIndexCheckpointBytes'th byte is saved the first time
+// something at or past it is looked up, so a lookup only counts the characters
+// since the checkpoint before it.
+@interface GTMRegexOffsetIndex : NSObject {
+ @private
+  NSData *utf8StrBuf_;
+  BOOL isASCII_;
+  __strong NSUInteger *checkpoints_;
+  NSUInteger numCheckpoints_;
+  NSUInteger checkpointCapacity_;
+}
+// |isASCII| says the offsets are the same in both (no work to do)
+- (id)initWithUTF8StrBuf:(NSData *)utf8StrBuf isASCII:(BOOL)isASCII;
+- (NSData *)utf8StrBuf;
+- (NSUInteger)utf16OffsetForUTF8Offset:(NSUInteger)offset;
 @end
 
 // private enumerator as impl detail
@@ -44,6 +188,7 @@ static NSString *const kReplacementPattern =
  @private
   GTMRegex *regex_;
   NSData *utf8StrBuf_;
+  GTMRegexOffsetIndex *offsetIndex_;
   BOOL allSegments_;
   BOOL treatStartOfNewSegmentAsBeginningOfString_;
   regoff_t curParseIndex_;
@@ -56,10 +201,13 @@ static NSString *const kReplacementPattern =
 @end
 
 @interface GTMRegexStringSegment (PrivateMethods)
-- (id)initWithUTF8StrBuf:(NSData *)utf8StrBuf
-              regMatches:(regmatch_t *)regMatches
-           numRegMatches:(NSUInteger)numRegMatches
-                 isMatch:(BOOL)isMatch;
+- (id)initWithOffsetIndex:(GTMRegexOffsetIndex *)offsetIndex
+               regMatches:(regmatch_t *)regMatches
+            numRegMatches:(NSUInteger)numRegMatches
+                  isMatch:(BOOL)isMatch;
+// for reusing a segment, see -enumerateSegmentsInString:allSegments:usingBlock:
+- (void)setRegMatches:(const regmatch_t *)regMatches isMatch:(BOOL)isMatch;
+- (void)setUnmatchedRangeFrom:(regoff_t)start to:(regoff_t)end;
 @end
 
 @implementation GTMRegex
@@ -201,13 +349,22 @@ static NSString *const kReplacementPattern =
   [super dealloc];
 }
 
+- (NSString *)pattern {
+  return pattern_;
+}
+
+- (GTMRegexOptions)options {
+  return options_;
+}
+
 - (NSUInteger)subPatternCount {
   return regexData_.re_nsub;
 }
 
 - (BOOL)matchesString:(NSString *)str {
   regmatch_t regMatch;
-  if (![self runRegexOnUTF8:[str UTF8String]
+  const char *utf8Str = [str UTF8String];
+  if (![self runRegexOnUTF8:utf8Str
                      nmatch:1
                      pmatch:&regMatch
                       flags:0]) {
@@ -215,9 +372,9 @@ static NSString *const kReplacementPattern =
     return NO;
   }
 
-  // make sure the match is the full string
-  return (regMatch.rm_so == 0) &&
-    (regMatch.rm_eo == (regoff_t)[str lengthOfBytesUsingEncoding:NSUTF8StringEncoding]);
+  // make sure the match is the full string (ending at the NUL means it got to
+  // the end, so there is no need to work out the UTF-8 length again)
+  return (regMatch.rm_so == 0) && (utf8Str[regMatch.rm_eo] == '\0');
 }
 
 - (NSArray *)subPatternsOfString:(NSString *)str {
@@ -241,7 +398,7 @@ static NSString *const kReplacementPattern =
 
     // make sure the match is the full string
     if ((regMatches[0].rm_so != 0) ||
-        (regMatches[0].rm_eo != (regoff_t)[str lengthOfBytesUsingEncoding:NSUTF8StringEncoding])) {
+        (utf8Str[regMatches[0].rm_eo] != '\0')) {
       // only matched a sub part of the string
       return nil;
     }
@@ -305,6 +462,35 @@ static NSString *const kReplacementPattern =
   return NO;
 }
 
+- (NSUInteger)numberOfMatchesInString:(NSString *)str {
+  const char *utf8Str = [str UTF8String];
+  if (!utf8Str)
+    return 0;
+
+  // walk the matches the same way GTMRegexEnumerator does, but w/ just the
+  // one regmatch_t and no segments.
+  regoff_t length = (regoff_t)strlen(utf8Str);
+  regoff_t curParseIndex = 0;
+  NSUInteger count = 0;
+  while (curParseIndex < length) {
+    regmatch_t regMatch;
+    regMatch.rm_so = curParseIndex;
+    regMatch.rm_eo = length;
+    int flags = REG_STARTEND;
+    if (curParseIndex != 0)
+      flags |= REG_NOTBOL;
+    if (![self runRegexOnUTF8:utf8Str
+                       nmatch:1
+                       pmatch:&regMatch
+                        flags:flags]) {
+      break;
+    }
+    ++count;
+    curParseIndex = NextParseIndex(utf8Str, length, &regMatch);
+  }
+  return count;
+}
+
 - (NSEnumerator *)segmentEnumeratorForString:(NSString *)str {
   return [[[GTMRegexEnumerator alloc] initWithRegex:self
                                       processString:str
@@ -317,6 +503,18 @@ static NSString *const kReplacementPattern =
                                         allSegments:NO] autorelease];
 }
 
+#if NS_BLOCKS_AVAILABLE
+- (void)enumerateSegmentsInString:(NSString *)str
+                       usingBlock:(GTMRegexSegmentBlock)block {
+  [self enumerateSegmentsInString:str allSegments:YES usingBlock:block];
+}
+
+- (void)enumerateMatchSegmentsInString:(NSString *)str
+                            usingBlock:(GTMRegexSegmentBlock)block {
+  [self enumerateSegmentsInString:str allSegments:NO usingBlock:block];
+}
+#endif  // NS_BLOCKS_AVAILABLE
+
 - (NSString *)stringByReplacingMatchesInString:(NSString *)str
                                withReplacement:(NSString *)replacementPattern {
   if (!str)
@@ -326,10 +524,8 @@ static NSString *const kReplacementPattern =
   // is just an empty string (or nil), just use the nil marker.
   NSArray *replacements = nil;
   if ([replacementPattern length]) {
-    // don't need newline support, just match the start of the pattern for '^'
-    GTMRegex *replacementRegex =
-      [GTMRegex regexWithPattern:kReplacementPattern
-                         options:kGTMRegexOptionSupressNewlineSupport];
+    pthread_once(&gReplacementRegexOnce, CreateReplacementRegex);
+    GTMRegex *replacementRegex = gReplacementRegex;
 #ifdef DEBUG
     if (!replacementRegex) {
       _GTMDevLog(@"failed to parse out replacement regex!!!"); // COV_NF_LINE
@@ -426,6 +622,125 @@ static NSString *const kReplacementPattern =
 
 @end
 
+@implementation GTMRegex (GTMRegexPatternCache)
+
++ (id)cachedRegexWithPattern:(NSString *)pattern
+                     options:(GTMRegexOptions)options {
+  if ([pattern length] == 0)
+    return nil;
+
+  GTMRegexCacheEntry probe = {
+    (CFStringRef)pattern, options, NULL, NULL, NULL
+  };
+  GTMRegex *result = nil;
+  BOOL enabled;
+
+  pthread_mutex_lock(&gPatternCacheLock);
+  enabled = (gPatternCacheLimit > 0);
+  if (enabled) {
+    GTMRegexCacheEntry *entry = NULL;
+    if (gPatternCacheEntries) {
+      entry = (GTMRegexCacheEntry *)CFSetGetValue(gPatternCacheEntries, &probe);
+    }
+    if (entry) {
+      ++gPatternCacheHits;
+      UnlinkPatternCacheEntry(entry);
+      LinkPatternCacheEntryAsNewest(entry);
+      // retain it here, once we unlock another thread could evict it
+      result = [[(GTMRegex *)entry->regex_ retain] autorelease];
+    } else {
+      ++gPatternCacheMisses;
+    }
+  }
+  pthread_mutex_unlock(&gPatternCacheLock);
+
+  if (result)
+    return result;
+
+  // compile it w/o holding the lock so other threads can keep using the cache
+  result = [GTMRegex regexWithPattern:pattern options:options];
+  if (!result || !enabled)
+    return result;
+
+  pthread_mutex_lock(&gPatternCacheLock);
+  if (!gPatternCacheEntries) {
+    CFSetCallBacks callBacks = {
+      0, NULL, NULL, NULL, PatternCacheEntryEqual, PatternCacheEntryHash
+    };
+    gPatternCacheEntries = CFSetCreateMutable(kCFAllocatorDefault, 0,
+                                              &callBacks);
+  }
+  // another thread could have added it (or disabled the cache) while we were
+  // compiling, in which case there is nothing to do.
+  if ((gPatternCacheLimit > 0) &&
+      gPatternCacheEntries &&
+      !CFSetContainsValue(gPatternCacheEntries, &probe)) {
+    GTMRegexCacheEntry *entry = malloc(sizeof(GTMRegexCacheEntry));
+    if (entry) {
+      entry->pattern_ = CFStringCreateCopy(kCFAllocatorDefault,
+                                           (CFStringRef)pattern);
+      if (entry->pattern_) {
+        entry->options_ = options;
+        entry->regex_ = CFRetain(result);
+        CFSetAddValue(gPatternCacheEntries, entry);
+        LinkPatternCacheEntryAsNewest(entry);
+        TrimPatternCache(gPatternCacheLimit, YES);
+      } else {
+        free(entry); // COV_NF_LINE - no real way to force this in a unittest
+      }
+    }
+  }
+  pthread_mutex_unlock(&gPatternCacheLock);
+
+  return result;
+}
+
++ (NSUInteger)patternCacheLimit {
+  pthread_mutex_lock(&gPatternCacheLock);
+  NSUInteger limit = gPatternCacheLimit;
+  pthread_mutex_unlock(&gPatternCacheLock);
+  return limit;
+}
+
++ (void)setPatternCacheLimit:(NSUInteger)limit {
+  pthread_mutex_lock(&gPatternCacheLock);
+  gPatternCacheLimit = limit;
+  TrimPatternCache(limit, YES);
+  pthread_mutex_unlock(&gPatternCacheLock);
+}
+
++ (uint64_t)patternCacheHitCount {
+  pthread_mutex_lock(&gPatternCacheLock);
+  uint64_t count = gPatternCacheHits;
+  pthread_mutex_unlock(&gPatternCacheLock);
+  return count;
+}
+
++ (uint64_t)patternCacheMissCount {
+  pthread_mutex_lock(&gPatternCacheLock);
+  uint64_t count = gPatternCacheMisses;
+  pthread_mutex_unlock(&gPatternCacheLock);
+  return count;
+}
+
++ (uint64_t)patternCacheEvictionCount {
+  pthread_mutex_lock(&gPatternCacheLock);
+  uint64_t count = gPatternCacheEvictions;
+  pthread_mutex_unlock(&gPatternCacheLock);
+  return count;
+}
+
++ (void)resetPatternCache {
+  pthread_mutex_lock(&gPatternCacheLock);
+  TrimPatternCache(0, NO);
+  gPatternCacheHits = 0;
+  gPatternCacheMisses = 0;
+  gPatternCacheEvictions = 0;
+  pthread_mutex_unlock(&gPatternCacheLock);
+}
+
+@end
+
 @implementation GTMRegex (PrivateMethods)
 
 - (NSString *)errorMessage:(int)errCode {
@@ -470,6 +785,154 @@ static NSString *const kReplacementPattern =
   return YES;
 }
 
+#if NS_BLOCKS_AVAILABLE
+// Walks the string the way GTMRegexEnumerator does, but w/ one match buffer
+// and one segment for the whole walk.  |segmentStart| is where the text that
+// hasn't been handed out yet starts, it only differs from |curParseIndex|
+// after an empty match.
+- (void)enumerateSegmentsInString:(NSString *)str
+                      allSegments:(BOOL)allSegments
+                       usingBlock:(GTMRegexSegmentBlock)block {
+  NSData *utf8StrBuf = [str dataUsingEncoding:NSUTF8StringEncoding];
+  if (!utf8StrBuf || !block)
+    return;
+
+  // only ASCII takes the same number of bytes in UTF-8 as it does in UTF-16
+  GTMRegexOffsetIndex *offsetIndex =
+    [[[GTMRegexOffsetIndex alloc] initWithUTF8StrBuf:utf8StrBuf
+                                             isASCII:([utf8StrBuf length] ==
+                                                      [str length])]
+     autorelease];
+  NSUInteger numRegMatches = [self subPatternCount];
+  size_t matchBufSize = (numRegMatches + 1) * sizeof(regmatch_t);
+  // the segment owns (and frees) its buffer, and gets copies of the matches
+  regmatch_t *segmentMatches = calloc(1, matchBufSize);
+  if (!segmentMatches)
+    return; // COV_NF_LINE - no real way to force this in a unittest
+  GTMRegexStringSegment *segment =
+    [[[GTMRegexStringSegment alloc] initWithOffsetIndex:offsetIndex
+                                             regMatches:segmentMatches
+                                          numRegMatches:numRegMatches
+                                                isMatch:NO] autorelease];
+  regmatch_t *matches = malloc(matchBufSize);
+  if (!segment || !matches) {
+    // COV_NF_START - no real way to force this in a unittest
+    free(matches);
+    return;
+    // COV_NF_END
+  }
+
+  // if the block throws, we still need to clean up
+  @try {
+    const char *utf8Str = [utf8StrBuf bytes];
+    regoff_t length = (regoff_t)[utf8StrBuf length];
+    regoff_t segmentStart = 0;
+    regoff_t curParseIndex = 0;
+    BOOL stop = NO;
+    while (curParseIndex < length) {
+      matches[0].rm_so = curParseIndex;
+      matches[0].rm_eo = length;
+      int flags = REG_STARTEND;
+      if (curParseIndex != 0) {
+        // see -[GTMRegexEnumerator treatStartOfNewSegmentAsBeginningOfString:]
+        flags |= REG_NOTBOL;
+      }
+      if (![self runRegexOnUTF8:utf8Str
+                         nmatch:(numRegMatches + 1)
+                         pmatch:matches
+                          flags:flags]) {
+        break;
+      }
+      if (allSegments && (matches[0].rm_so > segmentStart)) {
+        // the text before the match
+        [segment setUnmatchedRangeFrom:segmentStart to:matches[0].rm_so];
+        block(segment, &stop);
+        if (stop) return;
+      }
+      [segment setRegMatches:matches isMatch:YES];
+      block(segment, &stop);
+      if (stop) return;
+      segmentStart = matches[0].rm_eo;
+      curParseIndex = NextParseIndex(utf8Str, length, matches);
+    }
+    if (allSegments && (segmentStart < length)) {
+      // the text after the last match
+      [segment setUnmatchedRangeFrom:segmentStart to:length];
+      block(segment, &stop);
+    }
+  } @finally {
+    free(matches);
+  }
+}
+#endif  // NS_BLOCKS_AVAILABLE
+
+@end
+
+@implementation GTMRegexOffsetIndex
+
+- (id)initWithUTF8StrBuf:(NSData *)utf8StrBuf isASCII:(BOOL)isASCII {
+  self = [super init];
+  if (!self) return nil;
+
+  utf8StrBuf_ = [utf8StrBuf retain];
+  isASCII_ = isASCII;
+  if (!utf8StrBuf_) {
+    [self release];
+    return nil;
+  }
+  return self;
+}
+
+// Don't need a finalize because checkpoints_ is marked __strong
+- (void)dealloc {
+  free(checkpoints_);
+  [utf8StrBuf_ release];
+  [super dealloc];
+}
+
+- (NSData *)utf8StrBuf {
+  return utf8StrBuf_;
+}
+
+- (NSUInteger)utf16OffsetForUTF8Offset:(NSUInteger)offset {
+  NSUInteger length = [utf8StrBuf_ length];
+  if (offset > length)
+    offset = length;
+  if (isASCII_)
+    return offset;
+
+  const unsigned char *bytes = [utf8StrBuf_ bytes];
+  NSUInteger checkpoint = offset / kOffsetIndexCheckpointBytes;
+  if (checkpoint >= numCheckpoints_) {
+    if (checkpoint >= checkpointCapacity_) {
+      NSUInteger capacity = MAX(checkpointCapacity_ * 2, checkpoint + 1);
+      NSUInteger *grown = realloc(checkpoints_, capacity * sizeof(NSUInteger));
+      if (!grown) {
+        // COV_NF_START - no real way to force this in a unittest
+        return CountUTF16Characters(bytes, offset);
+        // COV_NF_END
+      }
+      checkpoints_ = grown;
+      checkpointCapacity_ = capacity;
+    }
+    if (numCheckpoints_ == 0) {
+      checkpoints_[0] = 0;
+      numCheckpoints_ = 1;
+    }
+    // fill in the checkpoints up to the one we need
+    for (; numCheckpoints_ <= checkpoint; ++numCheckpoints_) {
+      NSUInteger start = (numCheckpoints_ - 1) * kOffsetIndexCheckpointBytes;
+      checkpoints_[numCheckpoints_] =
+        checkpoints_[numCheckpoints_ - 1] +
+        CountUTF16Characters(bytes + start, kOffsetIndexCheckpointBytes);
+    }
+  }
+
+  NSUInteger start = checkpoint * kOffsetIndexCheckpointBytes;
+  return checkpoints_[checkpoint] +
+    CountUTF16Characters(bytes + start, offset - start);
+}
+
 @end
 
 @implementation GTMRegexEnumerator
@@ -487,9 +950,14 @@ static NSString *const kReplacementPattern =
   regex_ = [regex retain];
   utf8StrBuf_ = [[str dataUsingEncoding:NSUTF8StringEncoding] retain];
   allSegments_ = allSegments;
+  // only ASCII takes the same number of bytes in UTF-8 as it does in UTF-16
+  offsetIndex_ =
+    [[GTMRegexOffsetIndex alloc] initWithUTF8StrBuf:utf8StrBuf_
+                                            isASCII:([utf8StrBuf_ length] ==
+                                                     [str length])];
 
   // arg check
-  if (!regex_ || !utf8StrBuf_) {
+  if (!regex_ || !utf8StrBuf_ || !offsetIndex_) {
     [self release];
     return nil;
   }
@@ -504,6 +972,7 @@ static NSString *const kReplacementPattern =
   free(savedRegMatches_);
   [regex_ release];
   [utf8StrBuf_ release];
+  [offsetIndex_ release];
   [super dealloc];
 }
 
@@ -631,10 +1100,10 @@ static NSString *const kReplacementPattern =
     // create the segment to return
     if (nextMatches) {
       result =
-        [[[GTMRegexStringSegment alloc] initWithUTF8StrBuf:utf8StrBuf_
-                                                regMatches:nextMatches
-                                             numRegMatches:[regex_ subPatternCount]
-                                                   isMatch:isMatch] autorelease];
+        [[[GTMRegexStringSegment alloc] initWithOffsetIndex:offsetIndex_
+                                                 regMatches:nextMatches
+                                              numRegMatches:[regex_ subPatternCount]
+                                                    isMatch:isMatch] autorelease];
       nextMatches = nil;
     }
   } @catch (id e) { // COV_NF_START - no real way to force this in a test
@@ -670,6 +1139,7 @@ static NSString *const kReplacementPattern =
 - (void)dealloc {
   free(regMatches_);
   [utf8StrBuf_ release];
+  [offsetIndex_ release];
   [super dealloc];
 }
 
@@ -701,6 +1171,40 @@ static NSString *const kReplacementPattern =
                                  encoding:NSUTF8StringEncoding] autorelease];
 }
 
+- (NSRange)range {
+  return [self rangeOfSubPattern:0];
+}
+
+- (NSRange)rangeOfSubPattern:(NSUInteger)patternIndex {
+  NSRange utf8Range = [self utf8RangeOfSubPattern:patternIndex];
+  if (utf8Range.location == NSNotFound)
+    return utf8Range;
+
+  NSUInteger start =
+    [offsetIndex_ utf16OffsetForUTF8Offset:utf8Range.location];
+  NSUInteger end =
+    [offsetIndex_ utf16OffsetForUTF8Offset:NSMaxRange(utf8Range)];
+  return NSMakeRange(start, end - start);
+}
+
+- (NSRange)utf8Range {
+  return [self utf8RangeOfSubPattern:0];
+}
+
+- (NSRange)utf8RangeOfSubPattern:(NSUInteger)patternIndex {
+  if (patternIndex > numRegMatches_)
+    return NSMakeRange(NSNotFound, 0);
+
+  // pick off when it wasn't found
+  if ((regMatches_[patternIndex].rm_so == -1) &&
+      (regMatches_[patternIndex].rm_eo == -1))
+    return NSMakeRange(NSNotFound, 0);
+
+  return NSMakeRange((NSUInteger)regMatches_[patternIndex].rm_so,
+                     (NSUInteger)(regMatches_[patternIndex].rm_eo
+                                  - regMatches_[patternIndex].rm_so));
+}
+
 - (NSString *)description {
   NSMutableString *result =
     [NSMutableString stringWithFormat:@"%@<%p> { isMatch=\"%s\", subPatterns=(",
@@ -724,14 +1228,15 @@ static NSString *const kReplacementPattern =
 
 @implementation GTMRegexStringSegment (PrivateMethods)
 
-- (id)initWithUTF8StrBuf:(NSData *)utf8StrBuf
-              regMatches:(regmatch_t *)regMatches
-           numRegMatches:(NSUInteger)numRegMatches
-                 isMatch:(BOOL)isMatch {
+- (id)initWithOffsetIndex:(GTMRegexOffsetIndex *)offsetIndex
+               regMatches:(regmatch_t *)regMatches
+            numRegMatches:(NSUInteger)numRegMatches
+                  isMatch:(BOOL)isMatch {
   self = [super init];
   if (!self) return nil;
 
-  utf8StrBuf_ = [utf8StrBuf retain];
+  offsetIndex_ = [offsetIndex retain];
+  utf8StrBuf_ = [[offsetIndex utf8StrBuf] retain];
   regMatches_ = regMatches;
   numRegMatches_ = numRegMatches;
   isMatch_ = isMatch;
@@ -748,30 +1253,50 @@ static NSString *const kReplacementPattern =
   return self;
 }
 
+- (void)setRegMatches:(const regmatch_t *)regMatches isMatch:(BOOL)isMatch {
+  memcpy(regMatches_, regMatches, (numRegMatches_ + 1) * sizeof(regmatch_t));
+  isMatch_ = isMatch;
+}
+
+- (void)setUnmatchedRangeFrom:(regoff_t)start to:(regoff_t)end {
+  // mark everything but the zero slot w/ not used
+  for (NSUInteger x = numRegMatches_; x > 0; --x) {
+    regMatches_[x].rm_so = regMatches_[x].rm_eo = -1;
+  }
+  regMatches_[0].rm_so = start;
+  regMatches_[0].rm_eo = end;
+  isMatch_ = NO;
+}
+
 @end
 
 @implementation NSString (GTMRegexAdditions)
 
 - (BOOL)gtm_matchesPattern:(NSString *)pattern {
-  GTMRegex *regex = [GTMRegex regexWithPattern:pattern];
+  GTMRegex *regex = [GTMRegex cachedRegexWithPattern:pattern options:0];
   return [regex matchesString:self];
 }
 
 - (NSArray *)gtm_subPatternsOfPattern:(NSString *)pattern {
-  GTMRegex *regex = [GTMRegex regexWithPattern:pattern];
+  GTMRegex *regex = [GTMRegex cachedRegexWithPattern:pattern options:0];
   return [regex subPatternsOfString:self];
 }
 
 - (NSString *)gtm_firstSubStringMatchedByPattern:(NSString *)pattern {
-  GTMRegex *regex = [GTMRegex regexWithPattern:pattern];
+  GTMRegex *regex = [GTMRegex cachedRegexWithPattern:pattern options:0];
   return [regex firstSubStringMatchedInString:self];
 }
 
 - (BOOL)gtm_subStringMatchesPattern:(NSString *)pattern {
-  GTMRegex *regex = [GTMRegex regexWithPattern:pattern];
+  GTMRegex *regex = [GTMRegex cachedRegexWithPattern:pattern options:0];
   return [regex matchesSubStringInString:self];
 }
 
+- (NSUInteger)gtm_numberOfMatchesOfPattern:(NSString *)pattern {
+  GTMRegex *regex = [GTMRegex cachedRegexWithPattern:pattern options:0];
+  return [regex numberOfMatchesInString:self];
+}
+
 - (NSArray *)gtm_allSubstringsMatchedByPattern:(NSString *)pattern {
   NSEnumerator *enumerator = [self gtm_matchSegmentEnumeratorForPattern:pattern];
   NSArray *allSegments = [enumerator allObjects];
@@ -779,18 +1304,18 @@ static NSString *const kReplacementPattern =
 }
 
 - (NSEnumerator *)gtm_segmentEnumeratorForPattern:(NSString *)pattern {
-  GTMRegex *regex = [GTMRegex regexWithPattern:pattern];
+  GTMRegex *regex = [GTMRegex cachedRegexWithPattern:pattern options:0];
   return [regex segmentEnumeratorForString:self];
 }
 
 - (NSEnumerator *)gtm_matchSegmentEnumeratorForPattern:(NSString *)pattern {
-  GTMRegex *regex = [GTMRegex regexWithPattern:pattern];
+  GTMRegex *regex = [GTMRegex cachedRegexWithPattern:pattern options:0];
   return [regex matchSegmentEnumeratorForString:self];
 }
 
 - (NSString *)gtm_stringByReplacingMatchesOfPattern:(NSString *)pattern
                                     withReplacement:(NSString *)replacementPattern {
-  GTMRegex *regex = [GTMRegex regexWithPattern:pattern];
+  GTMRegex *regex = [GTMRegex cachedRegexWithPattern:pattern options:0];
   return [regex stringByReplacingMatchesInString:self
                                  withReplacement:replacementPattern];
 }
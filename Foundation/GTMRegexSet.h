@@ -0,0 +1,105 @@
+//
+//  GTMRegexSet.h
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "GTMRegex.h"
+
+/// Tests a string against many GTMRegex patterns at once.
+//
+// Asking each of N GTMRegex objects -matchesSubStringInString: costs N full
+// regexec runs.  A GTMRegexSet pulls the longest run of plain text each
+// pattern requires out of the pattern (ie: " disk full on " out of
+// "^E[0-9]+ disk full on (sd|hd)[a-z]$"), and builds one Aho-Corasick
+// automaton for all of them.  Matching scans the string once with that, and
+// only runs regexec for the patterns whose text turned up (and for the ones
+// that have no required text, ie: top level alternation).  The answers are
+// always exactly what the GTMRegex objects would give.
+//
+// The required text is matched w/o regard to ASCII case (regexec sorts out the
+// patterns that do care), and only ASCII text is used for it.
+//
+// A GTMRegexSet doesn't change once it is created, so it can be used from
+// several threads at once.
+//
+// Example usage:
+//
+//   GTMRegexSet *routes =
+//     [GTMRegexSet regexSetWithPatterns:[NSArray arrayWithObjects:
+//                                        @"^auth: .* failed$",
+//                                        @"disk (full|error)",
+//                                        @"timeout after [0-9]+ms", nil]];
+//   NSIndexSet *matches = [routes indexesOfPatternsMatchingString:line];
+//   ....
+//
+struct GTMRegexSetPrefilter;
+
+@interface GTMRegexSet : NSObject {
+ @private
+  NSArray *regexes_;
+  struct GTMRegexSetPrefilter *prefilter_;
+}
+
+/// Create a new, autoreleased set of the given patterns w/ the default options
++ (id)regexSetWithPatterns:(NSArray *)patterns;
+
+/// Create a new, autoreleased set of the given patterns w/ the matching options
++ (id)regexSetWithPatterns:(NSArray *)patterns
+                   options:(GTMRegexOptions)options;
+
+/// Create a new, autoreleased set of the given GTMRegex objects
++ (id)regexSetWithRegexes:(NSArray *)regexes;
+
+/// Initialize a new set of |patterns| (NSStrings), all using |options|.
+//
+// If any of the patterns is bad, returns nil and, if |outErrorOrNULL| is given,
+// fills it in as -[GTMRegex initWithPattern:options:withError:] does.
+//
+- (id)initWithPatterns:(NSArray *)patterns
+               options:(GTMRegexOptions)options
+             withError:(NSError **)outErrorOrNULL;
+
+/// Initialize a new set of |regexes| (GTMRegex objects)
+- (id)initWithRegexes:(NSArray *)regexes;
+
+/// Returns the number of patterns in the set
+- (NSUInteger)count;
+
+/// Returns the GTMRegex for the pattern at |index|
+- (GTMRegex *)regexAtIndex:(NSUInteger)index;
+
+/// Returns the number of patterns the literal prefilter can skip
+- (NSUInteger)numberOfPrefilteredPatterns;
+
+/// Returns the indexes of all the patterns that match a substring of |str|.
+//
+// ie: the indexes of the GTMRegex objects whose -matchesSubStringInString:
+// would return YES.  Returns an empty set if none match.
+//
+- (NSIndexSet *)indexesOfPatternsMatchingString:(NSString *)str;
+
+/// Returns the index of the first pattern that matches a substring of |str|, or NSNotFound.
+//
+// This stops at the first match, so it is cheaper than
+// -indexesOfPatternsMatchingString: when you only need one.
+//
+- (NSUInteger)indexOfFirstPatternMatchingString:(NSString *)str;
+
+/// Returns YES if any of the patterns match a substring of |str|
+- (BOOL)matchesSubStringInString:(NSString *)str;
+
+@end
@@ -0,0 +1,572 @@
+//
+//  GTMRegexSet.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMRegexSet.h"
+#import "GTMDefines.h"
+
+// GTMRegex's helper for running the regex on UTF-8 we already have.
+@interface GTMRegex (PrivateMethods)
+- (BOOL)runRegexOnUTF8:(const char*)utf8Str
+                nmatch:(size_t)nmatch
+                pmatch:(regmatch_t *)pmatch
+                 flags:(int)flags;
+@end
+
+// Short strings get their scratch flags from the stack.
+#define kStackFlagsLength 512
+
+// An Aho-Corasick automaton of the text each pattern requires.  The trie is
+// turned into a full DFA over classes of bytes (every byte that isn't in any
+// of the literals shares class zero, and upper case ASCII letters share the
+// lower case letter's class), so a scan is one table lookup per byte.
+typedef struct GTMRegexSetPrefilter {
+  NSUInteger numPatterns;
+  NSUInteger numLiterals;       // patterns w/ some required text
+  BOOL *hasLiteral;             // per pattern
+  NSUInteger numClasses;
+  unsigned char classes[256];   // byte -> class
+  int32_t *transitions;         // [state * numClasses + class] -> state
+  int32_t *reportStates;        // the state itself if it has output, else
+                                // its dictionary link
+  int32_t *dictionaryLinks;     // longest proper suffix state w/ output, or 0
+  int32_t *outputSlots;         // state -> slot, -1 if no output
+  NSUInteger numOutputSlots;
+  NSUInteger *outputStarts;     // slot -> start in outputPatterns (+1 = end)
+  NSUInteger *outputPatterns;   // pattern indexes, grouped by slot
+} GTMRegexSetPrefilter;
+
+GTM_INLINE unsigned char FoldASCII(unsigned char ch) {
+  return ((ch >= 'A') && (ch <= 'Z')) ? (unsigned char)(ch + ('a' - 'A')) : ch;
+}
+
+// The characters that mean something in an extended regex (re_format(7)).
+GTM_INLINE BOOL IsSpecialCharacter(char ch) {
+  return (ch != '\0') && (strchr("^.[$()|*+?{\\", ch) != NULL);
+}
+
+// Returns the index just past the bracket expression starting at |i|.
+static NSUInteger SkipBracketExpression(const char *pattern, NSUInteger i,
+                                        NSUInteger length) {
+  ++i;
+  if ((i < length) && (pattern[i] == '^')) ++i;
+  // a ']' first in the list is just a ']'
+  if ((i < length) && (pattern[i] == ']')) ++i;
+  while ((i < length) && (pattern[i] != ']')) {
+    char delimiter = (i + 1 < length) ? pattern[i + 1] : '\0';
+    if ((pattern[i] == '[') &&
+        ((delimiter == ':') || (delimiter == '.') || (delimiter == '='))) {
+      // [:class:], [.collating.] or [=equivalence=]
+      i += 2;
+      while ((i + 1 < length) &&
+             !((pattern[i] == delimiter) && (pattern[i + 1] == ']'))) {
+        ++i;
+      }
+      i += 2;
+    } else {
+      ++i;
+    }
+  }
+  return MIN(i + 1, length);
+}
+
+// Returns the index just past the parenthesized group starting at |i|.
+static NSUInteger SkipGroup(const char *pattern, NSUInteger i,
+                            NSUInteger length) {
+  NSUInteger depth = 0;
+  while (i < length) {
+    char ch = pattern[i];
+    if (ch == '\\') {
+      i += 2;
+    } else if (ch == '[') {
+      i = SkipBracketExpression(pattern, i, length);
+    } else {
+      ++i;
+      if (ch == '(') {
+        ++depth;
+      } else if ((ch == ')') && (--depth == 0)) {
+        break;
+      }
+    }
+  }
+  return MIN(i, length);
+}
+
+// Returns the index just past the bound ("{n,m}") starting at |i|.
+static NSUInteger SkipBound(const char *pattern, NSUInteger i,
+                            NSUInteger length) {
+  while ((i < length) && (pattern[i] != '}')) ++i;
+  return MIN(i + 1, length);
+}
+
+// Finds the longest run of ASCII text that anything |pattern| matches has to
+// contain.  Only the top level of the pattern is looked at: groups, bracket
+// expressions, '.', anchors and anything non-ASCII just end a run, a
+// character w/ '*', '?' or a bound after it is left out, and one w/ a '+'
+// ends its run.  Top level alternation means nothing is required.
+//
+// The text (ASCII case folded) goes in |literal|, and |run| is scratch; both
+// need room for |length| chars.  Returns the length of the text.
+static NSUInteger FindRequiredLiteral(const char *pattern, NSUInteger length,
+                                      char *literal, char *run) {
+  NSUInteger literalLength = 0;
+  NSUInteger runLength = 0;
+  NSUInteger i = 0;
+  for (;;) {
+    int ch = -1;
+    if (i < length) {
+      char patternCh = pattern[i];
+      switch (patternCh) {
+        case '|':
+          return 0;
+        case '\\':
+          if ((i + 1 < length) && IsSpecialCharacter(pattern[i + 1])) {
+            ch = (unsigned char)pattern[i + 1];
+          }
+          i += 2;
+          break;
+        case '(':
+          i = SkipGroup(pattern, i, length);
+          break;
+        case '[':
+          i = SkipBracketExpression(pattern, i, length);
+          break;
+        case '{':
+          i = SkipBound(pattern, i, length);
+          break;
+        case '^':
+        case '$':
+        case '.':
+        case '*':
+        case '+':
+        case '?':
+          ++i;
+          break;
+        default:
+          if ((unsigned char)patternCh < 0x80) {
+            ch = (unsigned char)patternCh;
+          }
+          ++i;
+          break;
+      }
+    }
+
+    if (ch >= 0) {
+      char next = (i < length) ? pattern[i] : '\0';
+      if ((next != '*') && (next != '?') && (next != '{')) {
+        run[runLength++] = (char)FoldASCII((unsigned char)ch);
+        if (next != '+') {
+          // the run carries on
+          continue;
+        }
+      }
+    }
+
+    // the run is over
+    if (runLength > literalLength) {
+      memcpy(literal, run, runLength);
+      literalLength = runLength;
+    }
+    runLength = 0;
+    if (i >= length) break;
+  }
+  return literalLength;
+}
+
+static void FreePrefilter(GTMRegexSetPrefilter *prefilter) {
+  if (!prefilter) return;
+  free(prefilter->hasLiteral);
+  free(prefilter->transitions);
+  free(prefilter->reportStates);
+  free(prefilter->dictionaryLinks);
+  free(prefilter->outputSlots);
+  free(prefilter->outputStarts);
+  free(prefilter->outputPatterns);
+  free(prefilter);
+}
+
+// Builds the automaton for |count| patterns (UTF-8, w/ |lengths|).  Returns
+// NULL if it runs out of memory.
+static GTMRegexSetPrefilter *CreatePrefilter(const char **patterns,
+                                             const NSUInteger *lengths,
+                                             NSUInteger count) {
+  GTMRegexSetPrefilter *prefilter = calloc(1, sizeof(GTMRegexSetPrefilter));
+  if (!prefilter) return NULL; // COV_NF_LINE - no real way to force this
+
+  NSUInteger totalLength = 0;
+  for (NSUInteger x = 0; x < count; ++x) {
+    totalLength += lengths[x];
+  }
+  prefilter->numPatterns = count;
+  prefilter->hasLiteral = calloc(MAX(count, 1), sizeof(BOOL));
+  char *literals = malloc(MAX(totalLength, 1));
+  char *run = malloc(MAX(totalLength, 1));
+  NSUInteger *literalStarts = malloc((count + 1) * sizeof(NSUInteger));
+  int32_t *terminals = malloc(MAX(count, 1) * sizeof(int32_t));
+  int32_t *failures = NULL;
+  int32_t *queue = NULL;
+  BOOL ok = NO;
+  if (!prefilter->hasLiteral || !literals || !run || !literalStarts ||
+      !terminals) {
+    goto bailout; // COV_NF_LINE - no real way to force this
+  }
+
+  // pull out the text, and give each byte in it a class
+  NSUInteger literalsLength = 0;
+  prefilter->numClasses = 1;
+  for (NSUInteger x = 0; x < count; ++x) {
+    literalStarts[x] = literalsLength;
+    NSUInteger literalLength = FindRequiredLiteral(patterns[x], lengths[x],
+                                                   literals + literalsLength,
+                                                   run);
+    for (NSUInteger y = 0; y < literalLength; ++y) {
+      unsigned char ch = (unsigned char)literals[literalsLength + y];
+      if (prefilter->classes[ch] == 0) {
+        prefilter->classes[ch] = (unsigned char)prefilter->numClasses++;
+        if ((ch >= 'a') && (ch <= 'z')) {
+          prefilter->classes[ch - ('a' - 'A')] = prefilter->classes[ch];
+        }
+      }
+    }
+    if (literalLength) {
+      prefilter->hasLiteral[x] = YES;
+      ++prefilter->numLiterals;
+    }
+    literalsLength += literalLength;
+  }
+  literalStarts[count] = literalsLength;
+
+  // build the trie
+  NSUInteger numClasses = prefilter->numClasses;
+  NSUInteger maxStates = literalsLength + 1;
+  prefilter->transitions = calloc(maxStates * numClasses, sizeof(int32_t));
+  prefilter->outputSlots = malloc(maxStates * sizeof(int32_t));
+  if (!prefilter->transitions || !prefilter->outputSlots) {
+    goto bailout; // COV_NF_LINE - no real way to force this
+  }
+  int32_t *transitions = prefilter->transitions;
+  NSUInteger numStates = 1;
+  for (NSUInteger x = 0; x < count; ++x) {
+    NSUInteger state = 0;
+    for (NSUInteger y = literalStarts[x]; y < literalStarts[x + 1]; ++y) {
+      NSUInteger cls = prefilter->classes[(unsigned char)literals[y]];
+      int32_t *next = &transitions[state * numClasses + cls];
+      if (*next == 0) {
+        *next = (int32_t)numStates++;
+      }
+      state = (NSUInteger)*next;
+    }
+    terminals[x] = (int32_t)state;
+  }
+
+  // group the patterns by the state their text ends in
+  for (NSUInteger x = 0; x < numStates; ++x) {
+    prefilter->outputSlots[x] = -1;
+  }
+  for (NSUInteger x = 0; x < count; ++x) {
+    if (prefilter->hasLiteral[x] &&
+        (prefilter->outputSlots[terminals[x]] < 0)) {
+      prefilter->outputSlots[terminals[x]] =
+        (int32_t)prefilter->numOutputSlots++;
+    }
+  }
+  prefilter->outputStarts = calloc(prefilter->numOutputSlots + 1,
+                                   sizeof(NSUInteger));
+  prefilter->outputPatterns = malloc(MAX(prefilter->numLiterals, 1) *
+                                     sizeof(NSUInteger));
+  if (!prefilter->outputStarts || !prefilter->outputPatterns) {
+    goto bailout; // COV_NF_LINE - no real way to force this
+  }
+  for (NSUInteger x = 0; x < count; ++x) {
+    if (prefilter->hasLiteral[x]) {
+      ++prefilter->outputStarts[prefilter->outputSlots[terminals[x]] + 1];
+    }
+  }
+  for (NSUInteger x = 1; x <= prefilter->numOutputSlots; ++x) {
+    prefilter->outputStarts[x] += prefilter->outputStarts[x - 1];
+  }
+  // fill them in using the starts as cursors, then put the starts back
+  for (NSUInteger x = 0; x < count; ++x) {
+    if (prefilter->hasLiteral[x]) {
+      NSUInteger slot = (NSUInteger)prefilter->outputSlots[terminals[x]];
+      prefilter->outputPatterns[prefilter->outputStarts[slot]++] = x;
+    }
+  }
+  for (NSUInteger x = prefilter->numOutputSlots; x > 0; --x) {
+    prefilter->outputStarts[x] = prefilter->outputStarts[x - 1];
+  }
+  prefilter->outputStarts[0] = 0;
+
+  // walk the trie breadth first to find the failure links, turning the trie
+  // into a DFA and finding the dictionary links as we go.
+  prefilter->reportStates = calloc(numStates, sizeof(int32_t));
+  prefilter->dictionaryLinks = calloc(numStates, sizeof(int32_t));
+  failures = calloc(numStates, sizeof(int32_t));
+  queue = malloc(numStates * sizeof(int32_t));
+  if (!prefilter->reportStates || !prefilter->dictionaryLinks ||
+      !failures || !queue) {
+    goto bailout; // COV_NF_LINE - no real way to force this
+  }
+  NSUInteger head = 0;
+  NSUInteger tail = 0;
+  for (NSUInteger cls = 1; cls < numClasses; ++cls) {
+    if (transitions[cls]) {
+      queue[tail++] = transitions[cls];
+    }
+  }
+  while (head < tail) {
+    NSUInteger state = (NSUInteger)queue[head++];
+    int32_t failure = failures[state];
+    prefilter->dictionaryLinks[state] =
+      (prefilter->outputSlots[failure] >= 0) ?
+        failure : prefilter->dictionaryLinks[failure];
+    prefilter->reportStates[state] =
+      (prefilter->outputSlots[state] >= 0) ?
+        (int32_t)state : prefilter->dictionaryLinks[state];
+    int32_t *row = &transitions[state * numClasses];
+    const int32_t *failureRow = &transitions[(NSUInteger)failure * numClasses];
+    for (NSUInteger cls = 1; cls < numClasses; ++cls) {
+      if (row[cls]) {
+        failures[row[cls]] = failureRow[cls];
+        queue[tail++] = row[cls];
+      } else {
+        row[cls] = failureRow[cls];
+      }
+    }
+  }
+  ok = YES;
+
+ bailout:
+  free(literals);
+  free(run);
+  free(literalStarts);
+  free(terminals);
+  free(failures);
+  free(queue);
+  if (!ok) {
+    // COV_NF_START - no real way to force this
+    FreePrefilter(prefilter);
+    prefilter = NULL;
+    // COV_NF_END
+  }
+  return prefilter;
+}
+
+// Scans |utf8Str| once, setting |candidates| for every pattern whose required
+// text is in it.  |seen| needs a (zeroed) flag per output slot.
+static void FindCandidates(const GTMRegexSetPrefilter *prefilter,
+                           const char *utf8Str,
+                           unsigned char *seen,
+                           unsigned char *candidates) {
+  const int32_t *transitions = prefilter->transitions;
+  const unsigned char *classes = prefilter->classes;
+  NSUInteger numClasses = prefilter->numClasses;
+  NSUInteger numSeen = 0;
+  NSUInteger state = 0;
+  for (const unsigned char *bytes = (const unsigned char *)utf8Str;
+       *bytes;
+       ++bytes) {
+    state = (NSUInteger)transitions[state * numClasses + classes[*bytes]];
+    int32_t report = prefilter->reportStates[state];
+    // once a state has been reported, so has everything on its dictionary
+    // links, so we can stop at the first one we've seen.
+    while (report) {
+      NSUInteger slot = (NSUInteger)prefilter->outputSlots[report];
+      if (seen[slot]) break;
+      seen[slot] = 1;
+      for (NSUInteger x = prefilter->outputStarts[slot];
+           x < prefilter->outputStarts[slot + 1];
+           ++x) {
+        candidates[prefilter->outputPatterns[x]] = 1;
+      }
+      report = prefilter->dictionaryLinks[report];
+      ++numSeen;
+    }
+    if (numSeen == prefilter->numOutputSlots) {
+      // found all of them, no need to look any further
+      break;
+    }
+  }
+}
+
+@interface GTMRegexSet (PrivateMethods)
+- (NSUInteger)matchUTF8:(const char *)utf8Str
+        addingIndexesTo:(NSMutableIndexSet *)indexes;
+@end
+
+@implementation GTMRegexSet
+
++ (id)regexSetWithPatterns:(NSArray *)patterns {
+  return [[[self alloc] initWithPatterns:patterns
+                                 options:0
+                               withError:nil] autorelease];
+}
+
++ (id)regexSetWithPatterns:(NSArray *)patterns
+                   options:(GTMRegexOptions)options {
+  return [[[self alloc] initWithPatterns:patterns
+                                 options:options
+                               withError:nil] autorelease];
+}
+
++ (id)regexSetWithRegexes:(NSArray *)regexes {
+  return [[[self alloc] initWithRegexes:regexes] autorelease];
+}
+
+- (id)init {
+  return [self initWithRegexes:nil];
+}
+
+- (id)initWithPatterns:(NSArray *)patterns
+               options:(GTMRegexOptions)options
+             withError:(NSError **)outErrorOrNULL {
+  if (outErrorOrNULL) *outErrorOrNULL = nil;
+
+  NSMutableArray *regexes = [NSMutableArray arrayWithCapacity:[patterns count]];
+  NSString *pattern = nil;
+  GTM_FOREACH_OBJECT(pattern, patterns) {
+    GTMRegex *regex = [GTMRegex regexWithPattern:pattern
+                                         options:options
+                                       withError:outErrorOrNULL];
+    if (!regex) {
+      [self release];
+      return nil;
+    }
+    [regexes addObject:regex];
+  }
+  return [self initWithRegexes:regexes];
+}
+
+- (id)initWithRegexes:(NSArray *)regexes {
+  self = [super init];
+  if (!self) return nil;
+
+  regexes_ = [regexes copy];
+  if (!regexes_) {
+    [self release];
+    return nil;
+  }
+
+  NSUInteger count = [regexes_ count];
+  const char **patterns = malloc(MAX(count, 1) * sizeof(char *));
+  NSUInteger *lengths = malloc(MAX(count, 1) * sizeof(NSUInteger));
+  if (patterns && lengths) {
+    for (NSUInteger x = 0; x < count; ++x) {
+      patterns[x] = [[[regexes_ objectAtIndex:x] pattern] UTF8String];
+      lengths[x] = patterns[x] ? strlen(patterns[x]) : 0;
+      if (!patterns[x]) patterns[x] = "";
+    }
+    prefilter_ = CreatePrefilter(patterns, lengths, count);
+  }
+  free(patterns);
+  free(lengths);
+  if (!prefilter_) {
+    // COV_NF_START - no real way to force this in a unittest
+    [self release];
+    return nil;
+    // COV_NF_END
+  }
+  return self;
+}
+
+- (void)dealloc {
+  FreePrefilter(prefilter_);
+  [regexes_ release];
+  [super dealloc];
+}
+
+- (NSUInteger)count {
+  return [regexes_ count];
+}
+
+- (GTMRegex *)regexAtIndex:(NSUInteger)index {
+  return [regexes_ objectAtIndex:index];
+}
+
+- (NSUInteger)numberOfPrefilteredPatterns {
+  return prefilter_->numLiterals;
+}
+
+- (NSIndexSet *)indexesOfPatternsMatchingString:(NSString *)str {
+  NSMutableIndexSet *result = [NSMutableIndexSet indexSet];
+  [self matchUTF8:[str UTF8String] addingIndexesTo:result];
+  return result;
+}
+
+- (NSUInteger)indexOfFirstPatternMatchingString:(NSString *)str {
+  return [self matchUTF8:[str UTF8String] addingIndexesTo:nil];
+}
+
+- (BOOL)matchesSubStringInString:(NSString *)str {
+  return [self indexOfFirstPatternMatchingString:str] != NSNotFound;
+}
+
+- (NSString *)description {
+  return [NSString stringWithFormat:@"%@<%p> { patterns=%lu, prefiltered=%lu }",
+          [self class], self, (unsigned long)[regexes_ count],
+          (unsigned long)prefilter_->numLiterals];
+}
+
+@end
+
+@implementation GTMRegexSet (PrivateMethods)
+
+// Runs the patterns that could match over |utf8Str|, adding the indexes of
+// the ones that do to |indexes|, or if |indexes| is nil stopping at the first
+// one.  Returns the first index that matched, or NSNotFound.
+- (NSUInteger)matchUTF8:(const char *)utf8Str
+        addingIndexesTo:(NSMutableIndexSet *)indexes {
+  NSUInteger count = [regexes_ count];
+  if (!utf8Str || !count)
+    return NSNotFound;
+
+  // a flag per output slot, then one per pattern
+  NSUInteger flagsLength = prefilter_->numOutputSlots + count;
+  unsigned char stackFlags[kStackFlagsLength];
+  unsigned char *flags = stackFlags;
+  if (flagsLength > kStackFlagsLength) {
+    flags = malloc(flagsLength);
+    if (!flags)
+      return NSNotFound; // COV_NF_LINE - no real way to force this
+  }
+  memset(flags, 0, flagsLength);
+  unsigned char *candidates = flags + prefilter_->numOutputSlots;
+  if (prefilter_->numLiterals) {
+    FindCandidates(prefilter_, utf8Str, flags, candidates);
+  }
+
+  NSUInteger result = NSNotFound;
+  for (NSUInteger x = 0; x < count; ++x) {
+    if (prefilter_->hasLiteral[x] && !candidates[x])
+      continue;
+    GTMRegex *regex = [regexes_ objectAtIndex:x];
+    if ([regex runRegexOnUTF8:utf8Str nmatch:0 pmatch:NULL flags:0]) {
+      if (result == NSNotFound) {
+        result = x;
+      }
+      if (!indexes) break;
+      [indexes addIndex:x];
+    }
+  }
+
+  if (flags != stackFlags) {
+    free(flags);
+  }
+  return result;
+}
+
+@end
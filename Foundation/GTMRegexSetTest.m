@@ -0,0 +1,286 @@
+//
+//  GTMRegexSetTest.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMSenTestCase.h"
+#import "GTMUnitTestDevLog.h"
+#import "GTMTestTimer.h"
+#import "GTMRegexSet.h"
+
+@interface GTMRegexSetTest : GTMTestCase
+@end
+
+// What asking each regex in turn gives.
+static NSIndexSet *MatchEachRegex(GTMRegexSet *set, NSString *str) {
+  NSMutableIndexSet *result = [NSMutableIndexSet indexSet];
+  for (NSUInteger x = 0; x < [set count]; ++x) {
+    if ([[set regexAtIndex:x] matchesSubStringInString:str]) {
+      [result addIndex:x];
+    }
+  }
+  return result;
+}
+
+// Checks the set gives the same answers as the regexes one at a time.
+static BOOL MatchesLikeEachRegex(GTMRegexSet *set, NSString *str) {
+  NSIndexSet *expected = MatchEachRegex(set, str);
+  if (![[set indexesOfPatternsMatchingString:str] isEqualToIndexSet:expected]) {
+    return NO;
+  }
+  if ([set indexOfFirstPatternMatchingString:str] != [expected firstIndex]) {
+    return NO;
+  }
+  return [set matchesSubStringInString:str] == ([expected count] > 0);
+}
+
+@implementation GTMRegexSetTest
+
+- (void)testInit {
+  GTMRegexSet *set = [GTMRegexSet regexSetWithPatterns:[NSArray array]];
+  STAssertNotNil(set, nil);
+  STAssertEquals([set count], (NSUInteger)0, nil);
+  STAssertEquals([[set indexesOfPatternsMatchingString:@"abc"] count],
+                 (NSUInteger)0, nil);
+  STAssertEquals([set indexOfFirstPatternMatchingString:@"abc"],
+                 (NSUInteger)NSNotFound, nil);
+  STAssertFalse([set matchesSubStringInString:@"abc"], nil);
+
+  set = [[[GTMRegexSet alloc] init] autorelease];
+  STAssertNil(set, nil);
+
+  // a bad pattern fails the whole set
+  NSArray *patterns = [NSArray arrayWithObjects:@"a+", @"(.", nil];
+  NSError *error = nil;
+  set = [[[GTMRegexSet alloc] initWithPatterns:patterns
+                                       options:0
+                                     withError:&error] autorelease];
+  STAssertNil(set, nil);
+  STAssertNotNil(error, nil);
+  STAssertEquals([error code], (NSInteger)kGTMRegexPatternParseFailedError,
+                 nil);
+  STAssertEqualStrings([[error userInfo] objectForKey:kGTMRegexPatternErrorPattern],
+                       @"(.", nil);
+  [GTMUnitTestDevLog expectString:@"Invalid pattern \"(.\", error: \"parentheses not balanced\""];
+  STAssertNil([GTMRegexSet regexSetWithPatterns:patterns], nil);
+
+  // regexes keep their own options
+  NSArray *regexes =
+    [NSArray arrayWithObjects:
+     [GTMRegex regexWithPattern:@"abc"],
+     [GTMRegex regexWithPattern:@"def" options:kGTMRegexOptionIgnoreCase],
+     nil];
+  set = [GTMRegexSet regexSetWithRegexes:regexes];
+  STAssertNotNil(set, nil);
+  STAssertEquals([set count], (NSUInteger)2, nil);
+  STAssertEquals([set regexAtIndex:1], [regexes objectAtIndex:1], nil);
+  STAssertEquals([set indexOfFirstPatternMatchingString:@"ABC DEF"],
+                 (NSUInteger)1, nil);
+  STAssertTrue([[set indexesOfPatternsMatchingString:@"abc DEF"]
+                isEqualToIndexSet:[NSIndexSet indexSetWithIndexesInRange:
+                                   NSMakeRange(0, 2)]], nil);
+  STAssertGreaterThan([[set description] length], (NSUInteger)10, nil);
+}
+
+- (void)testPrefilter {
+  // which patterns have required text
+  NSArray *patterns =
+    [NSArray arrayWithObjects:
+     @"foo|bar",          // top level alternation
+     @"(foo|bar)baz",     // "baz"
+     @"a*",               // nothing
+     @"[abc]+",           // nothing
+     @"x",                // "x"
+     @"^. *$",            // nothing
+     @"colou?r",          // "colo"
+     nil];
+  GTMRegexSet *set = [GTMRegexSet regexSetWithPatterns:patterns];
+  STAssertNotNil(set, nil);
+  STAssertEquals([set numberOfPrefilteredPatterns], (NSUInteger)3, nil);
+
+  NSArray *strings =
+    [NSArray arrayWithObjects:
+     @"", @"foo", @"barbaz", @"xyz", @"color", @"colour", @"COLOR", @"BAZ",
+     @"the quick brown fox", @"aaa\nbbb", nil];
+  NSString *str = nil;
+  GTM_FOREACH_OBJECT(str, strings) {
+    STAssertTrue(MatchesLikeEachRegex(set, str), @"string: %@", str);
+  }
+}
+
+- (void)testMatching {
+  NSArray *patterns =
+    [NSArray arrayWithObjects:
+     @"^auth: .* failed$",
+     @"disk (full|error)",
+     @"timeout after [0-9]+ms",
+     @"ab+c",
+     @"ab*c",
+     @"x{2,3}y",
+     @"\\.conf",
+     @"[[:digit:]]+\\$",
+     @"Error",
+     @"(a|b)c|d",
+     @"\\(paren\\)",
+     @"[]]bracket",
+     @"[^a-z]z",
+     [NSString stringWithUTF8String:"caf\xC3\xA9 au lait"],
+     nil];
+  NSArray *strings =
+    [NSArray arrayWithObjects:
+     @"auth: user bob failed",
+     @"auth: user bob failed later",
+     @"xauth: user failed",
+     @"disk full on sda",
+     @"DISK FULL",
+     @"timeout after 250ms",
+     @"timeout after ms",
+     @"abc ac abbbc",
+     @"xxy xxxy xy",
+     @"/etc/hosts.conf",
+     @"costs 42$",
+     @"error Error ERROR",
+     @"bc",
+     @"d",
+     @"(paren) ]bracket Zz",
+     [NSString stringWithUTF8String:"un caf\xC3\xA9 au lait"],
+     [NSString stringWithUTF8String:"un CAF\xC3\xA9 AU LAIT"],
+     @"",
+     @"nothing to see",
+     nil];
+  for (int options = 0; options < 2; ++options) {
+    GTMRegexSet *set =
+      [GTMRegexSet regexSetWithPatterns:patterns
+                                options:(options ? kGTMRegexOptionIgnoreCase
+                                                 : 0)];
+    STAssertNotNil(set, nil);
+    STAssertEquals([set count], [patterns count], nil);
+    NSString *str = nil;
+    GTM_FOREACH_OBJECT(str, strings) {
+      STAssertTrue(MatchesLikeEachRegex(set, str), @"string: %@", str);
+    }
+  }
+}
+
+- (void)testRandomPatterns {
+  // random patterns made from bits w/ and w/o required text, checked against
+  // the regexes one at a time on random strings.
+  NSArray *atoms =
+    [NSArray arrayWithObjects:
+     @"a", @"b", @"A", @"c", @".", @"[ab]", @"[^a]", @"(ab|c)", @"(a)",
+     @"\\.", @"\\(", @"x", @"[[:alpha:]]", @"[]a]", @"ab", nil];
+  NSArray *quantifiers =
+    [NSArray arrayWithObjects:@"", @"", @"", @"*", @"+", @"?", @"{1,2}",
+     @"{0,1}", nil];
+  const char kStringChars[] = "abAcC.x()]B\n";
+  srandom(7);
+  for (int round = 0; round < 200; ++round) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSMutableArray *regexes = [NSMutableArray array];
+    NSUInteger numPatterns = 1 + (NSUInteger)(random() % 40);
+    for (NSUInteger x = 0; x < numPatterns; ++x) {
+      NSMutableString *pattern = [NSMutableString string];
+      if (random() % 4 == 0) [pattern appendString:@"^"];
+      NSUInteger numAtoms = 1 + (NSUInteger)(random() % 5);
+      for (NSUInteger y = 0; y < numAtoms; ++y) {
+        [pattern appendString:
+         [atoms objectAtIndex:(NSUInteger)random() % [atoms count]]];
+        [pattern appendString:
+         [quantifiers objectAtIndex:(NSUInteger)random() % [quantifiers count]]];
+        if (random() % 20 == 0) [pattern appendString:@"|"];
+      }
+      if (random() % 5 == 0) [pattern appendString:@"$"];
+      GTMRegexOptions options =
+        (random() % 3 == 0) ? kGTMRegexOptionIgnoreCase : 0;
+      NSError *error = nil;
+      GTMRegex *regex = [GTMRegex regexWithPattern:pattern
+                                           options:options
+                                         withError:&error];
+      if (regex) {
+        [regexes addObject:regex];
+      }
+    }
+    GTMRegexSet *set = [GTMRegexSet regexSetWithRegexes:regexes];
+    STAssertNotNil(set, nil);
+    for (int y = 0; y < 20; ++y) {
+      char buffer[32];
+      int length = (int)(random() % 30);
+      for (int z = 0; z < length; ++z) {
+        buffer[z] = kStringChars[random() % (sizeof(kStringChars) - 1)];
+      }
+      buffer[length] = '\0';
+      NSString *str = [NSString stringWithUTF8String:buffer];
+      STAssertTrue(MatchesLikeEachRegex(set, str), @"string: %@, set: %@",
+                   str, regexes);
+    }
+    [pool release];
+  }
+}
+
+// Reports routing log lines through 10, 100 and 1000 patterns, w/ the set and
+// w/ each regex in turn.
+- (void)testThroughput {
+  NSArray *verbs = [NSArray arrayWithObjects:@"started", @"stopped",
+                    @"failed", @"restarted", nil];
+  NSMutableArray *lines = [NSMutableArray array];
+  for (int x = 0; x < 200; ++x) {
+    [lines addObject:
+     [NSString stringWithFormat:@"2014-05-01 12:00:%02d svc%04d: %@ pid %d",
+      x % 60, (x * 37) % 1000, [verbs objectAtIndex:x % 4], 1000 + x]];
+  }
+  const NSUInteger kCounts[] = { 10, 100, 1000 };
+  for (size_t c = 0; c < sizeof(kCounts) / sizeof(kCounts[0]); ++c) {
+    NSMutableArray *patterns = [NSMutableArray array];
+    for (NSUInteger x = 0; x < kCounts[c]; ++x) {
+      [patterns addObject:
+       [NSString stringWithFormat:@"svc%04lu: (start|stopp)ed pid [0-9]+$",
+        (unsigned long)x]];
+    }
+    GTMRegexSet *set = [GTMRegexSet regexSetWithPatterns:patterns];
+    STAssertNotNil(set, nil);
+    STAssertEquals([set numberOfPrefilteredPatterns], kCounts[c], nil);
+
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSUInteger setMatches = 0;
+    GTMTestTimer *setTimer = GTMTestTimerCreate();
+    GTMTestTimerStart(setTimer);
+    NSString *line = nil;
+    GTM_FOREACH_OBJECT(line, lines) {
+      setMatches += [[set indexesOfPatternsMatchingString:line] count];
+    }
+    GTMTestTimerStop(setTimer);
+
+    NSUInteger eachMatches = 0;
+    GTMTestTimer *eachTimer = GTMTestTimerCreate();
+    GTMTestTimerStart(eachTimer);
+    GTM_FOREACH_OBJECT(line, lines) {
+      eachMatches += [MatchEachRegex(set, line) count];
+    }
+    GTMTestTimerStop(eachTimer);
+    [pool release];
+
+    STAssertEquals(setMatches, eachMatches, nil);
+    NSLog(@"Matching a line against %lu patterns: %.0f ns w/ GTMRegexSet, "
+          @"%.0f ns one at a time",
+          (unsigned long)kCounts[c],
+          GTMTestTimerGetNanoseconds(setTimer) / [lines count],
+          GTMTestTimerGetNanoseconds(eachTimer) / [lines count]);
+    GTMTestTimerRelease(setTimer);
+    GTMTestTimerRelease(eachTimer);
+  }
+}
+
+@end
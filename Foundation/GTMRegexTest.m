@@ -19,6 +19,7 @@
 #import "GTMSenTestCase.h"
 #import "GTMRegex.h"
 #import "GTMUnitTestDevLog.h"
+#import "GTMTestTimer.h"
 
 //
 // NOTE:
@@ -33,6 +34,32 @@
 @interface NSString_GTMRegexAdditions : GTMTestCase
 @end
 
+#if NS_BLOCKS_AVAILABLE
+// Describes a segment as "+text(sub,sub...)" for a match or "-text" for the
+// text between matches (w/ the ranges) so walks can be compared.
+static NSString *DescribeSegment(GTMRegexStringSegment *segment,
+                                 NSUInteger subPatternCount) {
+  NSMutableString *result =
+    [NSMutableString stringWithFormat:@"%c%@%@",
+     ([segment isMatch] ? '+' : '-'), [segment string],
+     NSStringFromRange([segment range])];
+  for (NSUInteger x = 1; x <= subPatternCount; ++x) {
+    [result appendFormat:@"(%@)", [segment subPatternString:x]];
+  }
+  return result;
+}
+
+static NSArray *DescribeEnumerator(NSEnumerator *enumerator,
+                                   NSUInteger subPatternCount) {
+  NSMutableArray *result = [NSMutableArray array];
+  GTMRegexStringSegment *segment = nil;
+  while ((segment = [enumerator nextObject]) != nil) {
+    [result addObject:DescribeSegment(segment, subPatternCount)];
+  }
+  return result;
+}
+#endif  // NS_BLOCKS_AVAILABLE
+
 @implementation GTMRegexTest
 
 - (void)testEscapedPatternForString {
@@ -497,6 +524,30 @@
   STAssertFalse([regex matchesSubStringInString:@""], nil);
 }
 
+- (void)testNumberOfMatchesInString {
+  GTMRegex *regex = [GTMRegex regexWithPattern:@"foo+"];
+  STAssertNotNil(regex, nil);
+  STAssertEquals([regex numberOfMatchesInString:@"fo bar foobar foofooo baz"],
+                 (NSUInteger)3, nil);
+  STAssertEquals([regex numberOfMatchesInString:@"abcdef"], (NSUInteger)0, nil);
+  STAssertEquals([regex numberOfMatchesInString:@""], (NSUInteger)0, nil);
+  STAssertEquals([regex numberOfMatchesInString:nil], (NSUInteger)0, nil);
+  // agrees w/ the enumerator, including '^' only matching at line starts
+  regex = [GTMRegex regexWithPattern:@"^[a-z]+"];
+  STAssertNotNil(regex, nil);
+  NSString *str = @"abc def\nghi\n jkl";
+  STAssertEquals([regex numberOfMatchesInString:str], (NSUInteger)2, nil);
+  STAssertEquals([regex numberOfMatchesInString:str],
+                 [[[regex matchSegmentEnumeratorForString:str] allObjects] count],
+                 nil);
+  // empty matches count, and move on a character (not a byte)
+  regex = [GTMRegex regexWithPattern:@"a*"];
+  STAssertNotNil(regex, nil);
+  STAssertEquals([regex numberOfMatchesInString:@"bab"], (NSUInteger)3, nil);
+  str = [NSString stringWithUTF8String:"\xC3\xA9\xE2\x82\xAC"];
+  STAssertEquals([regex numberOfMatchesInString:str], (NSUInteger)2, nil);
+}
+
 - (void)testSegmentEnumeratorForString {
   GTMRegex *regex = [GTMRegex regexWithPattern:@"foo+ba+r"];
   STAssertNotNil(regex, nil);
@@ -829,6 +880,252 @@
   STAssertNil(seg, nil);
 }
 
+- (void)testSegmentRanges {
+  // ASCII, the UTF-8 and UTF-16 ranges are the same
+  NSString *str = @"fo bar foobar foofooo baz";
+  GTMRegex *regex = [GTMRegex regexWithPattern:@"(f)(o+)|(z)"];
+  STAssertNotNil(regex, nil);
+  NSEnumerator *enumerator = [regex segmentEnumeratorForString:str];
+  STAssertNotNil(enumerator, nil);
+  GTMRegexStringSegment *seg = nil;
+  while ((seg = [enumerator nextObject]) != nil) {
+    STAssertEqualStrings([str substringWithRange:[seg range]], [seg string],
+                         nil);
+    STAssertEquals([seg utf8Range], [seg range], nil);
+    for (NSUInteger x = 0; x <= 3; ++x) {
+      NSString *sub = [seg subPatternString:x];
+      NSRange range = [seg rangeOfSubPattern:x];
+      if (sub) {
+        STAssertEqualStrings([str substringWithRange:range], sub, nil);
+      } else {
+        STAssertEquals(range.location, (NSUInteger)NSNotFound, nil);
+        STAssertEquals([seg utf8RangeOfSubPattern:x].location,
+                       (NSUInteger)NSNotFound, nil);
+      }
+    }
+    STAssertEquals([seg rangeOfSubPattern:4].location, (NSUInteger)NSNotFound,
+                   nil);
+  }
+
+  // two, three and four (a surrogate pair) byte characters, repeated enough
+  // to need a number of checkpoints
+  NSString *unit =
+    [NSString stringWithUTF8String:"caf\xC3\xA9 \xE2\x82\xAC" "5 "
+                                   "\xF0\x9F\x98\x80 foo! "];
+  NSMutableString *longStr = [NSMutableString string];
+  for (int i = 0; i < 200; ++i) {
+    [longStr appendString:unit];
+  }
+  regex = [GTMRegex regexWithPattern:@"foo|[0-9]"];
+  STAssertNotNil(regex, nil);
+  STAssertEquals([regex numberOfMatchesInString:longStr], (NSUInteger)400,
+                 nil);
+  enumerator = [regex segmentEnumeratorForString:longStr];
+  STAssertNotNil(enumerator, nil);
+  NSUInteger lastEnd = 0;
+  NSUInteger lastUTF8End = 0;
+  while ((seg = [enumerator nextObject]) != nil) {
+    // the segments cover the whole string, one after the other
+    NSRange range = [seg range];
+    STAssertEquals(range.location, lastEnd, nil);
+    STAssertEqualStrings([longStr substringWithRange:range], [seg string], nil);
+    lastEnd = NSMaxRange(range);
+    NSRange utf8Range = [seg utf8Range];
+    STAssertEquals(utf8Range.location, lastUTF8End, nil);
+    STAssertEquals(utf8Range.length,
+                   [[seg string] lengthOfBytesUsingEncoding:NSUTF8StringEncoding],
+                   nil);
+    lastUTF8End = NSMaxRange(utf8Range);
+  }
+  STAssertEquals(lastEnd, [longStr length], nil);
+  STAssertEquals(lastUTF8End,
+                 [longStr lengthOfBytesUsingEncoding:NSUTF8StringEncoding],
+                 nil);
+  // and the same again, looking things up from the end back to the start
+  NSArray *segments = [[regex segmentEnumeratorForString:longStr] allObjects];
+  for (NSUInteger x = [segments count]; x > 0; --x) {
+    seg = [segments objectAtIndex:x - 1];
+    STAssertEqualStrings([longStr substringWithRange:[seg range]],
+                         [seg string], nil);
+  }
+}
+
+// Reports what finding the matches in a big, non-ASCII string costs when
+// making strings, getting ranges, and just counting.
+- (void)testSegmentRangeThroughput {
+  NSString *unit =
+    [NSString stringWithUTF8String:"Caf\xC3\xA9 au lait, "
+                                   "\xE2\x82\xAC" "3.50 \xF0\x9F\x98\x80\n"];
+  NSMutableString *str = [NSMutableString string];
+  for (int i = 0; i < 20000; ++i) {
+    [str appendString:unit];
+  }
+  GTMRegex *regex = [GTMRegex regexWithPattern:@"[0-9]+|lait"];
+  STAssertNotNil(regex, nil);
+  NSUInteger expected = [regex numberOfMatchesInString:str];
+  STAssertEquals(expected, (NSUInteger)60000, nil);
+
+  const char *kModes[] = { "strings", "ranges", "count" };
+  for (size_t mode = 0; mode < sizeof(kModes) / sizeof(kModes[0]); ++mode) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    GTMTestTimer *timer = GTMTestTimerCreate();
+    GTMTestTimerStart(timer);
+    NSUInteger found = 0;
+    if (mode == 2) {
+      found = [regex numberOfMatchesInString:str];
+    } else {
+      NSEnumerator *enumerator = [regex matchSegmentEnumeratorForString:str];
+      GTMRegexStringSegment *seg = nil;
+      NSUInteger total = 0;
+      while ((seg = [enumerator nextObject]) != nil) {
+        if (mode == 0) {
+          total += [[seg string] length];
+        } else {
+          total += [seg range].length;
+        }
+        ++found;
+      }
+      STAssertGreaterThan(total, (NSUInteger)0, nil);
+    }
+    GTMTestTimerStop(timer);
+    [pool release];
+    STAssertEquals(found, expected, nil);
+    NSLog(@"Matching a %lu character string (%s): %.0f ns per match",
+          (unsigned long)[str length], kModes[mode],
+          GTMTestTimerGetNanoseconds(timer) / expected);
+    GTMTestTimerRelease(timer);
+  }
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+- (void)testEnumerateSegmentsInString {
+  NSArray *patterns =
+    [NSArray arrayWithObjects:
+     @"foo+", @"(fo(o+))((bar)|(baz))", @"^[a-z]+", @"[0-9]", @"x", nil];
+  NSArray *strings =
+    [NSArray arrayWithObjects:
+     @"fo bar foobar foofooo baz", @"foooooobaz foobar abc", @"x",
+     @"abc def\nghi\n jkl", @"", @"no matches here",
+     [NSString stringWithUTF8String:"caf\xC3\xA9 foo 4 \xF0\x9F\x98\x80 x"],
+     nil];
+  NSString *pattern = nil;
+  GTM_FOREACH_OBJECT(pattern, patterns) {
+    GTMRegex *regex = [GTMRegex regexWithPattern:pattern];
+    STAssertNotNil(regex, nil);
+    NSUInteger subPatternCount = [regex subPatternCount];
+    NSString *str = nil;
+    GTM_FOREACH_OBJECT(str, strings) {
+      __block NSMutableArray *segments = [NSMutableArray array];
+      [regex enumerateSegmentsInString:str
+                            usingBlock:^(GTMRegexStringSegment *segment,
+                                         BOOL *stop) {
+        [segments addObject:DescribeSegment(segment, subPatternCount)];
+      }];
+      STAssertEqualObjects(segments,
+                           DescribeEnumerator([regex segmentEnumeratorForString:str],
+                                              subPatternCount),
+                           @"pattern: %@ string: %@", pattern, str);
+
+      segments = [NSMutableArray array];
+      [regex enumerateMatchSegmentsInString:str
+                                 usingBlock:^(GTMRegexStringSegment *segment,
+                                              BOOL *stop) {
+        [segments addObject:DescribeSegment(segment, subPatternCount)];
+      }];
+      STAssertEqualObjects(segments,
+                           DescribeEnumerator([regex matchSegmentEnumeratorForString:str],
+                                              subPatternCount),
+                           @"pattern: %@ string: %@", pattern, str);
+    }
+  }
+
+  // stopping early
+  GTMRegex *regex = [GTMRegex regexWithPattern:@"foo+"];
+  STAssertNotNil(regex, nil);
+  __block NSUInteger count = 0;
+  [regex enumerateSegmentsInString:@"fo bar foobar foofooo baz"
+                        usingBlock:^(GTMRegexStringSegment *segment,
+                                     BOOL *stop) {
+    if (++count == 2) {
+      *stop = YES;
+    }
+  }];
+  STAssertEquals(count, (NSUInteger)2, nil);
+
+  // nil in, nothing out
+  count = 0;
+  [regex enumerateSegmentsInString:nil
+                        usingBlock:^(GTMRegexStringSegment *segment,
+                                     BOOL *stop) {
+    ++count;
+  }];
+  STAssertEquals(count, (NSUInteger)0, nil);
+  [regex enumerateSegmentsInString:@"foo" usingBlock:nil];
+
+  // empty matches still cover the whole string
+  regex = [GTMRegex regexWithPattern:@"a*"];
+  STAssertNotNil(regex, nil);
+  __block NSMutableString *joined = [NSMutableString string];
+  __block NSUInteger matches = 0;
+  [regex enumerateSegmentsInString:@"bab"
+                        usingBlock:^(GTMRegexStringSegment *segment,
+                                     BOOL *stop) {
+    [joined appendString:[segment string]];
+    if ([segment isMatch]) ++matches;
+  }];
+  STAssertEqualStrings(joined, @"bab", nil);
+  STAssertEquals(matches, [regex numberOfMatchesInString:@"bab"], nil);
+}
+
+// Reports splitting a big string into lines w/ the enumerator and w/ the
+// block (just looking at the ranges).
+- (void)testEnumerateSegmentsThroughput {
+  NSMutableString *str = [NSMutableString string];
+  for (int i = 0; i < 50000; ++i) {
+    [str appendFormat:@"line %d of the file, w/ some text on it\n", i];
+  }
+  GTMRegex *regex = [GTMRegex regexWithPattern:@"\n"];
+  STAssertNotNil(regex, nil);
+
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  GTMTestTimer *timer = GTMTestTimerCreate();
+  GTMTestTimerStart(timer);
+  NSUInteger enumeratorLines = 0;
+  NSEnumerator *enumerator = [regex segmentEnumeratorForString:str];
+  GTMRegexStringSegment *segment = nil;
+  while ((segment = [enumerator nextObject]) != nil) {
+    if (![segment isMatch] && [segment utf8Range].length) ++enumeratorLines;
+  }
+  GTMTestTimerStop(timer);
+  [pool release];
+  NSLog(@"Splitting %lu lines w/ -segmentEnumeratorForString: %.0f ns a line",
+        (unsigned long)enumeratorLines,
+        GTMTestTimerGetNanoseconds(timer) / enumeratorLines);
+  GTMTestTimerRelease(timer);
+
+  pool = [[NSAutoreleasePool alloc] init];
+  timer = GTMTestTimerCreate();
+  GTMTestTimerStart(timer);
+  __block NSUInteger blockLines = 0;
+  [regex enumerateSegmentsInString:str
+                        usingBlock:^(GTMRegexStringSegment *seg, BOOL *stop) {
+    if (![seg isMatch] && [seg utf8Range].length) ++blockLines;
+  }];
+  GTMTestTimerStop(timer);
+  [pool release];
+  NSLog(@"Splitting %lu lines w/ -enumerateSegmentsInString:usingBlock: "
+        @"%.0f ns a line",
+        (unsigned long)blockLines,
+        GTMTestTimerGetNanoseconds(timer) / blockLines);
+  GTMTestTimerRelease(timer);
+
+  STAssertEquals(blockLines, (NSUInteger)50000, nil);
+  STAssertEquals(enumeratorLines, blockLines, nil);
+}
+
+#endif  // NS_BLOCKS_AVAILABLE
+
 - (void)testStringByReplacingMatchesInStringWithReplacement {
   GTMRegex *regex = [GTMRegex regexWithPattern:@"(foo)(.*)(bar)"];
   STAssertNotNil(regex, nil);
@@ -905,6 +1202,158 @@
                       @"failed to get a reasonable description for regex w/ options");
 }
 
+- (void)testPatternCache {
+  NSUInteger oldLimit = [GTMRegex patternCacheLimit];
+  [GTMRegex resetPatternCache];
+  [GTMRegex setPatternCacheLimit:2];
+
+  // first use is a miss, after that the same object comes back
+  GTMRegex *regex = [GTMRegex cachedRegexWithPattern:@"a+" options:0];
+  STAssertNotNil(regex, nil);
+  STAssertTrue([regex matchesString:@"aaa"], nil);
+  STAssertEquals([GTMRegex patternCacheMissCount], (uint64_t)1, nil);
+  STAssertEquals([GTMRegex patternCacheHitCount], (uint64_t)0, nil);
+  STAssertEquals([GTMRegex cachedRegexWithPattern:@"a+" options:0], regex, nil);
+  NSMutableString *mutablePattern = [NSMutableString stringWithString:@"a"];
+  [mutablePattern appendString:@"+"];
+  STAssertEquals([GTMRegex cachedRegexWithPattern:mutablePattern options:0],
+                 regex, nil);
+  // changing the string we looked up with doesn't change the cache
+  [mutablePattern setString:@"b+"];
+  STAssertEquals([GTMRegex cachedRegexWithPattern:@"a+" options:0], regex, nil);
+  STAssertEquals([GTMRegex patternCacheHitCount], (uint64_t)3, nil);
+
+  // the options are part of the key
+  GTMRegex *caseless =
+    [GTMRegex cachedRegexWithPattern:@"a+" options:kGTMRegexOptionIgnoreCase];
+  STAssertNotNil(caseless, nil);
+  STAssertTrue(caseless != regex, nil);
+  STAssertTrue([caseless matchesString:@"AaA"], nil);
+  STAssertFalse([regex matchesString:@"AaA"], nil);
+  STAssertEquals([GTMRegex patternCacheMissCount], (uint64_t)2, nil);
+
+  // use "a+" so the caseless one is the least recently used, then push it out
+  STAssertEquals([GTMRegex cachedRegexWithPattern:@"a+" options:0], regex, nil);
+  STAssertNotNil([GTMRegex cachedRegexWithPattern:@"b+" options:0], nil);
+  STAssertEquals([GTMRegex patternCacheEvictionCount], (uint64_t)1, nil);
+  STAssertEquals([GTMRegex cachedRegexWithPattern:@"a+" options:0], regex, nil);
+  STAssertEquals([GTMRegex patternCacheMissCount], (uint64_t)3, nil);
+  STAssertTrue([GTMRegex cachedRegexWithPattern:@"a+"
+                                        options:kGTMRegexOptionIgnoreCase]
+               != caseless, nil);
+  STAssertEquals([GTMRegex patternCacheMissCount], (uint64_t)4, nil);
+  STAssertEquals([GTMRegex patternCacheEvictionCount], (uint64_t)2, nil);
+
+  // bad patterns aren't cached
+  [GTMUnitTestDevLog expectString:@"Invalid pattern \"(.\", error: \"parentheses not balanced\""];
+  STAssertNil([GTMRegex cachedRegexWithPattern:@"(." options:0], nil);
+  [GTMUnitTestDevLog expectString:@"Invalid pattern \"(.\", error: \"parentheses not balanced\""];
+  STAssertNil([GTMRegex cachedRegexWithPattern:@"(." options:0], nil);
+  STAssertEquals([GTMRegex patternCacheMissCount], (uint64_t)6, nil);
+  STAssertNil([GTMRegex cachedRegexWithPattern:nil options:0], nil);
+  STAssertNil([GTMRegex cachedRegexWithPattern:@"" options:0], nil);
+
+  // lowering the limit evicts, zero disables
+  [GTMRegex setPatternCacheLimit:1];
+  STAssertEquals([GTMRegex patternCacheEvictionCount], (uint64_t)3, nil);
+  [GTMRegex setPatternCacheLimit:0];
+  STAssertEquals([GTMRegex patternCacheLimit], (NSUInteger)0, nil);
+  STAssertEquals([GTMRegex patternCacheEvictionCount], (uint64_t)4, nil);
+  GTMRegex *uncached = [GTMRegex cachedRegexWithPattern:@"a+" options:0];
+  STAssertNotNil(uncached, nil);
+  STAssertTrue([GTMRegex cachedRegexWithPattern:@"a+" options:0] != uncached,
+               nil);
+  STAssertEquals([GTMRegex patternCacheHitCount], (uint64_t)5, nil);
+  STAssertEquals([GTMRegex patternCacheMissCount], (uint64_t)6, nil);
+
+  [GTMRegex resetPatternCache];
+  STAssertEquals([GTMRegex patternCacheHitCount], (uint64_t)0, nil);
+  STAssertEquals([GTMRegex patternCacheMissCount], (uint64_t)0, nil);
+  STAssertEquals([GTMRegex patternCacheEvictionCount], (uint64_t)0, nil);
+  [GTMRegex setPatternCacheLimit:oldLimit];
+}
+
+// Hammers a small cache from several threads so lookups, compiles and
+// evictions all overlap.
+- (void)patternCacheThread:(NSConditionLock *)lock {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  for (int i = 0; i < 2000; ++i) {
+    NSString *pattern = [NSString stringWithFormat:@"x%d+y", i % 7];
+    NSString *str = [NSString stringWithFormat:@"x%dy", i % 7];
+    if (![[GTMRegex cachedRegexWithPattern:pattern options:0]
+          matchesString:str]) {
+      [lock lock];
+      [lock unlockWithCondition:-1]; // COV_NF_LINE - only on failure
+      break; // COV_NF_LINE - only on failure
+    }
+  }
+  [lock lock];
+  [lock unlockWithCondition:([lock condition] < 0 ? -1 : [lock condition] + 1)];
+  [pool release];
+}
+
+- (void)testPatternCacheThreads {
+  NSUInteger oldLimit = [GTMRegex patternCacheLimit];
+  [GTMRegex resetPatternCache];
+  [GTMRegex setPatternCacheLimit:4];
+  const NSInteger kThreads = 4;
+  NSConditionLock *lock = [[[NSConditionLock alloc] initWithCondition:0]
+                           autorelease];
+  for (NSInteger i = 0; i < kThreads; ++i) {
+    [NSThread detachNewThreadSelector:@selector(patternCacheThread:)
+                             toTarget:self
+                           withObject:lock];
+  }
+  STAssertTrue([lock lockWhenCondition:kThreads
+                            beforeDate:[NSDate dateWithTimeIntervalSinceNow:60]],
+               @"a thread failed to match (or took too long)");
+  [lock unlock];
+  STAssertEquals([GTMRegex patternCacheHitCount] +
+                 [GTMRegex patternCacheMissCount],
+                 (uint64_t)(2000 * kThreads), nil);
+  [GTMRegex resetPatternCache];
+  [GTMRegex setPatternCacheLimit:oldLimit];
+}
+
+// Reports what a convenience call costs w/ the cache and w/o it.
+- (void)testPatternCacheThroughput {
+  NSUInteger oldLimit = [GTMRegex patternCacheLimit];
+  NSArray *patterns =
+    [NSArray arrayWithObjects:
+     @"^[A-Za-z0-9._%+-]+@[A-Za-z0-9.-]+\\.[A-Za-z]{2,}$",
+     @"([0-9]+)-([0-9]+)", @"^ +| +$", @"(foo|bar)+baz", nil];
+  NSString *input = @"user@example.com 1600-2400 foobarbaz";
+  const int kRepeats = 20000;
+  for (int pass = 0; pass < 2; ++pass) {
+    [GTMRegex resetPatternCache];
+    [GTMRegex setPatternCacheLimit:(pass ? oldLimit : 0)];
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    GTMTestTimer *timer = GTMTestTimerCreate();
+    GTMTestTimerStart(timer);
+    for (int i = 0; i < kRepeats; ++i) {
+      for (NSUInteger j = 0; j < [patterns count]; ++j) {
+        [input gtm_subStringMatchesPattern:[patterns objectAtIndex:j]];
+      }
+      if (i % 1000 == 0) {
+        [pool release];
+        pool = [[NSAutoreleasePool alloc] init];
+      }
+    }
+    GTMTestTimerStop(timer);
+    [pool release];
+    NSLog(@"gtm_subStringMatchesPattern: w/ the cache %@: %.0f ns each",
+          (pass ? @"on" : @"off"),
+          GTMTestTimerGetNanoseconds(timer) / (kRepeats * [patterns count]));
+    GTMTestTimerRelease(timer);
+    if (pass) {
+      STAssertEquals([GTMRegex patternCacheMissCount],
+                     (uint64_t)[patterns count], nil);
+    }
+  }
+  [GTMRegex resetPatternCache];
+  [GTMRegex setPatternCacheLimit:oldLimit];
+}
+
 @end
 
 @implementation NSString_GTMRegexAdditions
@@ -1199,6 +1648,15 @@
   STAssertEqualStrings([segments objectAtIndex:0], @"foobar", nil);
 }
 
+- (void)testNumberOfMatchesOfPattern {
+  NSString *str = @"fo bar foobar foofooo baz";
+  STAssertEquals([str gtm_numberOfMatchesOfPattern:@"foo+"], (NSUInteger)3, nil);
+  STAssertEquals([@"abcdef" gtm_numberOfMatchesOfPattern:@"foo+"],
+                 (NSUInteger)0, nil);
+  STAssertEquals([@"" gtm_numberOfMatchesOfPattern:@"foo+"], (NSUInteger)0,
+                 nil);
+}
+
 - (void)testStringByReplacingMatchesOfPatternWithReplacement {
   // the basics
   STAssertEqualStrings(@"weeZbarZbydoo spamZfooZdoggies",
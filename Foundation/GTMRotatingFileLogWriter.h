@@ -0,0 +1,110 @@
+//
+//  GTMRotatingFileLogWriter.h
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMLogger.h"
+#import "GTMDefines.h"
+
+// GTMRotatingFileLogWriter is a GTMLogWriter that writes lines to a file and
+// starts a new file once the current one reaches a size limit and/or has been
+// in use for a given amount of time.  The |generations| most recent retired
+// files are kept next to it as path.1, path.2, ... (path.1 being the newest),
+// gzipped to path.1.gz etc. unless compression is turned off.  Retired files
+// are renamed out of the way straight away and then shuffled along and
+// compressed on a background thread, so logging doesn't wait on them.
+//
+// Messages are collected in a buffer and written with one write(2) when the
+// buffer fills up, when |flushInterval| has passed since the last write (this
+// is checked as messages are logged, there is no timer), or when an Error or
+// Assert level message is logged.  Call -flush to write out what is buffered.
+//
+// How to use:
+//
+//   GTMRotatingFileLogWriter *writer =
+//       [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:@"/tmp/app.log"
+//                                                   maxFileSize:1024 * 1024
+//                                              rotationInterval:24 * 60 * 60
+//                                                   generations:7];
+//   [[GTMLogger sharedLogger] setWriter:writer];
+//
+@interface GTMRotatingFileLogWriter : NSObject <GTMLogWriter> {
+ @private
+  NSString *path_;
+  unsigned long long maxFileSize_;
+  NSTimeInterval rotationInterval_;
+  NSUInteger generations_;
+  BOOL compressesRotatedFiles_;
+  int fd_;
+  unsigned long long fileSize_;      // Bytes written to the current file.
+  CFAbsoluteTime rotationDeadline_;  // When to rotate, if there's an interval.
+  char *buffer_;
+  NSUInteger bufferSize_;
+  NSUInteger bufferLength_;
+  NSTimeInterval flushInterval_;
+  CFAbsoluteTime lastFlush_;
+  NSOperationQueue *retireQueue_;
+  NSUInteger rotationCount_;
+}
+
+// Returns an autoreleased writer, see the designated initializer.
++ (id)rotatingFileLogWriterWithPath:(NSString *)path
+                        maxFileSize:(unsigned long long)maxFileSize
+                   rotationInterval:(NSTimeInterval)rotationInterval
+                        generations:(NSUInteger)generations;
+
+// Designated initializer.  Opens |path| for appending (creating it if needed).
+// A |maxFileSize| of 0 or |rotationInterval| <= 0 turns off that trigger.
+// With 0 |generations| retired files are simply deleted.  Returns nil if
+// |path| is nil or can't be opened.
+- (id)initWithPath:(NSString *)path
+       maxFileSize:(unsigned long long)maxFileSize
+  rotationInterval:(NSTimeInterval)rotationInterval
+       generations:(NSUInteger)generations;
+
+- (NSString *)path;
+- (unsigned long long)maxFileSize;
+- (NSTimeInterval)rotationInterval;
+- (NSUInteger)generations;
+
+// Whether retired files get gzipped.  Defaults to YES.
+- (BOOL)compressesRotatedFiles;
+- (void)setCompressesRotatedFiles:(BOOL)compresses;
+
+// The size of the write buffer.  Defaults to 64KB; 0 writes every message
+// straight away.
+- (NSUInteger)bufferSize;
+- (void)setBufferSize:(NSUInteger)size;
+
+// The longest a buffered message waits before being written, as long as
+// something else gets logged.  Defaults to 1 second.
+- (NSTimeInterval)flushInterval;
+- (void)setFlushInterval:(NSTimeInterval)interval;
+
+// Writes out anything that is buffered.
+- (void)flush;
+
+// Retires the current file now, whatever its size or age.
+- (void)rotate;
+
+// How many times the file has been rotated.
+- (NSUInteger)rotationCount;
+
+// Blocks until the background work for every file retired so far (renaming
+// and compression) is done.
+- (void)waitForRetiredFiles;
+
+@end  // GTMRotatingFileLogWriter
@@ -0,0 +1,446 @@
+//
+//  GTMRotatingFileLogWriter.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMRotatingFileLogWriter.h"
+#import <errno.h>
+#import <fcntl.h>
+#import <sys/stat.h>
+#import <sys/uio.h>
+#import <unistd.h>
+#import <zlib.h>
+#import "GTMZlibStream.h"
+
+static const NSUInteger kDefaultBufferSize = 64 * 1024;
+static const NSTimeInterval kDefaultFlushInterval = 1.0;
+
+// Writes all of |length| bytes, retrying on EINTR and short writes. Returns
+// how many bytes were written.
+static size_t WriteFully(int fd, const char *bytes, size_t length) {
+  size_t total = 0;
+  while (total < length) {
+    ssize_t written = write(fd, bytes + total, length - total);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    total += (size_t)written;
+  }
+  return total;
+}
+
+// Writes |length| bytes and a newline with as few write(2)s as possible,
+// normally one, so lines from several writers appending to the same file
+// don't get mixed up. Returns how many bytes were written.
+static size_t WriteLineFully(int fd, const char *bytes, size_t length) {
+  static char newline = '\n';
+  struct iovec pieces[2];
+  pieces[0].iov_base = (void *)bytes;
+  pieces[0].iov_len = length;
+  pieces[1].iov_base = &newline;
+  pieces[1].iov_len = 1;
+  ssize_t written;
+  do {
+    written = writev(fd, pieces, 2);
+  } while (written < 0 && errno == EINTR);
+  if (written < 0) return 0;
+  size_t total = (size_t)written;
+  // Only a short write leaves anything to do.
+  if (total < length) {
+    total += WriteFully(fd, bytes + total, length - total);
+  }
+  if (total == length) {
+    total += WriteFully(fd, "\n", 1);
+  }
+  return total;
+}
+
+// The background work for one retired file: moves the older generations
+// along and puts the retired file in as generation 1, gzipping it on the way.
+@interface GTMRetiredLogFile : NSObject <GTMZlibStreamDelegate> {
+ @private
+  NSString *retiredPath_;
+  NSString *basePath_;
+  NSUInteger generations_;
+  BOOL compress_;
+  int gzipFD_;  // Where the gzipped output goes while compressing.
+  BOOL gzipFailed_;
+}
+- (id)initWithRetiredPath:(NSString *)retiredPath
+                 basePath:(NSString *)basePath
+              generations:(NSUInteger)generations
+                 compress:(BOOL)compress;
+- (void)retire;
+@end
+
+@implementation GTMRetiredLogFile
+
+- (id)initWithRetiredPath:(NSString *)retiredPath
+                 basePath:(NSString *)basePath
+              generations:(NSUInteger)generations
+                 compress:(BOOL)compress {
+  if ((self = [super init])) {
+    retiredPath_ = [retiredPath copy];
+    basePath_ = [basePath copy];
+    generations_ = generations;
+    compress_ = compress;
+    gzipFD_ = -1;
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [retiredPath_ release];
+  [basePath_ release];
+  [super dealloc];
+}
+
+- (NSString *)pathForGeneration:(NSUInteger)generation
+                     compressed:(BOOL)compressed {
+  return [NSString stringWithFormat:@"%@.%lu%@", basePath_,
+          (unsigned long)generation, compressed ? @".gz" : @""];
+}
+
+// Gzips the retired file into |path| a piece at a time, so memory use doesn't
+// grow with the size of the file. Returns NO, leaving nothing at |path|, if it
+// couldn't be done.
+- (BOOL)gzipToPath:(NSString *)path {
+  int input = open([retiredPath_ fileSystemRepresentation], O_RDONLY);
+  if (input < 0) return NO;  // COV_NF_LINE
+  NSString *tempPath = [path stringByAppendingString:@".tmp"];
+  gzipFD_ = open([tempPath fileSystemRepresentation],
+                 O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  gzipFailed_ = NO;
+  const size_t kChunkSize = 64 * 1024;
+  char *chunk = malloc(kChunkSize);
+  GTMZlibDeflater *gzipper =
+      [[[GTMZlibDeflater alloc] initWithMode:kGTMZlibModeGzip
+                            compressionLevel:Z_DEFAULT_COMPRESSION
+                                    delegate:self] autorelease];
+  BOOL ok = (gzipFD_ >= 0 && chunk && gzipper);
+  while (ok) {
+    ssize_t got = read(input, chunk, kChunkSize);
+    if (got == 0) break;
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      ok = NO;  // COV_NF_LINE
+    } else {
+      ok = [gzipper processBytes:chunk length:(NSUInteger)got];
+    }
+  }
+  ok = ok && [gzipper finish] && !gzipFailed_;
+  free(chunk);
+  close(input);
+  if (gzipFD_ >= 0) {
+    if (close(gzipFD_) != 0) ok = NO;  // COV_NF_LINE
+    gzipFD_ = -1;
+    if (ok) {
+      ok = (rename([tempPath fileSystemRepresentation],
+                   [path fileSystemRepresentation]) == 0);
+    }
+    if (!ok) unlink([tempPath fileSystemRepresentation]);
+  }
+  return ok;
+}
+
+// From the GTMZlibStreamDelegate protocol.
+- (void)zlibStream:(GTMZlibStream *)stream
+   didProduceBytes:(const void *)bytes
+            length:(NSUInteger)length {
+  if (WriteFully(gzipFD_, bytes, length) != length) gzipFailed_ = YES;
+}
+
+- (void)retire {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  // A private instance, the shared one isn't safe to use off the main thread.
+  NSFileManager *fm = [[[NSFileManager alloc] init] autorelease];
+  if (generations_ == 0) {
+    [fm removeItemAtPath:retiredPath_ error:NULL];
+    [pool release];
+    return;
+  }
+
+  // Either flavor of a generation may be there, compression can be turned on
+  // and off, and a retired file that couldn't be gzipped is kept as is.
+  for (int compressed = 0; compressed < 2; ++compressed) {
+    [fm removeItemAtPath:[self pathForGeneration:generations_
+                                      compressed:compressed]
+                   error:NULL];
+    for (NSUInteger generation = generations_ - 1; generation > 0;
+         --generation) {
+      NSString *from = [self pathForGeneration:generation
+                                    compressed:compressed];
+      NSString *to = [self pathForGeneration:generation + 1
+                                  compressed:compressed];
+      rename([from fileSystemRepresentation], [to fileSystemRepresentation]);
+    }
+  }
+
+  if (compress_ && [self gzipToPath:[self pathForGeneration:1
+                                                   compressed:YES]]) {
+    [fm removeItemAtPath:retiredPath_ error:NULL];
+    [pool release];
+    return;
+  }
+  rename([retiredPath_ fileSystemRepresentation],
+         [[self pathForGeneration:1 compressed:NO] fileSystemRepresentation]);
+  [pool release];
+}
+
+@end  // GTMRetiredLogFile
+
+
+@interface GTMRotatingFileLogWriter (PrivateMethods)
+// These all assume the caller is synchronized.
+- (BOOL)openFile;
+- (void)flushLocked:(CFAbsoluteTime)now;
+- (void)rotateLocked:(CFAbsoluteTime)now;
+@end
+
+@implementation GTMRotatingFileLogWriter
+
++ (id)rotatingFileLogWriterWithPath:(NSString *)path
+                        maxFileSize:(unsigned long long)maxFileSize
+                   rotationInterval:(NSTimeInterval)rotationInterval
+                        generations:(NSUInteger)generations {
+  return [[[self alloc] initWithPath:path
+                         maxFileSize:maxFileSize
+                    rotationInterval:rotationInterval
+                         generations:generations] autorelease];
+}
+
+- (id)initWithPath:(NSString *)path
+       maxFileSize:(unsigned long long)maxFileSize
+  rotationInterval:(NSTimeInterval)rotationInterval
+       generations:(NSUInteger)generations {
+  if ((self = [super init])) {
+    path_ = [path copy];
+    maxFileSize_ = maxFileSize;
+    rotationInterval_ = rotationInterval;
+    generations_ = generations;
+    compressesRotatedFiles_ = YES;
+    fd_ = -1;
+    bufferSize_ = kDefaultBufferSize;
+    buffer_ = malloc(bufferSize_);
+    flushInterval_ = kDefaultFlushInterval;
+    retireQueue_ = [[NSOperationQueue alloc] init];
+    [retireQueue_ setMaxConcurrentOperationCount:1];
+    if (!path_ || !buffer_ || !retireQueue_ || ![self openFile]) {
+      [self release];
+      return nil;
+    }
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    lastFlush_ = now;
+    rotationDeadline_ = now + rotationInterval_;
+  }
+  return self;
+}
+
+- (id)init {
+  return [self initWithPath:nil maxFileSize:0 rotationInterval:0 generations:0];
+}
+
+- (void)dealloc {
+  if (fd_ >= 0) {
+    [self flushLocked:CFAbsoluteTimeGetCurrent()];
+    close(fd_);
+  }
+  // Let the background work finish before the files go unattended.
+  [retireQueue_ waitUntilAllOperationsAreFinished];
+  [retireQueue_ release];
+  free(buffer_);
+  [path_ release];
+  [super dealloc];
+}
+
+- (NSString *)path {
+  return path_;
+}
+
+- (unsigned long long)maxFileSize {
+  return maxFileSize_;
+}
+
+- (NSTimeInterval)rotationInterval {
+  return rotationInterval_;
+}
+
+- (NSUInteger)generations {
+  return generations_;
+}
+
+- (BOOL)compressesRotatedFiles {
+  BOOL result;
+  @synchronized(self) {
+    result = compressesRotatedFiles_;
+  }
+  return result;
+}
+
+- (void)setCompressesRotatedFiles:(BOOL)compresses {
+  @synchronized(self) {
+    compressesRotatedFiles_ = compresses;
+  }
+}
+
+- (NSUInteger)bufferSize {
+  NSUInteger result;
+  @synchronized(self) {
+    result = bufferSize_;
+  }
+  return result;
+}
+
+- (void)setBufferSize:(NSUInteger)size {
+  @synchronized(self) {
+    [self flushLocked:CFAbsoluteTimeGetCurrent()];
+    char *buffer = realloc(buffer_, size ? size : 1);
+    if (buffer) {
+      buffer_ = buffer;
+      bufferSize_ = size;
+    }
+  }
+}
+
+- (NSTimeInterval)flushInterval {
+  NSTimeInterval result;
+  @synchronized(self) {
+    result = flushInterval_;
+  }
+  return result;
+}
+
+- (void)setFlushInterval:(NSTimeInterval)interval {
+  @synchronized(self) {
+    flushInterval_ = interval;
+  }
+}
+
+- (void)flush {
+  @synchronized(self) {
+    [self flushLocked:CFAbsoluteTimeGetCurrent()];
+  }
+}
+
+- (void)rotate {
+  @synchronized(self) {
+    [self rotateLocked:CFAbsoluteTimeGetCurrent()];
+  }
+}
+
+- (NSUInteger)rotationCount {
+  NSUInteger result;
+  @synchronized(self) {
+    result = rotationCount_;
+  }
+  return result;
+}
+
+- (void)waitForRetiredFiles {
+  [retireQueue_ waitUntilAllOperationsAreFinished];
+}
+
+- (BOOL)openFile {
+  fd_ = open([path_ fileSystemRepresentation],
+             O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd_ < 0) return NO;
+  struct stat info;
+  fileSize_ = (fstat(fd_, &info) == 0) ? (unsigned long long)info.st_size : 0;
+  return YES;
+}
+
+- (void)flushLocked:(CFAbsoluteTime)now {
+  lastFlush_ = now;
+  if (!bufferLength_ || fd_ < 0) return;
+  fileSize_ += WriteFully(fd_, buffer_, bufferLength_);
+  bufferLength_ = 0;
+}
+
+- (void)rotateLocked:(CFAbsoluteTime)now {
+  [self flushLocked:now];
+  rotationDeadline_ = now + rotationInterval_;
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+
+  // Move the file out of the way under a name of its own, so the next
+  // rotation can't collide with it while it waits for the background thread.
+  ++rotationCount_;
+  NSString *retiredPath =
+      [path_ stringByAppendingFormat:@".retired-%d-%lu",
+       getpid(), (unsigned long)rotationCount_];
+  if (rename([path_ fileSystemRepresentation],
+             [retiredPath fileSystemRepresentation]) == 0) {
+    GTMRetiredLogFile *retired =
+        [[[GTMRetiredLogFile alloc] initWithRetiredPath:retiredPath
+                                               basePath:path_
+                                            generations:generations_
+                                               compress:compressesRotatedFiles_]
+          autorelease];
+    NSInvocationOperation *operation =
+        [[[NSInvocationOperation alloc] initWithTarget:retired
+                                              selector:@selector(retire)
+                                                object:nil] autorelease];
+    [retireQueue_ addOperation:operation];
+  }
+  [self openFile];
+}
+
+// From the GTMLogWriter protocol.
+- (void)logMessage:(NSString *)msg level:(GTMLoggerLevel)level {
+  if (!msg) return;
+  const char *utf8 = [msg UTF8String];
+  if (!utf8) return;
+  size_t length = strlen(utf8);
+
+  @synchronized(self) {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (rotationInterval_ > 0 && now >= rotationDeadline_) {
+      if (fileSize_ + bufferLength_) {
+        [self rotateLocked:now];
+      } else {
+        // Nothing to retire, just start the next interval.
+        rotationDeadline_ = now + rotationInterval_;
+      }
+    }
+    unsigned long long pending = fileSize_ + bufferLength_;
+    if (maxFileSize_ && pending && pending + length + 1 > maxFileSize_) {
+      [self rotateLocked:now];
+    }
+
+    if (bufferLength_ + length + 1 > bufferSize_) {
+      [self flushLocked:now];
+    }
+    if (length + 1 > bufferSize_) {
+      // Too big to buffer.
+      if (fd_ >= 0) {
+        fileSize_ += WriteLineFully(fd_, utf8, length);
+      }
+    } else {
+      memcpy(buffer_ + bufferLength_, utf8, length);
+      buffer_[bufferLength_ + length] = '\n';
+      bufferLength_ += length + 1;
+    }
+
+    if (level >= kGTMLoggerLevelError || now - lastFlush_ >= flushInterval_) {
+      [self flushLocked:now];
+    }
+  }
+}
+
+@end  // GTMRotatingFileLogWriter
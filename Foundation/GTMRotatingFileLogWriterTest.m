@@ -0,0 +1,342 @@
+//
+//  GTMRotatingFileLogWriterTest.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMSenTestCase.h"
+#import "GTMRotatingFileLogWriter.h"
+#import "GTMNSData+zlib.h"
+#import "GTMTestTimer.h"
+
+@interface GTMRotatingFileLogWriterTest : GTMTestCase {
+ @private
+  NSString *dir_;
+  NSString *path_;
+}
+- (NSString *)contentsOfFile:(NSString *)path;
+@end
+
+@implementation GTMRotatingFileLogWriterTest
+
+- (void)setUp {
+  dir_ = [[NSTemporaryDirectory() stringByAppendingPathComponent:
+           @"GTMRotatingFileLogWriterTest"] retain];
+  NSFileManager *fm = [NSFileManager defaultManager];
+  [fm removeItemAtPath:dir_ error:NULL];
+  STAssertTrue([fm createDirectoryAtPath:dir_
+             withIntermediateDirectories:YES
+                              attributes:nil
+                                   error:NULL], nil);
+  path_ = [[dir_ stringByAppendingPathComponent:@"test.log"] retain];
+}
+
+- (void)tearDown {
+  [[NSFileManager defaultManager] removeItemAtPath:dir_ error:NULL];
+  [dir_ release];
+  dir_ = nil;
+  [path_ release];
+  path_ = nil;
+}
+
+- (NSString *)contentsOfFile:(NSString *)path {
+  NSData *data = [NSData dataWithContentsOfFile:path];
+  if ([[path pathExtension] isEqualToString:@"gz"]) {
+    data = [NSData gtm_dataByInflatingData:data];
+  }
+  if (!data) return nil;
+  return [[[NSString alloc] initWithData:data
+                                encoding:NSUTF8StringEncoding] autorelease];
+}
+
+- (void)testCreation {
+  GTMRotatingFileLogWriter *writer =
+      [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:path_
+                                                  maxFileSize:100
+                                             rotationInterval:60
+                                                  generations:3];
+  STAssertNotNil(writer, nil);
+  STAssertEqualObjects([writer path], path_, nil);
+  STAssertEquals([writer maxFileSize], 100ULL, nil);
+  STAssertEquals([writer rotationInterval], (NSTimeInterval)60, nil);
+  STAssertEquals([writer generations], (NSUInteger)3, nil);
+  STAssertTrue([writer compressesRotatedFiles], nil);
+  STAssertEquals([writer bufferSize], (NSUInteger)(64 * 1024), nil);
+  STAssertEquals([writer flushInterval], (NSTimeInterval)1, nil);
+  STAssertEquals([writer rotationCount], (NSUInteger)0, nil);
+  STAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:path_], nil);
+
+  STAssertNil([[[GTMRotatingFileLogWriter alloc] init] autorelease], nil);
+  writer = [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:nil
+                                                       maxFileSize:100
+                                                  rotationInterval:0
+                                                       generations:1];
+  STAssertNil(writer, nil);
+  writer = [GTMRotatingFileLogWriter
+            rotatingFileLogWriterWithPath:@"/no/such/dir/test.log"
+                              maxFileSize:100
+                         rotationInterval:0
+                              generations:1];
+  STAssertNil(writer, nil);
+}
+
+- (void)testBuffering {
+  GTMRotatingFileLogWriter *writer =
+      [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:path_
+                                                  maxFileSize:0
+                                             rotationInterval:0
+                                                  generations:1];
+  [writer setFlushInterval:1000];
+  [writer logMessage:@"one" level:kGTMLoggerLevelInfo];
+  [writer logMessage:@"two" level:kGTMLoggerLevelDebug];
+  STAssertEqualObjects([self contentsOfFile:path_], @"", nil);
+  [writer flush];
+  STAssertEqualObjects([self contentsOfFile:path_], @"one\ntwo\n", nil);
+
+  // Errors go out straight away.
+  [writer logMessage:@"three" level:kGTMLoggerLevelInfo];
+  [writer logMessage:@"bad" level:kGTMLoggerLevelError];
+  STAssertEqualObjects([self contentsOfFile:path_],
+                       @"one\ntwo\nthree\nbad\n", nil);
+
+  // As does a full buffer, and messages bigger than the buffer.
+  [writer setBufferSize:8];
+  STAssertEquals([writer bufferSize], (NSUInteger)8, nil);
+  [writer logMessage:@"1234" level:kGTMLoggerLevelInfo];
+  [writer logMessage:@"5678" level:kGTMLoggerLevelInfo];
+  STAssertEqualObjects([self contentsOfFile:path_],
+                       @"one\ntwo\nthree\nbad\n1234\n", nil);
+  [writer logMessage:@"much too long" level:kGTMLoggerLevelInfo];
+  STAssertEqualObjects([self contentsOfFile:path_],
+                       @"one\ntwo\nthree\nbad\n1234\n5678\nmuch too long\n",
+                       nil);
+
+  // And an elapsed flush interval.
+  [writer setBufferSize:1024];
+  [writer setFlushInterval:0];
+  [writer logMessage:@"now" level:kGTMLoggerLevelInfo];
+  STAssertTrue([[self contentsOfFile:path_] hasSuffix:@"long\nnow\n"], nil);
+}
+
+- (void)testSizeRotation {
+  GTMRotatingFileLogWriter *writer =
+      [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:path_
+                                                  maxFileSize:20
+                                             rotationInterval:0
+                                                  generations:2];
+  [writer setCompressesRotatedFiles:NO];
+  for (int i = 1; i <= 7; ++i) {
+    [writer logMessage:[NSString stringWithFormat:@"message%d", i]
+                 level:kGTMLoggerLevelInfo];
+  }
+  [writer flush];
+  [writer waitForRetiredFiles];
+  STAssertEquals([writer rotationCount], (NSUInteger)3, nil);
+  STAssertEqualObjects([self contentsOfFile:path_], @"message7\n", nil);
+  STAssertEqualObjects([self contentsOfFile:[path_ stringByAppendingString:@".1"]],
+                       @"message5\nmessage6\n", nil);
+  STAssertEqualObjects([self contentsOfFile:[path_ stringByAppendingString:@".2"]],
+                       @"message3\nmessage4\n", nil);
+  STAssertNil([self contentsOfFile:[path_ stringByAppendingString:@".3"]], nil);
+
+  // A single message bigger than the limit still gets written.
+  [writer logMessage:@"a message longer than twenty bytes"
+               level:kGTMLoggerLevelInfo];
+  [writer flush];
+  STAssertEqualObjects([self contentsOfFile:path_],
+                       @"a message longer than twenty bytes\n", nil);
+}
+
+- (void)testCompression {
+  GTMRotatingFileLogWriter *writer =
+      [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:path_
+                                                  maxFileSize:0
+                                             rotationInterval:0
+                                                  generations:3];
+  for (int i = 1; i <= 5; ++i) {
+    [writer logMessage:[NSString stringWithFormat:@"file %d", i]
+                 level:kGTMLoggerLevelInfo];
+    [writer rotate];
+  }
+  [writer waitForRetiredFiles];
+  STAssertEqualObjects([self contentsOfFile:path_], @"", nil);
+  STAssertEqualObjects(
+      [self contentsOfFile:[path_ stringByAppendingString:@".1.gz"]],
+      @"file 5\n", nil);
+  STAssertEqualObjects(
+      [self contentsOfFile:[path_ stringByAppendingString:@".2.gz"]],
+      @"file 4\n", nil);
+  STAssertEqualObjects(
+      [self contentsOfFile:[path_ stringByAppendingString:@".3.gz"]],
+      @"file 3\n", nil);
+  NSArray *files =
+      [[NSFileManager defaultManager] contentsOfDirectoryAtPath:dir_
+                                                          error:NULL];
+  STAssertEquals([files count], (NSUInteger)4, @"%@", files);
+
+  // Files bigger than the pieces they're compressed in.
+  NSString *big = [@"" stringByPaddingToLength:300 * 1024
+                                    withString:@"0123456789abcdef"
+                               startingAtIndex:0];
+  [writer logMessage:big level:kGTMLoggerLevelInfo];
+  [writer rotate];
+  [writer waitForRetiredFiles];
+  STAssertEqualObjects(
+      [self contentsOfFile:[path_ stringByAppendingString:@".1.gz"]],
+      [big stringByAppendingString:@"\n"], nil);
+  files = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:dir_
+                                                              error:NULL];
+  STAssertEquals([files count], (NSUInteger)4, @"%@", files);
+
+  // With no generations retired files just go away.
+  [[NSFileManager defaultManager] removeItemAtPath:dir_ error:NULL];
+  [[NSFileManager defaultManager] createDirectoryAtPath:dir_
+                            withIntermediateDirectories:YES
+                                             attributes:nil
+                                                  error:NULL];
+  writer = [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:path_
+                                                       maxFileSize:0
+                                                  rotationInterval:0
+                                                       generations:0];
+  [writer logMessage:@"gone" level:kGTMLoggerLevelInfo];
+  [writer rotate];
+  [writer waitForRetiredFiles];
+  files = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:dir_
+                                                              error:NULL];
+  STAssertEqualObjects(files, [NSArray arrayWithObject:@"test.log"], nil);
+}
+
+- (void)testIntervalRotation {
+  GTMRotatingFileLogWriter *writer =
+      [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:path_
+                                                  maxFileSize:0
+                                             rotationInterval:0.2
+                                                  generations:1];
+  [writer setCompressesRotatedFiles:NO];
+  [writer logMessage:@"before" level:kGTMLoggerLevelInfo];
+  STAssertEquals([writer rotationCount], (NSUInteger)0, nil);
+  [NSThread sleepForTimeInterval:0.3];
+  [writer logMessage:@"after" level:kGTMLoggerLevelInfo];
+  [writer flush];
+  [writer waitForRetiredFiles];
+  STAssertEquals([writer rotationCount], (NSUInteger)1, nil);
+  STAssertEqualObjects([self contentsOfFile:path_], @"after\n", nil);
+  STAssertEqualObjects([self contentsOfFile:[path_ stringByAppendingString:@".1"]],
+                       @"before\n", nil);
+
+  // An interval with nothing logged doesn't retire an empty file.
+  [writer rotate];
+  [NSThread sleepForTimeInterval:0.3];
+  [writer logMessage:@"later" level:kGTMLoggerLevelInfo];
+  [writer flush];
+  [writer waitForRetiredFiles];
+  STAssertEquals([writer rotationCount], (NSUInteger)2, nil);
+  STAssertEqualObjects([self contentsOfFile:path_], @"later\n", nil);
+  STAssertEqualObjects([self contentsOfFile:[path_ stringByAppendingString:@".1"]],
+                       @"after\n", nil);
+}
+
+- (void)writeLines:(NSDictionary *)job {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  GTMRotatingFileLogWriter *writer = [job objectForKey:@"writer"];
+  NSString *line = [job objectForKey:@"line"];
+  for (int i = 0; i < 200; ++i) {
+    [writer logMessage:line level:kGTMLoggerLevelInfo];
+  }
+  NSConditionLock *done = [job objectForKey:@"done"];
+  [done lock];
+  [done unlockWithCondition:[done condition] + 1];
+  [pool drain];
+}
+
+- (void)testUnbufferedLinesStayWhole {
+  // Writers that don't buffer (or get lines bigger than their buffer) still
+  // put each line out in one write, so writers sharing a file don't mix
+  // their lines up.
+  NSConditionLock *done =
+      [[[NSConditionLock alloc] initWithCondition:0] autorelease];
+  NSMutableSet *expected = [NSMutableSet set];
+  const int kWriters = 4;
+  for (int i = 0; i < kWriters; ++i) {
+    GTMRotatingFileLogWriter *writer =
+        [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:path_
+                                                    maxFileSize:0
+                                               rotationInterval:0
+                                                    generations:1];
+    [writer setBufferSize:(i % 2) ? 0 : 16];
+    NSString *line = [@"" stringByPaddingToLength:1000 + i
+                                       withString:[NSString stringWithFormat:
+                                                   @"%d", i]
+                                  startingAtIndex:0];
+    [expected addObject:line];
+    NSDictionary *job = [NSDictionary dictionaryWithObjectsAndKeys:
+                         writer, @"writer", line, @"line", done, @"done", nil];
+    [NSThread detachNewThreadSelector:@selector(writeLines:)
+                             toTarget:self
+                           withObject:job];
+  }
+  [done lockWhenCondition:kWriters];
+  [done unlock];
+
+  NSArray *lines = [[self contentsOfFile:path_]
+                     componentsSeparatedByString:@"\n"];
+  STAssertEquals([lines count], (NSUInteger)(kWriters * 200 + 1), nil);
+  for (NSUInteger i = 0; i + 1 < [lines count]; ++i) {
+    STAssertTrue([expected containsObject:[lines objectAtIndex:i]],
+                 @"line %lu", (unsigned long)i);
+  }
+}
+
+// Compares the per message cost with the NSFileHandle writer, which does a
+// write(2) per message.
+- (void)testBufferedWriteCost {
+  const NSUInteger kMessages = 50000;
+  NSString *message = @"2014-01-01 10:29:24.177 myapp[4588/0xa07d0f60] [lvl=1] "
+                      @"-[Foo bar] a typical log message";
+  NSString *handlePath = [dir_ stringByAppendingPathComponent:@"handle.log"];
+  NSFileHandle *handle = [NSFileHandle fileHandleForLoggingAtPath:handlePath
+                                                             mode:0644];
+  GTMTestTimer *handleTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(handleTimer);
+  for (NSUInteger i = 0; i < kMessages; ++i) {
+    [handle logMessage:message level:kGTMLoggerLevelInfo];
+  }
+  GTMTestTimerStop(handleTimer);
+
+  GTMRotatingFileLogWriter *writer =
+      [GTMRotatingFileLogWriter rotatingFileLogWriterWithPath:path_
+                                                  maxFileSize:1024 * 1024
+                                             rotationInterval:0
+                                                  generations:2];
+  GTMTestTimer *rotatingTimer = GTMTestTimerCreate();
+  GTMTestTimerStart(rotatingTimer);
+  for (NSUInteger i = 0; i < kMessages; ++i) {
+    [writer logMessage:message level:kGTMLoggerLevelInfo];
+  }
+  [writer flush];
+  GTMTestTimerStop(rotatingTimer);
+  [writer waitForRetiredFiles];
+
+  NSLog(@"Per message: NSFileHandle %.0fns, GTMRotatingFileLogWriter %.0fns "
+        @"(%lu rotations)",
+        GTMTestTimerGetNanoseconds(handleTimer) / kMessages,
+        GTMTestTimerGetNanoseconds(rotatingTimer) / kMessages,
+        (unsigned long)[writer rotationCount]);
+  STAssertGreaterThan([writer rotationCount], (NSUInteger)0, nil);
+  GTMTestTimerRelease(handleTimer);
+  GTMTestTimerRelease(rotatingTimer);
+}
+
+@end
@@ -101,6 +101,27 @@
 #import <Foundation/Foundation.h>
 #import <sqlite3.h>
 
+@class GTMSQLiteStatement;
+
+//  Options for the bulk loading methods on GTMSQLiteDatabase
+enum {
+  kGTMSQLiteBulkLoadOptionRelaxDurability = 0x01,
+    // Run the load w/ "PRAGMA synchronous = OFF" and (unless the database
+    // uses WAL) "PRAGMA journal_mode = MEMORY", putting the old settings
+    // back when it is done. This is much faster, but a crash or power loss
+    // during the load can corrupt the database. Ignored if the caller already
+    // has a transaction open.
+};
+typedef NSUInteger GTMSQLiteBulkLoadOptions;
+
+#if NS_BLOCKS_AVAILABLE
+//  Called to bind the values for each row of a bulk load. Bind the values for
+//  row |rowIndex| (bindings are cleared for each row) and return YES, or
+//  return NO when there are no more rows.
+typedef BOOL (^GTMSQLiteBulkLoadBlock)(GTMSQLiteStatement *statement,
+                                       NSUInteger rowIndex);
+#endif  // NS_BLOCKS_AVAILABLE
+
 /// Wrapper for SQLite with release/retain semantics and CFString convenience features
 @interface GTMSQLiteDatabase : NSObject {
  @protected
@@ -111,6 +132,14 @@
   CFOptionFlags likeOptions_;
   CFOptionFlags globOptions_;
   NSMutableArray *userArgDataPool_;  // strong
+  CFMutableDictionaryRef statementCache_;  // strong, SQL to idle statement
+  // Least recently checked in idle statements first.
+  struct GTMSQLiteStatementCacheEntry *statementCacheOldest_;
+  struct GTMSQLiteStatementCacheEntry *statementCacheNewest_;
+  CFMutableDictionaryRef checkedOutStatements_;  // strong, statement to SQL
+  NSUInteger statementCacheLimit_;
+  NSUInteger statementCacheHits_;
+  NSUInteger statementCacheMisses_;
 }
 
 //  Get the numeric version number of the SQLite library (compiled in value
@@ -314,6 +343,120 @@
 //
 - (BOOL)commit;
 
+#pragma mark Statement Cache
+
+//  The database keeps a cache of prepared statements, keyed by their SQL, so
+//  SQL that is run over and over only has to be prepared once. The cache
+//  holds idle statements; when it is full the least recently used one is
+//  finalized. -executeSQL: uses the cache for SQL that is a single statement.
+//  Like the rest of this class, the cache is not thread safe.
+
+//  Check out a prepared statement for the given SQL. If the cache has an idle
+//  statement for the SQL it is reused, otherwise a new one is prepared. The
+//  statement belongs to the caller until it is handed back with
+//  checkInStatement:. Don't call -[GTMSQLiteStatement finalizeStatement] on
+//  it; if it is never checked in, it is finalized when the database is
+//  closed.
+//
+//  Args:
+//    sql: Raw SQL statement to prepare, see
+//         -[GTMSQLiteStatement initWithSQL:inDatabase:errorCode:].
+//    err:  Result code from SQLite. If nil is returned by this function
+//          check the result code for the error. If NULL no result code is
+//          reported.
+//
+//  Returns:
+//    Autoreleased GTMSQLiteStatement, nil on error
+//
+- (GTMSQLiteStatement *)checkOutStatementWithSQL:(NSString *)sql
+                                       errorCode:(int *)err;
+
+//  Hand a statement from checkOutStatementWithSQL:errorCode: back to the
+//  cache. The statement is reset and its bindings are cleared so it is ready
+//  for the next caller; it must not be used after this.
+//
+//  Args:
+//    statement: The checked out statement
+//
+- (void)checkInStatement:(GTMSQLiteStatement *)statement;
+
+//  Set the maximum number of idle statements kept in the cache (defaults to
+//  32). Extra statements are finalized. Zero turns the cache off.
+//
+//  Args:
+//    limit: Maximum number of idle statements
+//
+- (void)setStatementCacheLimit:(NSUInteger)limit;
+
+//  Get the maximum number of idle statements kept in the cache.
+//
+//  Returns:
+//    The cache limit
+//
+- (NSUInteger)statementCacheLimit;
+
+//  Get the number of statement check outs that reused a cached statement.
+//
+//  Returns:
+//    Hit count
+//
+- (NSUInteger)statementCacheHitCount;
+
+//  Get the number of statement check outs that had to prepare a statement.
+//
+//  Returns:
+//    Miss count
+//
+- (NSUInteger)statementCacheMissCount;
+
+//  Finalize all the idle statements in the cache. Statements that are checked
+//  out are not affected.
+//
+- (void)clearStatementCache;
+
+#pragma mark Bulk Loading
+
+//  Run an INSERT/UPDATE/etc. statement once for each row from an enumerator.
+//  The statement is prepared once and the rows are run inside immediate
+//  transactions, committing every |rowsPerTransaction| rows. If a
+//  transaction is already open, the rows become part of it instead.
+//
+//  If a row fails, the rows since the last commit are rolled back and the
+//  load stops.
+//
+//  Args:
+//    rows: Enumerator of NSArrays, each holding the values for a row in
+//          parameter order (see
+//          -[GTMSQLiteStatement bindFoundationObject:atPosition:]).
+//          Parameters past the end of a row are bound to NULL.
+//    sql: The SQL statement to run for each row.
+//    rowsPerTransaction: Rows to commit at a time, 0 for a single
+//                        transaction.
+//    options: GTMSQLiteBulkLoadOptions for the load.
+//    outRowsLoaded: If not NULL, set to the number of rows committed (or
+//                   added to an already open transaction).
+//
+//  Returns:
+//    SQLite result code, SQLITE_OK on no error
+//
+- (int)bulkLoadRows:(NSEnumerator *)rows
+            withSQL:(NSString *)sql
+ rowsPerTransaction:(NSUInteger)rowsPerTransaction
+            options:(GTMSQLiteBulkLoadOptions)options
+         rowsLoaded:(NSUInteger *)outRowsLoaded;
+
+#if NS_BLOCKS_AVAILABLE
+//  Like bulkLoadRows:withSQL:rowsPerTransaction:options:rowsLoaded:, but
+//  |block| binds the values for each row, so they can come straight from C
+//  data w/o creating Foundation objects.
+//
+- (int)bulkLoadWithSQL:(NSString *)sql
+    rowsPerTransaction:(NSUInteger)rowsPerTransaction
+               options:(GTMSQLiteBulkLoadOptions)options
+            rowsLoaded:(NSUInteger *)outRowsLoaded
+            usingBlock:(GTMSQLiteBulkLoadBlock)block;
+#endif  // NS_BLOCKS_AVAILABLE
+
 @end
 
 //  Wrapper class for SQLite statements with retain/release semantics.
@@ -536,6 +679,20 @@
 //
 - (int)bindStringAtPosition:(int)position string:(NSString *)string;
 
+//  Bind a Foundation object (NSString, NSNumber, NSData or NSNull) at the
+//  given position. NSNumbers holding floating point values are bound as
+//  doubles, others as 64-bit integers. nil is bound as NULL.
+//
+//  Args:
+//    object: Foundation object to bind
+//    position: Parameter position (1-based index)
+//
+//  Returns:
+//    SQLite result code, SQLITE_OK on no error, SQLITE_MISMATCH for other
+//    types of objects
+//
+- (int)bindFoundationObject:(id)object atPosition:(int)position;
+
 #pragma mark Results
 
 //  Get the number of result columns per row this statement will generate.
@@ -711,3 +868,163 @@
 + (NSString *)quoteAndEscapeString:(NSString *)string;
 
 @end
+
+//  A pool of connections to one database file so several threads can use it
+//  at once. A single GTMSQLiteDatabase is one sqlite3 connection, and can only
+//  be used by one thread at a time.
+//
+//  The pool puts the file in write-ahead logging (WAL) mode, where readers
+//  don't block the writer and the writer doesn't block readers. It keeps one
+//  writer connection and opens up to |maximumReaders| reader connections as
+//  they are needed. Each connection is a full GTMSQLiteDatabase (w/ its own
+//  statement cache, and the CF additions if asked for), and belongs to one
+//  thread from when it is checked out until it is checked back in. Writes are
+//  serialized by handing out the writer to one thread at a time; the reader
+//  connections are opened w/ "PRAGMA query_only" so they can't write by
+//  mistake. Every connection has to be checked back in before the pool is
+//  released.
+//
+//  WAL needs SQLite 3.7.0 or later and a file (not memory) database. With an
+//  older SQLite the pool still works, but readers and the writer block each
+//  other as they would w/ separate connections.
+//
+//  Example usage:
+//
+//    GTMSQLiteDatabasePool *pool =
+//      [[GTMSQLiteDatabasePool alloc] initWithPath:path
+//                                  withCFAdditions:YES
+//                                             utf8:YES
+//                                   maximumReaders:4
+//                                        errorCode:&err];
+//    ...
+//    GTMSQLiteDatabase *reader = [pool checkOutReader];
+//    GTMSQLiteStatement *statement =
+//      [reader checkOutStatementWithSQL:@"SELECT ..." errorCode:&err];
+//    ...
+//    [reader checkInStatement:statement];
+//    [pool checkInReader:reader];
+//
+@interface GTMSQLiteDatabasePool : NSObject {
+ @private
+  NSString *path_;  // strong
+  BOOL hasCFAdditions_;
+  BOOL useUTF8_;
+  BOOL isWAL_;
+  int timeoutMS_;
+  NSUInteger maximumReaders_;
+  GTMSQLiteDatabase *writer_;  // strong
+  BOOL writerCheckedOut_;
+  NSMutableArray *readers_;  // strong, every reader connection
+  NSMutableArray *idleReaders_;  // strong
+  struct GTMSQLiteDatabasePoolLock *lock_;
+}
+
+//  Open a pool of connections on a file-based database.
+//
+//  Args:
+//    path: Path to the database. If it does not exist an empty database
+//          will be created. It can't be a memory database.
+//    withCFAdditions: If true, every connection gets the CFString based
+//                     string functions and collation sequences (see
+//                     GTMSQLiteDatabase).
+//    useUTF8: Text encoding for a new database, see GTMSQLiteDatabase.
+//    maximumReaders: The most reader connections the pool will open, at
+//                    least 1. Reader check outs wait when they are all in
+//                    use.
+//    err:  Result code from SQLite. If nil is returned by this function
+//          check the result code for the error. If NULL no result code is
+//          reported.
+//
+- (id)initWithPath:(NSString *)path
+   withCFAdditions:(BOOL)additions
+              utf8:(BOOL)useUTF8
+    maximumReaders:(NSUInteger)maximumReaders
+         errorCode:(int *)err;
+
+//  Get the path of the database.
+//
+//  Returns:
+//    Path the pool was created with
+//
+- (NSString *)path;
+
+//  Check if the database is in WAL mode (see above).
+//
+//  Returns:
+//    YES if readers and the writer can run at the same time
+//
+- (BOOL)isWriteAheadLogging;
+
+//  Get the most reader connections the pool will open.
+//
+//  Returns:
+//    The reader limit
+//
+- (NSUInteger)maximumReaders;
+
+//  Set the busy timeout for all of the pool's connections, see
+//  -[GTMSQLiteDatabase setBusyTimeoutMS:]. Defaults to 5 seconds, since
+//  even in WAL mode a connection can briefly find the database busy (ie:
+//  while the writer checkpoints, or when another process has it open).
+//
+//  Args:
+//    timeoutMS: Integer count in ms
+//
+- (void)setBusyTimeoutMS:(int)timeoutMS;
+
+//  Get the busy timeout for the pool's connections.
+//
+//  Returns:
+//    Busy timeout in ms
+//
+- (int)busyTimeoutMS;
+
+//  Check out a connection for reading, waiting for one if all
+//  |maximumReaders| are in use. The connection can't be used to write.
+//
+//  Returns:
+//    A GTMSQLiteDatabase that belongs to the caller until it is handed back
+//    w/ checkInReader:, or nil if a connection couldn't be opened
+//
+- (GTMSQLiteDatabase *)checkOutReader;
+
+//  Hand back a connection from checkOutReader. Any transaction left open on
+//  it is rolled back, since an open read transaction keeps the WAL from
+//  being checkpointed.
+//
+//  Args:
+//    reader: The checked out connection
+//
+- (void)checkInReader:(GTMSQLiteDatabase *)reader;
+
+//  Check out the connection for writing, waiting until no other thread has
+//  it.
+//
+//  Returns:
+//    The writer GTMSQLiteDatabase, it belongs to the caller until it is
+//    handed back w/ checkInWriter:
+//
+- (GTMSQLiteDatabase *)checkOutWriter;
+
+//  Hand back the connection from checkOutWriter. Any transaction left open
+//  on it is rolled back. A connection that isn't the checked out writer is
+//  logged and ignored.
+//
+//  Args:
+//    writer: The checked out connection
+//
+- (void)checkInWriter:(GTMSQLiteDatabase *)writer;
+
+#if NS_BLOCKS_AVAILABLE
+//  Run |block| w/ a reader connection, checking it out and back in around the
+//  call.
+//
+- (void)readUsingBlock:(void (^)(GTMSQLiteDatabase *db))block;
+
+//  Run |block| w/ the writer connection, checking it out and back in around
+//  the call.
+//
+- (void)writeUsingBlock:(void (^)(GTMSQLiteDatabase *db))block;
+#endif  // NS_BLOCKS_AVAILABLE
+
+@end
@@ -26,7 +26,9 @@
 #import "GTMSQLite.h"
 #import "GTMMethodCheck.h"
 #import "GTMDefines.h"
+#include <ctype.h>
 #include <limits.h>
+#include <pthread.h>
 
 typedef struct {
   BOOL upperCase;
@@ -44,6 +46,13 @@ typedef struct {
   int             textRep;
 } LikeGlobUserArgs;
 
+//  Binds the values for the next row of a bulk load. Returns NO when there are
+//  no more rows, or on error w/ *err set.
+typedef BOOL (*BulkLoadRowFunction)(GTMSQLiteStatement *statement,
+                                    NSUInteger rowIndex,
+                                    void *context,
+                                    int *err);
+
 #if MAC_OS_X_VERSION_MIN_REQUIRED <= MAC_OS_X_VERSION_10_4
 // While we want to be compatible with Tiger, some operations are more
 // efficient when implemented with Leopard APIs. We look those up dynamically.
@@ -98,6 +107,82 @@ GTM_INLINE CFOptionFlags FilteredStringCompareFlags(CFOptionFlags inOptions) {
   return outOptions;
 }
 
+// The CF additions compare pure ASCII text byte by byte (w/o building
+// CFStrings) when the only options are ones that can't change the answer for
+// ASCII. Localized and numeric comparisons always go through CF.
+static const CFOptionFlags kASCIICompareOptions =
+  kCFCompareCaseInsensitive | kCFCompareNonliteral;
+
+// Returned by the ASCII fast paths when CF has to give the answer.
+static const int kASCIINoAnswer = -1;
+
+// Helper inline to check if |length| bytes are all ASCII.
+GTM_INLINE BOOL IsASCIIBytes(const void *bytes, int length) {
+  const unsigned char *text = bytes;
+  unsigned char bits = 0;
+  for (int i = 0; i < length; i++) {
+    bits |= text[i];
+  }
+  return (bits & 0x80) ? NO : YES;
+}
+
+// Helper inline to fold ASCII case the way CFStringCompare does (to lower).
+GTM_INLINE unsigned char FoldASCII(unsigned char c, BOOL caseInsensitive) {
+  if (caseInsensitive && (c >= 'A') && (c <= 'Z')) {
+    c += 'a' - 'A';
+  }
+  return c;
+}
+
+//  Default number of idle statements kept by the statement cache
+static const NSUInteger kDefaultStatementCacheLimit = 32;
+
+//  An idle statement in the statement cache, the entries are also kept in a
+//  doubly linked list in the order they were checked in so a hit or an
+//  eviction doesn't have to search for the entry.
+struct GTMSQLiteStatementCacheEntry {
+  GTMSQLiteStatement *statement;  // strong
+  NSString *key;  // weak, the statement cache holds it
+  struct GTMSQLiteStatementCacheEntry *older;
+  struct GTMSQLiteStatementCacheEntry *newer;
+};
+
+//  How many rows a bulk load binds between autorelease pool drains
+static const NSUInteger kBulkLoadRowsPerPool = 128;
+
+//  Cached statements live through schema changes. sqlite3_prepare_v2
+//  statements are reprepared by SQLite when that happens, but Tiger's SQLite
+//  doesn't have it (or sqlite3_clear_bindings), so there the statements are
+//  checked for that before they are reused.
+GTM_INLINE int PrepareCachedStatement(sqlite3 *db, const char *sql,
+                                      sqlite3_stmt **statement,
+                                      const char **tail) {
+#if MAC_OS_X_VERSION_MIN_REQUIRED <= MAC_OS_X_VERSION_10_4
+  return sqlite3_prepare(db, sql, -1, statement, tail);
+#else
+  return sqlite3_prepare_v2(db, sql, -1, statement, tail);
+#endif
+}
+
+GTM_INLINE BOOL CachedStatementExpired(sqlite3_stmt *statement) {
+#if MAC_OS_X_VERSION_MIN_REQUIRED <= MAC_OS_X_VERSION_10_4
+  return sqlite3_expired(statement) ? YES : NO;
+#else
+  return NO;
+#endif
+}
+
+GTM_INLINE void ClearCachedStatementBindings(sqlite3_stmt *statement) {
+#if MAC_OS_X_VERSION_MIN_REQUIRED <= MAC_OS_X_VERSION_10_4
+  int count = sqlite3_bind_parameter_count(statement);
+  for (int i = 1; i <= count; i++) {
+    sqlite3_bind_null(statement, i);
+  }
+#else
+  sqlite3_clear_bindings(statement);
+#endif
+}
+
 //  Function prototypes for our custom implementations of UPPER/LOWER using
 //  CFString so that we handle Unicode and localization more cleanly than
 //  native SQLite.
@@ -134,6 +219,32 @@ static CFLocaleRef gCurrentLocale = NULL;
 //  dealloc & finalize
 //
 - (void)cleanupDB;
+//  Check out a statement for |sql|. If |outHasMoreSQL| is given, SQL that
+//  holds more than one statement isn't prepared, nil is returned with
+//  *outHasMoreSQL set to YES instead.
+- (GTMSQLiteStatement *)checkOutStatementWithSQL:(NSString *)sql
+                                      hasMoreSQL:(BOOL *)outHasMoreSQL
+                                       errorCode:(int *)err;
+- (void)trimStatementCacheToLimit:(NSUInteger)limit;
+//  Unlink |entry| from the statement cache and free it, returns its statement
+//  autoreleased.
+- (GTMSQLiteStatement *)removeStatementCacheEntry:
+    (struct GTMSQLiteStatementCacheEntry *)entry;
+//  The first column of the first row of a PRAGMA query, nil if none.
+- (NSString *)resultOfPragma:(NSString *)pragma;
+- (int)bulkLoadWithSQL:(NSString *)sql
+    rowsPerTransaction:(NSUInteger)rowsPerTransaction
+               options:(GTMSQLiteBulkLoadOptions)options
+            rowsLoaded:(NSUInteger *)outRowsLoaded
+           rowFunction:(BulkLoadRowFunction)rowFunction
+               context:(void *)context;
+@end
+
+@interface GTMSQLiteStatement (PrivateMethods)
+//  Wrap a statement prepared by the database's statement cache, the new
+//  object owns |statement|.
+- (id)initWithPreparedStatement:(sqlite3_stmt *)statement
+                 hasCFAdditions:(BOOL)hasCFAdditions;
 @end
 
 @implementation GTMSQLiteDatabase
@@ -167,6 +278,7 @@ static CFLocaleRef gCurrentLocale = NULL;
 
   if ((self = [super init])) {
     path_ = [path copy];
+    statementCacheLimit_ = kDefaultStatementCacheLimit;
     if (useUTF8) {
       rc = sqlite3_open([path_ fileSystemRepresentation], &db_);
     } else {
@@ -229,6 +341,31 @@ static CFLocaleRef gCurrentLocale = NULL;
 }
 
 - (void)cleanupDB {
+  // The statement cache's statements have to be finalized before the database
+  // can close, including any that were checked out and never checked in.
+  [self trimStatementCacheToLimit:0];
+  if (checkedOutStatements_) {
+    CFIndex count = CFDictionaryGetCount(checkedOutStatements_);
+    if (count > 0) {
+      _GTMDevLog(@"%ld statement(s) from %@ were never checked in",
+                 (long)count, self);
+      const void **statements = malloc(sizeof(void *) * count);
+      if (statements) {
+        CFDictionaryGetKeysAndValues(checkedOutStatements_, statements, NULL);
+        for (CFIndex i = 0; i < count; i++) {
+          [(GTMSQLiteStatement *)statements[i] finalizeStatement];
+        }
+        free(statements);
+      }
+    }
+    CFRelease(checkedOutStatements_);
+    checkedOutStatements_ = NULL;
+  }
+  if (statementCache_) {
+    CFRelease(statementCache_);
+    statementCache_ = NULL;
+  }
+
   if (db_) {
     int rc = sqlite3_close(db_);
     if (rc != SQLITE_OK) {
@@ -479,17 +616,426 @@ static CFLocaleRef gCurrentLocale = NULL;
   int rc;
   // Sanity
   if (!sql) {
-    rc = SQLITE_MISUSE;  // Reasonable return for this case
+    return SQLITE_MISUSE;  // Reasonable return for this case
+  }
+  // A single statement can come from the statement cache, anything else goes
+  // through sqlite3_exec.
+  if (statementCacheLimit_ > 0) {
+    BOOL hasMoreSQL = NO;
+    GTMSQLiteStatement *statement =
+      [self checkOutStatementWithSQL:sql hasMoreSQL:&hasMoreSQL errorCode:&rc];
+    if (statement) {
+      sqlite3_stmt *stmt = [statement sqlite3Statement];
+      do {
+        rc = sqlite3_step(stmt);
+      } while (rc == SQLITE_ROW);
+      if (rc == SQLITE_DONE) {
+        rc = SQLITE_OK;
+      } else {
+        // Legacy statements only report SQLITE_ERROR from the step, the reset
+        // has the real error.
+        rc = sqlite3_reset(stmt);
+      }
+      [self checkInStatement:statement];
+      return rc;
+    }
+    // sqlite3_exec would fail the same way, but empty SQL (nothing to
+    // prepare) and SQL w/ more than one statement are left to it.
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  if (hasCFAdditions_) {
+    rc = sqlite3_exec(db_,
+                      [[sql precomposedStringWithCanonicalMapping]
+                        UTF8String],
+                      NULL, NULL, NULL);
   } else {
+    rc = sqlite3_exec(db_, [sql UTF8String], NULL, NULL, NULL);
+  }
+  return rc;
+}
+
+#pragma mark Statement Cache
+
+- (GTMSQLiteStatement *)checkOutStatementWithSQL:(NSString *)sql
+                                       errorCode:(int *)err {
+  return [self checkOutStatementWithSQL:sql hasMoreSQL:NULL errorCode:err];
+}
+
+- (GTMSQLiteStatement *)checkOutStatementWithSQL:(NSString *)sql
+                                      hasMoreSQL:(BOOL *)outHasMoreSQL
+                                       errorCode:(int *)err {
+  if (outHasMoreSQL) *outHasMoreSQL = NO;
+  if (!sql || !db_) {
+    if (err) *err = SQLITE_MISUSE;
+    return nil;
+  }
+  if (!checkedOutStatements_) {
+    statementCache_ =
+      CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                &kCFTypeDictionaryKeyCallBacks, NULL);
+    checkedOutStatements_ =
+      CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                &kCFTypeDictionaryKeyCallBacks,
+                                &kCFTypeDictionaryValueCallBacks);
+    if (!(statementCache_ && checkedOutStatements_)) {
+      // COV_NF_START
+      if (err) *err = SQLITE_NOMEM;
+      return nil;
+      // COV_NF_END
+    }
+  }
+
+  NSString *key = [[sql copy] autorelease];
+  GTMSQLiteStatement *statement = nil;
+  struct GTMSQLiteStatementCacheEntry *entry =
+    (struct GTMSQLiteStatementCacheEntry *)CFDictionaryGetValue(statementCache_,
+                                                                key);
+  if (entry) {
+    statement = [self removeStatementCacheEntry:entry];
+    if (CachedStatementExpired([statement sqlite3Statement])) {
+      // COV_NF_START - only on Tiger, after a schema change
+      [statement finalizeStatement];
+      statement = nil;
+      // COV_NF_END
+    }
+  }
+
+  int rc = SQLITE_OK;
+  if (statement) {
+    ++statementCacheHits_;
+  } else {
+    NSString *preparedSQL = sql;
     if (hasCFAdditions_) {
-      rc = sqlite3_exec(db_,
-                        [[sql precomposedStringWithCanonicalMapping]
-                          UTF8String],
-                        NULL, NULL, NULL);
+      preparedSQL = [sql precomposedStringWithCanonicalMapping];
+    }
+    if (!preparedSQL) {
+      // COV_NF_START
+      if (err) *err = SQLITE_INTERNAL;
+      return nil;
+      // COV_NF_END
+    }
+    sqlite3_stmt *stmt = NULL;
+    const char *tail = NULL;
+    rc = PrepareCachedStatement(db_, [preparedSQL UTF8String], &stmt, &tail);
+    if (rc == SQLITE_OK && stmt && outHasMoreSQL) {
+      while (tail && isspace((unsigned char)*tail)) {
+        tail++;
+      }
+      if (tail && *tail) {
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        *outHasMoreSQL = YES;
+      }
+    }
+    if (rc == SQLITE_OK && stmt) {
+      ++statementCacheMisses_;
+      statement =
+        [[[GTMSQLiteStatement alloc] initWithPreparedStatement:stmt
+                                                hasCFAdditions:hasCFAdditions_]
+          autorelease];
+      if (!statement) {
+        // COV_NF_START
+        sqlite3_finalize(stmt);
+        rc = SQLITE_INTERNAL;
+        // COV_NF_END
+      }
+    } else if (rc != SQLITE_OK) {
+      sqlite3_finalize(stmt);
+    }
+  }
+  if (statement) {
+    CFDictionarySetValue(checkedOutStatements_, statement, key);
+  }
+  if (err) *err = rc;
+  return statement;
+}
+
+- (void)checkInStatement:(GTMSQLiteStatement *)statement {
+  if (!statement) return;
+  NSString *key = nil;
+  if (checkedOutStatements_) {
+    key = (NSString *)CFDictionaryGetValue(checkedOutStatements_, statement);
+  }
+  if (!key) {
+    _GTMDevLog(@"%@ was not checked out from %@", statement, self);
+    return;
+  }
+  // Hold onto both, the dictionary had the only references to them.
+  [[key retain] autorelease];
+  [[statement retain] autorelease];
+  CFDictionaryRemoveValue(checkedOutStatements_, statement);
+
+  sqlite3_stmt *stmt = [statement sqlite3Statement];
+  if (!stmt) return;  // The caller finalized it.
+  sqlite3_reset(stmt);
+  ClearCachedStatementBindings(stmt);
+
+  if ((statementCacheLimit_ == 0)
+      || CFDictionaryContainsKey(statementCache_, key)) {
+    // Nowhere to keep it (the SQL was checked out more than once).
+    [statement finalizeStatement];
+    return;
+  }
+  struct GTMSQLiteStatementCacheEntry *entry =
+    malloc(sizeof(struct GTMSQLiteStatementCacheEntry));
+  if (!entry) {
+    // COV_NF_START
+    [statement finalizeStatement];
+    return;
+    // COV_NF_END
+  }
+  entry->statement = [statement retain];
+  entry->key = key;
+  entry->older = statementCacheNewest_;
+  entry->newer = NULL;
+  if (statementCacheNewest_) {
+    statementCacheNewest_->newer = entry;
+  } else {
+    statementCacheOldest_ = entry;
+  }
+  statementCacheNewest_ = entry;
+  CFDictionarySetValue(statementCache_, key, entry);
+  [self trimStatementCacheToLimit:statementCacheLimit_];
+}
+
+- (GTMSQLiteStatement *)removeStatementCacheEntry:
+    (struct GTMSQLiteStatementCacheEntry *)entry {
+  if (entry->older) {
+    entry->older->newer = entry->newer;
+  } else {
+    statementCacheOldest_ = entry->newer;
+  }
+  if (entry->newer) {
+    entry->newer->older = entry->older;
+  } else {
+    statementCacheNewest_ = entry->older;
+  }
+  CFDictionaryRemoveValue(statementCache_, entry->key);
+  GTMSQLiteStatement *statement = [entry->statement autorelease];
+  free(entry);
+  return statement;
+}
+
+- (void)trimStatementCacheToLimit:(NSUInteger)limit {
+  if (!statementCache_) return;
+  while ((NSUInteger)CFDictionaryGetCount(statementCache_) > limit) {
+    [[self removeStatementCacheEntry:statementCacheOldest_] finalizeStatement];
+  }
+}
+
+- (void)setStatementCacheLimit:(NSUInteger)limit {
+  statementCacheLimit_ = limit;
+  [self trimStatementCacheToLimit:limit];
+}
+
+- (NSUInteger)statementCacheLimit {
+  return statementCacheLimit_;
+}
+
+- (NSUInteger)statementCacheHitCount {
+  return statementCacheHits_;
+}
+
+- (NSUInteger)statementCacheMissCount {
+  return statementCacheMisses_;
+}
+
+- (void)clearStatementCache {
+  [self trimStatementCacheToLimit:0];
+}
+
+#pragma mark Bulk Loading
+
+static BOOL BindEnumeratorRow(GTMSQLiteStatement *statement,
+                              NSUInteger rowIndex,
+                              void *context,
+                              int *err) {
+  NSEnumerator *rows = (NSEnumerator *)context;
+  NSArray *row = [rows nextObject];
+  if (!row) return NO;
+  // No fast enumeration, this has to build for Tiger.
+  NSEnumerator *valueEnum = [row objectEnumerator];
+  id value;
+  int position = 1;
+  while ((value = [valueEnum nextObject])) {
+    int rc = [statement bindFoundationObject:value atPosition:position++];
+    if (rc != SQLITE_OK) {
+      *err = rc;
+      return NO;
+    }
+  }
+  return YES;
+}
+
+- (int)bulkLoadRows:(NSEnumerator *)rows
+            withSQL:(NSString *)sql
+ rowsPerTransaction:(NSUInteger)rowsPerTransaction
+            options:(GTMSQLiteBulkLoadOptions)options
+         rowsLoaded:(NSUInteger *)outRowsLoaded {
+  if (!rows) {
+    if (outRowsLoaded) *outRowsLoaded = 0;
+    return SQLITE_MISUSE;
+  }
+  return [self bulkLoadWithSQL:sql
+            rowsPerTransaction:rowsPerTransaction
+                       options:options
+                    rowsLoaded:outRowsLoaded
+                   rowFunction:BindEnumeratorRow
+                       context:rows];
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+static BOOL BindBlockRow(GTMSQLiteStatement *statement,
+                         NSUInteger rowIndex,
+                         void *context,
+                         int *err) {
+  GTMSQLiteBulkLoadBlock block = (GTMSQLiteBulkLoadBlock)context;
+  return block(statement, rowIndex);
+}
+
+- (int)bulkLoadWithSQL:(NSString *)sql
+    rowsPerTransaction:(NSUInteger)rowsPerTransaction
+               options:(GTMSQLiteBulkLoadOptions)options
+            rowsLoaded:(NSUInteger *)outRowsLoaded
+            usingBlock:(GTMSQLiteBulkLoadBlock)block {
+  if (!block) {
+    if (outRowsLoaded) *outRowsLoaded = 0;
+    return SQLITE_MISUSE;
+  }
+  return [self bulkLoadWithSQL:sql
+            rowsPerTransaction:rowsPerTransaction
+                       options:options
+                    rowsLoaded:outRowsLoaded
+                   rowFunction:BindBlockRow
+                       context:(void *)block];
+}
+
+#endif  // NS_BLOCKS_AVAILABLE
+
+- (NSString *)resultOfPragma:(NSString *)pragma {
+  int rc;
+  GTMSQLiteStatement *statement = [self checkOutStatementWithSQL:pragma
+                                                       errorCode:&rc];
+  NSString *result = nil;
+  if ([statement stepRowWithTimeout] == SQLITE_ROW) {
+    result = [statement resultStringAtPosition:0];
+  }
+  [self checkInStatement:statement];
+  return result;
+}
+
+- (int)bulkLoadWithSQL:(NSString *)sql
+    rowsPerTransaction:(NSUInteger)rowsPerTransaction
+               options:(GTMSQLiteBulkLoadOptions)options
+            rowsLoaded:(NSUInteger *)outRowsLoaded
+           rowFunction:(BulkLoadRowFunction)rowFunction
+               context:(void *)context {
+  NSUInteger rowsLoaded = 0;
+  if (outRowsLoaded) *outRowsLoaded = 0;
+
+  int rc;
+  GTMSQLiteStatement *statement = [self checkOutStatementWithSQL:sql
+                                                       errorCode:&rc];
+  if (!statement) return rc;
+  sqlite3_stmt *stmt = [statement sqlite3Statement];
+
+  // If the caller already has a transaction open, the rows are just part of
+  // it (and the journal mode can't be changed).
+  BOOL ownTransactions = sqlite3_get_autocommit(db_) ? YES : NO;
+
+  NSString *savedSynchronous = nil;
+  NSString *savedJournalMode = nil;
+  if ((options & kGTMSQLiteBulkLoadOptionRelaxDurability) && ownTransactions) {
+    savedSynchronous = [self resultOfPragma:@"PRAGMA synchronous;"];
+    if (savedSynchronous) {
+      [self executeSQL:@"PRAGMA synchronous = OFF;"];
+    }
+    // Leaving WAL mode would need exclusive access, and memory databases
+    // have nothing to change. Older SQLites don't have journal_mode at all.
+    NSString *journalMode = [[self resultOfPragma:@"PRAGMA journal_mode;"]
+                              lowercaseString];
+    if (journalMode
+        && ![journalMode isEqualToString:@"wal"]
+        && ![journalMode isEqualToString:@"memory"]
+        && ![journalMode isEqualToString:@"off"]) {
+      savedJournalMode = journalMode;
+      [self executeSQL:@"PRAGMA journal_mode = MEMORY;"];
+    }
+  }
+
+  NSUInteger rowsInTransaction = 0;
+  NSUInteger rowsInPool = 0;
+  if (ownTransactions) {
+    rc = [self executeSQL:@"BEGIN IMMEDIATE TRANSACTION;"];
+  }
+  // Drained every so many rows whatever the transactions, which can cover
+  // the whole load.
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  while (rc == SQLITE_OK) {
+    ClearCachedStatementBindings(stmt);
+    if (!rowFunction(statement, rowsLoaded + rowsInTransaction, context, &rc)) {
+      break;
+    }
+    do {
+      rc = sqlite3_step(stmt);
+    } while (rc == SQLITE_ROW);
+    if (rc == SQLITE_DONE) {
+      rc = SQLITE_OK;
     } else {
-      rc = sqlite3_exec(db_, [sql UTF8String], NULL, NULL, NULL);
+      // Legacy statements only report SQLITE_ERROR from the step, the reset
+      // has the real error.
+      rc = sqlite3_reset(stmt);
+      break;
+    }
+    sqlite3_reset(stmt);
+    ++rowsInTransaction;
+    if (++rowsInPool == kBulkLoadRowsPerPool) {
+      rowsInPool = 0;
+      [pool drain];
+      pool = [[NSAutoreleasePool alloc] init];
+    }
+
+    if (ownTransactions && (rowsInTransaction == rowsPerTransaction)) {
+      rc = [self executeSQL:@"COMMIT TRANSACTION;"];
+      if (rc != SQLITE_OK) break;
+      rowsLoaded += rowsInTransaction;
+      rowsInTransaction = 0;
+      rc = [self executeSQL:@"BEGIN IMMEDIATE TRANSACTION;"];
+    }
+  }
+  [pool drain];
+
+  if (rc == SQLITE_OK) {
+    if (ownTransactions) {
+      rc = [self executeSQL:@"COMMIT TRANSACTION;"];
+    }
+    if (rc == SQLITE_OK) {
+      rowsLoaded += rowsInTransaction;
     }
+  } else if (!ownTransactions) {
+    // The failed row undid itself, the ones before it are in the caller's
+    // transaction.
+    rowsLoaded += rowsInTransaction;
   }
+  if (ownTransactions && !sqlite3_get_autocommit(db_)) {
+    [self executeSQL:@"ROLLBACK TRANSACTION;"];
+  }
+  sqlite3_reset(stmt);
+  [self checkInStatement:statement];
+
+  if (savedJournalMode) {
+    [self executeSQL:[NSString stringWithFormat:@"PRAGMA journal_mode = %@;",
+                      savedJournalMode]];
+  }
+  if (savedSynchronous) {
+    [self executeSQL:[NSString stringWithFormat:@"PRAGMA synchronous = %@;",
+                      savedSynchronous]];
+  }
+
+  if (outRowsLoaded) *outRowsLoaded = rowsLoaded;
   return rc;
 }
 
@@ -845,6 +1391,25 @@ static void CollateNeeded(void *userContext, sqlite3 *db, int textRep,
   [gtmdb collationArgumentRetain:collationArgsData];
 }
 
+// Private helper to compare ASCII text like CFStringCompare (w/o the
+// localized or numeric options) does.
+static int CompareASCII(const void *str1, int length1,
+                        const void *str2, int length2,
+                        BOOL caseInsensitive) {
+  const unsigned char *text1 = str1;
+  const unsigned char *text2 = str2;
+  int length = (length1 < length2) ? length1 : length2;
+  for (int i = 0; i < length; i++) {
+    unsigned char c1 = FoldASCII(text1[i], caseInsensitive);
+    unsigned char c2 = FoldASCII(text2[i], caseInsensitive);
+    if (c1 != c2) {
+      return (c1 < c2) ? kCFCompareLessThan : kCFCompareGreaterThan;
+    }
+  }
+  if (length1 == length2) return kCFCompareEqualTo;
+  return (length1 < length2) ? kCFCompareLessThan : kCFCompareGreaterThan;
+}
+
 static int Collate8(void *userContext, int length1, const void *str1,
                     int length2, const void *str2) {
   // User args
@@ -869,6 +1434,20 @@ static int Collate8(void *userContext, int length1, const void *str1,
     }
   }
 
+  // ASCII compares the same byte by byte as it does w/ CFStringCompare, so
+  // skip making the strings.
+  if (!(userArgs->compareOptions & ~kASCIICompareOptions)
+      && IsASCIIBytes(str1, length1)
+      && IsASCIIBytes(str2, length2)) {
+    int sqliteResult = CompareASCII(str1, length1, str2, length2,
+                                    (userArgs->compareOptions
+                                     & kCFCompareCaseInsensitive) != 0);
+    if (userArgs->reverse) {
+      sqliteResult = -sqliteResult;
+    }
+    return sqliteResult;
+  }
+
   // We have UTF8 strings with no terminating null, we want to compare
   // with as few copies as possible. Leopard introduced a no-copy string
   // creation function, we'll use it when we can but we want to stay compatible
@@ -1038,117 +1617,268 @@ static int Collate16(void *userContext, int length1, const void *str1,
 
 #pragma mark Like/Glob
 
-// Private helper to handle LIKE and GLOB with different encodings. This
-// is essentially a reimplementation of patternCompare() in func.c of the
-// SQLite sources.
-static void LikeGlobCompare(sqlite3_context *context,
-                            CFStringRef pattern,
-                            CFStringRef targetString,
-                            UniChar matchAll,
-                            UniChar matchOne,
-                            UniChar escape,
-                            BOOL setSupport,
-                            CFOptionFlags compareOptions) {
+// LIKE and GLOB patterns are compiled into a list of steps once per
+// statement, and the compiled pattern is kept w/ sqlite3_set_auxdata() so the
+// rows after the first one don't parse the pattern again. The steps are
+// essentially a reimplementation of patternCompare() in func.c of the SQLite
+// sources.
+
+// Kinds of LikeGlobStep
+enum {
+  kLikeGlobMatchAll,  // Unanchors the step after it
+  kLikeGlobMatchOne,  // Consumes one composed character
+  kLikeGlobLiteral,   // Finds a run of normal or escaped characters
+  kLikeGlobSet,       // Finds a character from a character set
+  kLikeGlobFail,      // Never matches
+  kLikeGlobError,     // The pattern is bad from here on
+};
+
+typedef struct {
+  int kind;
+  // kLikeGlobLiteral and kLikeGlobSet for CF matching
+  CFStringRef literal;
+  CFCharacterSetRef charSet;
+  // kLikeGlobLiteral and kLikeGlobSet for ASCII matching. The literal is
+  // already case folded and the set already inverted.
+  const unsigned char *bytes;
+  size_t length;
+  uint32_t asciiSet[4];
+  // kLikeGlobError, only reported if there is text left to match when
+  // |needsCharacter|
+  const char *error;
+  BOOL needsCharacter;
+} LikeGlobStep;
+
+typedef struct {
+  // What the steps were compiled from
+  void *pattern;
+  size_t patternBytes;
+  BOOL isUTF16;
+  UniChar matchAll;
+  UniChar matchOne;
+  UniChar escape;
+  BOOL setSupport;
+  CFOptionFlags compareOptions;
+  // Steps for ASCII text, NULL if the pattern can't be matched byte by byte
+  LikeGlobStep *asciiSteps;
+  CFIndex asciiStepCount;
+  unsigned char *asciiLiterals;
+  // Steps for everything else, compiled the first time they are needed
+  LikeGlobStep *cfSteps;
+  CFIndex cfStepCount;
+} LikeGlobProgram;
+
+static void FreeLikeGlobSteps(LikeGlobStep *steps, CFIndex count) {
+  if (!steps) return;
+  for (CFIndex i = 0; i < count; i++) {
+    if (steps[i].literal) CFRelease(steps[i].literal);
+    if (steps[i].charSet) CFRelease(steps[i].charSet);
+  }
+  free(steps);
+}
+
+static void FreeLikeGlobProgram(void *data) {
+  LikeGlobProgram *program = data;
+  if (!program) return;
+  FreeLikeGlobSteps(program->asciiSteps, program->asciiStepCount);
+  FreeLikeGlobSteps(program->cfSteps, program->cfStepCount);
+  free(program->asciiLiterals);
+  free(program->pattern);
+  free(program);
+}
+
+GTM_INLINE void AddASCIIToSet(uint32_t *asciiSet, int first, int last) {
+  for (int c = first; c <= last; c++) {
+    asciiSet[c >> 5] |= 1U << (c & 31);
+  }
+}
+
+GTM_INLINE BOOL IsInASCIISet(const uint32_t *asciiSet, unsigned char c) {
+  return (asciiSet[c >> 5] & (1U << (c & 31))) ? YES : NO;
+}
+
+// Private helper to compile the ASCII steps for |program|, following the
+// same parse as CompileCFLikeGlobSteps(). Returns NO if the pattern can't be
+// matched byte by byte (bad patterns are left for the CF steps to report).
+static BOOL CompileASCIILikeGlobSteps(LikeGlobProgram *program) {
+  const char *pattern = program->pattern;
+  size_t patternLength = program->patternBytes;
+  BOOL caseInsensitive =
+    (program->compareOptions & kCFCompareCaseInsensitive) ? YES : NO;
+  LikeGlobStep *steps = calloc(patternLength + 1, sizeof(LikeGlobStep));
+  unsigned char *literals = malloc(patternLength + 1);
+  if (!steps || !literals) {
+    // COV_NF_START
+    free(steps);
+    free(literals);
+    return NO;
+    // COV_NF_END
+  }
+  unsigned char *literalEnd = literals;
+  CFIndex stepCount = 0;
+  size_t patternIndex = 0;
+  BOOL isValid = YES;
+  char patternChar;
+  while (isValid && (patternChar = pattern[patternIndex])) {
+    LikeGlobStep *step = &steps[stepCount++];
+    if (patternChar == program->matchAll) {
+      step->kind = kLikeGlobMatchAll;
+      patternIndex++;
+    } else if (patternChar == program->matchOne) {
+      step->kind = kLikeGlobMatchOne;
+      patternIndex++;
+    } else if (program->setSupport && (patternChar == '[')) {
+      step->kind = kLikeGlobSet;
+      BOOL invert = NO;
+      patternChar = pattern[++patternIndex];
+      if (patternChar == '^') {
+        invert = YES;
+        patternChar = pattern[++patternIndex];
+      }
+      // First char in set or first char in negation can be a literal "]"
+      if (patternChar == ']') {
+        AddASCIIToSet(step->asciiSet, ']', ']');
+        patternChar = pattern[++patternIndex];
+      }
+      while (patternChar && (patternChar != ']')) {
+        if ((pattern[patternIndex + 1] == '-')
+            && pattern[patternIndex + 2]
+            && (pattern[patternIndex + 2] != ']')) {
+          char rangeClose = pattern[patternIndex + 2];
+          // CF is handed a negative range length for these
+          if (rangeClose < patternChar) {
+            isValid = NO;
+            break;
+          }
+          AddASCIIToSet(step->asciiSet, patternChar, rangeClose);
+          patternIndex += 3;
+        } else {
+          AddASCIIToSet(step->asciiSet, patternChar, patternChar);
+          patternIndex++;
+        }
+        patternChar = pattern[patternIndex];
+      }
+      if (patternChar != ']') {
+        isValid = NO;
+      } else {
+        patternIndex++;
+        if (invert) {
+          for (int i = 0; i < 4; i++) {
+            step->asciiSet[i] = ~step->asciiSet[i];
+          }
+        }
+      }
+    } else {
+      // A run of normal or escaped characters
+      step->kind = kLikeGlobLiteral;
+      step->bytes = literalEnd;
+      while (patternChar &&
+             !((patternChar == program->matchAll) ||
+               (patternChar == program->matchOne) ||
+               (program->setSupport && (patternChar == '[')))) {
+        if (program->escape && (patternChar == program->escape)) {
+          patternChar = pattern[++patternIndex];
+          if (!patternChar) {
+            isValid = NO;
+            break;
+          }
+        }
+        *literalEnd++ = FoldASCII(patternChar, caseInsensitive);
+        patternChar = pattern[++patternIndex];
+      }
+      step->length = literalEnd - step->bytes;
+    }
+  }
+  if (!isValid) {
+    FreeLikeGlobSteps(steps, stepCount);
+    free(literals);
+    return NO;
+  }
+  program->asciiSteps = steps;
+  program->asciiStepCount = stepCount;
+  program->asciiLiterals = literals;
+  return YES;
+}
+
+// Private helper to compile the CF steps for |program| from |pattern|. A bad
+// pattern compiles to a kLikeGlobError step, so like SQLite it is only
+// reported for text that gets as far as the bad part.
+static BOOL CompileCFLikeGlobSteps(LikeGlobProgram *program,
+                                   CFStringRef pattern) {
   // Setup for pattern walk
   CFIndex patternLength = CFStringGetLength(pattern);
   CFStringInlineBuffer patternBuffer;
-  CFStringInitInlineBuffer(pattern, 
-                           &patternBuffer, 
+  CFStringInitInlineBuffer(pattern,
+                           &patternBuffer,
                            CFRangeMake(0, patternLength));
   UniChar patternChar;
   CFIndex patternIndex = 0;
-  CFIndex targetStringLength = CFStringGetLength(targetString);
-  CFIndex targetStringIndex = 0;
-  BOOL isAnchored = YES;
-
-  size_t dataSize = patternLength * sizeof(UniChar);
-  NSMutableData *tempData = [NSMutableData dataWithLength:dataSize];
-  // Temp string buffer can be no larger than the whole pattern
-  UniChar *findBuffer = [tempData mutableBytes];
-  if (!findBuffer) {
+  UniChar matchAll = program->matchAll;
+  UniChar matchOne = program->matchOne;
+  UniChar escape = program->escape;
+  BOOL setSupport = program->setSupport;
+
+  LikeGlobStep *steps = calloc(patternLength + 1, sizeof(LikeGlobStep));
+  // Temp string buffer can be no larger than the whole pattern, most patterns
+  // fit on the stack.
+  UniChar stackBuffer[128];
+  UniChar *findBuffer = stackBuffer;
+  if (patternLength > (CFIndex)(sizeof(stackBuffer) / sizeof(UniChar))) {
+    findBuffer = malloc(patternLength * sizeof(UniChar));
+  }
+  if (!steps || !findBuffer) {
     // COV_NF_START
-    sqlite3_result_error(context,
-                         "LIKE or GLOB CF implementation failed to " \
-                         "allocate temporary buffer", -1);
-    return;
+    free(steps);
+    if (findBuffer != stackBuffer) free(findBuffer);
+    return NO;
     // COV_NF_END
   }
 
-  // We'll use a mutable string we can just reset as we wish
-  CFMutableStringRef findString =
-    CFStringCreateMutableWithExternalCharactersNoCopy(kCFAllocatorDefault,
-                                                      NULL,
-                                                      0,
-                                                      0,
-                                                      kCFAllocatorNull);
-  GTMCFAutorelease(findString);
-  if (!findString) {
-    // COV_NF_START
-    sqlite3_result_error(context,
-                         "LIKE or GLOB CF implementation failed to " \
-                         "allocate temporary CFString", -1);
-    return;
-    // COV_NF_END
-  }
+  CFIndex stepCount = 0;
+  BOOL isComplete = NO;
+  BOOL isAllocated = YES;
   // Walk the pattern
-  while (patternIndex < patternLength) {
+  while (!isComplete && (patternIndex < patternLength)) {
+    LikeGlobStep *step = &steps[stepCount++];
     patternChar = CFStringGetCharacterFromInlineBuffer(&patternBuffer,
                                                        patternIndex);
     // Match all character has no effect other than to unanchor the search
     if (patternChar == matchAll) {
-      isAnchored = NO;
+      step->kind = kLikeGlobMatchAll;
       patternIndex++;
       continue;
     }
     // Match one character pushes the string index forward by one composed
     // character
     if (patternChar == matchOne) {
-      // If this single char match would walk us off the end of the string
-      // we're already done, no match
-      if (targetStringIndex >= targetStringLength) {
-        sqlite3_result_int(context, 0);
-        return;
-      }
-      // There's still room in the string, so move the string index forward one
-      // composed character and go back around.
-      CFRange nextCharRange =
-        CFStringGetRangeOfComposedCharactersAtIndex(targetString,
-                                                    targetStringIndex);
-      targetStringIndex = nextCharRange.location + nextCharRange.length;
+      step->kind = kLikeGlobMatchOne;
       patternIndex++;
       continue;
     }
     // Character set matches require the parsing of the character set
     if (setSupport && (patternChar == 0x5B)) {  // "["
-      // A character set must match one character, if there's not at least one
-      // character left in the string, don't bother
-      if (targetStringIndex >= targetStringLength) {
-        sqlite3_result_int(context, 0);
-        return;
-      }
-      // There's at least one character, try to match the remainder of the
-      // string using a CFCharacterSet
-      CFMutableCharacterSetRef charSet 
+      // A character set must match one character, so errors in it are only
+      // reported if there's at least one character left in the string
+      step->needsCharacter = YES;
+      CFMutableCharacterSetRef charSet
         = CFCharacterSetCreateMutable(kCFAllocatorDefault);
-      GTMCFAutorelease(charSet);
       if (!charSet) {
         // COV_NF_START
-        sqlite3_result_error(context,
-                             "LIKE or GLOB CF implementation failed to " \
-                             "allocate temporary CFMutableCharacterSet", -1);
-        return;
+        isAllocated = NO;
+        break;
         // COV_NF_END
       }
+      step->charSet = charSet;
 
       BOOL invert = NO;
       // Walk one character forward
       patternIndex++;
       if (patternIndex >= patternLength) {
         // Oops, out of room
-        sqlite3_result_error(context,
-                             "LIKE or GLOB CF implementation found " \
-                             "unclosed character set", -1);
-        return;
+        step->kind = kLikeGlobError;
+        step->error = "LIKE or GLOB CF implementation found " \
+                      "unclosed character set";
+        break;
       }
       // First character after pattern open is special-case
       patternChar = CFStringGetCharacterFromInlineBuffer(&patternBuffer,
@@ -1160,10 +1890,10 @@ static void LikeGlobCompare(sqlite3_context *context,
         patternIndex++;
         if (patternIndex >= patternLength) {
           // Oops, out of room
-          sqlite3_result_error(context,
-                               "LIKE or GLOB CF implementation found " \
-                               "unclosed character set after negation", -1);
-          return;
+          step->kind = kLikeGlobError;
+          step->error = "LIKE or GLOB CF implementation found " \
+                        "unclosed character set after negation";
+          break;
         }
         patternChar = CFStringGetCharacterFromInlineBuffer(&patternBuffer,
                                                            patternIndex);
@@ -1176,10 +1906,10 @@ static void LikeGlobCompare(sqlite3_context *context,
         patternIndex++;
         if (patternIndex >= patternLength) {
           // Oops, out of room
-          sqlite3_result_error(context,
-                               "LIKE or GLOB CF implementation found " \
-                               "unclosed character set after escaped ]", -1);
-          return;
+          step->kind = kLikeGlobError;
+          step->error = "LIKE or GLOB CF implementation found " \
+                        "unclosed character set after escaped ]";
+          break;
         }
         patternChar = CFStringGetCharacterFromInlineBuffer(&patternBuffer,
                                                            patternIndex);
@@ -1230,42 +1960,16 @@ static void LikeGlobCompare(sqlite3_context *context,
       }
       // Check for closure
       if (patternChar != 0x5D) {  // "]"
-        sqlite3_result_error(context,
-                             "LIKE or GLOB CF implementation found " \
-                             "unclosed character set", -1);
-        return;
-      } else {
-        // Increment past the end of the set
-        patternIndex++;
+        step->kind = kLikeGlobError;
+        step->error = "LIKE or GLOB CF implementation found " \
+                      "unclosed character set";
+        break;
       }
+      // Increment past the end of the set
+      patternIndex++;
       // Invert the set if needed
       if (invert) CFCharacterSetInvert(charSet);
-      // Do the search
-      CFOptionFlags findOptions = 0;
-      if (isAnchored) findOptions |= kCFCompareAnchored;
-      CFRange foundRange;
-      unsigned long rangeLen = targetStringLength - targetStringIndex;
-      BOOL found = CFStringFindCharacterFromSet(targetString,
-                                                charSet,
-                                                CFRangeMake(targetStringIndex,
-                                                            rangeLen),
-                                                findOptions,
-                                                &foundRange);
-      // If no match then the whole pattern fails
-      if (!found) {
-        sqlite3_result_int(context, 0);
-        return;
-      }
-      // If we did match then we need to push the string index to the
-      // character past the end of the match and then go back around
-      // the loop.
-      targetStringIndex = foundRange.location + foundRange.length;
-      // At this point patternIndex is either at the end of the
-      // string, or at the next special character which will be picked
-      // up and handled at the top of the loop. We do, however, need
-      // to reset the anchor status
-      isAnchored = YES;
-      // End of character sets, back around
+      step->kind = kLikeGlobSet;
       continue;
     }
     // Otherwise the pattern character is a normal or escaped
@@ -1282,10 +1986,11 @@ static void LikeGlobCompare(sqlite3_context *context,
         if (patternIndex >= patternLength) {
           // COV_NF_START
           // Oops, escape came at end of pattern, that's an error
-          sqlite3_result_error(context,
-                               "LIKE or GLOB CF implementation found " \
-                               "escape character at end of pattern", -1);
-          return;
+          step->kind = kLikeGlobError;
+          step->error = "LIKE or GLOB CF implementation found " \
+                        "escape character at end of pattern";
+          isComplete = YES;
+          break;
           // COV_NF_END
         }
         patternChar = CFStringGetCharacterFromInlineBuffer(&patternBuffer,
@@ -1303,46 +2008,222 @@ static void LikeGlobCompare(sqlite3_context *context,
         patternChar = 0;
       }
     }
-    // On loop exit we have a string ready for comparision, if that
-    // string is too long then it can't be a match.
-    if (findBufferIndex > (targetStringLength - targetStringIndex)) {
-      sqlite3_result_int(context, 0);
-      return;
+    if (isComplete) break;
+    if (findBufferIndex == 0) {
+      // Only a NUL gets here, and CF never finds an empty string.
+      step->kind = kLikeGlobFail;
+      break;
+    }
+    step->kind = kLikeGlobLiteral;
+    step->literal = CFStringCreateWithCharacters(kCFAllocatorDefault,
+                                                 findBuffer,
+                                                 findBufferIndex);
+    if (!step->literal) {
+      // COV_NF_START
+      isAllocated = NO;
+      break;
+      // COV_NF_END
+    }
+  }
+  if (findBuffer != stackBuffer) free(findBuffer);
+  if (!isAllocated) {
+    // COV_NF_START
+    FreeLikeGlobSteps(steps, stepCount);
+    return NO;
+    // COV_NF_END
+  }
+  program->cfSteps = steps;
+  program->cfStepCount = stepCount;
+  return YES;
+}
+
+// Private helper to find an ASCII literal (already case folded) in |target|
+// starting anywhere from |start| to |lastStart|. Returns where it was found
+// or NSNotFound.
+static size_t FindASCIILiteral(const unsigned char *literal,
+                               size_t length,
+                               const char *target,
+                               size_t start,
+                               size_t lastStart,
+                               BOOL caseInsensitive) {
+  unsigned char first = literal[0];
+  BOOL firstHasCase = caseInsensitive && (first >= 'a') && (first <= 'z');
+  for (size_t index = start; index <= lastStart; index++) {
+    if (!firstHasCase) {
+      // memchr is much faster than a loop for skipping to the first byte.
+      const char *found = memchr(target + index, first, lastStart - index + 1);
+      if (!found) break;
+      index = found - target;
+    } else if (FoldASCII(target[index], YES) != first) {
+      continue;
+    }
+    size_t i = 1;
+    for (; i < length; i++) {
+      if (FoldASCII(target[index + i], caseInsensitive) != literal[i]) break;
     }
+    if (i == length) return index;
+  }
+  return NSNotFound;
+}
 
-    // We actually need to do a comparison
-    CFOptionFlags findOptions = compareOptions;
-    if (isAnchored) findOptions |= kCFCompareAnchored;
-    CFStringSetExternalCharactersNoCopy(findString,
-                                        findBuffer,
-                                        findBufferIndex,
-                                        findBufferIndex);
-    CFRange foundRange;
-    unsigned long rangeLen = targetStringLength - targetStringIndex;
-    BOOL found = CFStringFindWithOptions(targetString,
-                                         findString,
-                                         CFRangeMake(targetStringIndex,
-                                                     rangeLen),
-                                         findOptions,
-                                         &foundRange);
-    // If no match then the whole pattern fails
-    if (!found) {
-      sqlite3_result_int(context, 0);
-      return;
+// Private helper to run the ASCII steps of |program| on |target|. Returns 1
+// or 0 for a match, or kASCIINoAnswer if the CF steps have to decide.
+static int RunASCIILikeGlobSteps(const LikeGlobProgram *program,
+                                 const char *target,
+                                 size_t targetLength) {
+  BOOL caseInsensitive =
+    (program->compareOptions & kCFCompareCaseInsensitive) ? YES : NO;
+  size_t targetIndex = 0;
+  BOOL isAnchored = YES;
+  for (CFIndex i = 0; i < program->asciiStepCount; i++) {
+    const LikeGlobStep *step = &program->asciiSteps[i];
+    switch (step->kind) {
+      case kLikeGlobMatchAll:
+        isAnchored = NO;
+        break;
+      case kLikeGlobMatchOne:
+        if (targetIndex >= targetLength) return 0;
+        // CR LF is a single composed character
+        if (target[targetIndex] == '\r') return kASCIINoAnswer;
+        targetIndex++;
+        break;
+      case kLikeGlobSet: {
+        if (targetIndex >= targetLength) return 0;
+        // Find the first character in the set (just the next one if
+        // anchored)
+        size_t searchEnd = isAnchored ? targetIndex + 1 : targetLength;
+        size_t foundIndex = targetIndex;
+        while ((foundIndex < searchEnd)
+               && !IsInASCIISet(step->asciiSet, target[foundIndex])) {
+          foundIndex++;
+        }
+        if (foundIndex >= searchEnd) return 0;
+        targetIndex = foundIndex + 1;
+        isAnchored = YES;
+        break;
+      }
+      case kLikeGlobLiteral: {
+        if (step->length > (targetLength - targetIndex)) return 0;
+        size_t lastStart =
+          isAnchored ? targetIndex : targetLength - step->length;
+        size_t foundIndex = FindASCIILiteral(step->bytes,
+                                             step->length,
+                                             target,
+                                             targetIndex,
+                                             lastStart,
+                                             caseInsensitive);
+        if (foundIndex == NSNotFound) return 0;
+        targetIndex = foundIndex + step->length;
+        isAnchored = YES;
+        break;
+      }
+      default:
+        // COV_NF_START
+        return kASCIINoAnswer;
+        // COV_NF_END
+    }
+  }
+  if (isAnchored) {
+    return (targetIndex == targetLength) ? 1 : 0;
+  }
+  return 1;
+}
+
+// Private helper to run the CF steps of |program| on |targetString| and set
+// the result.
+static void RunCFLikeGlobSteps(sqlite3_context *context,
+                               const LikeGlobProgram *program,
+                               CFStringRef targetString) {
+  CFIndex targetStringLength = CFStringGetLength(targetString);
+  CFIndex targetStringIndex = 0;
+  BOOL isAnchored = YES;
+  for (CFIndex i = 0; i < program->cfStepCount; i++) {
+    const LikeGlobStep *step = &program->cfSteps[i];
+    switch (step->kind) {
+      case kLikeGlobMatchAll:
+        isAnchored = NO;
+        break;
+      case kLikeGlobMatchOne: {
+        // If this single char match would walk us off the end of the string
+        // we're already done, no match
+        if (targetStringIndex >= targetStringLength) {
+          sqlite3_result_int(context, 0);
+          return;
+        }
+        CFRange nextCharRange =
+          CFStringGetRangeOfComposedCharactersAtIndex(targetString,
+                                                      targetStringIndex);
+        targetStringIndex = nextCharRange.location + nextCharRange.length;
+        break;
+      }
+      case kLikeGlobSet: {
+        if (targetStringIndex >= targetStringLength) {
+          sqlite3_result_int(context, 0);
+          return;
+        }
+        CFOptionFlags findOptions = 0;
+        if (isAnchored) findOptions |= kCFCompareAnchored;
+        CFRange foundRange;
+        unsigned long rangeLen = targetStringLength - targetStringIndex;
+        BOOL found = CFStringFindCharacterFromSet(targetString,
+                                                  step->charSet,
+                                                  CFRangeMake(targetStringIndex,
+                                                              rangeLen),
+                                                  findOptions,
+                                                  &foundRange);
+        // If no match then the whole pattern fails
+        if (!found) {
+          sqlite3_result_int(context, 0);
+          return;
+        }
+        // Push the string index to the character past the end of the match
+        targetStringIndex = foundRange.location + foundRange.length;
+        isAnchored = YES;
+        break;
+      }
+      case kLikeGlobLiteral: {
+        // If the literal is too long it can't be a match.
+        if (CFStringGetLength(step->literal)
+            > (targetStringLength - targetStringIndex)) {
+          sqlite3_result_int(context, 0);
+          return;
+        }
+        CFOptionFlags findOptions = program->compareOptions;
+        if (isAnchored) findOptions |= kCFCompareAnchored;
+        CFRange foundRange;
+        unsigned long rangeLen = targetStringLength - targetStringIndex;
+        BOOL found = CFStringFindWithOptions(targetString,
+                                             step->literal,
+                                             CFRangeMake(targetStringIndex,
+                                                         rangeLen),
+                                             findOptions,
+                                             &foundRange);
+        // If no match then the whole pattern fails
+        if (!found) {
+          sqlite3_result_int(context, 0);
+          return;
+        }
+        // Push the string index to the character past the end of the match
+        targetStringIndex = foundRange.location + foundRange.length;
+        isAnchored = YES;
+        break;
+      }
+      case kLikeGlobError:
+        if (step->needsCharacter
+            && (targetStringIndex >= targetStringLength)) {
+          sqlite3_result_int(context, 0);
+        } else {
+          sqlite3_result_error(context, step->error, -1);
+        }
+        return;
+      default:
+        sqlite3_result_int(context, 0);
+        return;
     }
-    // If we did match then we need to push the string index to the
-    // character past the end of the match and then go back around the
-    // loop.
-    targetStringIndex = foundRange.location + foundRange.length;
-    // At this point patternIndex is either at the end of the string,
-    // or at the next special character which will be picked up and
-    // handled at the top of the loop. We do, however, need to reset
-    // the anchor status
-    isAnchored = YES;
-  }
-  // On loop exit all pattern characters have been considered. If we're still
-  // alive it means that we've matched the entire pattern, except for trailing
-  // wildcards, we need to handle that case.
+  }
+  // All pattern steps have been considered. If we're still alive it means
+  // that we've matched the entire pattern, except for trailing wildcards, we
+  // need to handle that case.
   if (isAnchored) {
     // If we're still anchored there was no trailing matchAll, in which case
     // we have to have run to exactly the end of the string
@@ -1357,6 +2238,169 @@ static void LikeGlobCompare(sqlite3_context *context,
   }
 }
 
+// Private helper to handle LIKE and GLOB with different encodings. |pattern|
+// and |target| are NUL terminated UTF-8, or native-endian UTF-16 w/
+// |patternBytes| and |targetBytes| giving their lengths. The compiled
+// pattern is looked up in (or added to) the statement's aux data.
+static void LikeGlobCompare(sqlite3_context *context,
+                            const void *pattern,
+                            size_t patternBytes,
+                            const void *target,
+                            size_t targetBytes,
+                            BOOL isUTF16,
+                            UniChar matchAll,
+                            UniChar matchOne,
+                            UniChar escape,
+                            BOOL setSupport,
+                            CFOptionFlags compareOptions) {
+  // SQLite keeps the aux data as long as the pattern doesn't change, but the
+  // escape and options can, so check them all.
+  LikeGlobProgram *program = sqlite3_get_auxdata(context, 0);
+  BOOL isNewProgram = NO;
+  if (!program
+      || (program->patternBytes != patternBytes)
+      || (program->isUTF16 != isUTF16)
+      || (program->escape != escape)
+      || (program->compareOptions != compareOptions)
+      || memcmp(program->pattern, pattern, patternBytes)) {
+    program = calloc(1, sizeof(LikeGlobProgram));
+    void *patternCopy = malloc(patternBytes + 1);
+    if (!program || !patternCopy) {
+      // COV_NF_START
+      free(program);
+      free(patternCopy);
+      sqlite3_result_error(context,
+                           "LIKE or GLOB CF implementation failed to " \
+                           "allocate compiled pattern", -1);
+      return;
+      // COV_NF_END
+    }
+    memcpy(patternCopy, pattern, patternBytes);
+    ((char *)patternCopy)[patternBytes] = 0;
+    program->pattern = patternCopy;
+    program->patternBytes = patternBytes;
+    program->isUTF16 = isUTF16;
+    program->matchAll = matchAll;
+    program->matchOne = matchOne;
+    program->escape = escape;
+    program->setSupport = setSupport;
+    program->compareOptions = compareOptions;
+    isNewProgram = YES;
+    // ASCII text is matched byte by byte w/o CFStrings, when the options
+    // can't change the answer for ASCII.
+    if (!isUTF16
+        && (escape < 0x80)
+        && !(compareOptions & ~kASCIICompareOptions)
+        && IsASCIIBytes(pattern, (int)patternBytes)) {
+      CompileASCIILikeGlobSteps(program);
+    }
+  }
+
+  int asciiResult = kASCIINoAnswer;
+  if (program->asciiSteps && IsASCIIBytes(target, (int)targetBytes)) {
+    asciiResult = RunASCIILikeGlobSteps(program, target, targetBytes);
+  }
+  if (asciiResult != kASCIINoAnswer) {
+    sqlite3_result_int(context, asciiResult);
+  } else {
+    BOOL isCompiled = (program->cfSteps != NULL);
+    if (!isCompiled) {
+      CFStringRef patternString;
+      if (isUTF16) {
+        patternString =
+          CFStringCreateWithCharacters(kCFAllocatorDefault,
+                                       program->pattern,
+                                       patternBytes / sizeof(UniChar));
+      } else {
+        patternString =
+          CFStringCreateWithCString(kCFAllocatorDefault,
+                                    program->pattern,
+                                    kCFStringEncodingUTF8);
+      }
+      if (patternString) {
+        isCompiled = CompileCFLikeGlobSteps(program, patternString);
+        CFRelease(patternString);
+      }
+    }
+    CFStringRef targetString;
+    if (isUTF16) {
+      targetString =
+        CFStringCreateWithCharactersNoCopy(kCFAllocatorDefault,
+                                           target,
+                                           targetBytes / sizeof(UniChar),
+                                           kCFAllocatorNull);
+    } else {
+      targetString =
+        CFStringCreateWithCStringNoCopy(kCFAllocatorDefault,
+                                        target,
+                                        kCFStringEncodingUTF8,
+                                        kCFAllocatorNull);
+    }
+    if (!(isCompiled && targetString)) {
+      // COV_NF_START
+      sqlite3_result_error(context,
+                           "LIKE or GLOB CF implementation failed to " \
+                           "allocate CFStrings", -1);
+      // COV_NF_END
+    } else {
+      RunCFLikeGlobSteps(context, program, targetString);
+    }
+    if (targetString) CFRelease(targetString);
+  }
+
+  if (isNewProgram) {
+    // SQLite may free it right away, so this has to come last.
+    sqlite3_set_auxdata(context, 0, program, &FreeLikeGlobProgram);
+  }
+}
+
+// Private helper to get the LIKE ESCAPE character, if there is one. Returns
+// NO after setting an error.
+static BOOL LikeEscapeCharacter(sqlite3_context *context,
+                                int argc,
+                                sqlite3_value **argv,
+                                UniChar *outEscape) {
+  *outEscape = 0;
+  if (argc != 3) return YES;
+  // Force a UTF8 conversion for simplicity
+  const char *escape = (const char *)sqlite3_value_text(argv[2]);
+  if (!escape) {
+    sqlite3_result_error(context,
+                         "LIKE CF implementation missing " \
+                         "escape character", -1);
+    return NO;
+  }
+  // The usual case of an ASCII character doesn't need a CFString
+  if (escape[0] && !(escape[0] & 0x80) && !escape[1]) {
+    *outEscape = escape[0];
+    return YES;
+  }
+  CFStringRef escapeString =
+    CFStringCreateWithCString(kCFAllocatorDefault,
+                              escape,
+                              kCFStringEncodingUTF8);
+  if (!escapeString) {
+    // COV_NF_START
+    sqlite3_result_error(context,
+                         "LIKE CF implementation failed to " \
+                         "allocate CFString for ESCAPE", -1);
+    return NO;
+    // COV_NF_END
+  }
+  BOOL isSingleCharacter = (CFStringGetLength(escapeString) == 1);
+  if (isSingleCharacter) {
+    *outEscape = CFStringGetCharacterAtIndex(escapeString, 0);
+  }
+  CFRelease(escapeString);
+  if (!isSingleCharacter) {
+    sqlite3_result_error(context,
+                         "CF implementation ESCAPE expression " \
+                         "must be single character", -1);
+    return NO;
+  }
+  return YES;
+}
+
 static void Like8(sqlite3_context *context, int argc, sqlite3_value **argv) {
   // Get our LIKE options
   LikeGlobUserArgs *likeArgs = sqlite3_user_data(context);
@@ -1377,64 +2421,18 @@ static void Like8(sqlite3_context *context, int argc, sqlite3_value **argv) {
     return;
     // COV_NF_END
   }
-  CFStringRef patternString =
-    CFStringCreateWithCStringNoCopy(kCFAllocatorDefault,
-                                    pattern,
-                                    kCFStringEncodingUTF8,
-                                    kCFAllocatorNull);
-  CFStringRef targetString =
-    CFStringCreateWithCStringNoCopy(kCFAllocatorDefault,
-                                    target,
-                                    kCFStringEncodingUTF8,
-                                    kCFAllocatorNull);
-  GTMCFAutorelease(patternString);
-  GTMCFAutorelease(targetString);
-  if (!(patternString && targetString)) {
-    // COV_NF_START
-    sqlite3_result_error(context,
-                         "LIKE CF implementation failed " \
-                         "to allocate CFStrings", -1);
-    return;
-    // COV_NF_END
-  }
 
-  UniChar escapeChar = 0;
   // If there is a third argument it is the escape character
-  if (argc == 3) {
-    const char *escape = (const char *)sqlite3_value_text(argv[2]);
-    if (!escape) {
-      sqlite3_result_error(context,
-                           "LIKE CF implementation missing " \
-                           "escape character", -1);
-      return;
-    }
-    CFStringRef escapeString =
-      CFStringCreateWithCStringNoCopy(kCFAllocatorDefault,
-                                      escape,
-                                      kCFStringEncodingUTF8,
-                                      kCFAllocatorNull);
-    GTMCFAutorelease(escapeString);
-    if (!escapeString) {
-      // COV_NF_START
-      sqlite3_result_error(context,
-                           "LIKE CF implementation failed to " \
-                           "allocate CFString for ESCAPE", -1);
-      return;
-      // COV_NF_END
-    }
-    if (CFStringGetLength(escapeString) != 1) {
-      sqlite3_result_error(context,
-                           "CF implementation ESCAPE expression " \
-                           "must be single character", -1);
-      return;
-    }
-    escapeChar = CFStringGetCharacterAtIndex(escapeString, 0);
-  }
+  UniChar escapeChar;
+  if (!LikeEscapeCharacter(context, argc, argv, &escapeChar)) return;
 
   // Do the compare
   LikeGlobCompare(context,
-                  patternString,
-                  targetString,
+                  pattern,
+                  strlen(pattern),
+                  target,
+                  strlen(target),
+                  NO,
                   0x25,  // %
                   0x5F,  // _
                   escapeChar,
@@ -1469,65 +2467,18 @@ static void Like16(sqlite3_context *context, int argc, sqlite3_value **argv) {
     return;
     // COV_NF_END
   }
-  CFStringRef patternString =
-    CFStringCreateWithCharactersNoCopy(kCFAllocatorDefault,
-                                       patternText,
-                                       patternByteCount / sizeof(UniChar),
-                                       kCFAllocatorNull);
-  CFStringRef targetString =
-    CFStringCreateWithCharactersNoCopy(kCFAllocatorDefault,
-                                       targetText,
-                                       targetByteCount / sizeof(UniChar),
-                                       kCFAllocatorNull);
-  GTMCFAutorelease(patternString);
-  GTMCFAutorelease(targetString);
-  if (!(patternString && targetString)) {
-    // COV_NF_START
-    sqlite3_result_error(context,
-                         "LIKE CF implementation failed " \
-                         "to allocate CFStrings", -1);
-    return;
-    // COV_NF_END
-  }
 
-  // If there is a third argument it is the escape character, force a
-  // UTF8 conversion for simplicity
-  UniChar escapeChar = 0;
-  if (argc == 3) {
-    const char *escape = (const char *)sqlite3_value_text(argv[2]);
-    if (!escape) {
-      sqlite3_result_error(context,
-                           "LIKE CF implementation " \
-                           "missing escape character", -1);
-      return;
-    }
-    CFStringRef escapeString =
-      CFStringCreateWithCStringNoCopy(kCFAllocatorDefault,
-                                      escape,
-                                      kCFStringEncodingUTF8,
-                                      kCFAllocatorNull);
-    GTMCFAutorelease(escapeString);
-    if (!escapeString) {
-      // COV_NF_START
-      sqlite3_result_error(context,
-                           "LIKE CF implementation failed to " \
-                           "allocate CFString for ESCAPE", -1);
-      return;
-      // COV_NF_END
-    }
-    if (CFStringGetLength(escapeString) != 1) {
-      sqlite3_result_error(context,
-                           "CF implementation ESCAPE expression " \
-                           "must be single character", -1);
-      return;
-    }
-    escapeChar = CFStringGetCharacterAtIndex(escapeString, 0);
-  }
+  // If there is a third argument it is the escape character
+  UniChar escapeChar;
+  if (!LikeEscapeCharacter(context, argc, argv, &escapeChar)) return;
 
   // Do the compare
   LikeGlobCompare(context,
-                  patternString,
-                  targetString,
+                  patternText,
+                  patternByteCount,
+                  targetText,
+                  targetByteCount,
+                  YES,
                   0x25,  // %
                   0x5F,  // _
                   escapeChar,
@@ -1556,36 +2507,19 @@ static void Glob8(sqlite3_context *context, int argc, sqlite3_value **argv) {
     return;
     // COV_NF_END
   }
-  CFStringRef patternString =
-    CFStringCreateWithCStringNoCopy(kCFAllocatorDefault,
-                                    pattern,
-                                    kCFStringEncodingUTF8,
-                                    kCFAllocatorNull);
-  CFStringRef targetString =
-    CFStringCreateWithCStringNoCopy(kCFAllocatorDefault,
-                                    target,
-                                    kCFStringEncodingUTF8,
-                                    kCFAllocatorNull);
-  GTMCFAutorelease(patternString);
-  GTMCFAutorelease(targetString);
-
-  if (!(patternString && targetString)) {
-    // COV_NF_START
-    sqlite3_result_error(context,
-                         "GLOB CF implementation failed to " \
-                         "allocate CFStrings", -1);
-    // COV_NF_END
-  } else {
-    // Do the compare
-    LikeGlobCompare(context,
-                    patternString,
-                    targetString,
-                    0x2A,  // *
-                    0x3F,  // ?
-                    0,     // GLOB does not support escape characters
-                    YES,   // GLOB supports character sets
-                    *(globArgs->compareOptionPtr));
-  }
+
+  // Do the compare
+  LikeGlobCompare(context,
+                  pattern,
+                  strlen(pattern),
+                  target,
+                  strlen(target),
+                  NO,
+                  0x2A,  // *
+                  0x3F,  // ?
+                  0,     // GLOB does not support escape characters
+                  YES,   // GLOB supports character sets
+                  *(globArgs->compareOptionPtr));
 }
 
 static void Glob16(sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -1615,35 +2549,19 @@ static void Glob16(sqlite3_context *context, int argc, sqlite3_value **argv) {
     return;
     // COV_NF_END
   }
-  CFStringRef patternString =
-    CFStringCreateWithCharactersNoCopy(kCFAllocatorDefault,
-                                       patternText,
-                                       patternByteCount / sizeof(UniChar),
-                                       kCFAllocatorNull);
-  CFStringRef targetString =
-    CFStringCreateWithCharactersNoCopy(kCFAllocatorDefault,
-                                       targetText,
-                                       targetByteCount / sizeof(UniChar),
-                                       kCFAllocatorNull);
-  GTMCFAutorelease(patternString);
-  GTMCFAutorelease(targetString);
-  if (!(patternString && targetString)) {
-    // COV_NF_START
-    sqlite3_result_error(context,
-                         "GLOB CF implementation failed to  "\
-                         "allocate CFStrings", -1);
-    // COV_NF_END
-  } else {
-    // Do the compare
-    LikeGlobCompare(context,
-                    patternString,
-                    targetString,
-                    0x2A,  // *
-                    0x3F,  // ?
-                    0,     // GLOB does not support escape characters
-                    YES,   // GLOB supports character sets
-                    *(globArgs->compareOptionPtr));
-  }
+
+  // Do the compare
+  LikeGlobCompare(context,
+                  patternText,
+                  patternByteCount,
+                  targetText,
+                  targetByteCount,
+                  YES,
+                  0x2A,  // *
+                  0x3F,  // ?
+                  0,     // GLOB does not support escape characters
+                  YES,   // GLOB supports character sets
+                  *(globArgs->compareOptionPtr));
 }
 
 // -----------------------------------------------------------------------------
@@ -1709,6 +2627,15 @@ static void Glob16(sqlite3_context *context, int argc, sqlite3_value **argv) {
   return obj;
 }
 
+- (id)initWithPreparedStatement:(sqlite3_stmt *)statement
+                 hasCFAdditions:(BOOL)hasCFAdditions {
+  if ((self = [super init])) {
+    statement_ = statement;
+    hasCFAdditions_ = hasCFAdditions;
+  }
+  return self;
+}
+
 - (void)dealloc {
   if (statement_) {
     _GTMDevLog(@"-[GTMSQLiteStatement finalizeStatement] must be called when"
@@ -1827,6 +2754,29 @@ static void Glob16(sqlite3_context *context, int argc, sqlite3_value **argv) {
                            SQLITE_TRANSIENT);
 }
 
+- (int)bindFoundationObject:(id)object atPosition:(int)position {
+  if (!statement_) return SQLITE_MISUSE;
+  if (!object || [object isKindOfClass:[NSNull class]]) {
+    return sqlite3_bind_null(statement_, position);
+  } else if ([object isKindOfClass:[NSString class]]) {
+    return [self bindStringAtPosition:position string:object];
+  } else if ([object isKindOfClass:[NSNumber class]]) {
+    const char *type = [object objCType];
+    if (type && (type[0] == 'f' || type[0] == 'd')) {
+      return [self bindNumberAsDoubleAtPosition:position number:object];
+    }
+    return [self bindNumberAsLongLongAtPosition:position number:object];
+  } else if ([object isKindOfClass:[NSData class]]) {
+    if ([object length] == 0) {
+      // bindBlobAtPosition: treats that as a mistake, but an empty blob is
+      // still a blob (and not a NULL).
+      return sqlite3_bind_blob(statement_, position, "", 0, SQLITE_STATIC);
+    }
+    return [self bindBlobAtPosition:position data:object];
+  }
+  return SQLITE_MISMATCH;
+}
+
 #pragma mark Results
 
 - (int)resultColumnCount {
@@ -1993,3 +2943,258 @@ static void Glob16(sqlite3_context *context, int argc, sqlite3_value **argv) {
 }
 
 @end
+
+#pragma mark -
+
+//  Default busy timeout for the connections of a GTMSQLiteDatabasePool
+static const int kDefaultPoolBusyTimeoutMS = 5000;
+
+struct GTMSQLiteDatabasePoolLock {
+  pthread_mutex_t mutex;
+  pthread_cond_t readerAvailable;
+  pthread_cond_t writerAvailable;
+};
+
+@interface GTMSQLiteDatabasePool (PrivateMethods)
+- (GTMSQLiteDatabase *)openConnectionWithErrorCode:(int *)err;
+- (void)rollbackOpenTransaction:(GTMSQLiteDatabase *)db;
+@end
+
+@implementation GTMSQLiteDatabasePool
+
+- (id)init {
+  return [self initWithPath:nil
+            withCFAdditions:NO
+                       utf8:YES
+             maximumReaders:0
+                  errorCode:NULL];
+}
+
+- (id)initWithPath:(NSString *)path
+   withCFAdditions:(BOOL)additions
+              utf8:(BOOL)useUTF8
+    maximumReaders:(NSUInteger)maximumReaders
+         errorCode:(int *)err {
+  int rc = SQLITE_MISUSE;
+  if ((self = [super init])) {
+    // Each connection to a memory database gets its own database, so they
+    // can't be pooled.
+    if ([path length] == 0
+        || [path isEqualToString:@":memory:"]
+        || maximumReaders == 0) {
+      if (err) *err = rc;
+      [self release];
+      return nil;
+    }
+    path_ = [path copy];
+    hasCFAdditions_ = additions;
+    useUTF8_ = useUTF8;
+    maximumReaders_ = maximumReaders;
+    timeoutMS_ = kDefaultPoolBusyTimeoutMS;
+    readers_ = [[NSMutableArray alloc] initWithCapacity:maximumReaders];
+    idleReaders_ = [[NSMutableArray alloc] initWithCapacity:maximumReaders];
+    lock_ = calloc(1, sizeof(struct GTMSQLiteDatabasePoolLock));
+    if (!readers_ || !idleReaders_ || !lock_) {
+      // COV_NF_START - not sure how to fail Cocoa initializers
+      if (err) *err = SQLITE_NOMEM;
+      free(lock_);
+      lock_ = NULL;
+      [self release];
+      return nil;
+      // COV_NF_END
+    }
+    pthread_mutex_init(&lock_->mutex, NULL);
+    pthread_cond_init(&lock_->readerAvailable, NULL);
+    pthread_cond_init(&lock_->writerAvailable, NULL);
+
+    writer_ = [[self openConnectionWithErrorCode:&rc] retain];
+    if (writer_) {
+      // journal_mode answers w/ the mode it ended up in. SQLites before WAL
+      // just report the old mode.
+      NSString *mode =
+        [writer_ resultOfPragma:@"PRAGMA journal_mode = WAL;"];
+      isWAL_ = [[mode lowercaseString] isEqualToString:@"wal"];
+      if (!isWAL_) {
+        _GTMDevLog(@"%@ couldn't switch to WAL (journal_mode is %@), readers "
+                   @"and the writer will block each other", self, mode);
+      }
+    }
+
+    if (err) *err = rc;
+    if (rc != SQLITE_OK) {
+      // COV_NF_START
+      [self release];
+      self = nil;
+      // COV_NF_END
+    }
+  }
+  return self;
+}
+
+- (void)dealloc {
+  if (writerCheckedOut_ || ([idleReaders_ count] != [readers_ count])) {
+    _GTMDevLog(@"%@ released w/ connections still checked out", self);
+  }
+  [idleReaders_ release];
+  [readers_ release];
+  [writer_ release];
+  [path_ release];
+  if (lock_) {
+    pthread_cond_destroy(&lock_->writerAvailable);
+    pthread_cond_destroy(&lock_->readerAvailable);
+    pthread_mutex_destroy(&lock_->mutex);
+    free(lock_);
+  }
+  [super dealloc];
+}
+
+- (NSString *)path {
+  return path_;
+}
+
+- (BOOL)isWriteAheadLogging {
+  return isWAL_;
+}
+
+- (NSUInteger)maximumReaders {
+  return maximumReaders_;
+}
+
+- (void)setBusyTimeoutMS:(int)timeoutMS {
+  // The connections may be in use on other threads, so they pick up the new
+  // value as they are checked out.
+  pthread_mutex_lock(&lock_->mutex);
+  timeoutMS_ = timeoutMS;
+  pthread_mutex_unlock(&lock_->mutex);
+}
+
+- (int)busyTimeoutMS {
+  pthread_mutex_lock(&lock_->mutex);
+  int timeoutMS = timeoutMS_;
+  pthread_mutex_unlock(&lock_->mutex);
+  return timeoutMS;
+}
+
+- (GTMSQLiteDatabase *)openConnectionWithErrorCode:(int *)err {
+  GTMSQLiteDatabase *db =
+    [[[GTMSQLiteDatabase alloc] initWithPath:path_
+                             withCFAdditions:hasCFAdditions_
+                                        utf8:useUTF8_
+                                   errorCode:err] autorelease];
+  [db setBusyTimeoutMS:timeoutMS_];
+  return db;
+}
+
+- (void)rollbackOpenTransaction:(GTMSQLiteDatabase *)db {
+  if (!sqlite3_get_autocommit([db sqlite3DB])) {
+    _GTMDevLog(@"Rolling back the transaction left open on %@", db);
+    [db rollback];
+  }
+}
+
+- (GTMSQLiteDatabase *)checkOutReader {
+  GTMSQLiteDatabase *reader = nil;
+  pthread_mutex_lock(&lock_->mutex);
+  while (([idleReaders_ count] == 0)
+         && ([readers_ count] >= maximumReaders_)) {
+    pthread_cond_wait(&lock_->readerAvailable, &lock_->mutex);
+  }
+  if ([idleReaders_ count]) {
+    // |readers_| keeps it alive.
+    reader = [idleReaders_ lastObject];
+    [idleReaders_ removeLastObject];
+    if ([reader busyTimeoutMS] != timeoutMS_) {
+      [reader setBusyTimeoutMS:timeoutMS_];
+    }
+  } else {
+    // Opening under the lock serializes the opens, but there are only ever
+    // |maximumReaders_| of them.
+    int rc;
+    reader = [self openConnectionWithErrorCode:&rc];
+    if (reader) {
+      // Only understood by SQLite 3.8.0 and later, older ones ignore it.
+      [reader executeSQL:@"PRAGMA query_only = 1;"];
+      [readers_ addObject:reader];
+    } else {
+      _GTMDevLog(@"%@ couldn't open a reader, error code: %d", self, rc);
+    }
+  }
+  pthread_mutex_unlock(&lock_->mutex);
+  return reader;
+}
+
+- (void)checkInReader:(GTMSQLiteDatabase *)reader {
+  if (!reader) return;
+  [self rollbackOpenTransaction:reader];
+  pthread_mutex_lock(&lock_->mutex);
+  if (([readers_ indexOfObjectIdenticalTo:reader] == NSNotFound)
+      || ([idleReaders_ indexOfObjectIdenticalTo:reader] != NSNotFound)) {
+    _GTMDevLog(@"%@ is not a checked out reader of %@", reader, self);
+  } else {
+    [idleReaders_ addObject:reader];
+    pthread_cond_signal(&lock_->readerAvailable);
+  }
+  pthread_mutex_unlock(&lock_->mutex);
+}
+
+- (GTMSQLiteDatabase *)checkOutWriter {
+  pthread_mutex_lock(&lock_->mutex);
+  while (writerCheckedOut_) {
+    pthread_cond_wait(&lock_->writerAvailable, &lock_->mutex);
+  }
+  writerCheckedOut_ = YES;
+  if ([writer_ busyTimeoutMS] != timeoutMS_) {
+    [writer_ setBusyTimeoutMS:timeoutMS_];
+  }
+  pthread_mutex_unlock(&lock_->mutex);
+  return writer_;
+}
+
+- (void)checkInWriter:(GTMSQLiteDatabase *)writer {
+  if (!writer) return;
+  pthread_mutex_lock(&lock_->mutex);
+  BOOL checkedOut = writerCheckedOut_;
+  pthread_mutex_unlock(&lock_->mutex);
+  if ((writer != writer_) || !checkedOut) {
+    // Don't touch the writer (or free its slot) on a bad check in; another
+    // thread may legitimately hold it.
+    _GTMDevLog(@"%@ is not the checked out writer of %@", writer, self);
+    return;
+  }
+  [self rollbackOpenTransaction:writer];
+  pthread_mutex_lock(&lock_->mutex);
+  writerCheckedOut_ = NO;
+  pthread_cond_signal(&lock_->writerAvailable);
+  pthread_mutex_unlock(&lock_->mutex);
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+- (void)readUsingBlock:(void (^)(GTMSQLiteDatabase *db))block {
+  GTMSQLiteDatabase *reader = [self checkOutReader];
+  @try {
+    block(reader);
+  }
+  @finally {
+    [self checkInReader:reader];
+  }
+}
+
+- (void)writeUsingBlock:(void (^)(GTMSQLiteDatabase *db))block {
+  GTMSQLiteDatabase *writer = [self checkOutWriter];
+  @try {
+    block(writer);
+  }
+  @finally {
+    [self checkInWriter:writer];
+  }
+}
+
+#endif  // NS_BLOCKS_AVAILABLE
+
+- (NSString *)description {
+  return [NSString stringWithFormat:@"<%@: %p - %@>",
+          [self class], self, path_];
+}
+
+@end
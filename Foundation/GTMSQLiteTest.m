@@ -20,6 +20,7 @@
 #import "GTMSQLite.h"
 #import "GTMSenTestCase.h"
 #import "GTMUnitTestDevLog.h"
+#import "GTMTestTimer.h"
 
 @interface GTMSQLiteTest : GTMTestCase
 @end
@@ -36,6 +37,28 @@ static BOOL customUpperFunctionCalled =  NO;
 // Prototype for LIKE/GLOB test helper
 static NSArray* LikeGlobTestHelper(GTMSQLiteDatabase *db, NSString *sql);
 
+// Sets a flag when it goes away, to see when autorelease pools drain
+@interface GTMSQLiteDeallocFlag : NSObject {
+ @private
+  BOOL *flag_;
+}
+- (id)initWithFlag:(BOOL *)flag;
+@end
+
+@implementation GTMSQLiteDeallocFlag
+- (id)initWithFlag:(BOOL *)flag {
+  if ((self = [super init])) {
+    flag_ = flag;
+  }
+  return self;
+}
+
+- (void)dealloc {
+  *flag_ = YES;
+  [super dealloc];
+}
+@end
+
 @implementation GTMSQLiteTest
 
 // Test cases for change counting
@@ -1125,6 +1148,997 @@ static void TestUpperLower16Impl(sqlite3_context *context,
   STAssertNotNil([db8 description], nil);
 }
 
+- (void)testStatementCache {
+  int err;
+  GTMSQLiteDatabase *db =
+    [[[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:YES
+                                                       utf8:YES
+                                                  errorCode:&err]
+      autorelease];
+  STAssertNotNil(db, @"Failed to create database");
+  STAssertEquals([db statementCacheLimit], (NSUInteger)32, nil);
+
+  // executeSQL: goes through the cache for single statements...
+  err = [db executeSQL:@"CREATE TABLE foo (bar INTEGER);"];
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertEquals([db statementCacheMissCount], (NSUInteger)1, nil);
+  for (int i = 0; i < 5; i++) {
+    err = [db executeSQL:@"INSERT INTO foo (bar) VALUES (1);"];
+    STAssertEquals(err, SQLITE_OK, nil);
+  }
+  STAssertEquals([db statementCacheMissCount], (NSUInteger)2, nil);
+  STAssertEquals([db statementCacheHitCount], (NSUInteger)4, nil);
+  err = [db executeSQL:@"INSERT INTO nosuchtable (bar) VALUES (1);"];
+  STAssertNotEquals(err, SQLITE_OK, nil);
+  // ...and leaves the rest to sqlite3_exec.
+  err = [db executeSQL:@"INSERT INTO foo (bar) VALUES (2); "
+                       @"INSERT INTO foo (bar) VALUES (3);"];
+  STAssertEquals(err, SQLITE_OK, nil);
+  err = [db executeSQL:@""];
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertEquals([db statementCacheMissCount], (NSUInteger)2, nil);
+  STAssertEquals([db totalChangeCount], 7, nil);
+
+  // Checked out statements come back reset with no bindings.
+  NSString *selectSQL = @"SELECT COUNT(*), ? FROM foo;";
+  GTMSQLiteStatement *statement = [db checkOutStatementWithSQL:selectSQL
+                                                     errorCode:&err];
+  STAssertNotNil(statement, nil);
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertEquals([statement bindInt32AtPosition:1 value:42], SQLITE_OK, nil);
+  STAssertEquals([statement stepRow], SQLITE_ROW, nil);
+  STAssertEquals([statement resultInt32AtPosition:0], 7, nil);
+  STAssertEquals([statement resultInt32AtPosition:1], 42, nil);
+  [db checkInStatement:statement];
+  GTMSQLiteStatement *statement2 = [db checkOutStatementWithSQL:selectSQL
+                                                      errorCode:&err];
+  STAssertTrue(statement2 == statement, @"statement wasn't reused");
+  STAssertEquals([db statementCacheHitCount], (NSUInteger)5, nil);
+  STAssertEquals([statement2 stepRow], SQLITE_ROW, nil);
+  STAssertEquals([statement2 resultColumnTypeAtPosition:1], SQLITE_NULL, nil);
+
+  // While it is out, the same SQL gets another statement.
+  GTMSQLiteStatement *statement3 = [db checkOutStatementWithSQL:selectSQL
+                                                      errorCode:&err];
+  STAssertNotNil(statement3, nil);
+  STAssertTrue(statement3 != statement2, @"statement was shared");
+  [db checkInStatement:statement3];
+  [db checkInStatement:statement2];
+  STAssertNil([statement2 sqlite3Statement], @"extra copy wasn't finalized");
+
+  // Statements that didn't come from the cache are left alone.
+  GTMSQLiteStatement *other = [GTMSQLiteStatement statementWithSQL:selectSQL
+                                                        inDatabase:db
+                                                         errorCode:&err];
+  [GTMUnitTestDevLog expectPattern:@".* was not checked out from .*"];
+  [db checkInStatement:other];
+  STAssertTrue([other sqlite3Statement] != NULL, nil);
+  [other finalizeStatement];
+
+  // Bad SQL fails like GTMSQLiteStatement does.
+  statement = [db checkOutStatementWithSQL:@"SELECT * FROM nosuchtable"
+                                 errorCode:&err];
+  STAssertNil(statement, nil);
+  STAssertNotEquals(err, SQLITE_OK, nil);
+  statement = [db checkOutStatementWithSQL:nil errorCode:&err];
+  STAssertNil(statement, nil);
+  STAssertEquals(err, SQLITE_MISUSE, nil);
+
+  // The least recently used statements go when the limit is hit.
+  [db setStatementCacheLimit:2];
+  STAssertEquals([db statementCacheLimit], (NSUInteger)2, nil);
+  NSString *sqls[] = { @"SELECT 1;", @"SELECT 2;", @"SELECT 3;" };
+  for (size_t i = 0; i < sizeof(sqls) / sizeof(sqls[0]); i++) {
+    statement = [db checkOutStatementWithSQL:sqls[i] errorCode:&err];
+    STAssertNotNil(statement, nil);
+    [db checkInStatement:statement];
+  }
+  NSUInteger misses = [db statementCacheMissCount];
+  NSUInteger hits = [db statementCacheHitCount];
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 3;"
+                                          errorCode:&err]];
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 2;"
+                                          errorCode:&err]];
+  STAssertEquals([db statementCacheHitCount], hits + 2, nil);
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 1;"
+                                          errorCode:&err]];
+  STAssertEquals([db statementCacheMissCount], misses + 1, nil);
+
+  // A hit in the middle of the order moves that statement to the back.
+  [db setStatementCacheLimit:3];
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 3;"
+                                          errorCode:&err]];
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 2;"
+                                          errorCode:&err]];
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 4;"
+                                          errorCode:&err]];
+  misses = [db statementCacheMissCount];
+  hits = [db statementCacheHitCount];
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 2;"
+                                          errorCode:&err]];
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 4;"
+                                          errorCode:&err]];
+  STAssertEquals([db statementCacheHitCount], hits + 2, nil);
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 1;"
+                                          errorCode:&err]];
+  STAssertEquals([db statementCacheMissCount], misses + 1, nil);
+
+  // Clearing, or a limit of zero, finalizes what is cached.
+  [db clearStatementCache];
+  [db checkInStatement:[db checkOutStatementWithSQL:@"SELECT 1;"
+                                          errorCode:&err]];
+  STAssertEquals([db statementCacheMissCount], misses + 2, nil);
+  [db setStatementCacheLimit:0];
+  err = [db executeSQL:@"INSERT INTO foo (bar) VALUES (1);"];
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertEquals([db statementCacheMissCount], misses + 2, nil);
+  [db setStatementCacheLimit:32];
+
+  // A statement that never gets checked in is finalized with the database.
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  GTMSQLiteDatabase *db2 =
+    [[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:NO
+                                                      utf8:YES
+                                                 errorCode:&err];
+  STAssertNotNil(db2, @"Failed to create database");
+  statement = [db2 checkOutStatementWithSQL:@"SELECT 1;" errorCode:&err];
+  STAssertEquals([statement stepRow], SQLITE_ROW, nil);
+  [GTMUnitTestDevLog expectPattern:@"1 statement\\(s\\) from .* were never "
+                                   @"checked in"];
+  [db2 release];
+  [pool drain];
+}
+
+- (void)testStatementCacheThroughput {
+  int err;
+  GTMSQLiteDatabase *db =
+    [[[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:YES
+                                                       utf8:YES
+                                                  errorCode:&err]
+      autorelease];
+  STAssertNotNil(db, @"Failed to create database");
+  err = [db executeSQL:@"CREATE TABLE foo (id INTEGER PRIMARY KEY, bar TEXT);"];
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertTrue([db beginDeferredTransaction], nil);
+  for (int i = 0; i < 1000; i++) {
+    NSString *sql =
+      [NSString stringWithFormat:@"INSERT INTO foo VALUES (%d, 'row %d');",
+       i, i];
+    STAssertEquals([db executeSQL:sql], SQLITE_OK, nil);
+  }
+  STAssertTrue([db commit], nil);
+
+  NSString *selectSQL = @"SELECT bar FROM foo WHERE id = ?;";
+  const int kQueries = 20000;
+  double nanoseconds[2];
+  for (int cached = 0; cached < 2; cached++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    GTMTestTimer *timer = GTMTestTimerCreate();
+    GTMTestTimerStart(timer);
+    int found = 0;
+    for (int i = 0; i < kQueries; i++) {
+      GTMSQLiteStatement *statement;
+      if (cached) {
+        statement = [db checkOutStatementWithSQL:selectSQL errorCode:&err];
+      } else {
+        statement = [GTMSQLiteStatement statementWithSQL:selectSQL
+                                              inDatabase:db
+                                               errorCode:&err];
+      }
+      [statement bindInt32AtPosition:1 value:i % 1000];
+      if ([statement stepRow] == SQLITE_ROW) {
+        found++;
+      }
+      if (cached) {
+        [db checkInStatement:statement];
+      } else {
+        [statement finalizeStatement];
+      }
+    }
+    GTMTestTimerStop(timer);
+    [pool drain];
+    STAssertEquals(found, kQueries, nil);
+    nanoseconds[cached] = GTMTestTimerGetNanoseconds(timer);
+    GTMTestTimerRelease(timer);
+  }
+  NSLog(@"Prepared statements: %.0f ns per query, cached: %.0f ns per query",
+        nanoseconds[0] / kQueries, nanoseconds[1] / kQueries);
+}
+
+- (void)testBulkLoad {
+  int err;
+  GTMSQLiteDatabase *db =
+    [[[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:YES
+                                                       utf8:YES
+                                                  errorCode:&err]
+      autorelease];
+  STAssertNotNil(db, @"Failed to create database");
+  err = [db executeSQL:@"CREATE TABLE foo (id INTEGER UNIQUE, name TEXT, "
+                       @"value REAL, data BLOB, extra TEXT);"];
+  STAssertEquals(err, SQLITE_OK, nil);
+
+  NSString *insertSQL = @"INSERT INTO foo VALUES (?, ?, ?, ?, ?);";
+  NSData *data = [NSData dataWithBytes:"\x01\x02" length:2];
+  NSArray *rows =
+    [NSArray arrayWithObjects:
+     [NSArray arrayWithObjects:[NSNumber numberWithInt:1], @"one",
+      [NSNumber numberWithDouble:1.5], data, @"x", nil],
+     [NSArray arrayWithObjects:[NSNumber numberWithLongLong:1LL << 40],
+      [NSNull null], [NSNumber numberWithFloat:2.5f], [NSData data], nil],
+     [NSArray arrayWithObjects:[NSNumber numberWithInt:3], nil],
+     nil];
+  NSUInteger loaded = 0;
+  err = [db bulkLoadRows:[rows objectEnumerator]
+                 withSQL:insertSQL
+      rowsPerTransaction:0
+                 options:0
+              rowsLoaded:&loaded];
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertEquals(loaded, (NSUInteger)3, nil);
+
+  GTMSQLiteStatement *statement =
+    [GTMSQLiteStatement statementWithSQL:@"SELECT * FROM foo ORDER BY id;"
+                              inDatabase:db
+                               errorCode:&err];
+  STAssertEquals([statement stepRow], SQLITE_ROW, nil);
+  NSArray *expected = [rows objectAtIndex:0];
+  STAssertEqualObjects([statement resultRowArray], expected, nil);
+  STAssertEquals([statement stepRow], SQLITE_ROW, nil);
+  STAssertEquals([statement resultColumnTypeAtPosition:0], SQLITE_INTEGER, nil);
+  STAssertEquals([statement resultLongLongAtPosition:0], 1LL << 40, nil);
+  STAssertEquals([statement resultColumnTypeAtPosition:1], SQLITE_NULL, nil);
+  STAssertEquals([statement resultColumnTypeAtPosition:2], SQLITE_FLOAT, nil);
+  STAssertEquals([statement resultColumnTypeAtPosition:3], SQLITE_BLOB, nil);
+  STAssertEquals([statement resultColumnTypeAtPosition:4], SQLITE_NULL, nil);
+  STAssertEquals([statement stepRow], SQLITE_ROW, nil);
+  STAssertEquals([statement resultInt32AtPosition:0], 3, nil);
+  STAssertEquals([statement resultColumnTypeAtPosition:1], SQLITE_NULL, nil);
+  STAssertEquals([statement stepRow], SQLITE_DONE, nil);
+  [statement finalizeStatement];
+
+  // A failure rolls back to the last commit.
+  NSMutableArray *moreRows = [NSMutableArray array];
+  for (int i = 10; i < 40; i++) {
+    // Row 25 collides w/ row 10.
+    int rowID = (i == 25) ? 10 : i;
+    [moreRows addObject:
+     [NSArray arrayWithObjects:[NSNumber numberWithInt:rowID], @"more", nil]];
+  }
+  err = [db bulkLoadRows:[moreRows objectEnumerator]
+                 withSQL:insertSQL
+      rowsPerTransaction:10
+                 options:kGTMSQLiteBulkLoadOptionRelaxDurability
+              rowsLoaded:&loaded];
+  STAssertEquals(err, SQLITE_CONSTRAINT, nil);
+  STAssertEquals(loaded, (NSUInteger)10, nil);
+  NSArray *count = LikeGlobTestHelper(db, @"SELECT COUNT(*) FROM foo;");
+  STAssertEqualObjects(count,
+                       [NSArray arrayWithObject:[NSNumber numberWithInt:13]],
+                       nil);
+
+  // Inside a transaction the rows belong to the caller's transaction.
+  STAssertTrue([db beginDeferredTransaction], nil);
+  err = [db bulkLoadRows:[[moreRows subarrayWithRange:NSMakeRange(20, 5)]
+                          objectEnumerator]
+                 withSQL:insertSQL
+      rowsPerTransaction:2
+                 options:kGTMSQLiteBulkLoadOptionRelaxDurability
+              rowsLoaded:&loaded];
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertEquals(loaded, (NSUInteger)5, nil);
+  STAssertTrue([db rollback], nil);
+  count = LikeGlobTestHelper(db, @"SELECT COUNT(*) FROM foo;");
+  STAssertEqualObjects(count,
+                       [NSArray arrayWithObject:[NSNumber numberWithInt:13]],
+                       nil);
+
+  // Bad input.
+  rows = [NSArray arrayWithObject:
+          [NSArray arrayWithObject:[NSArray arrayWithObject:@"nope"]]];
+  err = [db bulkLoadRows:[rows objectEnumerator]
+                 withSQL:insertSQL
+      rowsPerTransaction:0
+                 options:0
+              rowsLoaded:&loaded];
+  STAssertEquals(err, SQLITE_MISMATCH, nil);
+  STAssertEquals(loaded, (NSUInteger)0, nil);
+  err = [db bulkLoadRows:nil
+                 withSQL:insertSQL
+      rowsPerTransaction:0
+                 options:0
+              rowsLoaded:&loaded];
+  STAssertEquals(err, SQLITE_MISUSE, nil);
+  err = [db bulkLoadRows:[rows objectEnumerator]
+                 withSQL:@"INSERT INTO nosuchtable VALUES (?);"
+      rowsPerTransaction:0
+                 options:0
+              rowsLoaded:&loaded];
+  STAssertNotEquals(err, SQLITE_OK, nil);
+  STAssertTrue(sqlite3_get_autocommit([db sqlite3DB]) != 0,
+               @"transaction left open");
+}
+
+#if NS_BLOCKS_AVAILABLE
+
+- (void)testBulkLoadWithBlock {
+  int err;
+  GTMSQLiteDatabase *db =
+    [[[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:NO
+                                                       utf8:YES
+                                                  errorCode:&err]
+      autorelease];
+  STAssertNotNil(db, @"Failed to create database");
+  err = [db executeSQL:@"CREATE TABLE points (x INTEGER, y REAL);"];
+  STAssertEquals(err, SQLITE_OK, nil);
+
+  const struct { int x; double y; } points[] = {
+    { 1, 0.5 }, { 2, 1.5 }, { 3, 2.5 }, { 4, 3.5 }, { 5, 4.5 }
+  };
+  const NSUInteger numPoints = sizeof(points) / sizeof(points[0]);
+  NSUInteger loaded = 0;
+  err = [db bulkLoadWithSQL:@"INSERT INTO points VALUES (?, ?);"
+         rowsPerTransaction:2
+                    options:0
+                 rowsLoaded:&loaded
+                 usingBlock:^(GTMSQLiteStatement *statement,
+                              NSUInteger rowIndex) {
+    if (rowIndex >= numPoints) return NO;
+    [statement bindInt32AtPosition:1 value:points[rowIndex].x];
+    [statement bindDoubleAtPosition:2 value:points[rowIndex].y];
+    return YES;
+  }];
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertEquals(loaded, numPoints, nil);
+  NSArray *sums =
+    LikeGlobTestHelper(db, @"SELECT SUM(x) + SUM(y) FROM points;");
+  STAssertEqualObjects(sums,
+                       [NSArray arrayWithObject:
+                        [NSNumber numberWithDouble:27.5]], nil);
+
+  err = [db bulkLoadWithSQL:@"INSERT INTO points VALUES (?, ?);"
+         rowsPerTransaction:2
+                    options:0
+                 rowsLoaded:&loaded
+                 usingBlock:nil];
+  STAssertEquals(err, SQLITE_MISUSE, nil);
+
+  // What the rows autorelease goes away during the load, even when it is all
+  // one transaction.
+  __block BOOL released = NO;
+  __block BOOL releasedDuringLoad = NO;
+  err = [db bulkLoadWithSQL:@"INSERT INTO points VALUES (?, ?);"
+         rowsPerTransaction:0
+                    options:0
+                 rowsLoaded:&loaded
+                 usingBlock:^(GTMSQLiteStatement *statement,
+                              NSUInteger rowIndex) {
+    if (rowIndex == 0) {
+      [[[GTMSQLiteDeallocFlag alloc] initWithFlag:&released] autorelease];
+    }
+    if (rowIndex == 1000) {
+      releasedDuringLoad = released;
+      return NO;
+    }
+    [statement bindInt32AtPosition:1 value:(int)rowIndex];
+    [statement bindDoubleAtPosition:2 value:0];
+    return YES;
+  }];
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertEquals(loaded, (NSUInteger)1000, nil);
+  STAssertTrue(releasedDuringLoad, nil);
+}
+
+#endif  // NS_BLOCKS_AVAILABLE
+
+- (void)testBulkLoadThroughput {
+  NSString *path =
+    [NSTemporaryDirectory() stringByAppendingPathComponent:
+     [NSString stringWithFormat:@"GTMSQLiteBulkLoad_%u.db", arc4random()]];
+  int err;
+  GTMSQLiteDatabase *db =
+    [[GTMSQLiteDatabase alloc] initWithPath:path
+                            withCFAdditions:YES
+                                       utf8:YES
+                                  errorCode:&err];
+  STAssertNotNil(db, @"Failed to create database");
+  err = [db executeSQL:@"CREATE TABLE foo (id INTEGER, name TEXT);"];
+  STAssertEquals(err, SQLITE_OK, nil);
+  NSString *insertSQL = @"INSERT INTO foo VALUES (?, ?);";
+
+  // One row at a time w/ autocommit, the way it would be done w/o the bulk
+  // API.
+  const int kSlowRows = 500;
+  GTMTestTimer *timer = GTMTestTimerCreate();
+  GTMTestTimerStart(timer);
+  for (int i = 0; i < kSlowRows; i++) {
+    GTMSQLiteStatement *statement =
+      [GTMSQLiteStatement statementWithSQL:insertSQL
+                                inDatabase:db
+                                 errorCode:&err];
+    [statement bindInt32AtPosition:1 value:i];
+    [statement bindStringAtPosition:2 string:@"a row of text"];
+    STAssertEquals([statement stepRow], SQLITE_DONE, nil);
+    [statement finalizeStatement];
+  }
+  GTMTestTimerStop(timer);
+  double slowNanoseconds = GTMTestTimerGetNanoseconds(timer) / kSlowRows;
+  GTMTestTimerRelease(timer);
+
+  const NSUInteger kBulkRows = 50000;
+  NSMutableArray *rows = [NSMutableArray arrayWithCapacity:kBulkRows];
+  for (NSUInteger i = 0; i < kBulkRows; i++) {
+    [rows addObject:
+     [NSArray arrayWithObjects:[NSNumber numberWithUnsignedInteger:i],
+      @"a row of text", nil]];
+  }
+  const GTMSQLiteBulkLoadOptions kOptions[] = {
+    0, kGTMSQLiteBulkLoadOptionRelaxDurability
+  };
+  for (size_t i = 0; i < sizeof(kOptions) / sizeof(kOptions[0]); i++) {
+    NSUInteger loaded = 0;
+    timer = GTMTestTimerCreate();
+    GTMTestTimerStart(timer);
+    err = [db bulkLoadRows:[rows objectEnumerator]
+                   withSQL:insertSQL
+        rowsPerTransaction:10000
+                   options:kOptions[i]
+                rowsLoaded:&loaded];
+    GTMTestTimerStop(timer);
+    STAssertEquals(err, SQLITE_OK, nil);
+    STAssertEquals(loaded, kBulkRows, nil);
+    NSLog(@"Inserting rows: %.0f ns per row one at a time, %.0f ns per row "
+          @"bulk loaded (options 0x%lx)", slowNanoseconds,
+          GTMTestTimerGetNanoseconds(timer) / kBulkRows,
+          (unsigned long)kOptions[i]);
+    GTMTestTimerRelease(timer);
+  }
+
+  [db release];
+  [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+- (void)testDatabasePool {
+  int err;
+  GTMSQLiteDatabasePool *pool =
+    [[[GTMSQLiteDatabasePool alloc] initWithPath:@":memory:"
+                                 withCFAdditions:YES
+                                            utf8:YES
+                                  maximumReaders:2
+                                       errorCode:&err] autorelease];
+  STAssertNil(pool, nil);
+  STAssertEquals(err, SQLITE_MISUSE, nil);
+  NSString *path =
+    [NSTemporaryDirectory() stringByAppendingPathComponent:
+     [NSString stringWithFormat:@"GTMSQLitePool_%u.db", arc4random()]];
+  pool = [[[GTMSQLiteDatabasePool alloc] initWithPath:path
+                                      withCFAdditions:YES
+                                                 utf8:YES
+                                       maximumReaders:0
+                                            errorCode:&err] autorelease];
+  STAssertNil(pool, nil);
+  STAssertEquals(err, SQLITE_MISUSE, nil);
+
+  pool = [[GTMSQLiteDatabasePool alloc] initWithPath:path
+                                     withCFAdditions:YES
+                                                utf8:YES
+                                      maximumReaders:2
+                                           errorCode:&err];
+  STAssertNotNil(pool, nil);
+  STAssertEquals(err, SQLITE_OK, nil);
+  STAssertTrue([pool isWriteAheadLogging], nil);
+  STAssertEqualObjects([pool path], path, nil);
+  STAssertEquals([pool maximumReaders], (NSUInteger)2, nil);
+  STAssertEquals([pool busyTimeoutMS], 5000, nil);
+
+  GTMSQLiteDatabase *writer = [pool checkOutWriter];
+  STAssertNotNil(writer, nil);
+  STAssertTrue([writer hasCFAdditions], nil);
+  err = [writer executeSQL:@"CREATE TABLE foo (bar TEXT);"
+                           @"INSERT INTO foo VALUES ('a');"];
+  STAssertEquals(err, SQLITE_OK, nil);
+
+  // Readers see the last commit, and don't wait on the writer.
+  STAssertTrue([writer beginDeferredTransaction], nil);
+  err = [writer executeSQL:@"INSERT INTO foo VALUES ('b');"];
+  STAssertEquals(err, SQLITE_OK, nil);
+  GTMSQLiteDatabase *reader1 = [pool checkOutReader];
+  STAssertNotNil(reader1, nil);
+  STAssertTrue(reader1 != writer, nil);
+  STAssertTrue([reader1 hasCFAdditions], nil);
+  NSArray *count = LikeGlobTestHelper(reader1, @"SELECT COUNT(*) FROM foo;");
+  STAssertEqualObjects(count,
+                       [NSArray arrayWithObject:[NSNumber numberWithInt:1]],
+                       nil);
+  STAssertTrue([writer commit], nil);
+  count = LikeGlobTestHelper(reader1, @"SELECT COUNT(*) FROM foo;");
+  STAssertEqualObjects(count,
+                       [NSArray arrayWithObject:[NSNumber numberWithInt:2]],
+                       nil);
+  // CF additions are installed on the readers too.
+  NSString *upperSQL =
+    [NSString stringWithCString:"SELECT UPPER('é');"
+                       encoding:NSUTF8StringEncoding];
+  NSArray *upper = LikeGlobTestHelper(reader1, upperSQL);
+  NSString *expectedUpper = [NSString stringWithCString:"É"
+                                               encoding:NSUTF8StringEncoding];
+  STAssertEqualObjects(upper, [NSArray arrayWithObject:expectedUpper], nil);
+
+  // Readers can't write.
+  err = [reader1 executeSQL:@"INSERT INTO foo VALUES ('c');"];
+  STAssertNotEquals(err, SQLITE_OK, nil);
+
+  // A transaction left open on a connection is rolled back at check in.
+  STAssertTrue([writer beginDeferredTransaction], nil);
+  err = [writer executeSQL:@"INSERT INTO foo VALUES ('d');"];
+  STAssertEquals(err, SQLITE_OK, nil);
+  [GTMUnitTestDevLog expectPattern:@"Rolling back the transaction left open "
+                                   @"on .*"];
+  [pool checkInWriter:writer];
+  STAssertTrue([pool checkOutWriter] == writer, nil);
+  STAssertTrue(sqlite3_get_autocommit([writer sqlite3DB]) != 0, nil);
+  [GTMUnitTestDevLog expectPattern:@".* is not the checked out writer of .*"];
+  [pool checkInWriter:reader1];
+  [pool checkInWriter:writer];
+  // A second check in must not free the slot again.
+  [GTMUnitTestDevLog expectPattern:@".* is not the checked out writer of .*"];
+  [pool checkInWriter:writer];
+  STAssertTrue([pool checkOutWriter] == writer, nil);
+  [pool checkInWriter:writer];
+
+  // Readers are reused once they are checked in.
+  GTMSQLiteDatabase *reader2 = [pool checkOutReader];
+  STAssertNotNil(reader2, nil);
+  STAssertTrue(reader2 != reader1, nil);
+  [pool checkInReader:reader1];
+  [GTMUnitTestDevLog expectPattern:@".* is not a checked out reader of .*"];
+  [pool checkInReader:reader1];
+  STAssertTrue([pool checkOutReader] == reader1, nil);
+  [pool checkInReader:reader1];
+  [pool checkInReader:reader2];
+
+  [pool setBusyTimeoutMS:100];
+  STAssertEquals([pool busyTimeoutMS], 100, nil);
+  reader1 = [pool checkOutReader];
+  STAssertEquals([reader1 busyTimeoutMS], 100, nil);
+  [pool checkInReader:reader1];
+
+#if NS_BLOCKS_AVAILABLE
+  [pool writeUsingBlock:^(GTMSQLiteDatabase *db) {
+    STAssertEquals([db executeSQL:@"DELETE FROM foo;"], SQLITE_OK, nil);
+  }];
+  __block NSArray *blockCount = nil;
+  [pool readUsingBlock:^(GTMSQLiteDatabase *db) {
+    blockCount = LikeGlobTestHelper(db, @"SELECT COUNT(*) FROM foo;");
+  }];
+  STAssertEqualObjects(blockCount,
+                       [NSArray arrayWithObject:[NSNumber numberWithInt:0]],
+                       nil);
+#endif  // NS_BLOCKS_AVAILABLE
+
+  [pool release];
+  NSFileManager *fm = [NSFileManager defaultManager];
+  [fm removeItemAtPath:path error:NULL];
+  [fm removeItemAtPath:[path stringByAppendingString:@"-wal"] error:NULL];
+  [fm removeItemAtPath:[path stringByAppendingString:@"-shm"] error:NULL];
+}
+
+// Thread body for -secondsToRead:threads:pool:database:. Runs queries w/ a
+// reader from the pool, or w/ the single shared database.
+- (void)runPoolQueries:(NSDictionary *)job {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  GTMSQLiteDatabasePool *dbPool = [job objectForKey:@"pool"];
+  GTMSQLiteDatabase *sharedDB = [job objectForKey:@"db"];
+  NSConditionLock *done = [job objectForKey:@"done"];
+  NSUInteger count = [[job objectForKey:@"count"] unsignedIntegerValue];
+  for (NSUInteger i = 0; i < count; ++i) {
+    NSAutoreleasePool *inner = [[NSAutoreleasePool alloc] init];
+    GTMSQLiteDatabase *db = dbPool ? [dbPool checkOutReader] : sharedDB;
+    // Doesn't lock anything w/ the pool, since |sharedDB| is nil then.
+    @synchronized(sharedDB) {
+      int err;
+      GTMSQLiteStatement *statement =
+        [db checkOutStatementWithSQL:@"SELECT SUM(value) FROM foo "
+                                     @"WHERE id % 7 = ?;"
+                           errorCode:&err];
+      [statement bindInt32AtPosition:1 value:(int)(i % 7)];
+      [statement stepRow];
+      [db checkInStatement:statement];
+    }
+    if (dbPool) [dbPool checkInReader:db];
+    [inner drain];
+  }
+  [done lock];
+  [done unlockWithCondition:[done condition] + 1];
+  [pool drain];
+}
+
+// Thread body for -secondsToRead:threads:pool:database:. Inserts rows one
+// transaction at a time while the queries run.
+- (void)runPoolWrites:(NSDictionary *)job {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  GTMSQLiteDatabasePool *dbPool = [job objectForKey:@"pool"];
+  GTMSQLiteDatabase *sharedDB = [job objectForKey:@"db"];
+  NSConditionLock *done = [job objectForKey:@"done"];
+  NSUInteger count = [[job objectForKey:@"count"] unsignedIntegerValue];
+  for (NSUInteger i = 0; i < count; ++i) {
+    GTMSQLiteDatabase *db = dbPool ? [dbPool checkOutWriter] : sharedDB;
+    @synchronized(sharedDB) {
+      [db executeSQL:@"INSERT INTO foo (value) VALUES (1);"];
+    }
+    if (dbPool) [dbPool checkInWriter:db];
+  }
+  [done lock];
+  [done unlockWithCondition:[done condition] + 1];
+  [pool drain];
+}
+
+// Returns the wall clock time it takes |threads| threads to run |queries|
+// queries between them (while another thread writes) using either |pool| or
+// the single connection |db|.
+- (double)secondsToRead:(NSUInteger)queries
+                threads:(NSUInteger)threads
+                   pool:(GTMSQLiteDatabasePool *)pool
+               database:(GTMSQLiteDatabase *)db {
+  NSConditionLock *done =
+      [[[NSConditionLock alloc] initWithCondition:0] autorelease];
+  NSDictionary *job =
+      [NSDictionary dictionaryWithObjectsAndKeys:
+       done, @"done",
+       [NSNumber numberWithUnsignedInteger:queries / threads], @"count",
+       (pool ? (id)pool : (id)db), (pool ? @"pool" : @"db"),
+       nil];
+  GTMTestTimer *timer = GTMTestTimerCreate();
+  GTMTestTimerStart(timer);
+  [NSThread detachNewThreadSelector:@selector(runPoolWrites:)
+                           toTarget:self
+                         withObject:job];
+  for (NSUInteger i = 0; i < threads; ++i) {
+    [NSThread detachNewThreadSelector:@selector(runPoolQueries:)
+                             toTarget:self
+                           withObject:job];
+  }
+  [done lockWhenCondition:(NSInteger)threads + 1];
+  [done unlock];
+  GTMTestTimerStop(timer);
+  double seconds = GTMTestTimerGetSeconds(timer);
+  GTMTestTimerRelease(timer);
+  return seconds;
+}
+
+- (void)testDatabasePoolThroughput {
+  NSString *path =
+    [NSTemporaryDirectory() stringByAppendingPathComponent:
+     [NSString stringWithFormat:@"GTMSQLitePool_%u.db", arc4random()]];
+  const NSUInteger kThreads = 4;
+  int err;
+  GTMSQLiteDatabasePool *pool =
+    [[GTMSQLiteDatabasePool alloc] initWithPath:path
+                                withCFAdditions:YES
+                                           utf8:YES
+                                 maximumReaders:kThreads
+                                      errorCode:&err];
+  STAssertNotNil(pool, nil);
+  GTMSQLiteDatabase *writer = [pool checkOutWriter];
+  err = [writer executeSQL:@"CREATE TABLE foo (id INTEGER PRIMARY KEY, "
+                           @"value INTEGER);"];
+  STAssertEquals(err, SQLITE_OK, nil);
+  NSUInteger loaded;
+#if NS_BLOCKS_AVAILABLE
+  err = [writer bulkLoadWithSQL:@"INSERT INTO foo (value) VALUES (?);"
+             rowsPerTransaction:0
+                        options:0
+                     rowsLoaded:&loaded
+                     usingBlock:^(GTMSQLiteStatement *statement,
+                                  NSUInteger rowIndex) {
+    [statement bindInt32AtPosition:1 value:(int)rowIndex];
+    return (BOOL)(rowIndex < 20000);
+  }];
+#else
+  NSMutableArray *rows = [NSMutableArray array];
+  for (int i = 0; i < 20000; i++) {
+    [rows addObject:[NSArray arrayWithObject:[NSNumber numberWithInt:i]]];
+  }
+  err = [writer bulkLoadRows:[rows objectEnumerator]
+                     withSQL:@"INSERT INTO foo (value) VALUES (?);"
+          rowsPerTransaction:0
+                     options:0
+                  rowsLoaded:&loaded];
+#endif  // NS_BLOCKS_AVAILABLE
+  STAssertEquals(err, SQLITE_OK, nil);
+  [pool checkInWriter:writer];
+
+  GTMSQLiteDatabase *single =
+    [[GTMSQLiteDatabase alloc] initWithPath:path
+                            withCFAdditions:YES
+                                       utf8:YES
+                                  errorCode:&err];
+  STAssertNotNil(single, nil);
+  [single setBusyTimeoutMS:5000];
+
+  const NSUInteger kQueries = 400;
+  double singleSeconds = [self secondsToRead:kQueries
+                                     threads:kThreads
+                                        pool:nil
+                                    database:single];
+  double poolSeconds = [self secondsToRead:kQueries
+                                   threads:kThreads
+                                      pool:pool
+                                  database:nil];
+  NSLog(@"%lu reader threads + 1 writer: %.0f queries/s w/ a pool, "
+        @"%.0f queries/s sharing one connection", (unsigned long)kThreads,
+        kQueries / poolSeconds, kQueries / singleSeconds);
+
+  [single release];
+  [pool release];
+  NSFileManager *fm = [NSFileManager defaultManager];
+  [fm removeItemAtPath:path error:NULL];
+  [fm removeItemAtPath:[path stringByAppendingString:@"-wal"] error:NULL];
+  [fm removeItemAtPath:[path stringByAppendingString:@"-shm"] error:NULL];
+}
+
+- (void)testASCIIFastPaths {
+  // ASCII text is matched and compared w/o CFStrings. Putting a non-ASCII
+  // character in front of both sides forces the CF code to run instead, and
+  // shouldn't change any of the answers.
+  int err;
+  GTMSQLiteDatabase *db =
+    [[[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:YES
+                                                       utf8:YES
+                                                  errorCode:&err]
+      autorelease];
+  STAssertNotNil(db, @"Failed to create database");
+  NSString *sql =
+    [NSString stringWithCString:
+     "SELECT ?1 LIKE ?2, ('é' || ?1) LIKE ('é' || ?2), "
+     "?1 LIKE ?2 ESCAPE '!', ('é' || ?1) LIKE ('é' || ?2) ESCAPE '!', "
+     "?1 GLOB ?2, ('é' || ?1) GLOB ('é' || ?2), "
+     "?1 < ?2 COLLATE NOCASE, ('é' || ?1) < ('é' || ?2) COLLATE NOCASE, "
+     "?1 = ?2 COLLATE NOCASE, ('é' || ?1) = ('é' || ?2) COLLATE NOCASE, "
+     "?1 < ?2 COLLATE NOCASE_REVERSE, "
+     "('é' || ?1) < ('é' || ?2) COLLATE NOCASE_REVERSE;"
+                       encoding:NSUTF8StringEncoding];
+  GTMSQLiteStatement *statement =
+    [db checkOutStatementWithSQL:sql errorCode:&err];
+  STAssertNotNil(statement, @"error %d", err);
+
+  NSArray *targets =
+    [NSArray arrayWithObjects:@"", @"a", @"abab", @"ABAB", @"abc", @"a_c",
+     @"a%c", @"a!c", @"x[y]z", @"a\r\nb", @"Hello World", @"hello", nil];
+  NSArray *patterns =
+    [NSArray arrayWithObjects:@"", @"a", @"%", @"*", @"_", @"?", @"%ab",
+     @"*ab", @"ab%", @"ab*", @"a_c", @"a?c", @"%B%", @"*B*", @"a!%c",
+     @"a!_c", @"[a-c]*", @"*[^a]", @"x[]y]*", @"[]]*", @"a_b", @"a?b",
+     @"a__b", @"a??b", @"hello%", @"HELLO*", @"%o w%", @"*o W*", nil];
+  const int kColumns = 12;
+  NSString *target;
+  GTM_FOREACH_OBJECT(target, targets) {
+    NSString *pattern;
+    GTM_FOREACH_OBJECT(pattern, patterns) {
+      [statement bindStringAtPosition:1 string:target];
+      [statement bindStringAtPosition:2 string:pattern];
+      STAssertEquals([statement stepRow], SQLITE_ROW,
+                     @"'%@' '%@'", target, pattern);
+      for (int column = 0; column < kColumns; column += 2) {
+        STAssertEquals([statement resultInt32AtPosition:column],
+                       [statement resultInt32AtPosition:column + 1],
+                       @"'%@' '%@' column %d", target, pattern, column);
+      }
+      [statement reset];
+    }
+  }
+  [db checkInStatement:statement];
+
+  // Options that can't be done byte by byte still use CF.
+  [db setLikeComparisonOptions:kCFCompareNumerically];
+  NSArray *result = LikeGlobTestHelper(db, @"SELECT 'abc' LIKE 'ABC';");
+  STAssertEqualObjects(result,
+                       [NSArray arrayWithObject:[NSNumber numberWithInt:0]],
+                       nil);
+
+  // Bad patterns are still reported.
+  statement = [db checkOutStatementWithSQL:@"SELECT 'a' GLOB '[a';"
+                                 errorCode:&err];
+  STAssertEquals([statement stepRow], SQLITE_ERROR, nil);
+  [db checkInStatement:statement];
+  statement = [db checkOutStatementWithSQL:@"SELECT 'a' LIKE 'a' ESCAPE '';"
+                                 errorCode:&err];
+  STAssertEquals([statement stepRow], SQLITE_ERROR, nil);
+  [db checkInStatement:statement];
+}
+
+- (void)testASCIIFastPathThroughput {
+  // A million rows only w/ GTM_ENABLE_BENCHMARKS set, the default keeps the
+  // unittests quick.
+  const int kRows = getenv("GTM_ENABLE_BENCHMARKS") ? 1000000 : 10000;
+  int err;
+  GTMSQLiteDatabase *cfDB =
+    [[[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:YES
+                                                       utf8:YES
+                                                  errorCode:&err]
+      autorelease];
+  GTMSQLiteDatabase *plainDB =
+    [[[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:NO
+                                                       utf8:YES
+                                                  errorCode:&err]
+      autorelease];
+  GTMSQLiteDatabase *dbs[] = { cfDB, plainDB };
+  for (size_t i = 0; i < sizeof(dbs) / sizeof(dbs[0]); i++) {
+    GTMSQLiteDatabase *db = dbs[i];
+    err = [db executeSQL:@"CREATE TABLE foo (name TEXT);"];
+    STAssertEquals(err, SQLITE_OK, nil);
+    // Let SQLite make the rows, it is much faster than binding them all.
+    err = [db executeSQL:
+           [NSString stringWithFormat:
+            @"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n "
+            @"WHERE i < %d) INSERT INTO foo SELECT 'Row number ' || i || "
+            @"' of the benchmark table' FROM n;", kRows]];
+    if (err != SQLITE_OK) {
+      // Older SQLites w/o common table expressions.
+      NSUInteger loaded;
+      NSMutableArray *rows = [NSMutableArray arrayWithCapacity:kRows];
+      for (int row = 1; row <= kRows; row++) {
+        NSString *name =
+          [NSString stringWithFormat:@"Row number %d of the benchmark table",
+           row];
+        [rows addObject:[NSArray arrayWithObject:name]];
+      }
+      err = [db bulkLoadRows:[rows objectEnumerator]
+                     withSQL:@"INSERT INTO foo VALUES (?);"
+          rowsPerTransaction:0
+                     options:0
+                  rowsLoaded:&loaded];
+    }
+    STAssertEquals(err, SQLITE_OK, nil);
+  }
+
+  NSString *queries[] = {
+    @"SELECT COUNT(*) FROM foo WHERE name LIKE '%number 1234%';",
+    @"SELECT COUNT(*) FROM foo WHERE name GLOB '*[0-9]7 of*';",
+    @"SELECT COUNT(*) FROM (SELECT name FROM foo "
+    @"ORDER BY name COLLATE NOCASE);",
+  };
+  for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+    double nanoseconds[2];
+    NSArray *counts[2];
+    for (size_t j = 0; j < sizeof(dbs) / sizeof(dbs[0]); j++) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      GTMTestTimer *timer = GTMTestTimerCreate();
+      GTMTestTimerStart(timer);
+      counts[j] = [LikeGlobTestHelper(dbs[j], queries[i]) retain];
+      GTMTestTimerStop(timer);
+      nanoseconds[j] = GTMTestTimerGetNanoseconds(timer);
+      GTMTestTimerRelease(timer);
+      [pool drain];
+      [counts[j] autorelease];
+    }
+    STAssertEqualObjects(counts[0], counts[1], @"%@", queries[i]);
+    NSLog(@"%@ on %d rows: %.0f ns per row w/ CF additions, "
+          @"%.0f ns per row w/o", queries[i], kRows,
+          nanoseconds[0] / kRows, nanoseconds[1] / kRows);
+  }
+}
+
+- (void)testLikeGlobPatternCache {
+  int err;
+  GTMSQLiteDatabase *db =
+    [[[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:YES
+                                                       utf8:YES
+                                                  errorCode:&err]
+      autorelease];
+  STAssertNotNil(db, @"Failed to create database");
+  NSString *umlaut = [NSString stringWithCString:"ü"
+                                        encoding:NSUTF8StringEncoding];
+  err = [db executeSQL:
+         [NSString stringWithFormat:
+          @"CREATE TABLE foo (name TEXT, pattern TEXT);"
+          @"INSERT INTO foo VALUES ('Apple', 'a%%');"
+          @"INSERT INTO foo VALUES ('apricot', 'A%%');"
+          @"INSERT INTO foo VALUES ('banana', '%%an%%');"
+          @"INSERT INTO foo VALUES ('Gr%@n', '%%%@%%');"
+          @"INSERT INTO foo VALUES ('gr%@n', 'x%%');",
+          umlaut, umlaut, umlaut]];
+  STAssertEquals(err, SQLITE_OK, nil);
+
+  // The same statement w/ a different pattern each time.
+  GTMSQLiteStatement *statement =
+    [db checkOutStatementWithSQL:@"SELECT COUNT(*) FROM foo WHERE name LIKE ?;"
+                       errorCode:&err];
+  STAssertNotNil(statement, nil);
+  NSString *patterns[] = {
+    @"a%", @"%AN%", [NSString stringWithFormat:@"%%%@%%", umlaut], @"gr_n",
+    @"a%", @"%",
+  };
+  int counts[] = { 2, 1, 2, 2, 2, 5 };
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    [statement bindStringAtPosition:1 string:patterns[i]];
+    STAssertEquals([statement stepRow], SQLITE_ROW, nil);
+    STAssertEquals([statement resultInt32AtPosition:0], counts[i],
+                   @"pattern %@", patterns[i]);
+    [statement reset];
+  }
+  // Changing the options changes the answer for a pattern already compiled.
+  CFOptionFlags likeOptions = [db likeComparisonOptions];
+  [db setLikeComparisonOptions:0];
+  [statement bindStringAtPosition:1 string:@"a%"];
+  STAssertEquals([statement stepRow], SQLITE_ROW, nil);
+  STAssertEquals([statement resultInt32AtPosition:0], 1, nil);
+  [statement reset];
+  [db setLikeComparisonOptions:likeOptions];
+  [db checkInStatement:statement];
+
+  // A different pattern on each row.
+  NSArray *result =
+    LikeGlobTestHelper(db, @"SELECT name LIKE pattern FROM foo;");
+  NSNumber *yes = [NSNumber numberWithInt:1];
+  NSNumber *no = [NSNumber numberWithInt:0];
+  NSArray *expected = [NSArray arrayWithObjects:yes, yes, yes, yes, no, nil];
+  STAssertEqualObjects(result, expected, nil);
+
+  // Like SQLite, a bad pattern is only an error for text that gets as far as
+  // the bad part of it.
+  result = LikeGlobTestHelper(db, @"SELECT 'a' GLOB 'b[a';");
+  STAssertEqualObjects(result, [NSArray arrayWithObject:no], nil);
+  statement = [db checkOutStatementWithSQL:@"SELECT name GLOB 'b[a' FROM foo;"
+                                 errorCode:&err];
+  STAssertEquals([statement stepRow], SQLITE_ROW, nil);
+  STAssertEquals([statement resultInt32AtPosition:0], 0, nil);
+  STAssertEquals([statement stepRow], SQLITE_ROW, nil);
+  STAssertEquals([statement stepRow], SQLITE_ERROR, nil);
+  [db checkInStatement:statement];
+}
+
+- (void)testLikeGlobPatternCacheThroughput {
+  const int kRows = 200000;
+  int err;
+  GTMSQLiteDatabase *db =
+    [[[GTMSQLiteDatabase alloc] initInMemoryWithCFAdditions:YES
+                                                       utf8:YES
+                                                  errorCode:&err]
+      autorelease];
+  STAssertNotNil(db, @"Failed to create database");
+  err = [db executeSQL:@"CREATE TABLE foo (name TEXT);"];
+  STAssertEquals(err, SQLITE_OK, nil);
+  // Half the rows are ASCII, half have to go through CF.
+  NSString *nonASCII = [NSString stringWithCString:"Zeile %d für"
+                                          encoding:NSUTF8StringEncoding];
+  NSMutableArray *rows = [NSMutableArray arrayWithCapacity:kRows];
+  for (int row = 0; row < kRows; row++) {
+    NSString *format = (row & 1) ? nonASCII : @"Row %d for";
+    NSString *name = [NSString stringWithFormat:format, row];
+    [rows addObject:[NSArray arrayWithObject:name]];
+  }
+  NSUInteger loaded;
+  err = [db bulkLoadRows:[rows objectEnumerator]
+                 withSQL:@"INSERT INTO foo VALUES (?);"
+      rowsPerTransaction:0
+                 options:0
+              rowsLoaded:&loaded];
+  STAssertEquals(err, SQLITE_OK, nil);
+
+  // The second query builds the pattern on each row, so it has to be
+  // compiled for each row.
+  NSString *queries[] = {
+    @"SELECT COUNT(*) FROM foo WHERE name LIKE '%1234%';",
+    @"SELECT COUNT(*) FROM foo WHERE name LIKE ('%1234' || "
+    @"substr(name, 1, 0) || '%');",
+    @"SELECT COUNT(*) FROM foo WHERE name GLOB '*12[0-9]4 f*';",
+    @"SELECT COUNT(*) FROM foo WHERE name GLOB ('*12[0-9]4 f' || "
+    @"substr(name, 1, 0) || '*');",
+  };
+  for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    GTMTestTimer *timer = GTMTestTimerCreate();
+    GTMTestTimerStart(timer);
+    NSArray *count = LikeGlobTestHelper(db, queries[i]);
+    GTMTestTimerStop(timer);
+    STAssertEquals([count count], (NSUInteger)1, nil);
+    NSLog(@"%@ on %d rows: %.0f ns per row", queries[i], kRows,
+          GTMTestTimerGetNanoseconds(timer) / kRows);
+    GTMTestTimerRelease(timer);
+    [pool drain];
+  }
+}
+
 // // From GTMSQLite.m
 // CFStringEncoding SqliteTextEncodingToCFStringEncoding(int enc);
 
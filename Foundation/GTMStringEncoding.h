@@ -30,9 +30,14 @@
   BOOL doPad_;
   char paddingChar_;
   int padLen_;
+  int kernel_;
 }
 
 // Create a new, autoreleased GTMStringEncoding object with a standard encoding.
+// The hex, base32 and base64 ones (but not base32hex or crockford) encode and
+// decode in larger steps (with SSE on Intel) than custom encodings do.  Decode
+// synonyms and ignored characters (e.g. MIME line breaks) drop them back to
+// the generic code only around the characters involved.
 + (id)binaryStringEncoding;
 + (id)hexStringEncoding;
 + (id)rfc4648Base32StringEncoding;
@@ -85,4 +90,131 @@
 - (NSData *)decode:(NSString *)string;
 - (NSString *)stringByDecoding:(NSString *)string;
 
+#pragma mark Buffers
+
+// The number of characters encoding |length| bytes produces (including any
+// padding).
+- (NSUInteger)encodedLengthForLength:(NSUInteger)length;
+
+// The most bytes decoding |length| characters can produce.
+- (NSUInteger)maximumDecodedLengthForLength:(NSUInteger)length;
+
+// Encodes |length| bytes straight into |buffer|, without any intermediate
+// objects.  Returns the number of characters written (no terminating NUL),
+// or NSNotFound if |capacity| is less than -encodedLengthForLength:.
+- (NSUInteger)encodeBytes:(const void *)bytes
+                   length:(NSUInteger)length
+               intoBuffer:(char *)buffer
+                 capacity:(NSUInteger)capacity;
+
+// Decodes |length| characters straight into |buffer|.  Returns the number of
+// bytes written, or NSNotFound if the input is bad or |capacity| is less than
+// -maximumDecodedLengthForLength:.  Nothing is logged; if |errorOffset| is
+// given it gets the offset of the first bad character, |length| if the input
+// stopped partway through a byte, or NSNotFound if there was no room.
+- (NSUInteger)decodeChars:(const char *)chars
+                   length:(NSUInteger)length
+               intoBuffer:(void *)buffer
+                 capacity:(NSUInteger)capacity
+              errorOffset:(NSUInteger *)errorOffset;
+
+@end
+
+// Encodes a stream of bytes a piece at a time, in constant memory, giving
+// the same characters as GTMStringEncoding's -encode: would for the whole
+// thing.  Bytes short of a whole quantum are held back until the next piece
+// (or -finish...), so the output of each call can be written out directly.
+@interface GTMStringEncoder : NSObject {
+ @private
+  GTMStringEncoding *encoding_;
+  unsigned char pending_[8];
+  NSUInteger pendingLength_;
+  NSUInteger quantumLength_;
+  BOOL finished_;
+}
+
+// |encoding| is retained, and shouldn't be changed while it is in use.
+- (id)initWithEncoding:(GTMStringEncoding *)encoding;
+
+- (GTMStringEncoding *)encoding;
+
+// The number of characters the next -encodeBytes:... with |length| bytes
+// will write.
+- (NSUInteger)encodedLengthForLength:(NSUInteger)length;
+
+// The number of characters -finishIntoBuffer:capacity: will write.
+- (NSUInteger)finalLength;
+
+// Encodes the next |length| bytes into |buffer|.  Returns the number of
+// characters written, or NSNotFound if |capacity| is too small (in which case
+// nothing is used up) or the encoder is finished.
+- (NSUInteger)encodeBytes:(const void *)bytes
+                   length:(NSUInteger)length
+               intoBuffer:(char *)buffer
+                 capacity:(NSUInteger)capacity;
+
+// Writes out whatever was held back, plus any padding, and ends the stream.
+// Returns the number of characters written, or NSNotFound if |capacity| is
+// too small or the encoder is already finished.
+- (NSUInteger)finishIntoBuffer:(char *)buffer capacity:(NSUInteger)capacity;
+
+// The same, as autoreleased strings.
+- (NSString *)encodeData:(NSData *)data;
+- (NSString *)finishEncoding;
+
+- (BOOL)isFinished;
+
+@end
+
+// Decodes a stream of characters a piece at a time, in constant memory.
+// Pieces can be split anywhere; the bits of a partial byte are carried over
+// to the next one.
+@interface GTMStringDecoder : NSObject {
+ @private
+  GTMStringEncoding *encoding_;
+  int buffer_;
+  int bitsLeft_;
+  BOOL expectPad_;
+  BOOL finished_;
+  BOOL failed_;
+  unsigned long long totalIn_;
+  unsigned long long errorOffset_;
+}
+
+// |encoding| is retained, and shouldn't be changed while it is in use.
+- (id)initWithEncoding:(GTMStringEncoding *)encoding;
+
+- (GTMStringEncoding *)encoding;
+
+// The most bytes the next -decodeChars:... with |length| characters can
+// write.
+- (NSUInteger)maximumDecodedLengthForLength:(NSUInteger)length;
+
+// Decodes the next |length| characters into |buffer|.  Returns the number of
+// bytes written, or NSNotFound if the input is bad (see -errorOffset), the
+// decoder has failed or finished, or |capacity| is less than
+// -maximumDecodedLengthForLength: (in which case nothing is used up and the
+// decoder hasn't failed).
+- (NSUInteger)decodeChars:(const char *)chars
+                   length:(NSUInteger)length
+               intoBuffer:(void *)buffer
+                 capacity:(NSUInteger)capacity;
+
+// The same, as autoreleased data.  Returns nil on failure.
+- (NSData *)decodeString:(NSString *)string;
+
+// Ends the stream.  Returns NO if it stopped partway through a byte, or the
+// decoder had already failed.
+- (BOOL)finish;
+
+- (BOOL)isFinished;
+- (BOOL)hasFailed;
+
+// Where in the whole stream the decoder found a problem (the end of it if it
+// was incomplete), or NSNotFound if it hasn't failed.
+- (unsigned long long)errorOffset;
+
+// The number of characters decoded so far.
+- (unsigned long long)totalIn;
+
 @end
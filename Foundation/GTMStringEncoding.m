@@ -18,12 +18,338 @@
 
 #import "GTMStringEncoding.h"
 
+#if defined(__SSSE3__)
+#import <tmmintrin.h>
+#elif defined(__SSE2__)
+#import <emmintrin.h>
+#endif
+
 enum {
   kUnknownChar = -1,
   kPaddingChar = -2,
   kIgnoreChar = -3
 };
 
+// The built in encodings have fixed alphabets, so they get loops that do a
+// whole quantum (and, where the compiler targets it, a whole vector) at a
+// time instead of the generic bit at a time ones.  Both directions stop at
+// the last full quantum and leave the rest to the generic code, and decoding
+// gives up (so the generic code can report the problem) on anything that
+// isn't in the alphabet.
+typedef enum {
+  kKernelNone = 0,
+  kKernelBase64,
+  kKernelBase64Websafe,
+  kKernelBase32,
+  kKernelHex,
+} Kernel;
+
+#if defined(__SSSE3__)
+
+// Twelve bytes (of the sixteen loaded) to sixteen characters.  The approach
+// is Wojciech Muła's: spread the 6 bit indices out one per byte with a
+// shuffle and two multiplies, then add a per range offset picked by another
+// shuffle.
+GTM_INLINE __m128i EncodeBase64Vector(__m128i in, __m128i offsets) {
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                         4, 5, 3, 4, 1, 2, 0, 1));
+  __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  __m128i indices = _mm_or_si128(t1, t3);
+  // 0 for a-z, 1-10 for 0-9, 11 and 12 for the last two, 13 for A-Z.
+  __m128i ranges = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  ranges = _mm_or_si128(ranges, _mm_and_si128(upper, _mm_set1_epi8(13)));
+  return _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, ranges));
+}
+
+// Sixteen characters to twelve bytes (in the low bytes of |*out|).  Returns
+// NO if any of them aren't in the alphabet.
+GTM_INLINE BOOL DecodeBase64Vector(__m128i in, __m128i char62, __m128i char63,
+                                   __m128i *out) {
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+                                _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+  __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+  __m128i is62 = _mm_cmpeq_epi8(in, char62);
+  __m128i is63 = _mm_cmpeq_epi8(in, char63);
+  __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                               _mm_or_si128(digit, _mm_or_si128(is62, is63)));
+  if (_mm_movemask_epi8(valid) != 0xFFFF) return NO;
+
+  __m128i values =
+      _mm_or_si128(
+          _mm_or_si128(
+              _mm_and_si128(upper, _mm_sub_epi8(in, _mm_set1_epi8('A'))),
+              _mm_and_si128(lower, _mm_sub_epi8(in, _mm_set1_epi8('a' - 26)))),
+          _mm_or_si128(
+              _mm_and_si128(digit, _mm_add_epi8(in, _mm_set1_epi8(52 - '0'))),
+              _mm_or_si128(_mm_and_si128(is62, _mm_set1_epi8(62)),
+                           _mm_and_si128(is63, _mm_set1_epi8(63)))));
+  // Pairs of 6 bits to 12, pairs of those to 24, then drop every 4th byte
+  // and put the rest in big endian order.
+  __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+  *out = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                14, 13, 12, -1, -1, -1, -1));
+  return YES;
+}
+
+#endif  // __SSSE3__
+
+#if defined(__SSE2__)
+
+// Nibbles (one per byte) to upper case hex digits.
+GTM_INLINE __m128i HexDigitsVector(__m128i nibbles) {
+  __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)),
+                                  _mm_set1_epi8('A' - '9' - 1));
+  return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+
+// Hex digits (either case) to nibbles.  Returns NO if any aren't hex digits.
+GTM_INLINE BOOL HexNibblesVector(__m128i in, __m128i *out) {
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+  // Folding to upper case only disturbs things that aren't hex anyway.
+  __m128i folded = _mm_andnot_si128(_mm_set1_epi8(0x20), in);
+  __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('A' - 1)),
+                                 _mm_cmplt_epi8(folded, _mm_set1_epi8('F' + 1)));
+  if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xFFFF) return NO;
+  *out = _mm_or_si128(
+      _mm_and_si128(digit, _mm_sub_epi8(in, _mm_set1_epi8('0'))),
+      _mm_and_si128(letter, _mm_sub_epi8(folded, _mm_set1_epi8('A' - 10))));
+  return YES;
+}
+
+#endif  // __SSE2__
+
+// Encodes as many whole quanta of |in| as it can, returning how many bytes
+// were used.  |out| gets |shift| bits per character.
+static NSUInteger EncodeQuanta(Kernel kernel, const char *charMap,
+                               const unsigned char *in, NSUInteger inLen,
+                               unsigned char *out) {
+  NSUInteger i = 0;
+  switch (kernel) {
+    case kKernelBase64:
+    case kKernelBase64Websafe: {
+#if defined(__SSSE3__)
+      BOOL websafe = (kernel == kKernelBase64Websafe);
+      __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52,
+                                      (websafe ? '-' : '+') - 62,
+                                      (websafe ? '_' : '/') - 63, 'A', 0, 0);
+      for (; inLen - i >= 16; i += 12, out += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)out, EncodeBase64Vector(bytes, offsets));
+      }
+#endif  // __SSSE3__
+      for (; inLen - i >= 3; i += 3, out += 4) {
+        uint32_t bits = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) |
+                        in[i + 2];
+        out[0] = (unsigned char)charMap[bits >> 18];
+        out[1] = (unsigned char)charMap[(bits >> 12) & 0x3f];
+        out[2] = (unsigned char)charMap[(bits >> 6) & 0x3f];
+        out[3] = (unsigned char)charMap[bits & 0x3f];
+      }
+      break;
+    }
+
+    case kKernelBase32:
+      for (; inLen - i >= 5; i += 5, out += 8) {
+        uint64_t bits = ((uint64_t)in[i] << 32) | ((uint64_t)in[i + 1] << 24) |
+                        ((uint64_t)in[i + 2] << 16) |
+                        ((uint64_t)in[i + 3] << 8) | in[i + 4];
+        out[0] = (unsigned char)charMap[bits >> 35];
+        out[1] = (unsigned char)charMap[(bits >> 30) & 0x1f];
+        out[2] = (unsigned char)charMap[(bits >> 25) & 0x1f];
+        out[3] = (unsigned char)charMap[(bits >> 20) & 0x1f];
+        out[4] = (unsigned char)charMap[(bits >> 15) & 0x1f];
+        out[5] = (unsigned char)charMap[(bits >> 10) & 0x1f];
+        out[6] = (unsigned char)charMap[(bits >> 5) & 0x1f];
+        out[7] = (unsigned char)charMap[bits & 0x1f];
+      }
+      break;
+
+    case kKernelHex:
+#if defined(__SSE2__)
+      for (; inLen - i >= 16; i += 16, out += 32) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4),
+                                     _mm_set1_epi8(0x0f));
+        __m128i low = _mm_and_si128(bytes, _mm_set1_epi8(0x0f));
+        _mm_storeu_si128((__m128i *)out,
+                         HexDigitsVector(_mm_unpacklo_epi8(high, low)));
+        _mm_storeu_si128((__m128i *)(out + 16),
+                         HexDigitsVector(_mm_unpackhi_epi8(high, low)));
+      }
+#endif  // __SSE2__
+      for (; i < inLen; ++i, out += 2) {
+        out[0] = (unsigned char)charMap[in[i] >> 4];
+        out[1] = (unsigned char)charMap[in[i] & 0x0f];
+      }
+      break;
+
+    case kKernelNone:
+      break;
+  }
+  return i;
+}
+
+// Decodes as many whole quanta of |in| as it can into |out| (which has room
+// for |outCapacity| bytes).  Stops early at anything that isn't in the
+// alphabet, including bytes outside of 7-bit ASCII (which |reverseCharMap|
+// has no entries for).  Returns how many characters were used, and the bytes
+// written in |outLen|.
+static NSUInteger DecodeQuanta(Kernel kernel, const int *reverseCharMap,
+                               const unsigned char *in, NSUInteger inLen,
+                               unsigned char *out, NSUInteger outCapacity,
+                               NSUInteger *outLen) {
+#if !defined(__SSSE3__)
+#pragma unused(outCapacity)
+#endif
+  NSUInteger i = 0;
+  NSUInteger o = 0;
+  const int *map = reverseCharMap;
+  switch (kernel) {
+    case kKernelBase64:
+    case kKernelBase64Websafe: {
+#if defined(__SSSE3__)
+      BOOL websafe = (kernel == kKernelBase64Websafe);
+      __m128i char62 = _mm_set1_epi8(websafe ? '-' : '+');
+      __m128i char63 = _mm_set1_epi8(websafe ? '_' : '/');
+      // Each store writes four bytes past the twelve that count.
+      for (; inLen - i >= 16 && outCapacity - o >= 16; i += 16, o += 12) {
+        __m128i chars = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i bytes;
+        if (!DecodeBase64Vector(chars, char62, char63, &bytes)) break;
+        _mm_storeu_si128((__m128i *)(out + o), bytes);
+      }
+#endif  // __SSSE3__
+      for (; inLen - i >= 4; i += 4, o += 3) {
+        if ((in[i] | in[i + 1] | in[i + 2] | in[i + 3]) & 0x80) break;
+        int a = map[in[i]], b = map[in[i + 1]];
+        int c = map[in[i + 2]], d = map[in[i + 3]];
+        if ((a | b | c | d) < 0) break;
+        uint32_t bits = ((uint32_t)a << 18) | ((uint32_t)b << 12) |
+                        ((uint32_t)c << 6) | (uint32_t)d;
+        out[o] = (unsigned char)(bits >> 16);
+        out[o + 1] = (unsigned char)(bits >> 8);
+        out[o + 2] = (unsigned char)bits;
+      }
+      break;
+    }
+
+    case kKernelBase32:
+      for (; inLen - i >= 8; i += 8, o += 5) {
+        if ((in[i] | in[i + 1] | in[i + 2] | in[i + 3] |
+             in[i + 4] | in[i + 5] | in[i + 6] | in[i + 7]) & 0x80) {
+          break;
+        }
+        int c0 = map[in[i]], c1 = map[in[i + 1]];
+        int c2 = map[in[i + 2]], c3 = map[in[i + 3]];
+        int c4 = map[in[i + 4]], c5 = map[in[i + 5]];
+        int c6 = map[in[i + 6]], c7 = map[in[i + 7]];
+        if ((c0 | c1 | c2 | c3 | c4 | c5 | c6 | c7) < 0) break;
+        uint64_t bits = ((uint64_t)c0 << 35) | ((uint64_t)c1 << 30) |
+                        ((uint64_t)c2 << 25) | ((uint64_t)c3 << 20) |
+                        ((uint64_t)c4 << 15) | ((uint64_t)c5 << 10) |
+                        ((uint64_t)c6 << 5) | (uint64_t)c7;
+        out[o] = (unsigned char)(bits >> 32);
+        out[o + 1] = (unsigned char)(bits >> 24);
+        out[o + 2] = (unsigned char)(bits >> 16);
+        out[o + 3] = (unsigned char)(bits >> 8);
+        out[o + 4] = (unsigned char)bits;
+      }
+      break;
+
+    case kKernelHex:
+#if defined(__SSE2__)
+      for (; inLen - i >= 32; i += 32, o += 16) {
+        __m128i first, second;
+        if (!HexNibblesVector(_mm_loadu_si128((const __m128i *)(in + i)),
+                              &first) ||
+            !HexNibblesVector(_mm_loadu_si128((const __m128i *)(in + i + 16)),
+                              &second)) {
+          break;
+        }
+        // Each 16 bit lane holds the high nibble then the low one.
+        __m128i mask = _mm_set1_epi16(0x00ff);
+        first = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(first, mask), 4),
+                             _mm_srli_epi16(first, 8));
+        second = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(second, mask), 4),
+                              _mm_srli_epi16(second, 8));
+        _mm_storeu_si128((__m128i *)(out + o), _mm_packus_epi16(first, second));
+      }
+#endif  // __SSE2__
+      for (; inLen - i >= 2; i += 2, ++o) {
+        if ((in[i] | in[i + 1]) & 0x80) break;
+        int high = map[in[i]], low = map[in[i + 1]];
+        if ((high | low) < 0) break;
+        out[o] = (unsigned char)((high << 4) | low);
+      }
+      break;
+
+    case kKernelNone:
+      break;
+  }
+  *outLen = o;
+  return i;
+}
+
+// How far a decode has got, so that it can pick up again with the next
+// piece of input.
+typedef struct {
+  int buffer;
+  int bitsLeft;
+  BOOL expectPad;
+} DecodeState;
+
+typedef enum {
+  kDecodeErrorNone = 0,
+  kDecodeErrorUnexpectedChar,
+  kDecodeErrorExpectedPadding,
+  kDecodeErrorIncomplete,
+} DecodeError;
+
+// The string's own characters if it can hand them over, otherwise a copy.
+static const char *ASCIICharacters(NSString *string) {
+  if (!string) return NULL;
+  const char *chars = CFStringGetCStringPtr((CFStringRef)string,
+                                            kCFStringEncodingASCII);
+  if (!chars) chars = [string cStringUsingEncoding:NSASCIIStringEncoding];
+  return chars;
+}
+
+@interface GTMStringEncoding (PrivateMethods)
+// Bytes in a quantum, the smallest piece that encodes without padding.
+- (NSUInteger)quantumLength;
+- (int)bitsPerChar;
+// Encodes |inLen| bytes into |outBuf|, which must be big enough.  Anything
+// but the last piece of a stream must be whole quanta.  Returns the number
+// of characters written.
+- (NSUInteger)encodeBytes:(const unsigned char *)inBuf
+                   length:(NSUInteger)inLen
+                   output:(unsigned char *)outBuf
+                      pad:(BOOL)pad;
+// Decodes |inLen| characters into |outBuf| (which has room for |outLen|
+// bytes) carrying on from |state|.  Returns the number of bytes written, or
+// NSNotFound with what went wrong, and where, in |error| and |errorPos|.
+- (NSUInteger)decodeChars:(const unsigned char *)inBuf
+                   length:(NSUInteger)inLen
+                   output:(unsigned char *)outBuf
+                 capacity:(NSUInteger)outLen
+                    state:(DecodeState *)state
+                    error:(DecodeError *)error
+                 errorPos:(NSUInteger *)errorPos;
+// Whether a decode can stop at |state| without dropping any bits.
+- (BOOL)isCompleteState:(const DecodeState *)state;
+@end
+
 @implementation GTMStringEncoding
 
 + (id)binaryStringEncoding {
@@ -34,6 +360,7 @@ enum {
   GTMStringEncoding *ret = [self stringEncodingWithString:
       @"0123456789ABCDEF"];
   [ret addDecodeSynonyms:@"AaBbCcDdEeFf"];
+  ret->kernel_ = kKernelHex;
   return ret;
 }
 
@@ -42,6 +369,7 @@ enum {
       @"ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"];
   [ret setPaddingChar:'='];
   [ret setDoPad:YES];
+  ret->kernel_ = kKernelBase32;
   return ret;
 }
 
@@ -66,6 +394,7 @@ enum {
       @"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"];
   [ret setPaddingChar:'='];
   [ret setDoPad:YES];
+  ret->kernel_ = kKernelBase64;
   return ret;
 }
 
@@ -74,6 +403,7 @@ enum {
       @"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"];
   [ret setPaddingChar:'='];
   [ret setDoPad:YES];
+  ret->kernel_ = kKernelBase64Websafe;
   return ret;
 }
 
@@ -173,89 +503,149 @@ GTM_INLINE int lcm(int a, int b) {
   reverseCharMap_[(int)c] = kPaddingChar;
 }
 
-- (NSString *)encode:(NSData *)inData {
-  NSUInteger inLen = [inData length];
-  if (inLen <= 0) {
-    _GTMDevLog(@"Empty input");
-    return @"";
-  }
-  unsigned char *inBuf = (unsigned char *)[inData bytes];
-  NSUInteger inPos = 0;
+- (NSUInteger)quantumLength {
+  return (NSUInteger)(padLen_ * shift_ / 8);
+}
+
+- (int)bitsPerChar {
+  return shift_;
+}
 
-  NSUInteger outLen = (inLen * 8 + shift_ - 1) / shift_;
+- (NSUInteger)encodedLengthForLength:(NSUInteger)length {
+  NSUInteger outLen = (length * 8 + shift_ - 1) / shift_;
   if (doPad_) {
     outLen = ((outLen + padLen_ - 1) / padLen_) * padLen_;
   }
-  NSMutableData *outData = [NSMutableData dataWithLength:outLen];
-  unsigned char *outBuf = (unsigned char *)[outData mutableBytes];
+  return outLen;
+}
+
+- (NSUInteger)maximumDecodedLengthForLength:(NSUInteger)length {
+  return length * shift_ / 8;
+}
+
+- (NSUInteger)encodeBytes:(const unsigned char *)inBuf
+                   length:(NSUInteger)inLen
+                   output:(unsigned char *)outBuf
+                      pad:(BOOL)pad {
+  NSUInteger inPos = 0;
   NSUInteger outPos = 0;
 
-  int buffer = inBuf[inPos++];
-  int bitsLeft = 8;
-  while (bitsLeft > 0 || inPos < inLen) {
-    if (bitsLeft < shift_) {
-      if (inPos < inLen) {
-        buffer <<= 8;
-        buffer |= (inBuf[inPos++] & 0xff);
-        bitsLeft += 8;
-      } else {
-        int pad = shift_ - bitsLeft;
-        buffer <<= pad;
-        bitsLeft += pad;
+  if (kernel_ != kKernelNone) {
+    inPos = EncodeQuanta((Kernel)kernel_, charMap_, inBuf, inLen, outBuf);
+    outPos = inPos * 8 / shift_;
+  }
+
+  if (inPos < inLen) {
+    int buffer = inBuf[inPos++];
+    int bitsLeft = 8;
+    while (bitsLeft > 0 || inPos < inLen) {
+      if (bitsLeft < shift_) {
+        if (inPos < inLen) {
+          buffer <<= 8;
+          buffer |= (inBuf[inPos++] & 0xff);
+          bitsLeft += 8;
+        } else {
+          int pad = shift_ - bitsLeft;
+          buffer <<= pad;
+          bitsLeft += pad;
+        }
       }
+      int idx = (buffer >> (bitsLeft - shift_)) & mask_;
+      bitsLeft -= shift_;
+      outBuf[outPos++] = charMap_[idx];
     }
-    int idx = (buffer >> (bitsLeft - shift_)) & mask_;
-    bitsLeft -= shift_;
-    outBuf[outPos++] = charMap_[idx];
   }
 
-  if (doPad_) {
-    while (outPos < outLen)
+  if (pad) {
+    while (outPos % padLen_)
       outBuf[outPos++] = paddingChar_;
   }
+  return outPos;
+}
+
+- (NSUInteger)encodeBytes:(const void *)bytes
+                   length:(NSUInteger)length
+               intoBuffer:(char *)buffer
+                 capacity:(NSUInteger)capacity {
+  if (!length) return 0;
+  if (!bytes || !buffer ||
+      capacity < [self encodedLengthForLength:length]) {
+    return NSNotFound;
+  }
+  return [self encodeBytes:bytes
+                    length:length
+                    output:(unsigned char *)buffer
+                       pad:doPad_];
+}
 
+- (NSString *)encode:(NSData *)inData {
+  NSUInteger inLen = [inData length];
+  if (inLen <= 0) {
+    _GTMDevLog(@"Empty input");
+    return @"";
+  }
+  NSUInteger outLen = [self encodedLengthForLength:inLen];
+  unsigned char *outBuf = malloc(outLen);
+  if (!outBuf) return nil;  // COV_NF_LINE
+  NSUInteger outPos = [self encodeBytes:[inData bytes]
+                                 length:inLen
+                                 output:outBuf
+                                    pad:doPad_];
   _GTMDevAssert(outPos == outLen, @"Underflowed output buffer");
-  [outData setLength:outPos];
 
-  return [[[NSString alloc] initWithData:outData
-                                encoding:NSASCIIStringEncoding] autorelease];
+  // The string takes the buffer over rather than copying it.
+  return [[[NSString alloc] initWithBytesNoCopy:outBuf
+                                         length:outPos
+                                       encoding:NSASCIIStringEncoding
+                                   freeWhenDone:YES] autorelease];
 }
 
 - (NSString *)encodeString:(NSString *)inString {
   return [self encode:[inString dataUsingEncoding:NSUTF8StringEncoding]];
 }
 
-- (NSData *)decode:(NSString *)inString {
-  char *inBuf = (char *)[inString cStringUsingEncoding:NSASCIIStringEncoding];
-  if (!inBuf) {
-    _GTMDevLog(@"unable to convert buffer to ASCII");
-    return nil;
-  }
-  NSUInteger inLen = strlen(inBuf);
-
-  NSUInteger outLen = inLen * shift_ / 8;
-  NSMutableData *outData = [NSMutableData dataWithLength:outLen];
-  unsigned char *outBuf = (unsigned char *)[outData mutableBytes];
+- (NSUInteger)decodeChars:(const unsigned char *)inBuf
+                   length:(NSUInteger)inLen
+                   output:(unsigned char *)outBuf
+                 capacity:(NSUInteger)outLen
+                    state:(DecodeState *)state
+                    error:(DecodeError *)error
+                 errorPos:(NSUInteger *)errorPos {
+  int buffer = state->buffer;
+  int bitsLeft = state->bitsLeft;
+  BOOL expectPad = state->expectPad;
   NSUInteger outPos = 0;
 
-  int buffer = 0;
-  int bitsLeft = 0;
-  BOOL expectPad = NO;
+  // The fast loops get another go each time the generic one is back on a
+  // quantum boundary after skipping something (e.g. a MIME line break).
+  BOOL tryKernel = (kernel_ != kKernelNone);
   for (NSUInteger i = 0; i < inLen; i++) {
-    int val = reverseCharMap_[(int)inBuf[i]];
+    if (tryKernel && !bitsLeft && !expectPad) {
+      NSUInteger written = 0;
+      i += DecodeQuanta((Kernel)kernel_, reverseCharMap_, inBuf + i, inLen - i,
+                        outBuf + outPos, outLen - outPos, &written);
+      outPos += written;
+      tryKernel = NO;
+      if (i >= inLen) break;
+    }
+    int c = inBuf[i];
+    int val = (c < 128) ? reverseCharMap_[c] : kUnknownChar;
     switch (val) {
       case kIgnoreChar:
+        tryKernel = (kernel_ != kKernelNone);
         break;
       case kPaddingChar:
         expectPad = YES;
         break;
       case kUnknownChar:
-        _GTMDevLog(@"Unexpected data in input pos %lu", (unsigned long)i);
-        return nil;
+        *error = kDecodeErrorUnexpectedChar;
+        *errorPos = i;
+        return NSNotFound;
       default:
         if (expectPad) {
-          _GTMDevLog(@"Expected further padding characters");
-          return nil;
+          *error = kDecodeErrorExpectedPadding;
+          *errorPos = i;
+          return NSNotFound;
         }
         buffer <<= shift_;
         buffer |= val & mask_;
@@ -267,17 +657,93 @@ GTM_INLINE int lcm(int a, int b) {
         break;
     }
   }
+  _GTMDevAssert(outPos <= outLen, @"Overflowed buffer");
 
-  if (bitsLeft && buffer & ((1 << bitsLeft) - 1)) {
-    _GTMDevLog(@"Incomplete trailing data");
-    return nil;
+  state->buffer = buffer;
+  state->bitsLeft = bitsLeft;
+  state->expectPad = expectPad;
+  return outPos;
+}
+
+- (BOOL)isCompleteState:(const DecodeState *)state {
+  return !(state->bitsLeft && state->buffer & ((1 << state->bitsLeft) - 1));
+}
+
+- (NSUInteger)decodeChars:(const char *)chars
+                   length:(NSUInteger)length
+               intoBuffer:(void *)buffer
+                 capacity:(NSUInteger)capacity
+              errorOffset:(NSUInteger *)errorOffset {
+  if (errorOffset) *errorOffset = NSNotFound;
+  if (!length) return 0;
+  if (!chars || !buffer ||
+      capacity < [self maximumDecodedLengthForLength:length]) {
+    return NSNotFound;
   }
+  DecodeState state = { 0, 0, NO };
+  DecodeError error = kDecodeErrorNone;
+  NSUInteger errorPos = 0;
+  NSUInteger outPos = [self decodeChars:(const unsigned char *)chars
+                                 length:length
+                                 output:buffer
+                               capacity:capacity
+                                  state:&state
+                                  error:&error
+                               errorPos:&errorPos];
+  if (outPos != NSNotFound && ![self isCompleteState:&state]) {
+    outPos = NSNotFound;
+    errorPos = length;
+  }
+  if (outPos == NSNotFound && errorOffset) *errorOffset = errorPos;
+  return outPos;
+}
 
-  // Shorten buffer if needed due to padding chars
-  _GTMDevAssert(outPos <= outLen, @"Overflowed buffer");
-  [outData setLength:outPos];
+- (NSData *)decode:(NSString *)inString {
+  const char *inBuf = ASCIICharacters(inString);
+  if (!inBuf) {
+    _GTMDevLog(@"unable to convert buffer to ASCII");
+    return nil;
+  }
+  NSUInteger inLen = [inString length];
+
+  NSUInteger outLen = [self maximumDecodedLengthForLength:inLen];
+  // Never zero, so the NoCopy below always has something to own.
+  unsigned char *outBuf = malloc(outLen + 1);
+  if (!outBuf) return nil;  // COV_NF_LINE
+  DecodeState state = { 0, 0, NO };
+  DecodeError error = kDecodeErrorNone;
+  NSUInteger errorPos = 0;
+  NSUInteger outPos = [self decodeChars:(const unsigned char *)inBuf
+                                 length:inLen
+                                 output:outBuf
+                               capacity:outLen
+                                  state:&state
+                                  error:&error
+                               errorPos:&errorPos];
+  if (outPos != NSNotFound && ![self isCompleteState:&state]) {
+    outPos = NSNotFound;
+    error = kDecodeErrorIncomplete;
+  }
+  if (outPos == NSNotFound) {
+    switch (error) {
+      case kDecodeErrorUnexpectedChar:
+        _GTMDevLog(@"Unexpected data in input pos %lu",
+                   (unsigned long)errorPos);
+        break;
+      case kDecodeErrorExpectedPadding:
+        _GTMDevLog(@"Expected further padding characters");
+        break;
+      default:
+        _GTMDevLog(@"Incomplete trailing data");
+        break;
+    }
+    free(outBuf);
+    return nil;
+  }
 
-  return outData;
+  // Padding means there may be a few bytes spare at the end; not worth a
+  // copy to trim them.
+  return [NSData dataWithBytesNoCopy:outBuf length:outPos freeWhenDone:YES];
 }
 
 - (NSString *)stringByDecoding:(NSString *)inString {
@@ -287,3 +753,256 @@ GTM_INLINE int lcm(int a, int b) {
 }
 
 @end
+
+
+@implementation GTMStringEncoder
+
+- (id)initWithEncoding:(GTMStringEncoding *)encoding {
+  if ((self = [super init])) {
+    encoding_ = [encoding retain];
+    if (!encoding_) {
+      [self release];
+      return nil;
+    }
+    quantumLength_ = [encoding_ quantumLength];
+    _GTMDevAssert(quantumLength_ <= sizeof(pending_), @"Quantum too long");
+  }
+  return self;
+}
+
+- (id)init {
+  return [self initWithEncoding:nil];
+}
+
+- (void)dealloc {
+  [encoding_ release];
+  [super dealloc];
+}
+
+- (GTMStringEncoding *)encoding {
+  return encoding_;
+}
+
+- (NSUInteger)encodedLengthForLength:(NSUInteger)length {
+  NSUInteger whole = pendingLength_ + length;
+  whole -= whole % quantumLength_;
+  return whole * 8 / [encoding_ bitsPerChar];
+}
+
+- (NSUInteger)finalLength {
+  if (!pendingLength_) return 0;
+  return [encoding_ encodedLengthForLength:pendingLength_];
+}
+
+- (NSUInteger)encodeBytes:(const void *)bytes
+                   length:(NSUInteger)length
+               intoBuffer:(char *)buffer
+                 capacity:(NSUInteger)capacity {
+  if (finished_) return NSNotFound;
+  if (!length) return 0;
+  NSUInteger needed = [self encodedLengthForLength:length];
+  if (!bytes || (needed && !buffer) || capacity < needed) return NSNotFound;
+
+  const unsigned char *in = bytes;
+  unsigned char *out = (unsigned char *)buffer;
+  NSUInteger written = 0;
+  if (pendingLength_) {
+    NSUInteger take = MIN(quantumLength_ - pendingLength_, length);
+    memcpy(pending_ + pendingLength_, in, take);
+    pendingLength_ += take;
+    in += take;
+    length -= take;
+    if (pendingLength_ < quantumLength_) return 0;
+    written = [encoding_ encodeBytes:pending_
+                              length:quantumLength_
+                              output:out
+                                 pad:NO];
+    pendingLength_ = 0;
+  }
+  NSUInteger whole = length - length % quantumLength_;
+  written += [encoding_ encodeBytes:in
+                             length:whole
+                             output:out + written
+                                pad:NO];
+  pendingLength_ = length - whole;
+  memcpy(pending_, in + whole, pendingLength_);
+  _GTMDevAssert(written == needed, @"Miscounted output");
+  return written;
+}
+
+- (NSUInteger)finishIntoBuffer:(char *)buffer capacity:(NSUInteger)capacity {
+  if (finished_) return NSNotFound;
+  NSUInteger needed = [self finalLength];
+  if ((needed && !buffer) || capacity < needed) return NSNotFound;
+  NSUInteger written = 0;
+  if (pendingLength_) {
+    written = [encoding_ encodeBytes:pending_
+                              length:pendingLength_
+                              output:(unsigned char *)buffer
+                                 pad:[encoding_ doPad]];
+    pendingLength_ = 0;
+  }
+  finished_ = YES;
+  return written;
+}
+
+- (NSString *)encodeData:(NSData *)data {
+  NSUInteger length = [self encodedLengthForLength:[data length]];
+  char *buffer = malloc(length + 1);
+  if (!buffer) return nil;  // COV_NF_LINE
+  NSUInteger written = [self encodeBytes:[data bytes]
+                                  length:[data length]
+                              intoBuffer:buffer
+                                capacity:length];
+  if (written == NSNotFound) {
+    free(buffer);
+    return nil;
+  }
+  return [[[NSString alloc] initWithBytesNoCopy:buffer
+                                         length:written
+                                       encoding:NSASCIIStringEncoding
+                                   freeWhenDone:YES] autorelease];
+}
+
+- (NSString *)finishEncoding {
+  NSUInteger length = [self finalLength];
+  char *buffer = malloc(length + 1);
+  if (!buffer) return nil;  // COV_NF_LINE
+  NSUInteger written = [self finishIntoBuffer:buffer capacity:length];
+  if (written == NSNotFound) {
+    free(buffer);
+    return nil;
+  }
+  return [[[NSString alloc] initWithBytesNoCopy:buffer
+                                         length:written
+                                       encoding:NSASCIIStringEncoding
+                                   freeWhenDone:YES] autorelease];
+}
+
+- (BOOL)isFinished {
+  return finished_;
+}
+
+@end  // GTMStringEncoder
+
+
+@implementation GTMStringDecoder
+
+- (id)initWithEncoding:(GTMStringEncoding *)encoding {
+  if ((self = [super init])) {
+    encoding_ = [encoding retain];
+    if (!encoding_) {
+      [self release];
+      return nil;
+    }
+  }
+  return self;
+}
+
+- (id)init {
+  return [self initWithEncoding:nil];
+}
+
+- (void)dealloc {
+  [encoding_ release];
+  [super dealloc];
+}
+
+- (GTMStringEncoding *)encoding {
+  return encoding_;
+}
+
+- (NSUInteger)maximumDecodedLengthForLength:(NSUInteger)length {
+  return (bitsLeft_ + length * [encoding_ bitsPerChar]) / 8;
+}
+
+- (NSUInteger)decodeChars:(const char *)chars
+                   length:(NSUInteger)length
+               intoBuffer:(void *)buffer
+                 capacity:(NSUInteger)capacity {
+  if (failed_ || finished_) return NSNotFound;
+  if (!length) return 0;
+  if (!chars || !buffer ||
+      capacity < [self maximumDecodedLengthForLength:length]) {
+    return NSNotFound;
+  }
+  DecodeState state = { buffer_, bitsLeft_, expectPad_ };
+  DecodeError error = kDecodeErrorNone;
+  NSUInteger errorPos = 0;
+  NSUInteger written = [encoding_ decodeChars:(const unsigned char *)chars
+                                       length:length
+                                       output:buffer
+                                     capacity:capacity
+                                        state:&state
+                                        error:&error
+                                     errorPos:&errorPos];
+  if (written == NSNotFound) {
+    failed_ = YES;
+    errorOffset_ = totalIn_ + errorPos;
+    return NSNotFound;
+  }
+  buffer_ = state.buffer;
+  bitsLeft_ = state.bitsLeft;
+  expectPad_ = state.expectPad;
+  totalIn_ += length;
+  return written;
+}
+
+- (NSData *)decodeString:(NSString *)string {
+  NSUInteger length = [string length];
+  const char *chars = ASCIICharacters(string);
+  if (!chars && length) {
+    if (!failed_ && !finished_) {
+      NSCharacterSet *nonASCII =
+          [[NSCharacterSet characterSetWithRange:NSMakeRange(0, 128)]
+              invertedSet];
+      failed_ = YES;
+      errorOffset_ =
+          totalIn_ + [string rangeOfCharacterFromSet:nonASCII].location;
+    }
+    return nil;
+  }
+  NSUInteger capacity = [self maximumDecodedLengthForLength:length];
+  unsigned char *buffer = malloc(capacity + 1);
+  if (!buffer) return nil;  // COV_NF_LINE
+  NSUInteger written = [self decodeChars:chars
+                                  length:length
+                              intoBuffer:buffer
+                                capacity:capacity];
+  if (written == NSNotFound) {
+    free(buffer);
+    return nil;
+  }
+  return [NSData dataWithBytesNoCopy:buffer length:written freeWhenDone:YES];
+}
+
+- (BOOL)finish {
+  if (failed_) return NO;
+  if (finished_) return YES;
+  DecodeState state = { buffer_, bitsLeft_, expectPad_ };
+  if (![encoding_ isCompleteState:&state]) {
+    failed_ = YES;
+    errorOffset_ = totalIn_;
+    return NO;
+  }
+  finished_ = YES;
+  return YES;
+}
+
+- (BOOL)isFinished {
+  return finished_;
+}
+
+- (BOOL)hasFailed {
+  return failed_;
+}
+
+- (unsigned long long)errorOffset {
+  return failed_ ? errorOffset_ : NSNotFound;
+}
+
+- (unsigned long long)totalIn {
+  return totalIn_;
+}
+
+@end  // GTMStringDecoder
@@ -19,6 +19,7 @@
 #import "GTMSenTestCase.h"
 #import "GTMStringEncoding.h"
 #import "GTMUnitTestDevLog.h"
+#import "GTMTestTimer.h"
 
 @interface GTMStringEncodingTest : GTMTestCase
 @end
@@ -306,4 +307,395 @@
   STAssertNil([coder decode:@"abcd<C3><A9>f"], nil);
 }
 
+// The same alphabet as a built in encoding, but through the generic code.
+static GTMStringEncoding *GenericTwin(NSString *alphabet, BOOL pad) {
+  GTMStringEncoding *coder = [GTMStringEncoding stringEncodingWithString:alphabet];
+  if (pad) {
+    [coder setPaddingChar:'='];
+    [coder setDoPad:YES];
+  }
+  return coder;
+}
+
+static NSData *RandomData(NSUInteger length) {
+  NSMutableData *data = [NSMutableData dataWithLength:length];
+  unsigned char *bytes = [data mutableBytes];
+  uint32_t seed = (uint32_t)length;
+  for (NSUInteger i = 0; i < length; i++) {
+    seed = seed * 1103515245 + 12345;
+    bytes[i] = (unsigned char)(seed >> 16);
+  }
+  return data;
+}
+
+- (void)testBuiltInsMatchGeneric {
+  NSString *base64 =
+      @"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  NSString *websafe =
+      @"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  NSArray *builtIns =
+      [NSArray arrayWithObjects:
+       [GTMStringEncoding rfc4648Base64StringEncoding],
+       [GTMStringEncoding rfc4648Base64WebsafeStringEncoding],
+       [GTMStringEncoding rfc4648Base32StringEncoding],
+       [GTMStringEncoding hexStringEncoding], nil];
+  NSArray *twins =
+      [NSArray arrayWithObjects:
+       GenericTwin(base64, YES),
+       GenericTwin(websafe, YES),
+       GenericTwin(@"ABCDEFGHIJKLMNOPQRSTUVWXYZ234567", YES),
+       GenericTwin(@"0123456789ABCDEF", NO), nil];
+  for (NSUInteger c = 0; c < [builtIns count]; c++) {
+    GTMStringEncoding *coder = [builtIns objectAtIndex:c];
+    GTMStringEncoding *twin = [twins objectAtIndex:c];
+    for (NSUInteger length = 1; length < 200; length++) {
+      NSData *data = RandomData(length);
+      NSString *encoded = [coder encode:data];
+      STAssertEqualStrings(encoded, [twin encode:data], @"%@ %lu", coder,
+                           (unsigned long)length);
+      STAssertEqualObjects([coder decode:encoded], data, @"%@ %lu", coder,
+                           (unsigned long)length);
+    }
+    NSData *data = RandomData(100000);
+    NSString *encoded = [coder encode:data];
+    STAssertEqualStrings(encoded, [twin encode:data], @"%@", coder);
+    STAssertEqualObjects([coder decode:encoded], data, @"%@", coder);
+
+    // Bad data deep inside is still reported where it is.
+    NSMutableString *bad = [NSMutableString stringWithString:encoded];
+    [bad replaceCharactersInRange:NSMakeRange(5000, 1) withString:@"*"];
+    [GTMUnitTestDevLog expectString:@"Unexpected data in input pos 5000"];
+    STAssertNil([coder decode:bad], @"%@", coder);
+
+    // As is padding in the middle.
+    bad = [NSMutableString stringWithString:[coder encode:RandomData(10)]];
+    [bad appendString:encoded];
+    if ([bad rangeOfString:@"="].length) {
+      [GTMUnitTestDevLog expectString:@"Expected further padding characters"];
+      STAssertNil([coder decode:bad], @"%@", coder);
+    }
+
+    // Ignored characters only interrupt the fast path.
+    [coder ignoreCharacters:@"\n"];
+    NSMutableString *wrapped = [NSMutableString stringWithString:encoded];
+    [wrapped insertString:@"\n" atIndex:76];
+    [wrapped insertString:@"\n" atIndex:12345];
+    STAssertEqualObjects([coder decode:wrapped], data, @"%@", coder);
+  }
+}
+
+- (void)testBuffers {
+  GTMStringEncoding *coder = [GTMStringEncoding rfc4648Base64StringEncoding];
+  STAssertEquals([coder encodedLengthForLength:0], (NSUInteger)0, nil);
+  STAssertEquals([coder encodedLengthForLength:1], (NSUInteger)4, nil);
+  STAssertEquals([coder encodedLengthForLength:3], (NSUInteger)4, nil);
+  STAssertEquals([coder encodedLengthForLength:4], (NSUInteger)8, nil);
+  STAssertEquals([coder maximumDecodedLengthForLength:8], (NSUInteger)6, nil);
+
+  char chars[16];
+  STAssertEquals([coder encodeBytes:"hello" length:5 intoBuffer:chars
+                           capacity:7], (NSUInteger)NSNotFound, nil);
+  STAssertEquals([coder encodeBytes:"hello" length:5 intoBuffer:chars
+                           capacity:sizeof(chars)], (NSUInteger)8, nil);
+  STAssertEquals(memcmp(chars, "aGVsbG8=", 8), 0, nil);
+  STAssertEquals([coder encodeBytes:NULL length:0 intoBuffer:NULL
+                           capacity:0], (NSUInteger)0, nil);
+
+  // Errors are reported by offset, without being logged.
+  char bytes[16];
+  NSUInteger errorOffset = 0;
+  STAssertEquals([coder decodeChars:"aGVsbG8=" length:8 intoBuffer:bytes
+                           capacity:sizeof(bytes) errorOffset:&errorOffset],
+                 (NSUInteger)5, nil);
+  STAssertEquals(memcmp(bytes, "hello", 5), 0, nil);
+  STAssertEquals(errorOffset, (NSUInteger)NSNotFound, nil);
+  STAssertEquals([coder decodeChars:"aGVs*G8=" length:8 intoBuffer:bytes
+                           capacity:sizeof(bytes) errorOffset:&errorOffset],
+                 (NSUInteger)NSNotFound, nil);
+  STAssertEquals(errorOffset, (NSUInteger)4, nil);
+  STAssertEquals([coder decodeChars:"aGV=bG8=" length:8 intoBuffer:bytes
+                           capacity:sizeof(bytes) errorOffset:&errorOffset],
+                 (NSUInteger)NSNotFound, nil);
+  STAssertEquals(errorOffset, (NSUInteger)4, nil);
+  STAssertEquals([coder decodeChars:"aGVsbG9" length:7 intoBuffer:bytes
+                           capacity:sizeof(bytes) errorOffset:&errorOffset],
+                 (NSUInteger)NSNotFound, nil);
+  STAssertEquals(errorOffset, (NSUInteger)7, nil);
+  STAssertEquals([coder decodeChars:"aGVs\xc3\xa9G8=" length:9 intoBuffer:bytes
+                           capacity:sizeof(bytes) errorOffset:&errorOffset],
+                 (NSUInteger)NSNotFound, nil);
+  STAssertEquals(errorOffset, (NSUInteger)4, nil);
+  STAssertEquals([coder decodeChars:"aGVsbG8=" length:8 intoBuffer:bytes
+                           capacity:5 errorOffset:&errorOffset],
+                 (NSUInteger)NSNotFound, nil);
+  STAssertEquals(errorOffset, (NSUInteger)NSNotFound, nil);
+  STAssertEquals([coder decodeChars:"aGVsbG8=" length:8 intoBuffer:bytes
+                           capacity:sizeof(bytes) errorOffset:NULL],
+                 (NSUInteger)5, nil);
+
+  // Big enough to go through the vector code too.
+  NSData *data = RandomData(1000);
+  NSUInteger length = [coder encodedLengthForLength:[data length]];
+  NSMutableData *encoded = [NSMutableData dataWithLength:length];
+  STAssertEquals([coder encodeBytes:[data bytes]
+                             length:[data length]
+                         intoBuffer:[encoded mutableBytes]
+                           capacity:length], length, nil);
+  NSString *string =
+      [[[NSString alloc] initWithData:encoded
+                             encoding:NSASCIIStringEncoding] autorelease];
+  STAssertEqualStrings(string, [coder encode:data], nil);
+  NSUInteger capacity = [coder maximumDecodedLengthForLength:length];
+  NSMutableData *decoded = [NSMutableData dataWithLength:capacity];
+  NSUInteger decodedLength = [coder decodeChars:[encoded bytes]
+                                         length:length
+                                     intoBuffer:[decoded mutableBytes]
+                                       capacity:capacity
+                                    errorOffset:NULL];
+  STAssertEquals(decodedLength, [data length], nil);
+  [decoded setLength:decodedLength];
+  STAssertEqualObjects(decoded, data, nil);
+}
+
+- (void)testStreaming {
+  NSArray *coders =
+      [NSArray arrayWithObjects:
+       [GTMStringEncoding rfc4648Base64StringEncoding],
+       [GTMStringEncoding rfc4648Base32StringEncoding],
+       [GTMStringEncoding rfc4648Base32HexStringEncoding],
+       [GTMStringEncoding hexStringEncoding],
+       [GTMStringEncoding binaryStringEncoding],
+       [GTMStringEncoding stringEncodingWithString:@"01234567"], nil];
+  NSData *data = RandomData(5000);
+  NSUInteger pieceSizes[] = { 1, 2, 5, 7, 100, 4999, 10000 };
+  for (NSUInteger c = 0; c < [coders count]; c++) {
+    GTMStringEncoding *coder = [coders objectAtIndex:c];
+    NSString *expected = [coder encode:data];
+    for (size_t p = 0; p < sizeof(pieceSizes) / sizeof(pieceSizes[0]); ++p) {
+      NSUInteger pieceSize = pieceSizes[p];
+      GTMStringEncoder *encoder =
+          [[[GTMStringEncoder alloc] initWithEncoding:coder] autorelease];
+      NSMutableString *encoded = [NSMutableString string];
+      for (NSUInteger offset = 0; offset < [data length]; offset += pieceSize) {
+        NSRange range =
+            NSMakeRange(offset, MIN(pieceSize, [data length] - offset));
+        [encoded appendString:
+            [encoder encodeData:[data subdataWithRange:range]]];
+      }
+      [encoded appendString:[encoder finishEncoding]];
+      STAssertTrue([encoder isFinished], nil);
+      STAssertNil([encoder finishEncoding], nil);
+      STAssertEqualStrings(encoded, expected, @"%@ piece %lu", coder,
+                           (unsigned long)pieceSize);
+
+      GTMStringDecoder *decoder =
+          [[[GTMStringDecoder alloc] initWithEncoding:coder] autorelease];
+      NSMutableData *decoded = [NSMutableData data];
+      for (NSUInteger offset = 0; offset < [expected length];
+           offset += pieceSize) {
+        NSRange range =
+            NSMakeRange(offset, MIN(pieceSize, [expected length] - offset));
+        NSData *piece = [decoder decodeString:
+                         [expected substringWithRange:range]];
+        STAssertNotNil(piece, nil);
+        [decoded appendData:piece];
+      }
+      STAssertTrue([decoder finish], nil);
+      STAssertEqualObjects(decoded, data, @"%@ piece %lu", coder,
+                           (unsigned long)pieceSize);
+      STAssertEquals([decoder totalIn], (unsigned long long)[expected length],
+                     nil);
+    }
+  }
+
+  // Output only ever covers whole quanta until the end.
+  GTMStringEncoder *encoder =
+      [[[GTMStringEncoder alloc] initWithEncoding:
+        [GTMStringEncoding rfc4648Base64StringEncoding]] autorelease];
+  char chars[8];
+  STAssertEquals([encoder encodedLengthForLength:2], (NSUInteger)0, nil);
+  STAssertEquals([encoder encodeBytes:"he" length:2 intoBuffer:chars
+                             capacity:0], (NSUInteger)0, nil);
+  STAssertEquals([encoder finalLength], (NSUInteger)4, nil);
+  STAssertEquals([encoder encodedLengthForLength:3], (NSUInteger)4, nil);
+  STAssertEquals([encoder encodeBytes:"llo" length:3 intoBuffer:chars
+                             capacity:3], (NSUInteger)NSNotFound, nil);
+  STAssertEquals([encoder encodeBytes:"llo" length:3 intoBuffer:chars
+                             capacity:4], (NSUInteger)4, nil);
+  STAssertEquals(memcmp(chars, "aGVs", 4), 0, nil);
+  STAssertEquals([encoder finishIntoBuffer:chars capacity:3],
+                 (NSUInteger)NSNotFound, nil);
+  STAssertEquals([encoder finishIntoBuffer:chars capacity:sizeof(chars)],
+                 (NSUInteger)4, nil);
+  STAssertEquals(memcmp(chars, "bG8=", 4), 0, nil);
+  STAssertEquals([encoder encodeBytes:"x" length:1 intoBuffer:chars
+                             capacity:sizeof(chars)],
+                 (NSUInteger)NSNotFound, nil);
+
+  STAssertNil([[[GTMStringEncoder alloc] init] autorelease], nil);
+  STAssertNil([[[GTMStringDecoder alloc] init] autorelease], nil);
+}
+
+- (void)testStreamingErrors {
+  GTMStringEncoding *coder = [GTMStringEncoding rfc4648Base64StringEncoding];
+  [coder ignoreCharacters:@"\n"];
+
+  // Problems are placed in the whole stream, not the piece.
+  GTMStringDecoder *decoder =
+      [[[GTMStringDecoder alloc] initWithEncoding:coder] autorelease];
+  STAssertEquals([decoder errorOffset], (unsigned long long)NSNotFound, nil);
+  STAssertEqualObjects([decoder decodeString:@"aGVs\nbG"],
+                       [NSData dataWithBytes:"hell" length:4], nil);
+  STAssertNil([decoder decodeString:@"8*"], nil);
+  STAssertTrue([decoder hasFailed], nil);
+  STAssertEquals([decoder errorOffset], 8ULL, nil);
+  STAssertNil([decoder decodeString:@"AAAA"], @"stays failed");
+  STAssertFalse([decoder finish], nil);
+
+  // Running out partway through a byte.
+  decoder = [[[GTMStringDecoder alloc] initWithEncoding:coder] autorelease];
+  STAssertNotNil([decoder decodeString:@"aGVsbG9"], nil);
+  STAssertFalse([decoder hasFailed], nil);
+  STAssertFalse([decoder finish], nil);
+  STAssertEquals([decoder errorOffset], 7ULL, nil);
+
+  // Data after padding, split across pieces.
+  decoder = [[[GTMStringDecoder alloc] initWithEncoding:coder] autorelease];
+  STAssertNotNil([decoder decodeString:@"aGVsbG8="], nil);
+  STAssertNil([decoder decodeString:@"aGVs"], nil);
+  STAssertEquals([decoder errorOffset], 8ULL, nil);
+
+  // Non-ASCII.
+  decoder = [[[GTMStringDecoder alloc] initWithEncoding:coder] autorelease];
+  STAssertNotNil([decoder decodeString:@"aGVs"], nil);
+  STAssertNil([decoder decodeString:@"bG\u00e9="], nil);
+  STAssertEquals([decoder errorOffset], 6ULL, nil);
+
+  // Too little room isn't a failure.
+  decoder = [[[GTMStringDecoder alloc] initWithEncoding:coder] autorelease];
+  char bytes[8];
+  STAssertEquals([decoder maximumDecodedLengthForLength:8], (NSUInteger)6,
+                 nil);
+  STAssertEquals([decoder decodeChars:"aGVsbG8=" length:8 intoBuffer:bytes
+                             capacity:5], (NSUInteger)NSNotFound, nil);
+  STAssertFalse([decoder hasFailed], nil);
+  STAssertEquals([decoder decodeChars:"aGVsbG8=" length:8 intoBuffer:bytes
+                             capacity:sizeof(bytes)], (NSUInteger)5, nil);
+  STAssertTrue([decoder finish], nil);
+  STAssertTrue([decoder isFinished], nil);
+}
+
+// Reports the encode and decode rates of the built in encodings against the
+// generic code.
+- (void)testThroughput {
+  NSData *data = RandomData(8 * 1024 * 1024);
+  double gigabytes = [data length] / 1e9;
+  NSArray *builtIns =
+      [NSArray arrayWithObjects:
+       [GTMStringEncoding rfc4648Base64StringEncoding],
+       [GTMStringEncoding rfc4648Base32StringEncoding],
+       [GTMStringEncoding hexStringEncoding], nil];
+  NSArray *twins =
+      [NSArray arrayWithObjects:
+       GenericTwin(@"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                   @"0123456789+/", YES),
+       GenericTwin(@"ABCDEFGHIJKLMNOPQRSTUVWXYZ234567", YES),
+       GenericTwin(@"0123456789ABCDEF", NO), nil];
+  NSString *names[] = { @"base64", @"base32", @"hex" };
+  for (NSUInteger c = 0; c < [builtIns count]; c++) {
+    double rates[2][2];
+    for (int generic = 0; generic < 2; generic++) {
+      GTMStringEncoding *coder =
+          [(generic ? twins : builtIns) objectAtIndex:c];
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      GTMTestTimer *timer = GTMTestTimerCreate();
+      GTMTestTimerStart(timer);
+      NSString *encoded = [coder encode:data];
+      GTMTestTimerStop(timer);
+      rates[generic][0] = gigabytes / GTMTestTimerGetSeconds(timer);
+      GTMTestTimerRelease(timer);
+      timer = GTMTestTimerCreate();
+      GTMTestTimerStart(timer);
+      NSData *decoded = [coder decode:encoded];
+      GTMTestTimerStop(timer);
+      rates[generic][1] = gigabytes / GTMTestTimerGetSeconds(timer);
+      GTMTestTimerRelease(timer);
+      STAssertEqualObjects(decoded, data, nil);
+      [pool release];
+    }
+    NSLog(@"%@: encode %.2fGB/s (generic %.2fGB/s), "
+          @"decode %.2fGB/s (generic %.2fGB/s)", names[c],
+          rates[0][0], rates[1][0], rates[0][1], rates[1][1]);
+  }
+}
+
+// Transcodes through a pair of fixed buffers, the way a large file would be,
+// against encoding and decoding it in one go.
+- (void)testStreamingThroughput {
+  GTMStringEncoding *coder = [GTMStringEncoding rfc4648Base64StringEncoding];
+  NSData *data = RandomData(8 * 1024 * 1024);
+  const unsigned char *bytes = [data bytes];
+  double gigabytes = [data length] / 1e9;
+  const NSUInteger kPieceSize = 64 * 1024;
+
+  GTMStringEncoder *encoder =
+      [[[GTMStringEncoder alloc] initWithEncoding:coder] autorelease];
+  GTMStringDecoder *decoder =
+      [[[GTMStringDecoder alloc] initWithEncoding:coder] autorelease];
+  NSUInteger charsSize = [encoder encodedLengthForLength:kPieceSize] + 4;
+  char *chars = malloc(charsSize);
+  NSUInteger outSize = [decoder maximumDecodedLengthForLength:charsSize] + 1;
+  unsigned char *out = malloc(outSize);
+  STAssertTrue(chars && out, nil);
+  NSUInteger matched = 0;
+  BOOL same = YES;
+  GTMTestTimer *timer = GTMTestTimerCreate();
+  GTMTestTimerStart(timer);
+  NSUInteger offset = 0;
+  BOOL done = NO;
+  while (!done) {
+    NSUInteger length = 0;
+    if (offset < [data length]) {
+      NSUInteger piece = MIN(kPieceSize, [data length] - offset);
+      length = [encoder encodeBytes:bytes + offset
+                             length:piece
+                         intoBuffer:chars
+                           capacity:charsSize];
+      offset += piece;
+    } else {
+      length = [encoder finishIntoBuffer:chars capacity:charsSize];
+      done = YES;
+    }
+    NSUInteger decoded = [decoder decodeChars:chars
+                                       length:length
+                                   intoBuffer:out
+                                     capacity:outSize];
+    same = same && (decoded != NSNotFound) &&
+        (memcmp(out, bytes + matched, decoded) == 0);
+    matched += decoded;
+  }
+  GTMTestTimerStop(timer);
+  STAssertTrue(same, nil);
+  STAssertTrue([decoder finish], nil);
+  STAssertEquals(matched, [data length], nil);
+  double streamed = gigabytes / GTMTestTimerGetSeconds(timer);
+  GTMTestTimerRelease(timer);
+  free(chars);
+  free(out);
+
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  timer = GTMTestTimerCreate();
+  GTMTestTimerStart(timer);
+  NSData *roundTrip = [coder decode:[coder encode:data]];
+  GTMTestTimerStop(timer);
+  STAssertEqualObjects(roundTrip, data, nil);
+  double oneShot = gigabytes / GTMTestTimerGetSeconds(timer);
+  GTMTestTimerRelease(timer);
+  [pool release];
+
+  NSLog(@"base64 round trip: streamed %.2fGB/s in %luK of buffers, "
+        @"one shot %.2fGB/s", streamed,
+        (unsigned long)((charsSize + outSize) / 1024), oneShot);
+}
+
 @end
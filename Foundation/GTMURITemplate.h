@@ -27,7 +27,15 @@
 // of a feature that is not supported, it will fail with an error.
 //
 
-@interface GTMURITemplate : NSObject
+struct GTMURITemplateOp;
+
+@interface GTMURITemplate : NSObject {
+ @private
+  NSString *templateString_;
+  struct GTMURITemplateOp *ops_;
+  NSUInteger numOps_;
+  NSUInteger opsCapacity_;
+}
 
 // Process the template.  If the template uses an unsupported feature, it will
 // throw an exception to help catch that limitation.  Currently unsupported
@@ -39,6 +47,27 @@
 // are coming out of some other structure).
 + (NSString *)expandTemplate:(NSString *)uriTemplate values:(id)valueProvider;
 
+// Returns an autoreleased template compiled from |uriTemplate|.
+//
+// +expandTemplate:values: has to parse the template every time it is called.
+// A compiled template parses it once into a flat list of literal text and
+// expressions, so expanding the same template over and over only has to look
+// up and escape the values.  Compiled templates don't change once they are
+// created, so they can be shared between threads.
++ (id)templateWithString:(NSString *)uriTemplate;
+
+// Compiles |uriTemplate|.  Returns nil if |uriTemplate| is nil, or if there
+// isn't memory to compile it.
+- (id)initWithString:(NSString *)uriTemplate;
+
+// The template string this was compiled from.
+- (NSString *)templateString;
+
+// Expands the template w/ the values from |valueProvider|.  The results (and
+// any exceptions for unsupported features) are the same as
+// +expandTemplate:values: gives for the template string.
+- (NSString *)expandWithValues:(id)valueProvider;
+
 @end
 
 #endif  // MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_5
@@ -17,11 +17,30 @@
 
 #if MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_5
 
-// Key constants for handling variables.
-static NSString *const kVariable = @"variable"; // NSString
-static NSString *const kExplode = @"explode"; // NSString
-static NSString *const kPartial = @"partial"; // NSString
-static NSString *const kPartialValue = @"partialValue"; // NSNumber
+// The kinds of steps in a compiled template.
+typedef enum {
+  kLiteralOp,     // Append the text in string_.
+  kExpressionOp,  // Expand the numVariables_ variable ops that follow it.
+  kVariableOp,    // One variable of an expression, named string_.
+} GTMURITemplateOpKind;
+
+// A compiled template is a flat array of these.  Like
+// GTMLoggerRingBufferWriter, these use CF types so the strings can be
+// CFRetained, otherwise the GC wouldn't know that the ops hold them.
+struct GTMURITemplateOp {
+  GTMURITemplateOpKind kind_;
+  CFStringRef string_;
+
+  // Only used by kExpressionOp.
+  unichar expressionOperator_;
+  NSUInteger numVariables_;
+
+  // Only used by kVariableOp.
+  unichar explode_;            // 0, '*' or '+'.
+  CFStringRef partial_;        // The partial mode (":" or "^") if one was set.
+  CFStringRef defaultValue_;   // The default in effect for the expression.
+};
+typedef struct GTMURITemplateOp GTMURITemplateOp;
 
 // Help for passing the Expansion info in one shot.
 struct ExpansionInfo {
@@ -31,71 +50,405 @@ struct ExpansionInfo {
   BOOL allowReservedInEscape;
 
   // Update for each variable.
-  NSString *explode;
+  unichar explode;
+};
+typedef struct ExpansionInfo ExpansionInfo;
+
+// Character classes from RFC 3986, used to decide what needs escaping.
+enum {
+  kURIUnreservedChar = 1 << 0,  // ALPHA / DIGIT / "-" / "." / "_" / "~"
+  kURIReservedChar = 1 << 1,    // gen-delims / sub-delims
+};
+
+#define U kURIUnreservedChar
+#define R kURIReservedChar
+static const unsigned char kURICharClasses[128] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x00
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x10
+  0, R, 0, R, R, 0, R, R, R, R, R, R, R, U, U, R,  // 0x20  !"#$%&'()*+,-./
+  U, U, U, U, U, U, U, U, U, U, R, R, 0, R, 0, R,  // 0x30 0123456789:;<=>?
+  R, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,  // 0x40 @ABCDEFGHIJKLMNO
+  U, U, U, U, U, U, U, U, U, U, U, R, 0, R, 0, U,  // 0x50 PQRSTUVWXYZ[\]^_
+  0, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,  // 0x60 `abcdefghijklmno
+  U, U, U, U, U, U, U, U, U, U, U, 0, 0, 0, U, 0,  // 0x70 pqrstuvwxyz{|}~
 };
+#undef U
+#undef R
 
 // Helper just to shorten the lines when needed.
 static NSString *UnescapeString(NSString *str) {
   return [str stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
 }
 
-static NSString *EscapeString(NSString *str, BOOL allowReserved) {
-  static CFStringRef kReservedChars = CFSTR(":/?#[]@!$&'()*+,;=");
-  CFStringRef allowedChars = allowReserved ? kReservedChars : NULL;
+// Appends |str| to |result|, percent escaping (as UTF-8) everything but the
+// unreserved characters, and also leaving the reserved characters alone if
+// |allowReserved|.
+//
+// These are the same results CFURLCreateStringByAddingPercentEscapes gave for
+// this w/ the right "leave" and "force" sets, but w/o creating a new string
+// for every value.
+//
+// Reference: http://www.ietf.org/rfc/rfc3986.txt
+static void AppendEscapedString(NSMutableString *result, NSString *str,
+                                BOOL allowReserved) {
+  static const char kHexDigits[] = "0123456789ABCDEF";
+  const unsigned char leaveAlone =
+    allowReserved ? (kURIUnreservedChar | kURIReservedChar)
+                  : kURIUnreservedChar;
+
+  CFStringRef cfStr = (CFStringRef)str;
+  CFIndex length = CFStringGetLength(cfStr);
+  CFStringInlineBuffer inlineBuffer;
+  CFStringInitInlineBuffer(cfStr, &inlineBuffer, CFRangeMake(0, length));
+
+  // Worst case a character turns into 4 UTF-8 bytes, each written as "%XX".
+  enum { kBufferSize = 256, kMaxCharExpansion = 12 };
+  unichar buffer[kBufferSize];
+  CFIndex used = 0;
+  NSUInteger startLength = [result length];
+  BOOL convertible = YES;
+  for (CFIndex i = 0; i < length; ++i) {
+    if (used > kBufferSize - kMaxCharExpansion) {
+      CFStringAppendCharacters((CFMutableStringRef)result, buffer, used);
+      used = 0;
+    }
+    unichar c = CFStringGetCharacterFromInlineBuffer(&inlineBuffer, i);
+    if ((c < 128) && (kURICharClasses[c] & leaveAlone)) {
+      buffer[used++] = c;
+      continue;
+    }
+    unsigned char utf8[4];
+    int utf8Len = 0;
+    if (c < 0x80) {
+      utf8[utf8Len++] = (unsigned char)c;
+    } else if (c < 0x800) {
+      utf8[utf8Len++] = (unsigned char)(0xC0 | (c >> 6));
+      utf8[utf8Len++] = (unsigned char)(0x80 | (c & 0x3F));
+    } else if (CFStringIsSurrogateHighCharacter(c)) {
+      unichar low = 0;
+      if (i + 1 < length) {
+        low = CFStringGetCharacterFromInlineBuffer(&inlineBuffer, i + 1);
+      }
+      if (!CFStringIsSurrogateLowCharacter(low)) {
+        convertible = NO;
+        break;
+      }
+      ++i;
+      UTF32Char longChar = CFStringGetLongCharacterForSurrogatePair(c, low);
+      utf8[utf8Len++] = (unsigned char)(0xF0 | (longChar >> 18));
+      utf8[utf8Len++] = (unsigned char)(0x80 | ((longChar >> 12) & 0x3F));
+      utf8[utf8Len++] = (unsigned char)(0x80 | ((longChar >> 6) & 0x3F));
+      utf8[utf8Len++] = (unsigned char)(0x80 | (longChar & 0x3F));
+    } else if (CFStringIsSurrogateLowCharacter(c)) {
+      convertible = NO;
+      break;
+    } else {
+      utf8[utf8Len++] = (unsigned char)(0xE0 | (c >> 12));
+      utf8[utf8Len++] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+      utf8[utf8Len++] = (unsigned char)(0x80 | (c & 0x3F));
+    }
+    for (int j = 0; j < utf8Len; ++j) {
+      buffer[used++] = '%';
+      buffer[used++] = (unichar)kHexDigits[utf8[j] >> 4];
+      buffer[used++] = (unichar)kHexDigits[utf8[j] & 0x0F];
+    }
+  }
+  if (convertible) {
+    if (used > 0) {
+      CFStringAppendCharacters((CFMutableStringRef)result, buffer, used);
+    }
+  } else {
+    // A lone surrogate can't be converted to UTF-8.  CFURL gave up on those
+    // and the string was used as is, so do the same.
+    [result deleteCharactersInRange:NSMakeRange(startLength,
+                                                [result length] - startLength)];
+    [result appendString:str];
+  }
+}
 
-  // NSURL's stringByAddingPercentEscapesUsingEncoding: does not escape
-  // some characters that should be escaped in URL parameters, like / and ?;
-  // we'll use CFURL to force the encoding of those
-  //
-  // Reference: http://www.ietf.org/rfc/rfc3986.txt
-  static CFStringRef kCharsToForceEscape = CFSTR("!*'();:@&=+$,/?%#[]");
-  static CFStringRef kCharsToForceEscapeSansReserved = CFSTR("%");
-  CFStringRef forceEscapedChars =
-    allowReserved ? kCharsToForceEscapeSansReserved : kCharsToForceEscape;
-
-  NSString *resultStr = str;
-  CFStringRef escapedStr =
-    CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault,
-                                            (CFStringRef)str,
-                                            allowedChars,
-                                            forceEscapedChars,
-                                            kCFStringEncodingUTF8);
-  if (escapedStr) {
-    resultStr = [(NSString *)escapedStr autorelease];
+// The expansions of the different value types.  Empty arrays and dictionaries
+// are never passed in (they are treated as undefined), so these always append
+// something (even if just the variable name).
+
+static void AppendExpandedString(NSMutableString *result,
+                                 NSString *valueStr,
+                                 NSString *variableName,
+                                 const ExpansionInfo *expansionInfo) {
+  switch (expansionInfo->expressionOperator) {
+    case ';':
+    case '?':
+      [result appendString:variableName];
+      if ([valueStr length] == 0) {
+        return;
+      }
+      [result appendString:@"="];
+      break;
+    default:
+      break;
+  }
+  AppendEscapedString(result, valueStr, expansionInfo->allowReservedInEscape);
+}
+
+static void AppendExpandedArray(NSMutableString *result,
+                                NSArray *valueArray,
+                                NSString *variableName,
+                                const ExpansionInfo *expansionInfo) {
+  // When joining variable with value, use "var.val" except for 'path' and
+  // 'form' style expression, use 'var=val' then.
+  NSString *variableValueJoiner = @".";
+  unichar expressionOperator = expansionInfo->expressionOperator;
+  if ((expressionOperator == ';') || (expressionOperator == '?')) {
+    variableValueJoiner = @"=";
+  }
+  // Use the default joiner unless there was no explode request, then a list
+  // always gets comma seperated.
+  NSString *joiner = expansionInfo->joiner;
+  if (expansionInfo->explode == 0) {
+    joiner = @",";
+  }
+  // 'form' style without an explode gets the variable name set to the
+  // joined list of values.
+  if ((expressionOperator == '?') && (expansionInfo->explode == 0)) {
+    [result appendString:variableName];
+    [result appendString:@"="];
+  }
+  // Loop over the values.
+  BOOL first = YES;
+  for (NSString *value in valueArray) {
+    if (!first) {
+      [result appendString:joiner];
+    }
+    first = NO;
+    // Should variable names be used?
+    if (expansionInfo->explode == '+') {
+      [result appendString:variableName];
+      [result appendString:variableValueJoiner];
+    }
+    AppendEscapedString(result, value, expansionInfo->allowReservedInEscape);
+  }
+}
+
+static void AppendExpandedDictionary(NSMutableString *result,
+                                     NSDictionary *valueDict,
+                                     NSString *variableName,
+                                     const ExpansionInfo *expansionInfo) {
+  // When joining variable with value:
+  // - Default to the joiner...
+  // - No explode, always comma...
+  // - For 'path' and 'form' style expression, use 'var=val'.
+  NSString *keyValueJoiner = expansionInfo->joiner;
+  unichar expressionOperator = expansionInfo->expressionOperator;
+  if (expansionInfo->explode == 0) {
+    keyValueJoiner = @",";
+  } else if ((expressionOperator == ';') || (expressionOperator == '?')) {
+    keyValueJoiner = @"=";
+  }
+  // Use the default joiner unless there was no explode request, then a list
+  // always gets comma seperated.
+  NSString *joiner = expansionInfo->joiner;
+  if (expansionInfo->explode == 0) {
+    joiner = @",";
+  }
+  // 'form' style without an explode gets the variable name set to the
+  // joined list of values.
+  if ((expressionOperator == '?') && (expansionInfo->explode == 0)) {
+    [result appendString:variableName];
+    [result appendString:@"="];
+  }
+  // Loop over the sorted keys.
+  NSArray *sortedKeys =
+    [[valueDict allKeys] sortedArrayUsingSelector:@selector(compare:)];
+  BOOL first = YES;
+  for (NSString *key in sortedKeys) {
+    NSString *value = [valueDict objectForKey:key];
+    if (!first) {
+      [result appendString:joiner];
+    }
+    first = NO;
+    // Should variable names be used?
+    if (expansionInfo->explode == '+') {
+      [result appendString:variableName];
+      [result appendString:@"."];
+    }
+    AppendEscapedString(result, key, expansionInfo->allowReservedInEscape);
+    if ((expressionOperator == '?' || expressionOperator == ';')
+        && ([value length] == 0)) {
+      continue;
+    }
+    [result appendString:keyValueJoiner];
+    AppendEscapedString(result, value, expansionInfo->allowReservedInEscape);
+  }
+}
+
+// Expands |expression| (a kExpressionOp, followed by its kVariableOps) onto
+// the end of |result|.
+static void AppendExpandedExpression(NSMutableString *result,
+                                     const GTMURITemplateOp *expression,
+                                     id valueProvider) {
+  NSString *prefix = nil;
+  ExpansionInfo expansionInfo;
+  unichar expressionOperator = expression->expressionOperator_;
+  expansionInfo.expressionOperator = expressionOperator;
+  expansionInfo.joiner = nil;
+  expansionInfo.allowReservedInEscape = NO;
+  switch (expressionOperator) {
+    case 0:
+      expansionInfo.joiner = @",";
+      prefix = @"";
+      break;
+    case '+':
+      expansionInfo.joiner = @",";
+      prefix = @"";
+      // The reserved character are safe from escaping.
+      expansionInfo.allowReservedInEscape = YES;
+      break;
+    case '.':
+      expansionInfo.joiner = @".";
+      prefix = @".";
+      break;
+    case '/':
+      expansionInfo.joiner = @"/";
+      prefix = @"/";
+      break;
+    case ';':
+      expansionInfo.joiner = @";";
+      prefix = @";";
+      break;
+    case '?':
+      expansionInfo.joiner = @"&";
+      prefix = @"?";
+      break;
+    default:
+      [NSException raise:@"GTMURITemplateUnsupported"
+                  format:@"Unknown expression operator '%C'", expressionOperator];
+      break;
+  }
+
+  // The prefix is only kept if the variables expand to something.
+  NSUInteger prefixStart = [result length];
+  [result appendString:prefix];
+  NSUInteger valuesStart = [result length];
+
+  BOOL gotAResult = NO;
+  const GTMURITemplateOp *variables = expression + 1;
+  for (NSUInteger i = 0; i < expression->numVariables_; ++i) {
+    const GTMURITemplateOp *varOp = &variables[i];
+    NSString *variable = (NSString *)varOp->string_;
+
+    expansionInfo.explode = varOp->explode_;
+    // Look up the variable value.
+    id rawValue = [valueProvider objectForKey:variable];
+
+    // If the value is an empty array or dictionary, the default is still used.
+    if (([rawValue isKindOfClass:[NSArray class]]
+         || [rawValue isKindOfClass:[NSDictionary class]])
+        && [rawValue count] == 0) {
+      rawValue = nil;
+    }
+
+    // Got nothing?  Check defaults.
+    if (rawValue == nil) {
+      rawValue = (id)varOp->defaultValue_;
+    }
+
+    // If we didn't get any value, on to the next thing.
+    if (!rawValue) {
+      continue;
+    }
+
+    // Every value that gets here generates a result, so it is safe to add the
+    // joiner now.
+    if (gotAResult) {
+      [result appendString:expansionInfo.joiner];
+    }
+    gotAResult = YES;
+
+    // Time do to the work...
+    if ([rawValue isKindOfClass:[NSString class]]) {
+      AppendExpandedString(result, rawValue, variable, &expansionInfo);
+    } else if ([rawValue isKindOfClass:[NSNumber class]]) {
+      // Turn the number into a string and send it on its way.
+      AppendExpandedString(result, [rawValue stringValue], variable,
+                           &expansionInfo);
+    } else if ([rawValue isKindOfClass:[NSArray class]]) {
+      AppendExpandedArray(result, rawValue, variable, &expansionInfo);
+    } else if ([rawValue isKindOfClass:[NSDictionary class]]) {
+      AppendExpandedDictionary(result, rawValue, variable, &expansionInfo);
+    } else {
+      [NSException raise:@"GTMURITemplateUnsupported"
+                  format:@"Variable returned unsupported type (%@)",
+                         NSStringFromClass([rawValue class])];
+    }
+
+    // Apply partial.
+    // Defaults should get partial applied?
+    // ( http://tools.ietf.org/html/draft-gregorio-uritemplate-04#section-2.5 )
+    if (varOp->partial_) {
+      [NSException raise:@"GTMURITemplateUnsupported"
+                  format:@"Unsupported partial on expansion %@",
+                         (NSString *)varOp->partial_];
+    }
+  }
+
+  // Drop the prefix if nothing followed it.
+  if ([result length] == valuesStart) {
+    [result deleteCharactersInRange:NSMakeRange(prefixStart,
+                                                valuesStart - prefixStart)];
   }
-  return resultStr;
 }
 
 @interface GTMURITemplate ()
-+ (BOOL)parseExpression:(NSString *)expression
-     expressionOperator:(unichar*)outExpressionOperator
-              variables:(NSMutableArray **)outVariables
-          defaultValues:(NSMutableDictionary **)outDefaultValues;
-
-+ (NSString *)expandVariables:(NSArray *)variables
-           expressionOperator:(unichar)expressionOperator
-                       values:(id)valueProvider
-                defaultValues:(NSMutableDictionary *)defaultValues;
-
-+ (NSString *)expandString:(NSString *)valueStr
-              variableName:(NSString *)variableName
-             expansionInfo:(struct ExpansionInfo *)expansionInfo;
-+ (NSString *)expandArray:(NSArray *)valueArray
-             variableName:(NSString *)variableName
-            expansionInfo:(struct ExpansionInfo *)expansionInfo;
-+ (NSString *)expandDictionary:(NSDictionary *)valueDict
-                  variableName:(NSString *)variableName
-                 expansionInfo:(struct ExpansionInfo *)expansionInfo;
+- (GTMURITemplateOp *)addOpOfKind:(GTMURITemplateOpKind)kind;
+- (BOOL)addLiteral:(NSString *)literal;
+- (BOOL)addExpression:(NSString *)expression
+        defaultValues:(NSMutableDictionary **)outDefaultValues
+          outOfMemory:(BOOL *)outOfMemory;
 @end
 
 @implementation GTMURITemplate
 
 #pragma mark Internal Helpers
 
-+ (BOOL)parseExpression:(NSString *)expression
-     expressionOperator:(unichar*)outExpressionOperator
-              variables:(NSMutableArray **)outVariables
-          defaultValues:(NSMutableDictionary **)outDefaultValues {
+// Returns NULL if there isn't memory for another op.
+- (GTMURITemplateOp *)addOpOfKind:(GTMURITemplateOpKind)kind {
+  if (numOps_ == opsCapacity_) {
+    NSUInteger capacity = (opsCapacity_ == 0) ? 8 : opsCapacity_ * 2;
+    GTMURITemplateOp *ops = realloc(ops_, capacity * sizeof(GTMURITemplateOp));
+    if (!ops) return NULL;  // COV_NF_LINE
+    ops_ = ops;
+    opsCapacity_ = capacity;
+  }
+  GTMURITemplateOp *op = &ops_[numOps_++];
+  memset(op, 0, sizeof(GTMURITemplateOp));
+  op->kind_ = kind;
+  return op;
+}
+
+// Returns NO if there isn't memory for it.
+- (BOOL)addLiteral:(NSString *)literal {
+  if ([literal length] == 0) return YES;
+  // Runs of literal text (including expressions that fail to parse) are kept
+  // in one op.
+  if ((numOps_ > 0) && (ops_[numOps_ - 1].kind_ == kLiteralOp)) {
+    GTMURITemplateOp *op = &ops_[numOps_ - 1];
+    CFMutableStringRef joined =
+      CFStringCreateMutableCopy(kCFAllocatorDefault, 0, op->string_);
+    CFStringAppend(joined, (CFStringRef)literal);
+    CFRelease(op->string_);
+    op->string_ = joined;
+    return YES;
+  }
+  GTMURITemplateOp *op = [self addOpOfKind:kLiteralOp];
+  if (!op) return NO;  // COV_NF_LINE
+  op->string_ = CFStringCreateCopy(kCFAllocatorDefault, (CFStringRef)literal);
+  return YES;
+}
+
+// Returns NO if |expression| isn't valid, or if there isn't memory for it, in
+// which case |*outOfMemory| is set.
+- (BOOL)addExpression:(NSString *)expression
+        defaultValues:(NSMutableDictionary **)outDefaultValues
+          outOfMemory:(BOOL *)outOfMemory {
 
   // Please see the spec for full details, but here are the basics:
   //
@@ -125,7 +478,7 @@ static NSString *EscapeString(NSString *str, BOOL allowReserved) {
   // Partial (prefix/subset) characters
   static NSCharacterSet *partialSet = nil;
 
-  @synchronized(self) {
+  @synchronized([GTMURITemplate class]) {
     if (operatorSet == nil) {
       operatorSet = [[NSCharacterSet characterSetWithCharactersInString:@"+./;?|!@"] retain];
     }
@@ -142,32 +495,36 @@ static NSString *EscapeString(NSString *str, BOOL allowReserved) {
   if ([expression length] == 0) return NO;
 
   // Pull off any operator.
-  *outExpressionOperator = 0;
+  unichar expressionOperator = 0;
   unichar firstChar = [expression characterAtIndex:0];
   if ([operatorSet characterIsMember:firstChar]) {
-    *outExpressionOperator = firstChar;
+    expressionOperator = firstChar;
     expression = [expression substringFromIndex:1];
   }
 
   if ([expression length] == 0) return NO;
 
-  // Need to find at least one varspec for the expresssion to be considered
-  // valid.
-  BOOL gotAVarspec = NO;
+  // The variable ops follow the expression op.  Since adding ops can move
+  // them, hold onto the index and not the op.
+  NSUInteger expressionIndex = numOps_;
+  if (![self addOpOfKind:kExpressionOp]) {
+    // COV_NF_START
+    *outOfMemory = YES;
+    return NO;
+    // COV_NF_END
+  }
 
   // Split the variable list.
   NSArray *varspecs = [expression componentsSeparatedByString:@","];
 
   // Extract the defaults, explodes and modifiers from the varspecs.
-  *outVariables = [NSMutableArray arrayWithCapacity:[varspecs count]];
   for (NSString *varspec in varspecs) {
     NSString *defaultValue = nil;
+    unichar explode = 0;
+    NSString *partialMode = nil;
 
     if ([varspec length] == 0) continue;
 
-    NSMutableDictionary *varInfo =
-      [NSMutableDictionary dictionaryWithCapacity:4];
-
     // Check for a default (foo=bar).
     NSRange range = [varspec rangeOfString:@"="];
     if (range.location != NSNotFound) {
@@ -180,35 +537,44 @@ static NSString *EscapeString(NSString *str, BOOL allowReserved) {
 
     // Check for explode (foo*).
     NSUInteger lenLessOne = [varspec length] - 1;
-    if ([explodeSet characterIsMember:[varspec characterAtIndex:lenLessOne]]) {
-      [varInfo setObject:[varspec substringFromIndex:lenLessOne] forKey:kExplode];
+    unichar lastChar = [varspec characterAtIndex:lenLessOne];
+    if ([explodeSet characterIsMember:lastChar]) {
+      explode = lastChar;
       varspec = [varspec substringToIndex:lenLessOne];
       if ([varspec length] == 0) continue;
     } else {
       // Check for partial (prefix/suffix) (foo:12).
       range = [varspec rangeOfCharacterFromSet:partialSet];
       if (range.location != NSNotFound) {
-        NSString *partialMode = [varspec substringWithRange:range];
         NSString *valueStr = [varspec substringFromIndex:range.location + 1];
         // If there wasn't a value for the partial, ignore it.
+        // TODO: Should validate valueStr is just a number...
         if ([valueStr length] > 0) {
-          [varInfo setObject:partialMode forKey:kPartial];
-          // TODO: Should validate valueStr is just a number...
-          [varInfo setObject:[NSNumber numberWithInteger:[valueStr integerValue]]
-                      forKey:kPartialValue];
+          partialMode = [varspec substringWithRange:range];
         }
         varspec = [varspec substringToIndex:range.location];
         if ([varspec length] == 0) continue;
       }
     }
 
-    // Spec allows percent escaping in names, so undo that.
+    // Spec allows percent escaping in names, so undo that.  If the escapes
+    // aren't valid UTF-8 there is no name to look up.
     varspec = UnescapeString(varspec);
+    if (!varspec) continue;
 
     // Save off the cleaned up variable name.
-    [varInfo setObject:varspec forKey:kVariable];
-    [*outVariables addObject:varInfo];
-    gotAVarspec = YES;
+    GTMURITemplateOp *varOp = [self addOpOfKind:kVariableOp];
+    if (!varOp) {
+      // COV_NF_START
+      *outOfMemory = YES;
+      return NO;
+      // COV_NF_END
+    }
+    varOp->string_ = CFRetain((CFStringRef)varspec);
+    varOp->explode_ = explode;
+    if (partialMode) {
+      varOp->partial_ = CFRetain((CFStringRef)partialMode);
+    }
 
     // Now that the variable has been cleaned up, store its default.
     if (defaultValue) {
@@ -218,304 +584,148 @@ static NSString *EscapeString(NSString *str, BOOL allowReserved) {
       [*outDefaultValues setObject:defaultValue forKey:varspec];
     }
   }
-  // All done.
-  return gotAVarspec;
-}
 
-+ (NSString *)expandVariables:(NSArray *)variables
-           expressionOperator:(unichar)expressionOperator
-                       values:(id)valueProvider
-                defaultValues:(NSMutableDictionary *)defaultValues {
-  NSString *prefix = nil;
-  struct ExpansionInfo expansionInfo;
-  expansionInfo.expressionOperator = expressionOperator;
-  expansionInfo.joiner = nil;
-  expansionInfo.allowReservedInEscape = NO;
-  switch (expressionOperator) {
-    case 0:
-      expansionInfo.joiner = @",";
-      prefix = @"";
-      break;
-    case '+':
-      expansionInfo.joiner = @",";
-      prefix = @"";
-      // The reserved character are safe from escaping.
-      expansionInfo.allowReservedInEscape = YES;
-      break;
-    case '.':
-      expansionInfo.joiner = @".";
-      prefix = @".";
-      break;
-    case '/':
-      expansionInfo.joiner = @"/";
-      prefix = @"/";
-      break;
-    case ';':
-      expansionInfo.joiner = @";";
-      prefix = @";";
-      break;
-    case '?':
-      expansionInfo.joiner = @"&";
-      prefix = @"?";
-      break;
-    default:
-      [NSException raise:@"GTMURITemplateUnsupported"
-                  format:@"Unknown expression operator '%C'", expressionOperator];
-      break;
+  // Need to find at least one varspec for the expresssion to be considered
+  // valid.
+  NSUInteger numVariables = numOps_ - expressionIndex - 1;
+  if (numVariables == 0) {
+    numOps_ = expressionIndex;
+    return NO;
   }
 
-  NSMutableArray *results = [NSMutableArray arrayWithCapacity:[variables count]];
-
-  for (NSDictionary *varInfo in variables) {
-    NSString *variable = [varInfo objectForKey:kVariable];
-
-    expansionInfo.explode = [varInfo objectForKey:kExplode];
-    // Look up the variable value.
-    id rawValue = [valueProvider objectForKey:variable];
+  GTMURITemplateOp *expressionOp = &ops_[expressionIndex];
+  expressionOp->expressionOperator_ = expressionOperator;
+  expressionOp->numVariables_ = numVariables;
 
-    // If the value is an empty array or dictionary, the default is still used.
-    if (([rawValue isKindOfClass:[NSArray class]]
-         || [rawValue isKindOfClass:[NSDictionary class]])
-        && [rawValue count] == 0) {
-      rawValue = nil;
-    }
-
-    // Got nothing?  Check defaults.
-    if (rawValue == nil) {
-      rawValue = [defaultValues objectForKey:variable];
-    }
-
-    // If we didn't get any value, on to the next thing.
-    if (!rawValue) {
-      continue;
-    }
-
-    // Time do to the work...
-    NSString *result = nil;
-    if ([rawValue isKindOfClass:[NSString class]]) {
-      result = [self expandString:rawValue
-                     variableName:variable
-                    expansionInfo:&expansionInfo];
-    } else if ([rawValue isKindOfClass:[NSNumber class]]) {
-      // Turn the number into a string and send it on its way.
-      result = [self expandString:[rawValue stringValue]
-                     variableName:variable
-                    expansionInfo:&expansionInfo];
-    } else if ([rawValue isKindOfClass:[NSArray class]]) {
-      result = [self expandArray:rawValue
-                    variableName:variable
-                   expansionInfo:&expansionInfo];
-    } else if ([rawValue isKindOfClass:[NSDictionary class]]) {
-      result = [self expandDictionary:rawValue
-                         variableName:variable
-                        expansionInfo:&expansionInfo];
-    } else {
-      [NSException raise:@"GTMURITemplateUnsupported"
-                  format:@"Variable returned unsupported type (%@)",
-                         NSStringFromClass([rawValue class])];
+  // Defaults live through the full evaluation, so the ones in effect for this
+  // expression are any seen so far (including the ones in this expression).
+  for (NSUInteger i = 1; i <= numVariables; ++i) {
+    GTMURITemplateOp *varOp = &expressionOp[i];
+    NSString *defaultValue =
+      [*outDefaultValues objectForKey:(NSString *)varOp->string_];
+    if (defaultValue) {
+      varOp->defaultValue_ = CFRetain((CFStringRef)defaultValue);
     }
+  }
 
-    // Did it generate anything?
-    if (!result)
-      continue;
+  // All done.
+  return YES;
+}
 
-    // Apply partial.
-    // Defaults should get partial applied?
-    // ( http://tools.ietf.org/html/draft-gregorio-uritemplate-04#section-2.5 )
-    NSString *partial = [varInfo objectForKey:kPartial];
-    if ([partial length] > 0) {
-      [NSException raise:@"GTMURITemplateUnsupported"
-                  format:@"Unsupported partial on expansion %@", partial];
-    }
+#pragma mark Public API
 
-    // Add the result
-    [results addObject:result];
-  }
++ (NSString *)expandTemplate:(NSString *)uriTemplate values:(id)valueProvider {
+  GTMURITemplate *compiled = [self templateWithString:uriTemplate];
+  return [compiled expandWithValues:valueProvider];
+}
 
-  // Join and add any needed prefix.
-  NSString *joinedResults =
-    [results componentsJoinedByString:expansionInfo.joiner];
-  if (([prefix length] > 0) && ([joinedResults length] > 0)) {
-    return [prefix stringByAppendingString:joinedResults];
-  }
-  return joinedResults;
++ (id)templateWithString:(NSString *)uriTemplate {
+  return [[[self alloc] initWithString:uriTemplate] autorelease];
 }
 
-+ (NSString *)expandString:(NSString *)valueStr
-              variableName:(NSString *)variableName
-             expansionInfo:(struct ExpansionInfo *)expansionInfo {
-  NSString *escapedValue =
-    EscapeString(valueStr, expansionInfo->allowReservedInEscape);
-  switch (expansionInfo->expressionOperator) {
-    case ';':
-    case '?':
-      if ([valueStr length] > 0) {
-        return [NSString stringWithFormat:@"%@=%@", variableName, escapedValue];
-      }
-      return variableName;
-    default:
-      return escapedValue;
-  }
+- (id)init {
+  return [self initWithString:nil];
 }
 
-+ (NSString *)expandArray:(NSArray *)valueArray
-             variableName:(NSString *)variableName
-            expansionInfo:(struct ExpansionInfo *)expansionInfo {
-  NSMutableArray *results = [NSMutableArray arrayWithCapacity:[valueArray count]];
-  // When joining variable with value, use "var.val" except for 'path' and
-  // 'form' style expression, use 'var=val' then.
-  char variableValueJoiner = '.';
-  char expressionOperator = expansionInfo->expressionOperator;
-  if ((expressionOperator == ';') || (expressionOperator == '?')) {
-    variableValueJoiner = '=';
-  }
-  // Loop over the values.
-  for (NSString *value in valueArray) {
-    // Escape it.
-    value = EscapeString(value, expansionInfo->allowReservedInEscape);
-    // Should variable names be used?
-    if ([expansionInfo->explode isEqual:@"+"]) {
-      value = [NSString stringWithFormat:@"%@%c%@",
-               variableName, variableValueJoiner, value];
+- (id)initWithString:(NSString *)uriTemplate {
+  if ((self = [super init])) {
+    if (!uriTemplate) {
+      [self release];
+      return nil;
     }
-    [results addObject:value];
-  }
-  if ([results count] > 0) {
-    // Use the default joiner unless there was no explode request, then a list
-    // always gets comma seperated.
-    NSString *joiner = expansionInfo->joiner;
-    if (expansionInfo->explode == nil) {
-      joiner = @",";
+    templateString_ = [uriTemplate copy];
+
+    NSScanner *scanner = [NSScanner scannerWithString:templateString_];
+    [scanner setCharactersToBeSkipped:nil];
+
+    // Defaults have to live through the full evaluation, so if any are encoured
+    // they are reused throughout the expansion calls.
+    NSMutableDictionary *defaultValues = nil;
+
+    // Pull out the expressions for processing.
+    BOOL outOfMemory = NO;
+    while (![scanner isAtEnd] && !outOfMemory) {
+      NSString *skipped = nil;
+      // Find the next '{'.
+      if ([scanner scanUpToString:@"{" intoString:&skipped]) {
+        // Add anything before it to the result.
+        outOfMemory = ![self addLiteral:skipped];
+      }
+      // Advance over the '{'.
+      [scanner scanString:@"{" intoString:nil];
+      // Collect the expression.
+      NSString *expression = nil;
+      if ([scanner scanUpToString:@"}" intoString:&expression]) {
+        // Collect the trailing '}' on the expression.
+        BOOL hasTrailingBrace = [scanner scanString:@"}" intoString:nil];
+
+        // Parse the expression.
+        if (![self addExpression:expression
+                   defaultValues:&defaultValues
+                     outOfMemory:&outOfMemory] && !outOfMemory) {
+          // Failed to parse, add the raw expression to the output.
+          NSString *raw;
+          if (hasTrailingBrace) {
+            raw = [NSString stringWithFormat:@"{%@}", expression];
+          } else {
+            raw = [NSString stringWithFormat:@"{%@", expression];
+          }
+          outOfMemory = ![self addLiteral:raw];
+        }
+      } else if (![scanner isAtEnd]) {
+        // Empty expression ('{}').  Copy over the opening brace and the
+        // trailing one will be copied by the next cycle of the loop.
+        outOfMemory = ![self addLiteral:@"{"];
+      }
     }
-    // Join the values.
-    NSString *joined = [results componentsJoinedByString:joiner];
-    // 'form' style without an explode gets the variable name set to the
-    // joined list of values.
-    if ((expressionOperator == '?') && (expansionInfo->explode == nil)) {
-      return [NSString stringWithFormat:@"%@=%@", variableName, joined];
+    if (outOfMemory) {
+      // COV_NF_START
+      [self release];
+      return nil;
+      // COV_NF_END
     }
-    return joined;
   }
-  return nil;
+  return self;
 }
 
-+ (NSString *)expandDictionary:(NSDictionary *)valueDict
-                  variableName:(NSString *)variableName
-                 expansionInfo:(struct ExpansionInfo *)expansionInfo {
-  NSMutableArray *results = [NSMutableArray arrayWithCapacity:[valueDict count]];
-  // When joining variable with value:
-  // - Default to the joiner...
-  // - No explode, always comma...
-  // - For 'path' and 'form' style expression, use 'var=val'.
-  NSString *keyValueJoiner = expansionInfo->joiner;
-  char expressionOperator = expansionInfo->expressionOperator;
-  if (!expansionInfo->explode) {
-    keyValueJoiner = @",";
-  } else if ((expressionOperator == ';') || (expressionOperator == '?')) {
-    keyValueJoiner = @"=";
+- (void)dealloc {
+  for (NSUInteger i = 0; i < numOps_; ++i) {
+    GTMURITemplateOp *op = &ops_[i];
+    if (op->string_) CFRelease(op->string_);
+    if (op->partial_) CFRelease(op->partial_);
+    if (op->defaultValue_) CFRelease(op->defaultValue_);
   }
-  // Loop over the sorted keys.
-  NSArray *sortedKeys =
-    [[valueDict allKeys] sortedArrayUsingSelector:@selector(compare:)];
-  for (NSString *key in sortedKeys) {
-    NSString *value = [valueDict objectForKey:key];
-    // Escape them.
-    key = EscapeString(key, expansionInfo->allowReservedInEscape);
-    value = EscapeString(value, expansionInfo->allowReservedInEscape);
-    // Should variable names be used?
-    if ([expansionInfo->explode isEqual:@"+"]) {
-      key = [NSString stringWithFormat:@"%@.%@", variableName, key];
-    }
-    if ((expressionOperator == '?' || expressionOperator == ';')
-        && ([value length] == 0)) {
-      [results addObject:key];
-    } else {
-      NSString *pair = [NSString stringWithFormat:@"%@%@%@",
-                        key, keyValueJoiner, value];
-      [results addObject:pair];
-    }
-  }
-  if ([results count]) {
-    // Use the default joiner unless there was no explode request, then a list
-    // always gets comma seperated.
-    NSString *joiner = expansionInfo->joiner;
-    if (!expansionInfo->explode) {
-      joiner = @",";
-    }
-    // Join the values.
-    NSString *joined = [results componentsJoinedByString:joiner];
-    // 'form' style without an explode gets the variable name set to the
-    // joined list of values.
-    if ((expressionOperator == '?') && (expansionInfo->explode == nil)) {
-      return [NSString stringWithFormat:@"%@=%@", variableName, joined];
-    }
-    return joined;
-  }
-  return nil;
+  free(ops_);
+  [templateString_ release];
+  [super dealloc];
 }
 
-#pragma mark Public API
+- (NSString *)templateString {
+  return templateString_;
+}
 
-+ (NSString *)expandTemplate:(NSString *)uriTemplate values:(id)valueProvider {
+- (NSString *)expandWithValues:(id)valueProvider {
   NSMutableString *result =
-    [NSMutableString stringWithCapacity:[uriTemplate length]];
-
-  NSScanner *scanner = [NSScanner scannerWithString:uriTemplate];
-  [scanner setCharactersToBeSkipped:nil];
-
-  // Defaults have to live through the full evaluation, so if any are encoured
-  // they are reused throughout the expansion calls.
-  NSMutableDictionary *defaultValues = nil;
-
-  // Pull out the expressions for processing.
-  while (![scanner isAtEnd]) {
-    NSString *skipped = nil;
-    // Find the next '{'.
-    if ([scanner scanUpToString:@"{" intoString:&skipped]) {
-      // Add anything before it to the result.
-      [result appendString:skipped];
-    }
-    // Advance over the '{'.
-    [scanner scanString:@"{" intoString:nil];
-    // Collect the expression.
-    NSString *expression = nil;
-    if ([scanner scanUpToString:@"}" intoString:&expression]) {
-      // Collect the trailing '}' on the expression.
-      BOOL hasTrailingBrace = [scanner scanString:@"}" intoString:nil];
-
-      // Parse the expression.
-      NSMutableArray *variables = nil;
-      unichar expressionOperator = 0;
-      if ([self parseExpression:expression
-             expressionOperator:&expressionOperator
-                      variables:&variables
-                  defaultValues:&defaultValues]) {
-        // Do the expansion.
-        NSString *substitution = [self expandVariables:variables
-                                  expressionOperator:expressionOperator
-                                              values:valueProvider
-                                       defaultValues:defaultValues];
-        if (substitution) {
-          [result appendString:substitution];
-        }
-      } else {
-        // Failed to parse, add the raw expression to the output.
-        if (hasTrailingBrace) {
-          [result appendFormat:@"{%@}", expression];
-        } else {
-          [result appendFormat:@"{%@", expression];
-        }
-      }
-    } else if (![scanner isAtEnd]) {
-      // Empty expression ('{}').  Copy over the opening brace and the trailing
-      // one will be copied by the next cycle of the loop.
-      [result appendString:@"{"];
+    [NSMutableString stringWithCapacity:[templateString_ length]];
+  NSUInteger i = 0;
+  while (i < numOps_) {
+    const GTMURITemplateOp *op = &ops_[i];
+    if (op->kind_ == kLiteralOp) {
+      [result appendString:(NSString *)op->string_];
+      ++i;
+    } else {
+      AppendExpandedExpression(result, op, valueProvider);
+      i += 1 + op->numVariables_;
     }
   }
-
   return result;
 }
 
+- (NSString *)description {
+  return [NSString stringWithFormat:@"%@<%p> { template=\"%@\" }",
+          [self class], self, templateString_];
+}
+
 @end
 
 #endif  // MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_5
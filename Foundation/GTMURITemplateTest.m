@@ -19,6 +19,7 @@
 
 #import "GTMSenTestCase.h"
 #import "GTMScriptRunner.h"
+#import "GTMTestTimer.h"
 
 @interface GTMURITemplateTest : GTMTestCase
 - (NSDictionary *)loadTestSuitesNamed:(NSString *)testSuitesName;
@@ -103,6 +104,17 @@
       STAssertEqualObjects(result, expectedResult,
                            @"template was '%@' (index %lu of '%@')",
                            testTemplate, (unsigned long)idx, suiteName);
+
+      // A compiled template should give the same thing, every time.
+      GTMURITemplate *compiled =
+        [GTMURITemplate templateWithString:testTemplate];
+      STAssertNotNil(compiled, nil);
+      for (int i = 0; i < 2; ++i) {
+        result = [compiled expandWithValues:vars];
+        STAssertEqualObjects(result, expectedResult,
+                             @"compiled template was '%@' (index %lu of '%@')",
+                             testTemplate, (unsigned long)idx, suiteName);
+      }
       ++idx;
     }
   }
@@ -128,6 +140,112 @@
   [self runTestSuites:testSuites];
 }
 
+- (void)testCompiledTemplate {
+  STAssertNil([GTMURITemplate templateWithString:nil], nil);
+
+  NSString *templateStr = @"http://example.com/{user}/items{?q,lang=en}";
+  GTMURITemplate *compiled = [GTMURITemplate templateWithString:templateStr];
+  STAssertNotNil(compiled, nil);
+  STAssertEqualObjects([compiled templateString], templateStr, nil);
+
+  NSDictionary *values =
+    [NSDictionary dictionaryWithObjectsAndKeys:
+     @"bob", @"user",
+     [NSString stringWithUTF8String:"caf\xC3\xA9 & cr\xC3\xA8me"], @"q",
+     nil];
+  STAssertEqualObjects([compiled expandWithValues:values],
+                       @"http://example.com/bob/items"
+                       @"?q=caf%C3%A9%20%26%20cr%C3%A8me&lang=en", nil);
+  values = [NSDictionary dictionaryWithObjectsAndKeys:
+            @"al", @"user",
+            @"fr", @"lang",
+            nil];
+  STAssertEqualObjects([compiled expandWithValues:values],
+                       @"http://example.com/al/items?lang=fr", nil);
+  STAssertEqualObjects([compiled expandWithValues:nil],
+                       @"http://example.com//items?lang=en", nil);
+
+  // Characters outside the BMP are escaped as their 4 UTF-8 bytes.
+  compiled = [GTMURITemplate templateWithString:@"{x}|{+x}"];
+  values =
+    [NSDictionary dictionaryWithObject:
+     [NSString stringWithUTF8String:"a/\xF0\x9F\x98\x80~"] forKey:@"x"];
+  STAssertEqualObjects([compiled expandWithValues:values],
+                       @"a%2F%F0%9F%98%80~|a/%F0%9F%98%80~", nil);
+
+  // Broken templates come through as text.
+  compiled = [GTMURITemplate templateWithString:@"a{}b{=x}c{"];
+  STAssertEqualObjects([compiled expandWithValues:values], @"a{}b{=x}c", nil);
+
+  // Unsupported features still throw when expanded.
+  compiled = [GTMURITemplate templateWithString:@"{x:3}"];
+  STAssertThrows([compiled expandWithValues:values], nil);
+  STAssertEqualObjects([compiled expandWithValues:nil], @"", nil);
+  compiled = [GTMURITemplate templateWithString:@"{|x}"];
+  STAssertThrows([compiled expandWithValues:values], nil);
+}
+
+- (void)testCompiledTemplateThroughput {
+  NSArray *templates =
+    [NSArray arrayWithObjects:
+     @"https://api.example.com/v1/users/{userId}/albums{?max-results,start}",
+     @"https://api.example.com/v1/search{?q,lang,fields*}",
+     @"https://api.example.com/v1/files/{+path}{;rev}",
+     nil];
+  NSDictionary *fields =
+    [NSDictionary dictionaryWithObjectsAndKeys:
+     @"title,id", @"fields",
+     @"2", @"depth",
+     nil];
+  NSDictionary *values =
+    [NSDictionary dictionaryWithObjectsAndKeys:
+     @"someone@example.com", @"userId",
+     [NSNumber numberWithInt:25], @"max-results",
+     [NSNumber numberWithInt:100], @"start",
+     [NSString stringWithUTF8String:"weekend in Z\xC3\xBCrich"], @"q",
+     @"de", @"lang",
+     fields, @"fields",
+     @"docs/2014/q3 plan.txt", @"path",
+     @"42", @"rev",
+     nil];
+  NSMutableArray *compiledTemplates = [NSMutableArray array];
+  for (NSString *templateStr in templates) {
+    GTMURITemplate *compiled = [GTMURITemplate templateWithString:templateStr];
+    STAssertEqualObjects([compiled expandWithValues:values],
+                         [GTMURITemplate expandTemplate:templateStr
+                                                 values:values], nil);
+    [compiledTemplates addObject:compiled];
+  }
+
+  const int kIterations = 20000;
+  double nanoseconds[2];
+  for (int mode = 0; mode < 2; ++mode) {
+    GTMTestTimer *timer = GTMTestTimerCreate();
+    GTMTestTimerStart(timer);
+    for (int i = 0; i < kIterations; ++i) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      if (mode == 0) {
+        for (NSString *templateStr in templates) {
+          [GTMURITemplate expandTemplate:templateStr values:values];
+        }
+      } else {
+        for (GTMURITemplate *compiled in compiledTemplates) {
+          [compiled expandWithValues:values];
+        }
+      }
+      [pool release];
+    }
+    GTMTestTimerStop(timer);
+    nanoseconds[mode] = GTMTestTimerGetNanoseconds(timer);
+    GTMTestTimerRelease(timer);
+  }
+  NSUInteger expansions = (NSUInteger)kIterations * [templates count];
+  NSLog(@"URI template expansion: one-shot %.0f ns, compiled %.0f ns "
+        @"(%.1fx)",
+        nanoseconds[0] / expansions, nanoseconds[1] / expansions,
+        nanoseconds[0] / nanoseconds[1]);
+}
+
 @end
 
 #endif  // MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_5
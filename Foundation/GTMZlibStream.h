@@ -0,0 +1,136 @@
+//
+//  GTMZlibStream.h
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import <Foundation/Foundation.h>
+#import "GTMDefines.h"
+
+// Incremental versions of the NSData (GTMZLibAdditions) helpers.  Data is fed
+// in a piece at a time with -processBytes:length:, and the results are handed
+// to a delegate (or block) as they are produced, so memory use is bounded by
+// zlib's window and a small output buffer rather than by the size of the
+// payload, and there is no limit on the total length.
+//
+//   GTMZlibDeflater *gzipper =
+//       [[[GTMZlibDeflater alloc] initWithMode:kGTMZlibModeGzip
+//                             compressionLevel:9
+//                                     delegate:self] autorelease];
+//   while ((chunk = [input readDataOfLength:65536]) && [chunk length]) {
+//     if (![gzipper processData:chunk]) ...
+//   }
+//   if (![gzipper finish]) ...
+//
+// Neither class is thread safe.
+
+struct z_stream_s;
+@class GTMZlibStream;
+
+typedef enum {
+  // A zlib stream (what the NSData helpers call "deflate").  When inflating,
+  // zlib and gzip headers are both accepted.
+  kGTMZlibModeZlib,
+  // A gzip stream.  When inflating, zlib and gzip headers are both accepted.
+  kGTMZlibModeGzip,
+  // No header or trailer at all, see the note on "raw" in GTMNSData+zlib.h.
+  kGTMZlibModeRaw,
+} GTMZlibMode;
+
+@protocol GTMZlibStreamDelegate <NSObject>
+// Called with each piece of output.  |bytes| is only valid during the call.
+- (void)zlibStream:(GTMZlibStream *)stream
+   didProduceBytes:(const void *)bytes
+            length:(NSUInteger)length;
+@end
+
+#if NS_BLOCKS_AVAILABLE
+typedef void (^GTMZlibStreamOutputBlock)(const void *bytes, NSUInteger length);
+#endif  // NS_BLOCKS_AVAILABLE
+
+// The common parts of GTMZlibDeflater and GTMZlibInflater, don't use it
+// directly.
+@interface GTMZlibStream : NSObject {
+ @protected
+  struct z_stream_s *stream_;
+  GTMZlibMode mode_;
+  id<GTMZlibStreamDelegate> delegate_;  // weak
+  id outputBlock_;  // A GTMZlibStreamOutputBlock
+  unsigned char *output_;
+  BOOL finished_;
+  BOOL failed_;
+  unsigned long long totalIn_;
+  unsigned long long totalOut_;
+}
+
+- (GTMZlibMode)mode;
+
+// Feeds in more data.  Returns NO if there was an error (bad data when
+// inflating), after which the stream stays failed.
+- (BOOL)processBytes:(const void *)bytes length:(NSUInteger)length;
+- (BOOL)processData:(NSData *)data;
+
+// Ends the stream.  For a deflater this writes out everything still
+// buffered and the trailer; for an inflater it checks the stream was complete.
+// Returns NO if there was an error.
+- (BOOL)finish;
+
+// YES once -finish succeeded (or an inflater has seen the end of the stream).
+- (BOOL)isFinished;
+
+// YES once there has been an error.
+- (BOOL)hasFailed;
+
+// The bytes passed in and handed out so far.
+- (unsigned long long)totalIn;
+- (unsigned long long)totalOut;
+
+@end  // GTMZlibStream
+
+
+@interface GTMZlibDeflater : GTMZlibStream
+
+// |level| can be 1-9, any other values will be clipped to that range (except
+// Z_DEFAULT_COMPRESSION).  Returns nil if |delegate| is nil.
+- (id)initWithMode:(GTMZlibMode)mode
+  compressionLevel:(int)level
+          delegate:(id<GTMZlibStreamDelegate>)delegate;
+
+#if NS_BLOCKS_AVAILABLE
+- (id)initWithMode:(GTMZlibMode)mode
+  compressionLevel:(int)level
+       outputBlock:(GTMZlibStreamOutputBlock)block;
+#endif  // NS_BLOCKS_AVAILABLE
+
+// Pushes out everything passed in so far, ending on a byte boundary
+// (Z_SYNC_FLUSH), so a reader can decode all of it without waiting for
+// -finish.  Flushing often hurts the compression ratio.
+- (BOOL)flush;
+
+@end  // GTMZlibDeflater
+
+
+@interface GTMZlibInflater : GTMZlibStream
+
+// Returns nil if |delegate| is nil.
+- (id)initWithMode:(GTMZlibMode)mode
+          delegate:(id<GTMZlibStreamDelegate>)delegate;
+
+#if NS_BLOCKS_AVAILABLE
+- (id)initWithMode:(GTMZlibMode)mode
+       outputBlock:(GTMZlibStreamOutputBlock)block;
+#endif  // NS_BLOCKS_AVAILABLE
+
+@end  // GTMZlibInflater
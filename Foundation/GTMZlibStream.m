@@ -0,0 +1,359 @@
+//
+//  GTMZlibStream.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMZlibStream.h"
+#import <zlib.h>
+
+// Size of the output buffer handed to zlib.
+#define kOutputSize (16 * 1024)
+
+// |block| is a GTMZlibStreamOutputBlock, typed as id so these exist whether
+// or not blocks are available.
+@interface GTMZlibStream (PrivateMethods)
+- (id)initWithMode:(GTMZlibMode)mode
+          delegate:(id<GTMZlibStreamDelegate>)delegate
+       outputBlock:(id)block;
+// Passes whatever is in |output_| on, and resets it for zlib.
+- (void)deliverOutput;
+@end
+
+@implementation GTMZlibStream
+
+- (id)initWithMode:(GTMZlibMode)mode
+          delegate:(id<GTMZlibStreamDelegate>)delegate
+       outputBlock:(id)block {
+  if ((self = [super init])) {
+    mode_ = mode;
+    delegate_ = delegate;
+    outputBlock_ = [block copy];
+    stream_ = calloc(1, sizeof(z_stream));
+    output_ = malloc(kOutputSize);
+    if (!(delegate_ || outputBlock_) || !stream_ || !output_) {
+      [self release];
+      return nil;
+    }
+    stream_->next_out = output_;
+    stream_->avail_out = kOutputSize;
+  }
+  return self;
+}
+
+- (void)dealloc {
+  free(stream_);
+  free(output_);
+  [outputBlock_ release];
+  [super dealloc];
+}
+
+- (GTMZlibMode)mode {
+  return mode_;
+}
+
+- (void)deliverOutput {
+  NSUInteger length = kOutputSize - stream_->avail_out;
+  if (length) {
+    totalOut_ += length;
+#if NS_BLOCKS_AVAILABLE
+    if (outputBlock_) {
+      ((GTMZlibStreamOutputBlock)outputBlock_)(output_, length);
+    } else
+#endif  // NS_BLOCKS_AVAILABLE
+    {
+      [delegate_ zlibStream:self didProduceBytes:output_ length:length];
+    }
+  }
+  stream_->next_out = output_;
+  stream_->avail_out = kOutputSize;
+}
+
+- (BOOL)processBytes:(const void *)bytes length:(NSUInteger)length {
+  [self doesNotRecognizeSelector:_cmd];  // COV_NF_LINE - subclasses do this.
+  return NO;  // COV_NF_LINE
+}
+
+- (BOOL)processData:(NSData *)data {
+  return [self processBytes:[data bytes] length:[data length]];
+}
+
+- (BOOL)finish {
+  [self doesNotRecognizeSelector:_cmd];  // COV_NF_LINE - subclasses do this.
+  return NO;  // COV_NF_LINE
+}
+
+- (BOOL)isFinished {
+  return finished_;
+}
+
+- (BOOL)hasFailed {
+  return failed_;
+}
+
+- (unsigned long long)totalIn {
+  return totalIn_;
+}
+
+- (unsigned long long)totalOut {
+  return totalOut_;
+}
+
+@end  // GTMZlibStream
+
+
+@interface GTMZlibDeflater (PrivateMethods)
+- (id)initWithMode:(GTMZlibMode)mode
+  compressionLevel:(int)level
+          delegate:(id<GTMZlibStreamDelegate>)delegate
+       outputBlock:(id)block;
+// Runs deflate() with |flush| until it has nothing more to say.
+- (BOOL)deflateWithFlush:(int)flush;
+@end
+
+@implementation GTMZlibDeflater
+
+- (id)initWithMode:(GTMZlibMode)mode
+  compressionLevel:(int)level
+          delegate:(id<GTMZlibStreamDelegate>)delegate
+       outputBlock:(id)block {
+  if ((self = [super initWithMode:mode delegate:delegate outputBlock:block])) {
+    if (level == Z_DEFAULT_COMPRESSION) {
+      // the default value is actually outside the range, so we have to let it
+      // through specifically.
+    } else if (level < Z_BEST_SPEED) {
+      level = Z_BEST_SPEED;
+    } else if (level > Z_BEST_COMPRESSION) {
+      level = Z_BEST_COMPRESSION;
+    }
+    int windowBits = 15;
+    if (mode == kGTMZlibModeGzip) {
+      windowBits += 16;  // gzip header instead of zlib header
+    } else if (mode == kGTMZlibModeRaw) {
+      windowBits *= -1;  // no header at all
+    }
+    int retCode = deflateInit2(stream_, level, Z_DEFLATED, windowBits, 8,
+                               Z_DEFAULT_STRATEGY);
+    if (retCode != Z_OK) {
+      // COV_NF_START - no real way to force this in a unittest.
+      _GTMDevLog(@"Failed to init for deflate w/ level %d, error %d",
+                 level, retCode);
+      free(stream_);
+      stream_ = NULL;
+      [self release];
+      return nil;
+      // COV_NF_END
+    }
+  }
+  return self;
+}
+
+- (id)initWithMode:(GTMZlibMode)mode
+  compressionLevel:(int)level
+          delegate:(id<GTMZlibStreamDelegate>)delegate {
+  return [self initWithMode:mode
+           compressionLevel:level
+                   delegate:delegate
+                outputBlock:nil];
+}
+
+#if NS_BLOCKS_AVAILABLE
+- (id)initWithMode:(GTMZlibMode)mode
+  compressionLevel:(int)level
+       outputBlock:(GTMZlibStreamOutputBlock)block {
+  return [self initWithMode:mode
+           compressionLevel:level
+                   delegate:nil
+                outputBlock:block];
+}
+#endif  // NS_BLOCKS_AVAILABLE
+
+- (id)init {
+  return [self initWithMode:kGTMZlibModeZlib
+           compressionLevel:Z_DEFAULT_COMPRESSION
+                   delegate:nil];
+}
+
+- (void)dealloc {
+  if (stream_) deflateEnd(stream_);
+  [super dealloc];
+}
+
+- (BOOL)deflateWithFlush:(int)flush {
+  int retCode;
+  do {
+    retCode = deflate(stream_, flush);
+    if (retCode != Z_OK && retCode != Z_STREAM_END && retCode != Z_BUF_ERROR) {
+      // COV_NF_START - would be an internal error in zlib.
+      _GTMDevLog(@"Error trying to deflate some of the payload, error %d",
+                 retCode);
+      failed_ = YES;
+      return NO;
+      // COV_NF_END
+    }
+    BOOL full = (stream_->avail_out == 0);
+    [self deliverOutput];
+    // With Z_FINISH, keep going until the end; otherwise until zlib stops
+    // filling the buffer.
+    if (flush == Z_FINISH ? (retCode == Z_STREAM_END) : !full) break;
+  } while (YES);
+  return YES;
+}
+
+- (BOOL)processBytes:(const void *)bytes length:(NSUInteger)length {
+  if (failed_ || finished_) return NO;
+  if (!length) return YES;
+  if (!bytes) return NO;
+  const unsigned char *next = bytes;
+  while (length) {
+    // avail_in is only an unsigned int.
+    unsigned int chunk = (length > UINT_MAX) ? UINT_MAX : (unsigned int)length;
+    stream_->next_in = (unsigned char *)next;
+    stream_->avail_in = chunk;
+    if (![self deflateWithFlush:Z_NO_FLUSH]) return NO;
+    _GTMDevAssert(stream_->avail_in == 0,
+                  @"deflate left %u bytes of input", stream_->avail_in);
+    next += chunk;
+    length -= chunk;
+    totalIn_ += chunk;
+  }
+  return YES;
+}
+
+- (BOOL)flush {
+  if (failed_ || finished_) return NO;
+  stream_->avail_in = 0;
+  return [self deflateWithFlush:Z_SYNC_FLUSH];
+}
+
+- (BOOL)finish {
+  if (failed_) return NO;
+  if (finished_) return YES;
+  stream_->avail_in = 0;
+  if (![self deflateWithFlush:Z_FINISH]) return NO;
+  finished_ = YES;
+  return YES;
+}
+
+@end  // GTMZlibDeflater
+
+
+@implementation GTMZlibInflater
+
+- (id)initWithMode:(GTMZlibMode)mode
+          delegate:(id<GTMZlibStreamDelegate>)delegate
+       outputBlock:(id)block {
+  if ((self = [super initWithMode:mode delegate:delegate outputBlock:block])) {
+    int windowBits = 15;  // 15 to enable any window size
+    if (mode == kGTMZlibModeRaw) {
+      windowBits *= -1;  // make it negative to signal no header.
+    } else {
+      windowBits += 32;  // and +32 to enable zlib or gzip header detection.
+    }
+    int retCode = inflateInit2(stream_, windowBits);
+    if (retCode != Z_OK) {
+      // COV_NF_START - no real way to force this in a unittest.
+      _GTMDevLog(@"Failed to init for inflate, error %d", retCode);
+      free(stream_);
+      stream_ = NULL;
+      [self release];
+      return nil;
+      // COV_NF_END
+    }
+  }
+  return self;
+}
+
+- (id)initWithMode:(GTMZlibMode)mode
+          delegate:(id<GTMZlibStreamDelegate>)delegate {
+  return [self initWithMode:mode delegate:delegate outputBlock:nil];
+}
+
+#if NS_BLOCKS_AVAILABLE
+- (id)initWithMode:(GTMZlibMode)mode
+       outputBlock:(GTMZlibStreamOutputBlock)block {
+  return [self initWithMode:mode delegate:nil outputBlock:block];
+}
+#endif  // NS_BLOCKS_AVAILABLE
+
+- (id)init {
+  return [self initWithMode:kGTMZlibModeZlib delegate:nil];
+}
+
+- (void)dealloc {
+  if (stream_) inflateEnd(stream_);
+  [super dealloc];
+}
+
+- (BOOL)processBytes:(const void *)bytes length:(NSUInteger)length {
+  if (failed_) return NO;
+  if (!length) return YES;
+  if (!bytes) return NO;
+  if (finished_) {
+    _GTMDevLog(@"More data after the end of the compressed stream");
+    failed_ = YES;
+    return NO;
+  }
+  const unsigned char *next = bytes;
+  while (length) {
+    // avail_in is only an unsigned int.
+    unsigned int chunk = (length > UINT_MAX) ? UINT_MAX : (unsigned int)length;
+    stream_->next_in = (unsigned char *)next;
+    stream_->avail_in = chunk;
+    int retCode;
+    BOOL full = NO;
+    do {
+      retCode = inflate(stream_, Z_NO_FLUSH);
+      if (retCode != Z_OK && retCode != Z_STREAM_END &&
+          retCode != Z_BUF_ERROR) {
+        _GTMDevLog(@"Error trying to inflate some of the payload, error %d: %s",
+                   retCode, stream_->msg);
+        failed_ = YES;
+        return NO;
+      }
+      full = (stream_->avail_out == 0);
+      [self deliverOutput];
+      // A full buffer can mean zlib has more output pending even once all
+      // the input is in.
+    } while (retCode == Z_OK && (stream_->avail_in > 0 || full));
+    unsigned int used = chunk - stream_->avail_in;
+    totalIn_ += used;
+    if (retCode == Z_STREAM_END) {
+      finished_ = YES;
+      if (stream_->avail_in != 0 || length > chunk) {
+        // make sure there wasn't more data tacked onto the end of a valid
+        // compressed stream.
+        _GTMDevLog(@"More data after the end of the compressed stream");
+        failed_ = YES;
+        return NO;
+      }
+    }
+    next += chunk;
+    length -= chunk;
+  }
+  return YES;
+}
+
+- (BOOL)finish {
+  if (failed_) return NO;
+  if (!finished_) {
+    _GTMDevLog(@"Compressed stream ended early");
+    failed_ = YES;
+    return NO;
+  }
+  return YES;
+}
+
+@end  // GTMZlibInflater
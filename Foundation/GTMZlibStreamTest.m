@@ -0,0 +1,300 @@
+//
+//  GTMZlibStreamTest.m
+//
+//  Copyright 2014 Google Inc.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not
+//  use this file except in compliance with the License.  You may obtain a copy
+//  of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+//  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+//  License for the specific language governing permissions and limitations under
+//  the License.
+//
+
+#import "GTMSenTestCase.h"
+#import "GTMUnitTestDevLog.h"
+#import "GTMZlibStream.h"
+#import "GTMNSData+zlib.h"
+#import <zlib.h>
+
+@interface GTMZlibStreamTest : GTMTestCase <GTMZlibStreamDelegate> {
+ @private
+  NSMutableData *output_;
+  NSUInteger largestPiece_;
+}
+@end
+
+// Feeds |data| to |stream| in pieces of |pieceSize| bytes.
+static BOOL ProcessInPieces(GTMZlibStream *stream, NSData *data,
+                            NSUInteger pieceSize) {
+  const unsigned char *bytes = [data bytes];
+  NSUInteger length = [data length];
+  for (NSUInteger offset = 0; offset < length; offset += pieceSize) {
+    NSUInteger piece = MIN(pieceSize, length - offset);
+    if (![stream processBytes:bytes + offset length:piece]) return NO;
+  }
+  return YES;
+}
+
+// Something compressible, but not trivially so.
+static NSData *TestPayload(NSUInteger length) {
+  NSMutableData *data = [NSMutableData dataWithLength:length];
+  unsigned char *bytes = [data mutableBytes];
+  uint32_t seed = 12345;
+  for (NSUInteger i = 0; i < length; ++i) {
+    seed = seed * 1103515245 + 12345;
+    bytes[i] = (unsigned char)("abcdefgh \n"[(seed >> 16) % 10]);
+  }
+  return data;
+}
+
+@implementation GTMZlibStreamTest
+
+- (void)setUp {
+  output_ = [[NSMutableData alloc] init];
+  largestPiece_ = 0;
+}
+
+- (void)tearDown {
+  [output_ release];
+  output_ = nil;
+}
+
+- (void)zlibStream:(GTMZlibStream *)stream
+   didProduceBytes:(const void *)bytes
+            length:(NSUInteger)length {
+  STAssertGreaterThan(length, (NSUInteger)0, nil);
+  largestPiece_ = MAX(largestPiece_, length);
+  [output_ appendBytes:bytes length:length];
+}
+
+- (void)testCreation {
+  STAssertNil([[[GTMZlibDeflater alloc] init] autorelease], nil);
+  STAssertNil([[[GTMZlibInflater alloc] init] autorelease], nil);
+  STAssertNil([[[GTMZlibDeflater alloc] initWithMode:kGTMZlibModeGzip
+                                    compressionLevel:9
+                                            delegate:nil] autorelease], nil);
+  STAssertNil([[[GTMZlibInflater alloc] initWithMode:kGTMZlibModeGzip
+                                            delegate:nil] autorelease], nil);
+
+  GTMZlibDeflater *deflater =
+      [[[GTMZlibDeflater alloc] initWithMode:kGTMZlibModeRaw
+                            compressionLevel:42
+                                    delegate:self] autorelease];
+  STAssertNotNil(deflater, nil);
+  STAssertEquals([deflater mode], kGTMZlibModeRaw, nil);
+  STAssertFalse([deflater isFinished], nil);
+  STAssertFalse([deflater hasFailed], nil);
+  STAssertEquals([deflater totalIn], 0ULL, nil);
+  STAssertEquals([deflater totalOut], 0ULL, nil);
+}
+
+- (void)testRoundTrip {
+  NSData *payload = TestPayload(300 * 1024);
+  GTMZlibMode modes[] = { kGTMZlibModeZlib, kGTMZlibModeGzip, kGTMZlibModeRaw };
+  NSUInteger pieceSizes[] = { 1, 7, 1000, 65536, 10 * 1024 * 1024 };
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+    for (size_t p = 0; p < sizeof(pieceSizes) / sizeof(pieceSizes[0]); ++p) {
+      // Byte at a time over 300K takes a while, do less.
+      NSData *input = payload;
+      if (pieceSizes[p] == 1) {
+        input = [payload subdataWithRange:NSMakeRange(0, 20000)];
+      }
+      [output_ setLength:0];
+      GTMZlibDeflater *deflater =
+          [[[GTMZlibDeflater alloc] initWithMode:modes[m]
+                                compressionLevel:Z_DEFAULT_COMPRESSION
+                                        delegate:self] autorelease];
+      STAssertTrue(ProcessInPieces(deflater, input, pieceSizes[p]), nil);
+      STAssertTrue([deflater finish], nil);
+      STAssertTrue([deflater isFinished], nil);
+      STAssertTrue([deflater finish], @"finishing twice is harmless");
+      STAssertFalse([deflater processBytes:"x" length:1], nil);
+      STAssertEquals([deflater totalIn], (unsigned long long)[input length],
+                     nil);
+      STAssertEquals([deflater totalOut], (unsigned long long)[output_ length],
+                     nil);
+      NSData *compressed = [[output_ copy] autorelease];
+      STAssertLessThan([compressed length], [input length], nil);
+
+      // The one shot helpers read it.
+      NSData *inflated = (modes[m] == kGTMZlibModeRaw)
+          ? [NSData gtm_dataByRawInflatingData:compressed]
+          : [NSData gtm_dataByInflatingData:compressed];
+      STAssertEqualObjects(inflated, input, @"mode %d piece %lu", modes[m],
+                           (unsigned long)pieceSizes[p]);
+
+      // And so does the streaming inflater.
+      [output_ setLength:0];
+      largestPiece_ = 0;
+      GTMZlibInflater *inflater =
+          [[[GTMZlibInflater alloc] initWithMode:modes[m]
+                                        delegate:self] autorelease];
+      STAssertTrue(ProcessInPieces(inflater, compressed, pieceSizes[p]), nil);
+      STAssertTrue([inflater isFinished], nil);
+      STAssertTrue([inflater finish], nil);
+      STAssertEqualObjects(output_, input, nil);
+      STAssertEquals([inflater totalIn], (unsigned long long)[compressed length],
+                     nil);
+      STAssertEquals([inflater totalOut], (unsigned long long)[input length],
+                     nil);
+      // Output comes out in bounded pieces however big the input.
+      STAssertLessThanOrEqual(largestPiece_, (NSUInteger)(16 * 1024), nil);
+    }
+  }
+}
+
+- (void)testFlush {
+  GTMZlibDeflater *deflater =
+      [[[GTMZlibDeflater alloc] initWithMode:kGTMZlibModeGzip
+                            compressionLevel:Z_DEFAULT_COMPRESSION
+                                    delegate:self] autorelease];
+  NSData *first = [@"first part " dataUsingEncoding:NSUTF8StringEncoding];
+  STAssertTrue([deflater processData:first], nil);
+  STAssertTrue([deflater flush], nil);
+
+  // Everything so far can be decoded before the stream is finished.
+  NSMutableData *inflated = [NSMutableData data];
+  GTMZlibInflater *inflater =
+      [[[GTMZlibInflater alloc] initWithMode:kGTMZlibModeGzip
+                                    delegate:self] autorelease];
+  NSData *soFar = [[output_ copy] autorelease];
+  [output_ setLength:0];
+  STAssertTrue([inflater processData:soFar], nil);
+  STAssertFalse([inflater isFinished], nil);
+  [inflated appendData:output_];
+  STAssertEqualObjects(inflated, first, nil);
+  [output_ setLength:0];
+
+  NSData *second = [@"second part" dataUsingEncoding:NSUTF8StringEncoding];
+  STAssertTrue([deflater processData:second], nil);
+  STAssertTrue([deflater finish], nil);
+  STAssertFalse([deflater flush], nil);
+  soFar = [[output_ copy] autorelease];
+  [output_ setLength:0];
+  STAssertTrue([inflater processData:soFar], nil);
+  STAssertTrue([inflater finish], nil);
+  [inflated appendData:output_];
+  STAssertEqualObjects(inflated,
+                       [@"first part second part"
+                         dataUsingEncoding:NSUTF8StringEncoding], nil);
+}
+
+- (void)testInflateErrors {
+  NSData *payload = TestPayload(10000);
+  NSData *compressed = [NSData gtm_dataByGzippingData:payload];
+
+  // Truncated.
+  GTMZlibInflater *inflater =
+      [[[GTMZlibInflater alloc] initWithMode:kGTMZlibModeGzip
+                                    delegate:self] autorelease];
+  STAssertTrue([inflater processBytes:[compressed bytes]
+                               length:[compressed length] - 4], nil);
+  [GTMUnitTestDevLog expectString:@"Compressed stream ended early"];
+  STAssertFalse([inflater finish], nil);
+  STAssertTrue([inflater hasFailed], nil);
+
+  // Trailing data.
+  NSMutableData *trailing = [NSMutableData dataWithData:compressed];
+  [trailing appendBytes:"junk" length:4];
+  inflater = [[[GTMZlibInflater alloc] initWithMode:kGTMZlibModeGzip
+                                           delegate:self] autorelease];
+  [GTMUnitTestDevLog expectString:
+   @"More data after the end of the compressed stream"];
+  STAssertFalse([inflater processData:trailing], nil);
+  STAssertTrue([inflater hasFailed], nil);
+  STAssertFalse([inflater finish], nil);
+
+  inflater = [[[GTMZlibInflater alloc] initWithMode:kGTMZlibModeGzip
+                                           delegate:self] autorelease];
+  STAssertTrue([inflater processData:compressed], nil);
+  [GTMUnitTestDevLog expectString:
+   @"More data after the end of the compressed stream"];
+  STAssertFalse([inflater processBytes:"x" length:1], nil);
+
+  // Garbage.
+  inflater = [[[GTMZlibInflater alloc] initWithMode:kGTMZlibModeZlib
+                                           delegate:self] autorelease];
+  [GTMUnitTestDevLog expectPattern:
+   @"Error trying to inflate some of the payload, error -3: .*"];
+  STAssertFalse([inflater processBytes:"not zlib data" length:13], nil);
+  STAssertTrue([inflater hasFailed], nil);
+  STAssertFalse([inflater processData:compressed], @"stays failed");
+
+  // Nothing at all is fine until you finish.
+  inflater = [[[GTMZlibInflater alloc] initWithMode:kGTMZlibModeZlib
+                                           delegate:self] autorelease];
+  STAssertTrue([inflater processBytes:NULL length:0], nil);
+  [GTMUnitTestDevLog expectString:@"Compressed stream ended early"];
+  STAssertFalse([inflater finish], nil);
+}
+
+- (void)testHighlyCompressible {
+  // Zeros shrink about 1000 to 1, so zlib can take in all of the input
+  // while it still has output to hand back.  With no trailer to wait on, raw
+  // data ending one byte past a multiple of the output buffer does just that.
+  GTMZlibMode modes[] = { kGTMZlibModeZlib, kGTMZlibModeGzip, kGTMZlibModeRaw };
+  NSUInteger sizes[] = { 64 * 1024 + 1, 8 * 1024 * 1024 + 1 };
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+    for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); ++z) {
+      NSData *zeros = [NSMutableData dataWithLength:sizes[z]];
+      NSData *compressed = nil;
+      if (modes[m] == kGTMZlibModeRaw) {
+        compressed = [NSData gtm_dataByRawDeflatingData:zeros];
+      } else if (modes[m] == kGTMZlibModeGzip) {
+        compressed = [NSData gtm_dataByGzippingData:zeros];
+      } else {
+        compressed = [NSData gtm_dataByDeflatingData:zeros];
+      }
+      STAssertLessThan([compressed length], (NSUInteger)(16 * 1024), nil);
+
+      [output_ setLength:0];
+      GTMZlibInflater *inflater =
+          [[[GTMZlibInflater alloc] initWithMode:modes[m]
+                                        delegate:self] autorelease];
+      STAssertTrue([inflater processBytes:[compressed bytes]
+                                   length:[compressed length]], nil);
+      STAssertTrue([inflater isFinished], @"mode %d size %lu", modes[m],
+                   (unsigned long)sizes[z]);
+      STAssertTrue([inflater finish], nil);
+      STAssertEqualObjects(output_, zeros, nil);
+      STAssertEquals([inflater totalOut], (unsigned long long)[zeros length],
+                     nil);
+    }
+  }
+}
+
+#if NS_BLOCKS_AVAILABLE
+- (void)testBlocks {
+  NSData *payload = TestPayload(100000);
+  NSMutableData *compressed = [NSMutableData data];
+  GTMZlibDeflater *deflater =
+      [[[GTMZlibDeflater alloc] initWithMode:kGTMZlibModeZlib
+                            compressionLevel:1
+                                 outputBlock:^(const void *bytes,
+                                               NSUInteger length) {
+        [compressed appendBytes:bytes length:length];
+      }] autorelease];
+  STAssertTrue([deflater processData:payload], nil);
+  STAssertTrue([deflater finish], nil);
+
+  NSMutableData *inflated = [NSMutableData data];
+  GTMZlibInflater *inflater =
+      [[[GTMZlibInflater alloc] initWithMode:kGTMZlibModeZlib
+                                 outputBlock:^(const void *bytes,
+                                               NSUInteger length) {
+        [inflated appendBytes:bytes length:length];
+      }] autorelease];
+  STAssertTrue([inflater processData:compressed], nil);
+  STAssertTrue([inflater finish], nil);
+  STAssertEqualObjects(inflated, payload, nil);
+  STAssertEquals([output_ length], (NSUInteger)0, @"delegate not used");
+}
+#endif  // NS_BLOCKS_AVAILABLE
+
+@end